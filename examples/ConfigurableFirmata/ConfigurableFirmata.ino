@@ -8,6 +8,9 @@
 // work with Wifi-enabled Arduinos
 // #define ENABLE_WIFI
 
+// ESP32 only: run Firmata in a task on core 0, loop() on core 1 is then left to the transport
+// #define ENABLE_DUAL_CORE
+
 const char* ssid     = "your-ssid";
 const char* password = "your-password";
 const int NETWORK_PORT = 27016;
@@ -25,6 +28,12 @@ const int NETWORK_PORT = 27016;
 
 // This is rarely used
 // #define ENABLE_BASIC_SCHEDULER
+// Run-time statistics (loop time, traffic, free memory) for capacity planning
+// #define ENABLE_STATS
+// Save the configuration to EEPROM on request and restore it at boot
+// #define ENABLE_BOOT_CONFIG
+// Burst sampling into a RAM buffer (oscilloscope / logic analyzer). On AVR, also define CAPTURE_USE_TIMER2
+// #define ENABLE_CAPTURE
 #define ENABLE_SERIAL
 #define ENABLE_I2C
 #define ENABLE_SPI
@@ -32,6 +41,14 @@ const int NETWORK_PORT = 27016;
 #define ENABLE_DIGITAL
 #define ENABLE_DHT
 #define ENABLE_FREQUENCY
+// Quadrature encoders (on the ESP32 with the PCNT units that ENABLE_FREQUENCY doesn't use)
+// #define ENABLE_ENCODER
+// 74HC595 / 74HC165 shift register chains, with the SPI hardware when they are on its pins
+// #define ENABLE_SHIFT
+// HC-SR04 ultrasonic distance sensors
+// #define ENABLE_SONAR
+// PID and threshold control blocks that run on the board, from inputs of the other features to outputs
+// #define ENABLE_CONTROL
 
 #ifdef ENABLE_DIGITAL
 #include <DigitalInputFirmata.h>
@@ -106,6 +123,46 @@ AccelStepperFirmata accelStepper;
 Frequency frequency;
 #endif
 
+#ifdef ENABLE_ENCODER
+#include <EncoderFirmata.h>
+EncoderFirmata encoder;
+#endif
+
+#ifdef ENABLE_SHIFT
+#include <ShiftFirmata.h>
+ShiftFirmata shift;
+#endif
+
+#ifdef ENABLE_SONAR
+#include <SonarFirmata.h>
+SonarFirmata sonar;
+#endif
+
+#ifdef ENABLE_CONTROL
+#include <ControlFirmata.h>
+ControlFirmata control;
+#endif
+
+#ifdef ENABLE_STATS
+#include <FirmataStats.h>
+FirmataStats stats;
+#endif
+
+#ifdef ENABLE_BOOT_CONFIG
+#include <FirmataBootConfig.h>
+FirmataBootConfig bootConfig;
+#endif
+
+#ifdef ENABLE_CAPTURE
+#include <FirmataCapture.h>
+FirmataCapture capture;
+#endif
+
+#if defined(ENABLE_DUAL_CORE) && defined(ESP32)
+#include <FirmataDualCore.h>
+FirmataDualCore dualCore;
+#endif
+
 #ifdef ENABLE_BASIC_SCHEDULER
 // The scheduler allows to store scripts on the board, however this requires a kind of compiler on the client side.
 // When running dotnet/iot on the client side, prefer using the FirmataIlExecutor module instead
@@ -145,17 +202,21 @@ void initTransport()
 #endif
 #ifdef ENABLE_WIFI
 	WiFi.mode(WIFI_STA);
-	WiFi.begin(ssid, password);
-	pinMode(VERSION_BLINK_PIN, OUTPUT);
-	bool pinIsOn = false;
-	while (WiFi.status() != WL_CONNECTED)
-	{
-		delay(100);
-		pinIsOn = !pinIsOn;
-		digitalWrite(VERSION_BLINK_PIN, pinIsOn);
-	}
+	// Joins in the background, with the access point of the last boot if it is still there. Firmata
+	// runs at once, the stream attaches to the host once the connection is up (see serverStream.maintain()).
+	serverStream.beginFast(ssid, password);
+#if defined(ENABLE_DUAL_CORE) && defined(ESP32)
+	dualCore.begin(serverStream);
+	Firmata.begin(dualCore);
+#else
 	Firmata.begin(serverStream);
+#endif
 	Firmata.blinkVersion(); // Because the above doesn't do it.
+#elif defined(ENABLE_DUAL_CORE) && defined(ESP32)
+	Serial.begin(115200);
+	dualCore.begin(Serial);
+	Firmata.begin(dualCore);
+	Firmata.blinkVersion();
 #else 
 	Firmata.begin(115200);
 #endif
@@ -166,6 +227,8 @@ void initFirmata()
 #ifdef ENABLE_DIGITAL
 	firmataExt.addFeature(digitalInput);
 	firmataExt.addFeature(digitalOutput);
+	// Uncomment to report changes of input pins through pin change interrupts instead of polling
+	// digitalInput.setInterruptReporting(true);
 #endif
 	
 #ifdef ENABLE_ANALOG
@@ -209,9 +272,51 @@ void initFirmata()
 	firmataExt.addFeature(frequency);
 #endif
 
+#ifdef ENABLE_ENCODER
+	firmataExt.addFeature(encoder);
+#endif
+
+#ifdef ENABLE_SHIFT
+	firmataExt.addFeature(shift);
+#endif
+
+#ifdef ENABLE_SONAR
+	firmataExt.addFeature(sonar);
+#endif
+
+#ifdef ENABLE_CONTROL
+	firmataExt.addFeature(control);
+#endif
+
+#ifdef ENABLE_BOOT_CONFIG
+	firmataExt.addFeature(bootConfig);
+#endif
+
+#ifdef ENABLE_CAPTURE
+	firmataExt.addFeature(capture);
+#endif
+
+#ifdef ENABLE_STATS
+	firmataExt.attachStats(stats);
+#endif
+
 	Firmata.attach(SYSTEM_RESET, systemResetCallback);
 }
 
+void firmataLoop()
+{
+	while(Firmata.available()) 
+	{
+		Firmata.processInput();
+		if (!Firmata.isParsingMessage()) 
+		{
+			break;
+		}
+	}
+
+	firmataExt.report(reporting.elapsed());
+}
+
 void setup()
 {
 	// Set firmware name and version.
@@ -222,20 +327,18 @@ void setup()
 	initFirmata();
 
 	Firmata.parse(SYSTEM_RESET);
+#if defined(ENABLE_DUAL_CORE) && defined(ESP32)
+	dualCore.start(firmataLoop);
+#endif
 }
 
 void loop()
 {
-	while(Firmata.available()) 
-	{
-		Firmata.processInput();
-		if (!Firmata.isParsingMessage()) 
-		{
-			break;
-		}
-	}
-
-	firmataExt.report(reporting.elapsed());
+#if defined(ENABLE_DUAL_CORE) && defined(ESP32)
+	dualCore.pump();
+#else
+	firmataLoop();
+#endif
 #ifdef ENABLE_WIFI
 	serverStream.maintain();
 #endif
@@ -379,4 +379,5 @@ accelStepper.update();
   serial.update();
 #endif
 
+  Firmata.flush();
 }
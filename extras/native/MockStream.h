@@ -0,0 +1,120 @@
+/*
+  MockStream.h - In-memory Stream for the native tests and benchmarks
+
+  Input is read from a caller-provided buffer, output is collected in a buffer that can be
+  inspected and cleared. When the output buffer is full, further output is only counted.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef MockStream_h
+#define MockStream_h
+
+#include <Arduino.h>
+
+#define MOCK_STREAM_OUTPUT_SIZE 8192
+
+class MockStream : public Stream
+{
+  public:
+    MockStream()
+    {
+      setInput(nullptr, 0);
+      clearOutput();
+      setWriteSpace(-1);
+      setWriteLimit(0);
+    }
+
+    // the buffer must stay valid until it has been read
+    void setInput(const byte* data, size_t length)
+    {
+      input = data;
+      inputLength = length;
+      inputPos = 0;
+    }
+
+    int available() override { return (int)(inputLength - inputPos); }
+    int read() override { return inputPos < inputLength ? input[inputPos++] : -1; }
+    int peek() override { return inputPos < inputLength ? input[inputPos] : -1; }
+
+    size_t readBytes(char* buffer, size_t length) override
+    {
+      size_t count = inputLength - inputPos;
+      if (count > length)
+      {
+        count = length;
+      }
+      memcpy(buffer, input + inputPos, count);
+      inputPos += count;
+      return count;
+    }
+
+    size_t write(uint8_t c) override
+    {
+      return write(&c, 1);
+    }
+
+    size_t write(const uint8_t* buffer, size_t size) override
+    {
+      if (writeLimit > 0 && size > writeLimit)
+      {
+        size = writeLimit;
+      }
+      size_t count = MOCK_STREAM_OUTPUT_SIZE - outputLength;
+      if (count > size)
+      {
+        count = size;
+      }
+      memcpy(output + outputLength, buffer, count);
+      outputLength += count;
+      totalWritten += size;
+      if (writeSpace >= 0)
+      {
+        writeSpace = size < (size_t)writeSpace ? writeSpace - (int)size : 0;
+      }
+      writeCalls++;
+      return size;
+    }
+
+    void flush() override { flushCalls++; }
+
+    // the most bytes a single write() takes, 0 = no limit
+    void setWriteLimit(size_t limit) { writeLimit = limit; }
+
+    // what availableForWrite() returns, less what was written since; -1 = always room
+    void setWriteSpace(int space) { writeSpace = space; }
+    int availableForWrite() override { return writeSpace >= 0 ? writeSpace : MOCK_STREAM_OUTPUT_SIZE; }
+
+    void clearOutput()
+    {
+      outputLength = 0;
+      totalWritten = 0;
+      writeCalls = 0;
+      flushCalls = 0;
+    }
+
+    const byte* getOutput() const { return output; }
+    size_t getOutputLength() const { return outputLength; }
+    size_t getTotalWritten() const { return totalWritten; }
+    size_t getWriteCalls() const { return writeCalls; }
+    size_t getFlushCalls() const { return flushCalls; }
+
+  private:
+    const byte* input;
+    size_t inputLength;
+    size_t inputPos;
+    byte output[MOCK_STREAM_OUTPUT_SIZE];
+    size_t outputLength;
+    size_t totalWritten;
+    size_t writeCalls;
+    size_t flushCalls;
+    int writeSpace;
+    size_t writeLimit;
+};
+
+#endif
@@ -0,0 +1,84 @@
+/*
+  NativeFirmata.h - The firmware setup shared by the native tests and benchmarks
+
+  Mirrors examples/ConfigurableFirmata with the features that don't need extra hardware
+  libraries, connected to a MockStream instead of the serial port.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef NativeFirmata_h
+#define NativeFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include <DigitalInputFirmata.h>
+#include <DigitalOutputFirmata.h>
+#include <AnalogInputFirmata.h>
+#include <AnalogOutputFirmata.h>
+#include <FirmataReporting.h>
+#include <FirmataStats.h>
+#include <FirmataBootConfig.h>
+#include <FirmataExt.h>
+#include "MockStream.h"
+
+static MockStream stream;
+static DigitalInputFirmata digitalInput;
+static DigitalOutputFirmata digitalOutput;
+static AnalogInputFirmata analogInput;
+static AnalogOutputFirmata analogOutput;
+static FirmataReporting reporting;
+static FirmataStats stats;
+static FirmataBootConfig bootConfig;
+static FirmataExt firmataExt;
+
+static void systemResetCallback()
+{
+  for (byte i = 0; i < TOTAL_PINS; i++)
+  {
+    if (IS_PIN_ANALOG(i))
+    {
+      Firmata.setPinMode(i, PIN_MODE_ANALOG);
+    }
+    else if (IS_PIN_DIGITAL(i))
+    {
+      Firmata.setPinMode(i, PIN_MODE_OUTPUT);
+    }
+  }
+  firmataExt.reset();
+}
+
+// like setup() of the example sketch, the output up to here is discarded
+static void nativeSetup()
+{
+  Firmata.setFirmwareNameAndVersion("ConfigurableFirmata", FIRMATA_FIRMWARE_MAJOR_VERSION, FIRMATA_FIRMWARE_MINOR_VERSION);
+  Firmata.begin(stream);
+  firmataExt.addFeature(digitalInput);
+  firmataExt.addFeature(digitalOutput);
+  firmataExt.addFeature(analogInput);
+  firmataExt.addFeature(analogOutput);
+  firmataExt.addFeature(reporting);
+  firmataExt.addFeature(bootConfig);
+  firmataExt.attachStats(stats);
+  Firmata.attach(SYSTEM_RESET, systemResetCallback);
+  Firmata.parse(SYSTEM_RESET);
+  Firmata.flush();
+  stream.clearOutput();
+}
+
+// like loop() of the example sketch, until the input is consumed
+static void nativeProcess(const byte* data, size_t length)
+{
+  stream.setInput(data, length);
+  while (Firmata.available())
+  {
+    Firmata.processInput();
+  }
+  Firmata.flush();
+}
+
+#endif
@@ -0,0 +1,207 @@
+/*
+  firmata_bench.cpp - Microbenchmarks of the parser, the encoders and the sysex dispatch,
+  run on the development machine. See readme.md.
+
+  The absolute numbers only say something about the host, compare them between builds
+  of the same configuration to spot regressions.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <stdio.h>
+#include <chrono>
+#include <Encoder7Bit.h>
+#include "NativeFirmata.h"
+
+#define BENCH_INPUT_SIZE 65536
+
+static byte input[BENCH_INPUT_SIZE];
+static volatile byte sink;
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void printResult(const char* name, double time, double count, const char* unit)
+{
+  printf("%-36s %10.1f ns/%s %10.2f M%s/s\n", name, time * 1e9 / count, unit, count / time / 1e6, unit);
+}
+
+// a typical host stream: digital and analog writes, pin state queries and a long sysex message
+static size_t fillMixedInput()
+{
+  const byte pattern[] = {
+    DIGITAL_MESSAGE | 0, 0x10, 0x00,
+    ANALOG_MESSAGE | 5, 0x7F, 0x01,
+    SET_DIGITAL_PIN_VALUE, 4, 1,
+    START_SYSEX, PIN_STATE_QUERY, 4, END_SYSEX,
+    START_SYSEX, EXTENDED_ANALOG, 5, 0x10, 0x01, END_SYSEX,
+    START_SYSEX, SAMPLING_INTERVAL, 19, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, END_SYSEX,
+  };
+  size_t length = 0;
+  while (length + sizeof(pattern) <= BENCH_INPUT_SIZE)
+  {
+    memcpy(input + length, pattern, sizeof(pattern));
+    length += sizeof(pattern);
+  }
+  return length;
+}
+
+static void prepare()
+{
+  Firmata.parse(SYSTEM_RESET);
+  const byte modes[] = { SET_PIN_MODE, 4, PIN_MODE_OUTPUT, SET_PIN_MODE, 5, PIN_MODE_PWM };
+  nativeProcess(modes, sizeof(modes));
+  stream.clearOutput();
+}
+
+static void benchParse()
+{
+  size_t length = fillMixedInput();
+  prepare();
+  const int rounds = 50;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++)
+  {
+    for (size_t i = 0; i < length; i++)
+    {
+      Firmata.parse(input[i]);
+    }
+    stream.clearOutput();
+  }
+  printResult("parse() per byte", seconds(start), (double)rounds * length, "B");
+}
+
+static void benchProcessInput()
+{
+  size_t length = fillMixedInput();
+  prepare();
+  const int rounds = 50;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++)
+  {
+    nativeProcess(input, length);
+    stream.clearOutput();
+  }
+#ifdef LARGE_MEM_DEVICE
+  printResult("processInput() (LARGE_MEM_DEVICE)", seconds(start), (double)rounds * length, "B");
+#else
+  printResult("processInput()", seconds(start), (double)rounds * length, "B");
+#endif
+}
+
+static void benchEncode()
+{
+  const int rounds = 2000;
+  const int bytes = 252;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++)
+  {
+    Encoder7BitClass encoder;
+    Firmata.startSysex();
+    encoder.startBinaryWrite();
+    for (int i = 0; i < bytes; i++)
+    {
+      encoder.writeBinary((byte)(i + r));
+    }
+    encoder.endBinaryWrite();
+    Firmata.endSysex();
+    stream.clearOutput();
+  }
+  printResult("Encoder7Bit encode", seconds(start), (double)rounds * bytes, "B");
+}
+
+static void benchBlockEncode()
+{
+  const int rounds = 20000;
+  const int bytes = 252;
+  byte data[bytes];
+  for (int i = 0; i < bytes; i++)
+  {
+    data[i] = (byte)(i * 13);
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++)
+  {
+    Encoder7BitClass encoder;
+    data[0] = (byte)r;
+    Firmata.startSysex();
+    encoder.startBinaryWrite();
+    encoder.writeBinary(data, bytes);
+    encoder.endBinaryWrite();
+    Firmata.endSysex();
+    stream.clearOutput();
+  }
+  printResult("Encoder7Bit encode (block)", seconds(start), (double)rounds * bytes, "B");
+}
+
+static void benchDecode()
+{
+  const int rounds = 20000;
+  const int encodedLength = 288; // 252 bytes of data
+  byte encoded[encodedLength];
+  byte decoded[num7BitOutbytes(encodedLength)];
+  for (int i = 0; i < encodedLength; i++)
+  {
+    encoded[i] = (byte)(i * 13) & 0x7F;
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++)
+  {
+    encoded[0] = (byte)r & 0x7F;
+    Encoder7BitClass::readBinary(num7BitOutbytes(encodedLength), encoded, decoded);
+    sink = decoded[r % sizeof(decoded)];
+  }
+  printResult("Encoder7Bit decode", seconds(start), (double)rounds * sizeof(decoded), "B");
+}
+
+// from END_SYSEX to the feature, through FirmataExt: the handler of SAMPLING_INTERVAL is the
+// 5th feature, STATS_RESET goes to the last one
+static void benchSysexDispatch(const char* name, byte command, byte subcommand)
+{
+  prepare();
+  const byte message[] = { START_SYSEX, command, subcommand, 0, END_SYSEX };
+  const int rounds = 200000;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++)
+  {
+    for (size_t i = 0; i < sizeof(message); i++)
+    {
+      Firmata.parse(message[i]);
+    }
+  }
+  printResult(name, seconds(start), rounds, "msg");
+}
+
+static void benchReport()
+{
+  prepare();
+  const int rounds = 200000;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++)
+  {
+    firmataExt.report(false);
+  }
+  printResult("FirmataExt::report() per loop", seconds(start), rounds, "loop");
+}
+
+int main()
+{
+  nativeSetup();
+  printf("MAX_DATA_BYTES %d, TX_BUFFER_SIZE %d, RCV_BUF_SIZE %d\n", MAX_DATA_BYTES, TX_BUFFER_SIZE, RCV_BUF_SIZE);
+  benchParse();
+  benchProcessInput();
+  benchEncode();
+  benchBlockEncode();
+  benchDecode();
+  benchSysexDispatch("sysex dispatch (SAMPLING_INTERVAL)", SAMPLING_INTERVAL, 19);
+  benchSysexDispatch("sysex dispatch (FIRMATA_STATS)", FIRMATA_STATS, STATS_RESET);
+  benchReport();
+  return 0;
+}
@@ -0,0 +1,1824 @@
+/*
+  firmata_test.cpp - Regression tests of the parser, the encoders and the sysex dispatch,
+  run on the development machine. See readme.md.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <stdio.h>
+#include <thread>
+#include <vector>
+#include <Encoder7Bit.h>
+#include <FirmataDualCore.h>
+#include <FirmataArena.h>
+#include <FirmataCapture.h>
+#include <EncoderFirmata.h>
+#include <ShiftFirmata.h>
+#include <SonarFirmata.h>
+#include <ControlFirmata.h>
+#include <FirmataScheduler.h>
+#include <AccelStepperFirmata.h>
+#include <I2CFirmata.h>
+#include <SpiFirmata.h>
+#include <SerialFirmata.h>
+#include <EEPROM.h>
+#include <Wire.h>
+#include <utility/PinInterrupts.h>
+#include "NativeFirmata.h"
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    checks++; \
+    if (!(condition)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (0)
+
+static bool outputIs(const byte* expected, size_t length)
+{
+  return stream.getOutputLength() == length && memcmp(stream.getOutput(), expected, length) == 0;
+}
+
+static void process(const byte* data, size_t length)
+{
+  stream.clearOutput();
+  nativeProcess(data, length);
+}
+
+static void resetFirmata()
+{
+  Firmata.parse(SYSTEM_RESET);
+  Firmata.flush();
+  stream.clearOutput();
+}
+
+static void testReportFirmware()
+{
+  const byte query[] = { START_SYSEX, REPORT_FIRMWARE, END_SYSEX };
+  process(query, sizeof(query));
+  const byte* out = stream.getOutput();
+  size_t name = strlen("ConfigurableFirmata");
+  CHECK(stream.getOutputLength() == 4 + 2 * name + 1);
+  CHECK(out[0] == START_SYSEX && out[1] == REPORT_FIRMWARE);
+  CHECK(out[2] == FIRMATA_FIRMWARE_MAJOR_VERSION && out[3] == FIRMATA_FIRMWARE_MINOR_VERSION);
+  CHECK(out[4] == 'C' && out[5] == 0);
+  CHECK(out[stream.getOutputLength() - 1] == END_SYSEX);
+}
+
+static void testDigitalOutput()
+{
+  const byte messages[] = {
+    SET_PIN_MODE, 4, PIN_MODE_OUTPUT,
+    DIGITAL_MESSAGE | 0, 0x10, 0x00, // port 0, pin 4 high
+  };
+  process(messages, sizeof(messages));
+  CHECK(digitalRead(4) == HIGH);
+  CHECK(Firmata.getPinState(4) == 1);
+
+  const byte low[] = { SET_DIGITAL_PIN_VALUE, 4, 0 };
+  process(low, sizeof(low));
+  CHECK(digitalRead(4) == LOW);
+}
+
+static void testExtendedAnalog()
+{
+  const byte messages[] = {
+    SET_PIN_MODE, 5, PIN_MODE_PWM,
+    START_SYSEX, EXTENDED_ANALOG, 5, 0x7F, 0x01, END_SYSEX,
+  };
+  process(messages, sizeof(messages));
+  CHECK(nativeGetPwmValue(5) == 255);
+}
+
+static void testPinStateQuery()
+{
+  const byte messages[] = {
+    SET_PIN_MODE, 6, PIN_MODE_OUTPUT,
+    SET_DIGITAL_PIN_VALUE, 6, 1,
+    START_SYSEX, PIN_STATE_QUERY, 6, END_SYSEX,
+  };
+  process(messages, sizeof(messages));
+  const byte expected[] = { START_SYSEX, PIN_STATE_RESPONSE, 6, PIN_MODE_OUTPUT, 1, END_SYSEX };
+  CHECK(outputIs(expected, sizeof(expected)));
+
+  // pins other than digital ones keep the whole value
+  const byte pwm[] = { SET_PIN_MODE, 5, PIN_MODE_PWM };
+  process(pwm, sizeof(pwm));
+  Firmata.setPinState(5, 200);
+  CHECK(Firmata.getPinState(5) == 200);
+  CHECK((Firmata.getPortState(0) & 0x20) != 0);
+  const byte query[] = { START_SYSEX, PIN_STATE_QUERY, 5, END_SYSEX };
+  process(query, sizeof(query));
+  const byte pwmExpected[] = { START_SYSEX, PIN_STATE_RESPONSE, 5, PIN_MODE_PWM, 200 & 0x7F, 200 >> 7, END_SYSEX };
+  CHECK(outputIs(pwmExpected, sizeof(pwmExpected)));
+
+  // a new mode starts with state 0
+  const byte outputToPwm[] = { SET_PIN_MODE, 6, PIN_MODE_PWM, START_SYSEX, PIN_STATE_QUERY, 6, END_SYSEX };
+  process(outputToPwm, sizeof(outputToPwm));
+  const byte pwmCleared[] = { START_SYSEX, PIN_STATE_RESPONSE, 6, PIN_MODE_PWM, 0, END_SYSEX };
+  CHECK(outputIs(pwmCleared, sizeof(pwmCleared)));
+  Firmata.setPinMode(5, PIN_MODE_SERVO);
+  CHECK(Firmata.getPinState(5) == 0 && (Firmata.getPortState(0) & 0x20) == 0);
+  resetFirmata();
+}
+
+static void testEncoder7BitRoundTrip()
+{
+  byte data[256];
+  for (int i = 0; i < 256; i++)
+  {
+    data[i] = (byte)(i * 37 + 11);
+  }
+  stream.clearOutput();
+  Encoder7BitClass encoder;
+  encoder.startBinaryWrite();
+  for (int i = 0; i < 256; i++)
+  {
+    encoder.writeBinary(data[i]);
+  }
+  encoder.endBinaryWrite();
+  Firmata.flush();
+
+  size_t encodedLength = stream.getOutputLength();
+  CHECK(encodedLength == (256 * 8 + 6) / 7);
+  byte encoded[512];
+  memcpy(encoded, stream.getOutput(), encodedLength);
+  bool all7Bit = true;
+  for (size_t i = 0; i < encodedLength; i++)
+  {
+    all7Bit &= encoded[i] < 0x80;
+  }
+  CHECK(all7Bit);
+
+  byte decoded[256];
+  Encoder7BitClass::readBinary(num7BitOutbytes(encodedLength), encoded, decoded);
+  CHECK(memcmp(data, decoded, sizeof(data)) == 0);
+}
+
+// block writes, encode() and in-place decoding must match the byte-wise encoder
+static void testEncoder7BitBlocks()
+{
+  byte data[64];
+  for (int i = 0; i < 64; i++)
+  {
+    data[i] = (byte)(i * 73 + 5);
+  }
+  for (int prefix = 0; prefix < 8; prefix++)
+  {
+    for (int length = 0; length <= 40; length++)
+    {
+      Encoder7BitClass encoder;
+      stream.clearOutput();
+      encoder.startBinaryWrite();
+      for (int i = 0; i < prefix + length; i++)
+      {
+        encoder.writeBinary(data[i]);
+      }
+      encoder.endBinaryWrite();
+      Firmata.flush();
+      byte expected[128];
+      size_t expectedLength = stream.getOutputLength();
+      memcpy(expected, stream.getOutput(), expectedLength);
+
+      stream.clearOutput();
+      encoder.startBinaryWrite();
+      for (int i = 0; i < prefix; i++)
+      {
+        encoder.writeBinary(data[i]);
+      }
+      encoder.writeBinary(data + prefix, length);
+      encoder.endBinaryWrite();
+      Firmata.flush();
+      CHECK(outputIs(expected, expectedLength));
+
+      if (prefix == 0)
+      {
+        byte encoded[128];
+        CHECK(Encoder7BitClass::encode(data, length, encoded) == num7BitInbytes(length));
+        CHECK((size_t)num7BitInbytes(length) == expectedLength && memcmp(encoded, expected, expectedLength) == 0);
+        Encoder7BitClass::readBinary(length, encoded, encoded);
+        CHECK(memcmp(encoded, data, length) == 0);
+      }
+    }
+  }
+  stream.clearOutput();
+}
+
+static void testInputOverflow()
+{
+  byte message[MAX_DATA_BYTES + 3];
+  message[0] = START_SYSEX;
+  message[1] = PIN_STATE_QUERY;
+  for (size_t i = 2; i < sizeof(message) - 1; i++)
+  {
+    message[i] = 6;
+  }
+  message[sizeof(message) - 1] = END_SYSEX;
+  unsigned long discarded = Firmata.getMessagesDiscarded();
+  process(message, sizeof(message));
+  CHECK(Firmata.getMessagesDiscarded() == discarded + 1);
+  CHECK(stream.getOutputLength() > 2 && stream.getOutput()[1] == STRING_DATA);
+}
+
+static void testNumericEvents()
+{
+  const byte enable[] = { START_SYSEX, EVENT_REPORT, EVENT_CONFIG, 1, END_SYSEX };
+  process(enable, sizeof(enable));
+  CHECK(stream.getOutputLength() == 0);
+
+  const byte unhandled[] = { START_SYSEX, 0x0F, END_SYSEX };
+  process(unhandled, sizeof(unhandled));
+  const byte expected[] = {
+    START_SYSEX, EVENT_REPORT, EVENT_DATA,
+    EVENT_UNHANDLED_SYSEX & 0x7F, EVENT_UNHANDLED_SYSEX >> 7, 0, 0,
+    0x0F, 0, 0, 0, 0,
+    END_SYSEX
+  };
+  CHECK(outputIs(expected, sizeof(expected)));
+
+  // repeated within the rate limiting window: only counted
+  process(unhandled, sizeof(unhandled));
+  CHECK(stream.getOutputLength() == 0);
+  resetFirmata();
+}
+
+static void testStatsQuery()
+{
+  const byte query[] = { START_SYSEX, FIRMATA_STATS, STATS_QUERY, END_SYSEX };
+  process(query, sizeof(query));
+  const byte* out = stream.getOutput();
+  CHECK(stream.getOutputLength() > 3 && out[1] == FIRMATA_STATS && out[2] == STATS_REPLY);
+  CHECK(out[stream.getOutputLength() - 1] == END_SYSEX);
+}
+
+// the block parser must give the same result as feeding single bytes
+static void testBlockAndBytewiseParsing()
+{
+  const byte messages[] = {
+    SET_PIN_MODE, 7, PIN_MODE_OUTPUT,
+    START_SYSEX, PIN_STATE_QUERY, 7, 1, 2, 3, 4, 5, 6, 7, 8, 9, END_SYSEX,
+    DIGITAL_MESSAGE | 0, 0x00, 0x01, // pin 7 high
+    START_SYSEX, PIN_STATE_QUERY, 7, END_SYSEX,
+    START_SYSEX, REPORT_FIRMWARE, END_SYSEX,
+  };
+  process(messages, sizeof(messages));
+  size_t length = stream.getOutputLength();
+  byte block[MOCK_STREAM_OUTPUT_SIZE];
+  memcpy(block, stream.getOutput(), length);
+
+  resetFirmata();
+  for (size_t i = 0; i < sizeof(messages); i++)
+  {
+    nativeProcess(messages + i, 1);
+  }
+  CHECK(outputIs(block, length));
+}
+
+static size_t fillEnvelope(byte* message, uint16_t sequence, const byte* inner, size_t length)
+{
+  message[0] = START_SYSEX;
+  message[1] = FIRMATA_ENVELOPE;
+  message[2] = ENVELOPE_EXECUTE;
+  message[3] = sequence & 0x7F;
+  message[4] = sequence >> 7;
+  size_t encoded = Encoder7BitClass::encode(inner, length, message + 5);
+  message[5 + encoded] = END_SYSEX;
+  return encoded + 6;
+}
+
+// the stream is flushed after every output, also if it didn't go through the transmit buffer
+static void testStreamFlush()
+{
+  stream.clearOutput();
+  Firmata.flush();
+  CHECK(stream.getFlushCalls() == 0);
+  static byte block[TX_BUFFER_SIZE + 1];
+  Firmata.write(block, sizeof(block));
+  Firmata.flush();
+  CHECK(stream.getOutputLength() == sizeof(block) && stream.getFlushCalls() == 1);
+  // a message that fills the buffer is sent before flush()
+  stream.clearOutput();
+  for (size_t i = 0; i < TX_BUFFER_SIZE; i++) {
+    Firmata.write(0x01);
+  }
+  CHECK(stream.getOutputLength() == TX_BUFFER_SIZE);
+  Firmata.flush();
+  CHECK(stream.getFlushCalls() == 1);
+  Firmata.flush();
+  CHECK(stream.getFlushCalls() == 1);
+  stream.clearOutput();
+}
+
+static void testEnvelope()
+{
+  const byte inner[] = {
+    SET_PIN_MODE, 8, PIN_MODE_OUTPUT,
+    SET_DIGITAL_PIN_VALUE, 8, 1,
+    START_SYSEX, PIN_STATE_QUERY, 8, END_SYSEX,
+    START_SYSEX, 0x0F, END_SYSEX, // nobody handles this
+  };
+  byte message[64];
+  size_t length = fillEnvelope(message, 0x1234, inner, sizeof(inner));
+  process(message, length);
+  CHECK(digitalRead(8) == HIGH);
+  const byte state[] = { START_SYSEX, PIN_STATE_RESPONSE, 8, PIN_MODE_OUTPUT, 1, END_SYSEX };
+  const byte ack[] = { START_SYSEX, FIRMATA_ENVELOPE, ENVELOPE_ACK, 0x34, 0x24, ENVELOPE_OK, 1, END_SYSEX };
+  const byte* out = stream.getOutput();
+  size_t outLength = stream.getOutputLength();
+  CHECK(outLength >= sizeof(state) + sizeof(ack));
+  CHECK(memcmp(out, state, sizeof(state)) == 0);
+  CHECK(memcmp(out + outLength - sizeof(ack), ack, sizeof(ack)) == 0);
+
+  // a cut off inner message is discarded and must not swallow the following messages
+  const byte cutOff[] = { SET_DIGITAL_PIN_VALUE, 8, 0, START_SYSEX, PIN_STATE_QUERY };
+  length = fillEnvelope(message, 5, cutOff, sizeof(cutOff));
+  process(message, length);
+  const byte incomplete[] = { START_SYSEX, FIRMATA_ENVELOPE, ENVELOPE_ACK, 5, 0, ENVELOPE_INCOMPLETE, 0, END_SYSEX };
+  CHECK(outputIs(incomplete, sizeof(incomplete)));
+  CHECK(digitalRead(8) == LOW);
+  const byte query[] = { START_SYSEX, PIN_STATE_QUERY, 8, END_SYSEX };
+  process(query, sizeof(query));
+  const byte low[] = { START_SYSEX, PIN_STATE_RESPONSE, 8, PIN_MODE_OUTPUT, 0, END_SYSEX };
+  CHECK(outputIs(low, sizeof(low)));
+
+  // envelopes don't nest
+  byte nested[32];
+  const byte innermost[] = { SET_DIGITAL_PIN_VALUE, 8, 1 };
+  size_t nestedLength = fillEnvelope(nested, 1, innermost, sizeof(innermost));
+  length = fillEnvelope(message, 2, nested, nestedLength);
+  process(message, length);
+  const byte rejected[] = { START_SYSEX, FIRMATA_ENVELOPE, ENVELOPE_ACK, 1, 0, ENVELOPE_NESTED, 0, END_SYSEX };
+  const byte outer[] = { START_SYSEX, FIRMATA_ENVELOPE, ENVELOPE_ACK, 2, 0, ENVELOPE_OK, 0, END_SYSEX };
+  CHECK(stream.getOutputLength() == sizeof(rejected) + sizeof(outer));
+  CHECK(memcmp(stream.getOutput(), rejected, sizeof(rejected)) == 0);
+  CHECK(memcmp(stream.getOutput() + sizeof(rejected), outer, sizeof(outer)) == 0);
+  CHECK(digitalRead(8) == LOW);
+}
+
+static int bootConfigCommand(byte subcommand, byte flags)
+{
+  const byte message[] = { START_SYSEX, FIRMATA_BOOT_CONFIG, subcommand, flags, END_SYSEX };
+  process(message, sizeof(message));
+  // the status is the last message, a restore may report the inputs first
+  if (stream.getOutputLength() < 8) {
+    return -1;
+  }
+  const byte* out = stream.getOutput() + stream.getOutputLength() - 8;
+  if (out[0] != START_SYSEX || out[1] != FIRMATA_BOOT_CONFIG || out[2] != BOOT_CONFIG_STATUS || out[3] != BOOT_CONFIG_OK) {
+    return -1;
+  }
+  return out[5] | (out[6] << 7);
+}
+
+static void testBootConfig()
+{
+  const byte setup[] = {
+    SET_PIN_MODE, 9, PIN_MODE_OUTPUT,
+    SET_DIGITAL_PIN_VALUE, 9, 1,
+    SET_PIN_MODE, 10, PIN_MODE_PULLUP,
+    REPORT_DIGITAL | 1, 1,
+    REPORT_ANALOG | 2, 0, // A2 stays in analog mode, but silent
+    START_SYSEX, SAMPLING_INTERVAL, 100, 0, END_SYSEX,
+  };
+  process(setup, sizeof(setup));
+  int length = bootConfigCommand(BOOT_CONFIG_SAVE, BOOT_CONFIG_ON_RESET);
+  CHECK(length > 0);
+  byte saved[BOOT_CONFIG_SIZE];
+  for (int i = 0; i < BOOT_CONFIG_SIZE; i++) {
+    saved[i] = EEPROM.read(BOOT_CONFIG_EEPROM_OFFSET + i);
+  }
+
+  // the reset sets all pins to their defaults, the next loop iteration restores the configuration
+  resetFirmata();
+  CHECK(digitalRead(9) == LOW && Firmata.getPinMode(10) == PIN_MODE_OUTPUT);
+  firmataExt.report(false);
+  CHECK(Firmata.getPinMode(9) == PIN_MODE_OUTPUT && digitalRead(9) == HIGH);
+  CHECK(Firmata.getPinMode(10) == PIN_MODE_PULLUP);
+  CHECK(Firmata.getPinMode(26) == PIN_MODE_ANALOG);
+
+  // saving the restored configuration gives the same data, and rewrites only the magic byte
+  unsigned long writes = EEPROM.writes;
+  CHECK(bootConfigCommand(BOOT_CONFIG_SAVE, BOOT_CONFIG_ON_RESET) == length);
+  CHECK(EEPROM.writes - writes == 2);
+  bool same = true;
+  for (int i = 0; i < BOOT_CONFIG_SIZE; i++) {
+    same &= saved[i] == EEPROM.read(BOOT_CONFIG_EEPROM_OFFSET + i);
+  }
+  CHECK(same);
+
+  // without BOOT_CONFIG_ON_RESET, a SYSTEM_RESET gives the defaults
+  CHECK(bootConfigCommand(BOOT_CONFIG_SAVE, 0) == length);
+  resetFirmata();
+  firmataExt.report(false);
+  CHECK(Firmata.getPinMode(10) == PIN_MODE_OUTPUT);
+  CHECK(bootConfigCommand(BOOT_CONFIG_RESTORE, 0) == length);
+  CHECK(Firmata.getPinMode(10) == PIN_MODE_PULLUP);
+
+  CHECK(bootConfigCommand(BOOT_CONFIG_CLEAR, 0) == 0);
+  CHECK(bootConfigCommand(BOOT_CONFIG_QUERY, 0) == 0);
+  resetFirmata();
+}
+
+static void testSpscRing()
+{
+  static FirmataSpscRing ring;
+  byte data[DUAL_CORE_RING_SIZE + 1];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (byte)i;
+  }
+  CHECK(ring.available() == 0 && ring.peek() == -1 && ring.space() == DUAL_CORE_RING_SIZE);
+  CHECK(ring.write(data, sizeof(data)) == DUAL_CORE_RING_SIZE);
+  CHECK(ring.space() == 0 && ring.peek() == 0);
+  byte copy[DUAL_CORE_RING_SIZE];
+  CHECK(ring.read(copy, 10) == 10 && ring.space() == 10);
+  CHECK(ring.read(copy, sizeof(copy)) == DUAL_CORE_RING_SIZE - 10 && copy[0] == 10);
+
+  // one thread on each side, with odd length pieces so that they wrap around anywhere
+  const size_t total = 1 << 22;
+  std::thread producer([&]() {
+    size_t sent = 0;
+    while (sent < total) {
+      byte piece[97];
+      size_t length = min(1 + (sent % 97), total - sent);
+      for (size_t i = 0; i < length; i++) {
+        piece[i] = (byte)((sent + i) * 31);
+      }
+      size_t written = 0;
+      while (written < length) {
+        written += ring.write(piece + written, length - written);
+      }
+      sent += length;
+    }
+  });
+  size_t received = 0;
+  bool inOrder = true;
+  while (received < total) {
+    byte piece[61];
+    size_t length = ring.read(piece, 1 + (received % 61));
+    for (size_t i = 0; i < length; i++) {
+      inOrder &= piece[i] == (byte)((received + i) * 31);
+    }
+    received += length;
+  }
+  producer.join();
+  CHECK(inOrder);
+  CHECK(ring.available() == 0);
+}
+
+// records the streamed messages of STREAM_TEST_COMMAND
+#define STREAM_TEST_COMMAND 0x0E
+#define STREAM_TEST_SIZE (3 * SYSEX_STREAM_CHUNK_SIZE + 5)
+
+class StreamRecorder : public FirmataFeature
+{
+  public:
+    void handleCapability(byte pin) override {}
+    boolean handlePinMode(byte pin, int mode) override { return false; }
+    boolean handleSysex(byte command, byte argc, byte* argv) override
+    {
+      if (command != STREAM_TEST_COMMAND) {
+        return false;
+      }
+      shortMessages++;
+      return true;
+    }
+    boolean ownsSysexCommand(byte command) override { return command == STREAM_TEST_COMMAND; }
+    boolean handleSysexStream(byte command, byte phase, byte length, byte* data) override
+    {
+      phases[numPhases++ % sizeof(phases)] = phase;
+      if (phase == SYSEX_STREAM_BEGIN) {
+        return accept;
+      }
+      for (byte i = 0; i < length && received < sizeof(bytes); i++) {
+        bytes[received++] = data[i];
+      }
+      return true;
+    }
+    void reset() override
+    {
+      numPhases = 0;
+      received = 0;
+      shortMessages = 0;
+    }
+    // a message of configSize bytes for the boot configuration
+    void writeConfiguration(Print& out) override
+    {
+      if (configSize >= 2) {
+        out.write(START_SYSEX);
+        for (int i = 2; i < configSize; i++) {
+          out.write(i == 2 ? STREAM_TEST_COMMAND : 0);
+        }
+        out.write(END_SYSEX);
+      }
+    }
+    bool accept = true;
+    int configSize = 0;
+    byte phases[16];
+    size_t numPhases = 0;
+    byte bytes[STREAM_TEST_SIZE];
+    size_t received = 0;
+    int shortMessages = 0;
+};
+
+static StreamRecorder streamRecorder;
+
+static void testBootConfigTooLarge()
+{
+  // a configuration that doesn't fit leaves the stored one alone
+  const byte output[] = { SET_PIN_MODE, 9, PIN_MODE_OUTPUT };
+  process(output, sizeof(output));
+  int length = bootConfigCommand(BOOT_CONFIG_SAVE, 0);
+  CHECK(length > 0);
+  streamRecorder.configSize = BOOT_CONFIG_SIZE;
+  const byte save[] = { START_SYSEX, FIRMATA_BOOT_CONFIG, BOOT_CONFIG_SAVE, 0, END_SYSEX };
+  process(save, sizeof(save));
+  const byte* out = stream.getOutput() + stream.getOutputLength() - 8;
+  CHECK(out[2] == BOOT_CONFIG_STATUS && out[3] == BOOT_CONFIG_TOO_LARGE && (out[5] | (out[6] << 7)) == length);
+  streamRecorder.configSize = 0;
+
+  // so does a stepper, which can't be saved
+  const byte stepper[] = { START_SYSEX, ACCELSTEPPER_DATA, ACCELSTEPPER_CONFIG, 0, 0x10, 11, 12, 0, END_SYSEX };
+  process(stepper, sizeof(stepper));
+  process(save, sizeof(save));
+  out = stream.getOutput() + stream.getOutputLength() - 8;
+  CHECK(out[2] == BOOT_CONFIG_STATUS && out[3] == BOOT_CONFIG_UNSUPPORTED && (out[5] | (out[6] << 7)) == length);
+  resetFirmata();
+
+  // and a task or an open serial port
+  const byte task[] = { START_SYSEX, SCHEDULER_DATA, CREATE_FIRMATA_TASK, 1, 3, 0, END_SYSEX };
+  process(task, sizeof(task));
+  process(save, sizeof(save));
+  out = stream.getOutput() + stream.getOutputLength() - 8;
+  CHECK(out[2] == BOOT_CONFIG_STATUS && out[3] == BOOT_CONFIG_UNSUPPORTED);
+  resetFirmata();
+  const byte serial[] = { START_SYSEX, SERIAL_MESSAGE, SERIAL_CONFIG | HW_SERIAL1, 9600 & 0x7F, (9600 >> 7) & 0x7F, 0, END_SYSEX };
+  process(serial, sizeof(serial));
+  process(save, sizeof(save));
+  out = stream.getOutput() + stream.getOutputLength() - 8;
+  CHECK(out[2] == BOOT_CONFIG_STATUS && out[3] == BOOT_CONFIG_UNSUPPORTED);
+  const byte close[] = { START_SYSEX, SERIAL_MESSAGE, SERIAL_CLOSE | HW_SERIAL1, END_SYSEX };
+  process(close, sizeof(close));
+  process(save, sizeof(save));
+  out = stream.getOutput() + stream.getOutputLength() - 8;
+  CHECK(out[2] == BOOT_CONFIG_STATUS && out[3] == BOOT_CONFIG_OK);
+  CHECK(bootConfigCommand(BOOT_CONFIG_CLEAR, 0) == 0);
+  resetFirmata();
+}
+
+static size_t fillStreamMessage(byte* message, size_t dataBytes)
+{
+  message[0] = START_SYSEX;
+  message[1] = STREAM_TEST_COMMAND;
+  for (size_t i = 0; i < dataBytes; i++) {
+    message[2 + i] = (byte)(i * 7 + 3) & 0x7F;
+  }
+  message[2 + dataBytes] = END_SYSEX;
+  return dataBytes + 3;
+}
+
+struct ArenaObject
+{
+  static int destroyed;
+  long value;
+  ArenaObject(long value) : value(value) {}
+  ~ArenaObject() { destroyed++; }
+};
+int ArenaObject::destroyed = 0;
+
+static uint32_t unpack32(const byte* data)
+{
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 7) | ((uint32_t)data[2] << 14) | ((uint32_t)data[3] << 21) | ((uint32_t)data[4] << 28);
+}
+
+static void testArena()
+{
+  CHECK(FirmataArena.getCapacity() == FIRMATA_ARENA_SIZE && FirmataArena.getUsed() == 0);
+#if FIRMATA_ARENA_SIZE > 0
+  byte* a = (byte*)FirmataArena.allocate(10);
+  byte* b = (byte*)FirmataArena.allocate(10);
+  size_t block = FirmataArena.getUsed() / 2;
+  CHECK(a != nullptr && b == a + block && block >= FIRMATA_ARENA_ALIGN + 10);
+  CHECK((size_t)a % FIRMATA_ARENA_ALIGN == 0);
+  // a block from the middle is reused for the same size, the last one returns to the free memory
+  FirmataArena.release(a);
+  CHECK(FirmataArena.getUsed() == block);
+  CHECK(FirmataArena.allocate(12) == a);
+  FirmataArena.release(b);
+  CHECK(FirmataArena.allocate(10) == b);
+  FirmataArena.release(b);
+  FirmataArena.release(a);
+  CHECK(FirmataArena.getUsed() == 0 && FirmataArena.getHighWaterMark() >= 2 * block);
+
+  ArenaObject* object = FirmataArena.create<ArenaObject>(42L);
+  CHECK(object != nullptr && object->value == 42 && (byte*)object == a);
+  ArenaObject::destroyed = 0;
+  FirmataArena.destroy(object);
+  CHECK(ArenaObject::destroyed == 1 && FirmataArena.getUsed() == 0);
+
+  unsigned long fallbacks = FirmataArena.getHeapFallbacks();
+  byte* large = (byte*)FirmataArena.allocate(FIRMATA_ARENA_SIZE);
+  CHECK(large != nullptr && FirmataArena.getHeapFallbacks() == fallbacks + 1 && FirmataArena.getUsed() == 0);
+  FirmataArena.release(large);
+  unsigned long expectedFallbacks = fallbacks + 1;
+
+  a = (byte*)FirmataArena.allocate(20);
+#else
+  // without an arena every block comes from the heap
+  unsigned long fallbacks = FirmataArena.getHeapFallbacks();
+  ArenaObject* object = FirmataArena.create<ArenaObject>(42L);
+  CHECK(object != nullptr && object->value == 42 && FirmataArena.getUsed() == 0);
+  ArenaObject::destroyed = 0;
+  FirmataArena.destroy(object);
+  CHECK(ArenaObject::destroyed == 1 && FirmataArena.getHeapFallbacks() == fallbacks + 1);
+  byte* a = (byte*)FirmataArena.allocate(20);
+  unsigned long expectedFallbacks = fallbacks + 2;
+#endif
+  const byte query[] = { START_SYSEX, FIRMATA_STATS, STATS_MEMORY, END_SYSEX };
+  process(query, sizeof(query));
+  const byte* out = stream.getOutput();
+  CHECK(stream.getOutputLength() == 4 + 5 * 5 && out[2] == STATS_MEMORY_REPLY && out[28] == END_SYSEX);
+  CHECK(unpack32(out + 3) == FIRMATA_ARENA_SIZE && unpack32(out + 8) == FirmataArena.getUsed());
+  CHECK(unpack32(out + 13) == FirmataArena.getHighWaterMark() && unpack32(out + 18) == expectedFallbacks);
+
+#if FIRMATA_ARENA_SIZE > 0
+  // nothing survives a SYSTEM_RESET
+  resetFirmata();
+  CHECK(FirmataArena.getUsed() == 0 && FirmataArena.allocate(20) == a);
+#else
+  FirmataArena.release(a);
+#endif
+}
+
+static void firstIsr() {}
+static void secondIsr() {}
+
+static void testPinInterrupts()
+{
+  // the feature that attached an interrupt last owns it, the one before can't detach it anymore
+  static const char first = 1, second = 2; // only their addresses are used
+  PinInterrupts::attach(3, firstIsr, CHANGE, &first);
+  PinInterrupts::attach(3, secondIsr, RISING, &second);
+  CHECK(nativeGetInterruptHandler(3) == secondIsr && !PinInterrupts::isOwner(3, &first));
+  PinInterrupts::detach(3, &first);
+  CHECK(nativeGetInterruptHandler(3) == secondIsr && PinInterrupts::isOwner(3, &second));
+  PinInterrupts::detach(3, &second);
+  CHECK(nativeGetInterruptHandler(3) == nullptr && !PinInterrupts::isOwner(3, &second));
+  PinInterrupts::attach(NOT_AN_INTERRUPT, firstIsr, CHANGE, &first);
+  CHECK(!PinInterrupts::isOwner(NOT_AN_INTERRUPT, &first));
+}
+
+static void reportAnalogOnce()
+{
+  stream.clearOutput();
+  analogInput.report(true);
+  Firmata.flush();
+}
+
+static void testAnalogReportPolicy()
+{
+  const byte setup[] = {
+    REPORT_ANALOG | 0, 1,
+    REPORT_ANALOG | 1, 1,
+    // channel 0 only on change, channel 1 beyond a deadband of 10, with a heartbeat of 30 ms
+    START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_REPORT_POLICY, 0, ANALOG_REPORT_ON_CHANGE, 0, 0, 0, 0, END_SYSEX,
+    START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_REPORT_POLICY, 1, ANALOG_REPORT_ON_CHANGE, 10, 0, 30, 0, END_SYSEX,
+  };
+  nativeSetAnalogValue(0, 100);
+  nativeSetAnalogValue(1, 200);
+  process(setup, sizeof(setup));
+
+  // a new policy starts with a report, from then on unchanged values are left out
+  reportAnalogOnce();
+  const byte first[] = { ANALOG_MESSAGE | 0, 100, 0, ANALOG_MESSAGE | 1, 200 & 0x7F, 200 >> 7 };
+  CHECK(outputIs(first, sizeof(first)));
+  reportAnalogOnce();
+  CHECK(stream.getOutputLength() == 0);
+  nativeSetAnalogValue(0, 101);
+  nativeSetAnalogValue(1, 210);
+  reportAnalogOnce();
+  const byte changed[] = { ANALOG_MESSAGE | 0, 101, 0 };
+  CHECK(outputIs(changed, sizeof(changed)));
+  nativeSetAnalogValue(1, 211);
+  reportAnalogOnce();
+  const byte beyondDeadband[] = { ANALOG_MESSAGE | 1, 211 & 0x7F, 211 >> 7 };
+  CHECK(outputIs(beyondDeadband, sizeof(beyondDeadband)));
+  delay(35);
+  reportAnalogOnce();
+  CHECK(outputIs(beyondDeadband, sizeof(beyondDeadband)));
+
+  // the batched frame only contains the channels that are due
+  const byte batched[] = { START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_BATCHED_REPORT, 1, END_SYSEX };
+  process(batched, sizeof(batched));
+  nativeSetAnalogValue(0, 90);
+  reportAnalogOnce();
+  const byte* out = stream.getOutput();
+  CHECK(stream.getOutputLength() == 3 + 5 + 1 + 2 + 2 + 1 && out[8] == 2 && out[9] == 0x01 && out[11] == 90);
+
+  // ANALOG_REPORT_ALWAYS for all channels restores the old behaviour
+  const byte always[] = { START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_REPORT_POLICY, 127, ANALOG_REPORT_ALWAYS, 0, 0, 0, 0, END_SYSEX };
+  process(always, sizeof(always));
+  reportAnalogOnce();
+  out = stream.getOutput();
+  CHECK(stream.getOutputLength() == 3 + 5 + 1 + 2 + 2 * 2 + 1 && out[9] == 0x03);
+  nativeSetAnalogValue(0, 0);
+  nativeSetAnalogValue(1, 0);
+}
+
+static int reportedAnalog(byte channel)
+{
+  const byte* out = stream.getOutput();
+  for (size_t i = 0; i + 2 < stream.getOutputLength(); i++) {
+    if (out[i] == (ANALOG_MESSAGE | channel)) {
+      return out[i + 1] | (out[i + 2] << 7);
+    }
+  }
+  return -1;
+}
+
+static void testAnalogFilter()
+{
+  const byte setup[] = {
+    REPORT_ANALOG | 0, 1,
+    REPORT_ANALOG | 1, 1,
+    REPORT_ANALOG | 2, 1,
+    // 4 reads per sample for one more bit on channel 0, an IIR filter on 1, a moving average over 2 on 2
+    START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_FILTER, 0, 2, ANALOG_FILTER_NONE, 0, END_SYSEX,
+    START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_FILTER, 1, 0, ANALOG_FILTER_IIR, 1, END_SYSEX,
+    START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_FILTER, 2, 0, ANALOG_FILTER_MOVING_AVERAGE, 1, END_SYSEX,
+  };
+  nativeSetAnalogValue(0, 300);
+  nativeSetAnalogValue(1, 100);
+  nativeSetAnalogValue(2, 100);
+  process(setup, sizeof(setup));
+  reportAnalogOnce();
+  CHECK(reportedAnalog(0) == 600 && reportedAnalog(1) == 100 && reportedAnalog(2) == 100);
+  nativeSetAnalogValue(1, 200);
+  nativeSetAnalogValue(2, 200);
+  reportAnalogOnce();
+  CHECK(reportedAnalog(1) == 150 && reportedAnalog(2) == 150);
+  reportAnalogOnce();
+  CHECK(reportedAnalog(1) == 175 && reportedAnalog(2) == 200);
+
+  // the capability response shows the extra bit of channel 0
+  const byte capabilities[] = { START_SYSEX, CAPABILITY_QUERY, END_SYSEX };
+  process(capabilities, sizeof(capabilities));
+  const byte* out = stream.getOutput();
+  int resolutions[2] = { -1, -1 };
+  for (size_t i = 2, pin = 0; i < stream.getOutputLength() && pin <= 25; i += 2) {
+    if (out[i] == 0x7F) {
+      pin++;
+      i--;
+    } else if (out[i] == PIN_MODE_ANALOG && pin >= 24) {
+      resolutions[pin - 24] = out[i + 1];
+    }
+  }
+  CHECK(resolutions[0] == DEFAULT_ADC_RESOLUTION + 1 && resolutions[1] == DEFAULT_ADC_RESOLUTION);
+
+  const byte tooMuch[] = { START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_FILTER, 0, 2, ANALOG_FILTER_MOVING_AVERAGE, 7, END_SYSEX };
+  process(tooMuch, sizeof(tooMuch));
+  CHECK(stream.getOutputLength() > 2 && stream.getOutput()[1] == STRING_DATA);
+  // beyond the width of an int, where the shift is undefined
+  const byte wayTooMuch[] = { START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_FILTER, 0, 2, ANALOG_FILTER_MOVING_AVERAGE, 33, END_SYSEX };
+  process(wayTooMuch, sizeof(wayTooMuch));
+  CHECK(stream.getOutputLength() > 2 && stream.getOutput()[1] == STRING_DATA);
+  for (byte channel = 0; channel < 3; channel++) {
+    nativeSetAnalogValue(channel, 0);
+  }
+}
+
+static void testOutputQueue()
+{
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+  const byte setup[] = { REPORT_ANALOG | 0, 1, REPORT_ANALOG | 1, 1 };
+  const byte version[] = { REPORT_VERSION };
+  nativeSetAnalogValue(0, 100);
+  nativeSetAnalogValue(1, 200);
+  process(setup, sizeof(setup));
+  Firmata.setOutputQueue(true);
+
+  // nothing is written while the stream has no room, and the loop goes on
+  stream.setWriteSpace(0);
+  unsigned long dropped = Firmata.getMessagesDropped();
+  reportAnalogOnce();
+  nativeSetAnalogValue(0, 101);
+  reportAnalogOnce();
+  CHECK(stream.getOutputLength() == 0 && Firmata.getMessagesDropped() == dropped + 2);
+  Firmata.sendString(F("queued"));
+  process(version, sizeof(version));
+  CHECK(stream.getOutputLength() == 0);
+
+  // the reply goes first, also when the stream takes it in pieces
+  stream.setWriteSpace(2);
+  Firmata.flush();
+  CHECK(stream.getOutputLength() == 2 && stream.getOutput()[0] == REPORT_VERSION);
+  stream.setWriteSpace(1);
+  Firmata.flush();
+  CHECK(stream.getOutputLength() == 3 && stream.getOutput()[2] == FIRMATA_PROTOCOL_MINOR_VERSION);
+
+  // then the string, then only the latest sample of each channel
+  stream.setWriteSpace(-1);
+  Firmata.flush();
+  const byte* out = stream.getOutput();
+  size_t length = stream.getOutputLength();
+  CHECK(out[3] == START_SYSEX && out[4] == STRING_DATA && length == 3 + 3 + 2 * strlen("queued") + 6);
+  CHECK(out[length - 6] == (ANALOG_MESSAGE | 0) && reportedAnalog(0) == 101 && reportedAnalog(1) == 200);
+
+  // a source that sends changes can check for its unsent sample, a reply can drop it
+  stream.setWriteSpace(0);
+  reportAnalogOnce();
+  CHECK(Firmata.isTelemetryQueued(ANALOG_MESSAGE << 8 | 0) && Firmata.isTelemetryQueued(ANALOG_MESSAGE << 8 | 1));
+  Firmata.cancelTelemetry(ANALOG_MESSAGE << 8 | 0);
+  stream.setWriteSpace(-1);
+  Firmata.flush();
+  CHECK(!Firmata.isTelemetryQueued(ANALOG_MESSAGE << 8 | 1) && reportedAnalog(0) == -1 && reportedAnalog(1) == 200);
+
+  // turning the queue off writes what is left
+  stream.setWriteSpace(0);
+  reportAnalogOnce();
+  Firmata.setOutputQueue(false);
+  CHECK(stream.getOutputLength() == 6 && reportedAnalog(0) == 101);
+  stream.setWriteSpace(-1);
+
+  // a reply that doesn't fit waits for the backlog, also when the stream takes it in pieces
+  Firmata.setOutputQueue(true);
+  stream.clearOutput();
+  stream.setWriteSpace(0);
+  static byte backlog[FIRMATA_OUTPUT_QUEUE_SIZE - 16];
+  byte reply[64];
+  memset(backlog, 0x11, sizeof(backlog));
+  memset(reply, 0x22, sizeof(reply));
+  Firmata.write(backlog, sizeof(backlog));
+  Firmata.write(reply, sizeof(reply));
+  stream.setWriteLimit(10);
+  Firmata.flush();
+  stream.setWriteLimit(0);
+  stream.setWriteSpace(-1);
+  Firmata.flush();
+  CHECK(stream.getOutputLength() == sizeof(backlog) + sizeof(reply));
+  CHECK(stream.getOutput()[sizeof(backlog) - 1] == 0x11 && stream.getOutput()[sizeof(backlog)] == 0x22);
+
+  // the events of the inner messages of an envelope go out before the acknowledgement, too
+  stream.clearOutput();
+  stream.setWriteSpace(0);
+  const byte inner[] = { START_SYSEX, 0x0F, END_SYSEX }; // nobody handles this
+  byte envelope[32];
+  nativeProcess(envelope, fillEnvelope(envelope, 7, inner, sizeof(inner)));
+  stream.setWriteSpace(-1);
+  Firmata.flush();
+  const byte ack[] = { START_SYSEX, FIRMATA_ENVELOPE, ENVELOPE_ACK, 7, 0, ENVELOPE_OK, 1, END_SYSEX };
+  out = stream.getOutput();
+  length = stream.getOutputLength();
+  CHECK(length > sizeof(ack) && out[1] == STRING_DATA && memcmp(out + length - sizeof(ack), ack, sizeof(ack)) == 0);
+  Firmata.setOutputQueue(false);
+  nativeSetAnalogValue(0, 0);
+  nativeSetAnalogValue(1, 0);
+#endif
+}
+
+static void testCapabilityCache()
+{
+  const byte query[] = { START_SYSEX, CAPABILITY_QUERY, END_SYSEX };
+  process(query, sizeof(query));
+  std::vector<byte> first(stream.getOutput(), stream.getOutput() + stream.getOutputLength());
+  CHECK(first.size() > TOTAL_PINS + 3 && first[1] == CAPABILITY_RESPONSE && first.back() == END_SYSEX);
+  unsigned long written = Firmata.getBytesWritten();
+  process(query, sizeof(query));
+  CHECK(stream.getOutputLength() == first.size() && memcmp(stream.getOutput(), first.data(), first.size()) == 0);
+  CHECK(Firmata.getBytesWritten() == written + first.size());
+
+  // an ignored pin has no capabilities
+  Firmata.setPinMode(23, PIN_MODE_IGNORE); // for good, this test runs last
+  process(query, sizeof(query));
+  size_t ignoredLength = stream.getOutputLength();
+  CHECK(ignoredLength < first.size());
+
+  // the resolution follows the oversampling of an analog channel
+  const byte oversampling[] = { START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_FILTER, 0, 2, ANALOG_FILTER_NONE, 0, END_SYSEX };
+  process(oversampling, sizeof(oversampling));
+  process(query, sizeof(query));
+  const byte* out = stream.getOutput();
+  CHECK(stream.getOutputLength() == ignoredLength);
+  int resolution = -1;
+  for (size_t i = 2, pin = 0; i < stream.getOutputLength() && pin <= 24; i += 2) {
+    if (out[i] == 0x7F) {
+      pin++;
+      i--;
+    } else if (out[i] == PIN_MODE_ANALOG && pin == 24) {
+      resolution = out[i + 1];
+    }
+  }
+  CHECK(resolution == DEFAULT_ADC_RESOLUTION + 1);
+
+  const byte mapping[] = { START_SYSEX, ANALOG_MAPPING_QUERY, END_SYSEX };
+  process(mapping, sizeof(mapping));
+  out = stream.getOutput();
+  CHECK(stream.getOutputLength() == TOTAL_PINS + 3 && out[1] == ANALOG_MAPPING_RESPONSE && out[2 + 24] == 0 && out[2 + 23] == 127);
+  resetFirmata();
+}
+
+static FirmataCapture capture;
+
+static void captureCommand(byte subcommand)
+{
+  const byte message[] = { START_SYSEX, FIRMATA_CAPTURE, subcommand, END_SYSEX };
+  process(message, sizeof(message));
+}
+
+static void testCapture()
+{
+  // 10 frames of analog channel 0 and digital port 0, 3 of them before the trigger
+  const byte config[] = {
+    START_SYSEX, FIRMATA_CAPTURE, CAPTURE_CONFIG, 20, 0, 0, 0, 0, 10, 0, 0, 0, 0, 3, 0, 0, 0, 0,
+    CAPTURE_NO_TRIGGER_PIN, CAPTURE_EDGE_RISING, CAPTURE_SOURCE_ANALOG | 0, CAPTURE_SOURCE_PORT | 0, END_SYSEX
+  };
+  process(config, sizeof(config));
+  const byte* out = stream.getOutput();
+  CHECK(stream.getOutputLength() == 20 && out[2] == CAPTURE_STATUS && out[3] == CAPTURE_IDLE);
+  CHECK(unpack32(out + 14) == CAPTURE_BUFFER_SIZE / 3);
+
+  // the conversion doesn't fit into an interval of 12 us
+  byte tooFast[sizeof(config)];
+  memcpy(tooFast, config, sizeof(config));
+  tooFast[3] = 12;
+  process(tooFast, sizeof(tooFast));
+  CHECK(stream.getOutputLength() > 0 && stream.getOutput()[1] == STRING_DATA);
+  process(config, sizeof(config));
+  captureCommand(CAPTURE_ARM);
+  CHECK(stream.getOutputLength() == 20 && stream.getOutput()[3] == CAPTURE_ARMED);
+
+  digitalWrite(2, HIGH);
+  for (int i = 0; i < 5; i++) {
+    nativeSetAnalogValue(0, i);
+    capture.sampleFromTimer();
+  }
+  captureCommand(CAPTURE_TRIGGER);
+  for (int i = 0; i < 8; i++) {
+    nativeSetAnalogValue(0, 300 + i);
+    capture.sampleFromTimer();
+  }
+  // the data goes out one chunk per loop, the sample after the capture is not part of it
+  stream.clearOutput();
+  capture.report(false);
+  Firmata.flush();
+  out = stream.getOutput();
+  CHECK(stream.getOutputLength() == 20 + 44 + 20);
+  CHECK(out[3] == CAPTURE_SENDING && unpack32(out + 4) == 10 && unpack32(out + 9) == 3);
+  CHECK(out[22] == CAPTURE_DATA && unpack32(out + 23) == 0);
+  byte data[30];
+  Encoder7BitClass::readBinary(sizeof(data), (byte*)out + 28, data);
+  const byte expected[] = { 2, 0, 0x04, 3, 0, 0x04, 4, 0, 0x04, 300 & 0xFF, 300 >> 8, 0x04 };
+  CHECK(memcmp(data, expected, sizeof(expected)) == 0 && data[27] == (306 & 0xFF));
+  CHECK(out[64 + 3] == CAPTURE_COMPLETE);
+
+  // an edge on the trigger pin, in a ring that wrapped around
+  const byte pinTrigger[] = {
+    START_SYSEX, FIRMATA_CAPTURE, CAPTURE_CONFIG, 20, 0, 0, 0, 0, 4, 0, 0, 0, 0, 2, 0, 0, 0, 0,
+    5, CAPTURE_EDGE_FALLING, CAPTURE_SOURCE_PORT | 0, END_SYSEX
+  };
+  process(pinTrigger, sizeof(pinTrigger));
+  digitalWrite(5, HIGH);
+  captureCommand(CAPTURE_ARM);
+  for (int i = 0; i < CAPTURE_BUFFER_SIZE + 3; i++) {
+    capture.sampleFromTimer();
+  }
+  digitalWrite(5, LOW);
+  capture.sampleFromTimer();
+  capture.sampleFromTimer();
+  captureCommand(CAPTURE_QUERY);
+  CHECK(stream.getOutput()[3] == CAPTURE_SENDING && unpack32(stream.getOutput() + 4) == 4);
+  stream.clearOutput();
+  capture.report(false);
+  Firmata.flush();
+  out = stream.getOutput();
+  CHECK(stream.getOutputLength() == 20 + 3 + 5 + num7BitInbytes(4) + 1 + 20);
+  Encoder7BitClass::readBinary(4, (byte*)out + 28, data);
+  CHECK(data[0] == 0x24 && data[1] == 0x24 && data[2] == 0x04 && data[3] == 0x04);
+  digitalWrite(2, LOW);
+  nativeSetAnalogValue(0, 0);
+}
+
+static EncoderFirmata encoderFeature;
+
+// one quadrature step of the encoder on pins 2 and 3, polled as these pins have no interrupt
+static void encoderStep(int direction)
+{
+  // A leads B when turning forward: 11, 01, 00, 10
+  static const byte sequence[4][2] = { { 1, 1 }, { 0, 1 }, { 0, 0 }, { 1, 0 } };
+  static int phase = 0;
+  phase = (phase + direction + 4) % 4;
+  digitalWrite(2, sequence[phase][0]);
+  digitalWrite(3, sequence[phase][1]);
+  encoderFeature.report(false);
+}
+
+static void testEncoder()
+{
+  const byte attach[] = { START_SYSEX, ENCODER_DATA, ENCODER_ATTACH, 0, 2, 3, END_SYSEX };
+  process(attach, sizeof(attach));
+  CHECK(stream.getOutputLength() == 0 && Firmata.getPinMode(2) == PIN_MODE_ENCODER && Firmata.getPinMode(3) == PIN_MODE_ENCODER);
+  for (int i = 0; i < 6; i++) {
+    encoderStep(1);
+  }
+  encoderStep(-1);
+  const byte query[] = { START_SYSEX, ENCODER_DATA, ENCODER_REPORT_POSITIONS, END_SYSEX };
+  process(query, sizeof(query));
+  const byte five[] = { START_SYSEX, ENCODER_DATA, 0, 5, 0, 0, 0, END_SYSEX };
+  CHECK(outputIs(five, sizeof(five)));
+
+  const byte resetPosition[] = { START_SYSEX, ENCODER_DATA, ENCODER_RESET_POSITION, 0, END_SYSEX };
+  process(resetPosition, sizeof(resetPosition));
+  for (int i = 0; i < 3; i++) {
+    encoderStep(-1);
+  }
+  process(query, sizeof(query));
+  const byte minusThree[] = { START_SYSEX, ENCODER_DATA, ENCODER_NEGATIVE | 0, 3, 0, 0, 0, END_SYSEX };
+  CHECK(outputIs(minusThree, sizeof(minusThree)));
+
+  // automatic reports with velocity, only after a move
+  const byte automatic[] = {
+    START_SYSEX, ENCODER_DATA, ENCODER_REPORT_MODE, ENCODER_REPORT_VELOCITY | ENCODER_REPORT_ON_CHANGE, END_SYSEX,
+    START_SYSEX, ENCODER_DATA, ENCODER_REPORT_AUTO, 1, END_SYSEX,
+  };
+  process(automatic, sizeof(automatic));
+  encoderFeature.report(true);
+  stream.clearOutput();
+  encoderFeature.report(true);
+  Firmata.flush();
+  CHECK(stream.getOutputLength() == 0);
+  delay(10);
+  encoderStep(-1);
+  stream.clearOutput();
+  encoderFeature.report(true);
+  Firmata.flush();
+  const byte* out = stream.getOutput();
+  CHECK(stream.getOutputLength() == 3 + 8 + 1 && out[2] == (ENCODER_NEGATIVE | 0) && out[3] == 4);
+  // -1 count in about 10 ms
+  int32_t velocity = (int32_t)(((uint32_t)out[7] | (out[8] << 7) | (out[9] << 14) | ((uint32_t)out[10] << 21)) << 4) >> 4;
+  CHECK(velocity < -10 && velocity > -110);
+
+  // another pin mode releases the encoder
+  const byte output[] = { SET_PIN_MODE, 3, PIN_MODE_OUTPUT };
+  process(output, sizeof(output));
+  process(query, sizeof(query));
+  const byte none[] = { START_SYSEX, ENCODER_DATA, END_SYSEX };
+  CHECK(outputIs(none, sizeof(none)));
+}
+
+static ShiftFirmata shiftFeature;
+
+// a 74HC595 chain on pins 4 (data), 5 (clock), 6 (latch), a 74HC165 chain on pins 7, 8, 9
+static uint16_t shiftOutRegister;
+static uint16_t shiftOutLatched;
+static uint16_t shiftInputs;
+static uint16_t shiftInRegister;
+
+static void shiftSimulation(uint8_t pin, uint8_t value)
+{
+  if (pin == 5 && value == HIGH) {
+    shiftOutRegister = (shiftOutRegister << 1) | digitalRead(4);
+  } else if (pin == 6 && value == HIGH) {
+    shiftOutLatched = shiftOutRegister;
+  } else if ((pin == 9 && value == LOW) || (pin == 8 && value == HIGH)) {
+    shiftInRegister = pin == 9 ? shiftInputs : shiftInRegister << 1;
+    digitalWrite(7, (shiftInRegister & 0x8000) ? HIGH : LOW);
+  }
+}
+
+static void testShift()
+{
+  nativeSetWriteHook(shiftSimulation);
+  const byte config[] = {
+    START_SYSEX, SHIFT_DATA, SHIFT_CONFIG, 0, 4, 5, 6, SHIFT_MSB_FIRST, 0, 0, END_SYSEX,
+    START_SYSEX, SHIFT_DATA, SHIFT_CONFIG, 1, 7, 8, 9, SHIFT_MSB_FIRST | SHIFT_INPUT, 0, 0, END_SYSEX,
+  };
+  process(config, sizeof(config));
+  CHECK(stream.getOutputLength() == 0 && Firmata.getPinMode(4) == PIN_MODE_SHIFT && Firmata.getPinMode(9) == PIN_MODE_SHIFT);
+
+  // 0x12, 0x34 in 7 bit encoding
+  const byte write[] = { START_SYSEX, SHIFT_DATA, SHIFT_WRITE, 0, 0x12, 0x68, 0x00, END_SYSEX };
+  process(write, sizeof(write));
+  CHECK(shiftOutLatched == 0x1234);
+  const byte lsbFirst[] = {
+    START_SYSEX, SHIFT_DATA, SHIFT_CONFIG, 0, 4, 5, 6, 0, 0, 0, END_SYSEX,
+    START_SYSEX, SHIFT_DATA, SHIFT_WRITE, 0, 0x01, 0x00, END_SYSEX,
+  };
+  process(lsbFirst, sizeof(lsbFirst));
+  CHECK((shiftOutLatched & 0xFF) == 0x80);
+
+  shiftInputs = 0xA55A;
+  const byte read[] = { START_SYSEX, SHIFT_DATA, SHIFT_READ, 1, 2, END_SYSEX };
+  process(read, sizeof(read));
+  const byte* out = stream.getOutput();
+  byte data[2];
+  CHECK(stream.getOutputLength() == 4 + num7BitInbytes(2) + 1 && out[2] == SHIFT_REPLY && out[3] == 1);
+  Encoder7BitClass::readBinary(2, (byte*)out + 4, data);
+  CHECK(data[0] == 0xA5 && data[1] == 0x5A);
+
+  // reports only when the inputs changed
+  const byte report[] = { START_SYSEX, SHIFT_DATA, SHIFT_REPORT, 1, 2, END_SYSEX };
+  process(report, sizeof(report));
+  shiftFeature.report(true);
+  Firmata.flush();
+  CHECK(stream.getOutputLength() == 4 + num7BitInbytes(2) + 1);
+  stream.clearOutput();
+  shiftFeature.report(true);
+  Firmata.flush();
+  CHECK(stream.getOutputLength() == 0);
+  shiftInputs = 0x0001;
+  shiftFeature.report(true);
+  Firmata.flush();
+  out = stream.getOutput();
+  CHECK(stream.getOutputLength() == 4 + num7BitInbytes(2) + 1);
+  Encoder7BitClass::readBinary(2, (byte*)out + 4, data);
+  CHECK(data[0] == 0x00 && data[1] == 0x01);
+
+  // another pin mode releases the register
+  const byte output[] = { SET_PIN_MODE, 8, PIN_MODE_OUTPUT };
+  process(output, sizeof(output));
+  process(read, sizeof(read));
+  CHECK(stream.getOutputLength() > 0 && stream.getOutput()[1] == STRING_DATA);
+  nativeSetWriteHook(NULL);
+}
+
+static SonarFirmata sonar;
+static int sonarPings[32];
+
+static void countPings(uint8_t pin, uint8_t value)
+{
+  if (value == HIGH) {
+    sonarPings[pin]++;
+  }
+}
+
+static void testSonar()
+{
+  nativeSetWriteHook(countPings);
+  const byte config[] = {
+    START_SYSEX, SONAR_DATA, SONAR_CONFIG, 0, 10, 11, 100, 0, END_SYSEX,
+    START_SYSEX, SONAR_DATA, SONAR_CONFIG, 1, 12, 12, 100, 0, END_SYSEX, // one pin for trigger and echo
+  };
+  process(config, sizeof(config));
+  CHECK(stream.getOutputLength() == 0 && Firmata.getPinMode(11) == PIN_MODE_SONAR && Firmata.getPinMode(12) == PIN_MODE_SONAR);
+  delayMicroseconds(SONAR_PING_INTERVAL);
+  sonar.report(false);
+  CHECK(sonarPings[10] == 1 && sonarPings[12] == 0);
+
+  // an echo of 2 ms, polled as the native pins have no interrupt
+  nativeSetWriteHook(NULL);
+  digitalWrite(11, HIGH);
+  sonar.report(false);
+  delayMicroseconds(2000);
+  digitalWrite(11, LOW);
+  sonar.report(false);
+  CHECK(sonar.getDistance(0) >= 340 && sonar.getDistance(0) < 500);
+
+  // the next sensor waits for the ping interval, and gets no echo
+  nativeSetWriteHook(countPings);
+  sonar.report(false);
+  CHECK(sonarPings[12] == 0);
+  delayMicroseconds(SONAR_PING_INTERVAL);
+  sonar.report(false);
+  CHECK(sonarPings[12] == 1 && sonarPings[10] == 1);
+  delayMicroseconds(100 * 58 + 2000 + 100);
+  sonar.report(false);
+  CHECK(sonar.getDistance(1) == 0);
+
+  stream.clearOutput();
+  sonar.report(true);
+  Firmata.flush();
+  const byte* out = stream.getOutput();
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+  // a message per sensor
+  CHECK(stream.getOutputLength() == 2 * (3 + 3 + 1) && out[2] == SONAR_REPLY && out[3] == 0);
+  CHECK(out[9] == SONAR_REPLY && out[10] == 1 && out[11] == 0 && out[12] == 0);
+#else
+  CHECK(stream.getOutputLength() == 3 + 2 * 3 + 1 && out[2] == SONAR_REPLY && out[3] == 0 && out[6] == 1 && out[7] == 0 && out[8] == 0);
+#endif
+  CHECK((out[4] | (out[5] << 7)) == sonar.getDistance(0));
+
+  const byte output[] = { SET_PIN_MODE, 11, PIN_MODE_OUTPUT };
+  process(output, sizeof(output));
+  sonar.report(true);
+  Firmata.flush();
+  out = stream.getOutput();
+  CHECK(stream.getOutputLength() == 3 + 3 + 1 && out[3] == 1);
+  nativeSetWriteHook(NULL);
+}
+
+static ControlFirmata control;
+
+static byte* pack32(byte* out, int32_t value)
+{
+  for (int i = 0; i < 5; i++) {
+    *out++ = ((uint32_t)value >> (7 * i)) & 0x7F;
+  }
+  return out;
+}
+
+static void controlCommand(byte subcommand, byte block, const int32_t* values, int count, const byte* prefix = NULL, int prefixLength = 0)
+{
+  byte message[64];
+  byte* p = message;
+  *p++ = START_SYSEX;
+  *p++ = FIRMATA_CONTROL;
+  *p++ = subcommand;
+  *p++ = block;
+  for (int i = 0; i < prefixLength; i++) {
+    *p++ = prefix[i];
+  }
+  for (int i = 0; i < count; i++) {
+    p = pack32(p, values[i]);
+  }
+  *p++ = END_SYSEX;
+  process(message, p - message);
+}
+
+static void testControl()
+{
+  const byte pwm[] = { SET_PIN_MODE, 5, PIN_MODE_PWM, SET_PIN_MODE, 6, PIN_MODE_PWM };
+  process(pwm, sizeof(pwm));
+
+  // PID from analog channel 0 to PWM pin 5
+  const byte pidConfig[] = { CONTROL_TYPE_PID, CONTROL_INPUT_ANALOG, 0, CONTROL_OUTPUT_PWM, 5 };
+  const int32_t range[] = { 0, 255 };
+  controlCommand(CONTROL_CONFIG, 0, range, 2, pidConfig, sizeof(pidConfig));
+  const int32_t proportional[] = { 500, 0, 0 };
+  controlCommand(CONTROL_PID, 0, proportional, 3);
+  const int32_t setpoint[] = { 500 };
+  controlCommand(CONTROL_SETPOINT, 0, setpoint, 1);
+  const byte run[] = { CONTROL_RUN };
+  controlCommand(CONTROL_ENABLE, 0, NULL, 0, run, 1);
+  CHECK(stream.getOutputLength() == 0);
+  nativeSetAnalogValue(0, 300);
+  control.step();
+  CHECK(nativeGetPwmValue(5) == 100);
+  nativeSetAnalogValue(0, 600);
+  control.step();
+  CHECK(nativeGetPwmValue(5) == 0);
+
+  // the integral grows by ki * error * 10 ms per step
+  const int32_t integral[] = { 0, 10000, 0 };
+  controlCommand(CONTROL_PID, 0, integral, 3);
+  const byte stop[] = { 0 };
+  controlCommand(CONTROL_ENABLE, 0, NULL, 0, stop, 1); // the PID restarts when it is enabled again
+  controlCommand(CONTROL_ENABLE, 0, NULL, 0, run, 1);
+  nativeSetAnalogValue(0, 400);
+  for (int i = 0; i < 3; i++) {
+    control.step();
+  }
+  CHECK(nativeGetPwmValue(5) == 30);
+
+  // threshold with hysteresis from analog channel 1 to PWM pin 6
+  const byte thresholdConfig[] = { CONTROL_TYPE_THRESHOLD, CONTROL_INPUT_ANALOG, 1, CONTROL_OUTPUT_PWM, 6 };
+  const int32_t onOff[] = { 0, 200 };
+  controlCommand(CONTROL_CONFIG, 1, onOff, 2, thresholdConfig, sizeof(thresholdConfig));
+  const int32_t hysteresis[] = { 10 };
+  controlCommand(CONTROL_THRESHOLD, 1, hysteresis, 1);
+  controlCommand(CONTROL_SETPOINT, 1, setpoint, 1);
+  const byte runAndReport[] = { CONTROL_RUN | CONTROL_REPORT };
+  controlCommand(CONTROL_ENABLE, 1, NULL, 0, runAndReport, 1);
+  const int values[] = { 480, 495, 515, 505, 489 };
+  const int expected[] = { 200, 200, 0, 0, 200 };
+  for (int i = 0; i < 5; i++) {
+    nativeSetAnalogValue(1, values[i]);
+    control.step();
+    CHECK(nativeGetPwmValue(6) == expected[i]);
+  }
+
+  // telemetry of block 1 only
+  stream.clearOutput();
+  control.report(true);
+  Firmata.flush();
+  const byte* out = stream.getOutput();
+  CHECK(stream.getOutputLength() == 3 + 11 + 1 && out[2] == CONTROL_TELEMETRY && out[3] == 1);
+  CHECK(unpack32(out + 4) == 489 && unpack32(out + 9) == 200);
+
+  // an output pin in another mode is left alone
+  const byte output[] = { SET_PIN_MODE, 6, PIN_MODE_OUTPUT };
+  process(output, sizeof(output));
+  int before = nativeGetPwmValue(6);
+  nativeSetAnalogValue(1, 600);
+  control.step();
+  CHECK(nativeGetPwmValue(6) == before && stream.getOutputLength() == 0);
+  nativeSetAnalogValue(0, 0);
+  nativeSetAnalogValue(1, 0);
+  resetFirmata();
+}
+
+static FirmataScheduler scheduler;
+
+// a task with one 3 byte message
+static void createTask(byte id, const byte* message)
+{
+  const byte create[] = { START_SYSEX, SCHEDULER_DATA, CREATE_FIRMATA_TASK, id, 3, 0, END_SYSEX };
+  process(create, sizeof(create));
+  byte add[] = { START_SYSEX, SCHEDULER_DATA, ADD_TO_FIRMATA_TASK, id, 0, 0, 0, 0, END_SYSEX };
+  for (int i = 0; i < 24; i++) {
+    if (message[i / 8] & (1 << (i % 8))) {
+      add[4 + i / 7] |= 1 << (i % 7);
+    }
+  }
+  process(add, sizeof(add));
+}
+
+// a task that sets the digital pin to the value
+static void createPinTask(byte id, byte pin, byte value)
+{
+  const byte message[] = { SET_DIGITAL_PIN_VALUE, pin, value };
+  createTask(id, message);
+}
+
+static void testSchedulerTrigger()
+{
+  // the task runs on the rising edge of pin 2, only once
+  createPinTask(1, 7, HIGH);
+  const byte digitalTrigger[] = { START_SYSEX, SCHEDULER_DATA, TRIGGER_FIRMATA_TASK, 1, TASK_TRIGGER_DIGITAL, 2, TASK_TRIGGER_RISING, END_SYSEX };
+  process(digitalTrigger, sizeof(digitalTrigger));
+  CHECK(stream.getOutputLength() == 0);
+  scheduler.report(false);
+  CHECK(digitalRead(7) == LOW);
+  digitalWrite(2, HIGH);
+  scheduler.report(false);
+  CHECK(digitalRead(7) == HIGH);
+  const byte query[] = { START_SYSEX, SCHEDULER_DATA, QUERY_FIRMATA_TASK, 1, END_SYSEX };
+  process(query, sizeof(query));
+  CHECK(stream.getOutputLength() == 5 && stream.getOutput()[2] == QUERY_TASK_REPLY); // deleted after it ran
+
+  // a repeating analog trigger above 500, armed again below 450
+  digitalWrite(7, LOW);
+  createPinTask(2, 7, HIGH);
+  const byte analogTrigger[] = { START_SYSEX, SCHEDULER_DATA, TRIGGER_FIRMATA_TASK, 2, TASK_TRIGGER_ANALOG | TASK_TRIGGER_REPEAT, 0,
+    TASK_TRIGGER_RISING, 500 & 0x7F, 500 >> 7, 50, 0, END_SYSEX };
+  process(analogTrigger, sizeof(analogTrigger));
+  const int values[] = { 600, 400, 520, 480, 510, 300, 501 };
+  const int expected[] = { LOW, LOW, HIGH, LOW, LOW, LOW, HIGH };
+  for (int i = 0; i < 7; i++) {
+    nativeSetAnalogValue(0, values[i]);
+    scheduler.report(false);
+    CHECK(digitalRead(7) == expected[i]);
+    digitalWrite(7, LOW);
+  }
+  const byte queryTask2[] = { START_SYSEX, SCHEDULER_DATA, QUERY_FIRMATA_TASK, 2, END_SYSEX };
+  process(queryTask2, sizeof(queryTask2));
+  CHECK(stream.getOutputLength() > 5); // still loaded
+
+  // deleting the task removes its trigger
+  const byte remove[] = { START_SYSEX, SCHEDULER_DATA, DELETE_FIRMATA_TASK, 2, END_SYSEX };
+  process(remove, sizeof(remove));
+  createPinTask(2, 7, HIGH);
+  nativeSetAnalogValue(0, 300);
+  scheduler.report(false);
+  nativeSetAnalogValue(0, 600);
+  scheduler.report(false);
+  CHECK(digitalRead(7) == LOW);
+
+  // no trigger without a task
+  const byte unknown[] = { START_SYSEX, SCHEDULER_DATA, TRIGGER_FIRMATA_TASK, 5, TASK_TRIGGER_DIGITAL, 2, TASK_TRIGGER_CHANGE, END_SYSEX };
+  process(unknown, sizeof(unknown));
+  CHECK(stream.getOutputLength() == 5 && stream.getOutput()[2] == ERROR_TASK_REPLY);
+  nativeSetAnalogValue(0, 0);
+  digitalWrite(2, LOW);
+  resetFirmata();
+}
+
+// takes the analog values of servo pins, which AnalogOutputFirmata leaves to the other features
+class ServoRecorder : public FirmataFeature
+{
+  public:
+    void handleCapability(byte pin) override {}
+    boolean handlePinMode(byte pin, int mode) override { return mode == PIN_MODE_SERVO; }
+    boolean handleSysex(byte command, byte argc, byte* argv) override
+    {
+      if (command != EXTENDED_ANALOG || argc < 3 || Firmata.getPinMode(argv[0]) != PIN_MODE_SERVO) {
+        return false;
+      }
+      value = argv[1] | (argv[2] << 7);
+      return true;
+    }
+    void reset() override { value = -1; }
+    int value = -1;
+};
+
+static ServoRecorder servoRecorder;
+
+static void testSchedulerServo()
+{
+  const byte mode[] = { SET_PIN_MODE, 9, PIN_MODE_SERVO, ANALOG_MESSAGE | 9, 90, 0 };
+  process(mode, sizeof(mode));
+  CHECK(servoRecorder.value == 90);
+  // the same message from a task
+  const byte message[] = { ANALOG_MESSAGE | 9, 45, 0 };
+  createTask(4, message);
+  const byte schedule[] = { START_SYSEX, SCHEDULER_DATA, SCHEDULE_FIRMATA_TASK, 4, 0, 0, 0, 0, 0, END_SYSEX };
+  process(schedule, sizeof(schedule));
+  scheduler.report(false);
+  CHECK(servoRecorder.value == 45);
+  resetFirmata();
+}
+
+static I2CFirmata i2cFeature;
+
+static void i2cLoop()
+{
+  stream.clearOutput();
+  i2cFeature.report(false);
+  Firmata.flush();
+}
+
+static void testI2CBuses()
+{
+  const byte config[] = { START_SYSEX, I2C_CONFIG, 0, 0, END_SYSEX };
+  process(config, sizeof(config));
+  const byte config1[] = { START_SYSEX, I2C_CONFIG, 0, 0, 1, 400 & 0x7F, 400 >> 7, END_SYSEX }; // bus 1 at 400 kHz
+  process(config1, sizeof(config1));
+  CHECK(Wire.nativeIsBegun() && Wire1.nativeIsBegun() && Wire1.nativeGetClock() == 400000);
+  // the same address on both buses
+  const byte registers[] = { 1, 2, 3, 4 };
+  const byte registers1[] = { 9, 8, 7, 6 };
+  Wire.nativeSetDevice(0x20, registers, sizeof(registers));
+  Wire1.nativeSetDevice(0x20, registers1, sizeof(registers1));
+
+  // two requests queued for bus 0, one for bus 1: every loop does one transaction per bus
+  const byte requests[] = {
+    START_SYSEX, I2C_REQUEST, 0x20, I2C_READ, 0, 0, 2, 0, END_SYSEX,
+    START_SYSEX, I2C_REQUEST, 0x20, I2C_READ, 2, 0, 2, 0, END_SYSEX,
+    START_SYSEX, I2C_REQUEST, I2C_BUS_PREFIX, 1, 0x20, I2C_READ, 1, 0, 2, 0, END_SYSEX,
+  };
+  process(requests, sizeof(requests));
+  CHECK(stream.getOutputLength() == 0);
+  i2cLoop();
+  const byte replies[] = {
+    START_SYSEX, I2C_REPLY, 0x20, 0, 0, 0, 1, 0, 2, 0, END_SYSEX,
+    START_SYSEX, I2C_REPLY, I2C_BUS_PREFIX, 1, 0x20, 0, 1, 0, 8, 0, 7, 0, END_SYSEX,
+  };
+  CHECK(outputIs(replies, sizeof(replies)));
+  CHECK(Wire.nativeGetReads() == 1 && Wire1.nativeGetReads() == 1);
+  i2cLoop();
+  const byte second[] = { START_SYSEX, I2C_REPLY, 0x20, 0, 2, 0, 3, 0, 4, 0, END_SYSEX };
+  CHECK(outputIs(second, sizeof(second)));
+  CHECK(Wire.nativeGetReads() == 2 && Wire1.nativeGetReads() == 1);
+
+  // a bus the board doesn't have
+  const byte invalid[] = { START_SYSEX, I2C_REQUEST, I2C_BUS_PREFIX, I2C_MAX_BUSES, 0x20, I2C_READ, 2, 0, END_SYSEX };
+  process(invalid, sizeof(invalid));
+  i2cLoop();
+  CHECK(Wire.nativeGetReads() == 2 && Wire1.nativeGetReads() == 1);
+
+  // a trigger on bus 1 ignores the same data from the device on bus 0
+  Wire.nativeSetDevice(0x20, registers1, sizeof(registers1));
+  createPinTask(3, 7, HIGH);
+  const byte trigger[] = { START_SYSEX, SCHEDULER_DATA, TRIGGER_FIRMATA_TASK, 3, TASK_TRIGGER_I2C, I2C_BUS_PREFIX, 1, 0x20,
+    0x7F, 0x7F, 0, 0x7F, 0, 9, 0, END_SYSEX };
+  process(trigger, sizeof(trigger));
+  CHECK(stream.getOutputLength() == 0);
+  const byte read0[] = { START_SYSEX, I2C_REQUEST, 0x20, I2C_READ, 0, 0, 1, 0, END_SYSEX };
+  process(read0, sizeof(read0));
+  i2cLoop();
+  scheduler.report(false);
+  CHECK(Wire.nativeGetReads() == 1 && digitalRead(7) == LOW);
+  const byte read1[] = { START_SYSEX, I2C_REQUEST, I2C_BUS_PREFIX, 1, 0x20, I2C_READ, 0, 0, 1, 0, END_SYSEX };
+  process(read1, sizeof(read1));
+  i2cLoop();
+  scheduler.report(false);
+  CHECK(Wire1.nativeGetReads() == 2 && digitalRead(7) == HIGH);
+  digitalWrite(7, LOW);
+  resetFirmata();
+}
+
+static SpiFirmata spiFeature;
+static SPIClass spi1;
+
+// a device with CS on the pin and the clock in Hz
+static void spiDeviceConfig(byte deviceIdChannel, byte csPin, uint32_t clock)
+{
+  const byte config[] = { START_SYSEX, SPI_DATA, SPI_DEVICE_CONFIG, deviceIdChannel, 0x01, (byte)(clock & 0x7F),
+    (byte)((clock >> 7) & 0x7F), (byte)((clock >> 14) & 0x7F), (byte)((clock >> 21) & 0x7F), 0, 0, 1, csPin, END_SYSEX };
+  process(config, sizeof(config));
+}
+
+static void testSpiChannels()
+{
+  spiFeature.setChannel(1, &spi1);
+  const byte begin[] = { START_SYSEX, SPI_DATA, SPI_BEGIN, 0, END_SYSEX, START_SYSEX, SPI_DATA, SPI_BEGIN, 1, END_SYSEX };
+  process(begin, sizeof(begin));
+  CHECK(SPI.nativeIsBegun() && spi1.nativeIsBegun());
+  CHECK(Firmata.getPinMode(PIN_SPI_SCK) == PIN_MODE_SPI && Firmata.getPinMode(PIN_SPI_MISO) == PIN_MODE_SPI);
+  // device 1 on each host, the channel bits of the device id select the host
+  spiDeviceConfig(1 << 3 | 0, 8, 1000000);
+  spiDeviceConfig(1 << 3 | 1, 9, 2000000);
+
+  const byte transfer1[] = { START_SYSEX, SPI_DATA, SPI_TRANSFER, 1 << 3 | 1, 5, 1, 2, 0x11, 0, 0x22, 0, END_SYSEX };
+  process(transfer1, sizeof(transfer1));
+  const byte reply1[] = { START_SYSEX, SPI_DATA, SPI_REPLY, 1 << 3 | 1, 5, 2, 0x11, 0, 0x22, 0, END_SYSEX };
+  CHECK(outputIs(reply1, sizeof(reply1)));
+  CHECK(SPI.nativeGetTransfers() == 0 && spi1.nativeGetTransfers() == 1 && spi1.nativeGetClock() == 2000000);
+  CHECK(digitalRead(9) == HIGH && !spi1.nativeInTransaction());
+
+  // a chunked transfer holds host 0, host 1 goes on with transfers and continuous reads
+  const byte chunk[] = { START_SYSEX, SPI_DATA, SPI_WRITE, 1 << 3 | 0, 6, 0, 1, 0x33, 0, END_SYSEX };
+  process(chunk, sizeof(chunk));
+  CHECK(SPI.nativeGetTransfers() == 1 && SPI.nativeInTransaction() && SPI.nativeGetClock() == 1000000 && digitalRead(8) == LOW);
+  process(transfer1, sizeof(transfer1));
+  CHECK(outputIs(reply1, sizeof(reply1)) && spi1.nativeGetTransfers() == 2);
+  const byte continuous[] = { START_SYSEX, SPI_DATA, SPI_READ_CONTINUOUSLY, 1 << 3 | 1, 6, 0, 0, 0x44, 0, END_SYSEX };
+  process(continuous, sizeof(continuous));
+  stream.clearOutput();
+  spiFeature.report(true);
+  Firmata.flush();
+  const byte reply2[] = { START_SYSEX, SPI_DATA, SPI_REPLY, 1 << 3 | 1, 6, 1, 0x44, 0, END_SYSEX };
+  CHECK(outputIs(reply2, sizeof(reply2)) && spi1.nativeGetTransfers() == 3);
+  CHECK(SPI.nativeInTransaction() && digitalRead(8) == LOW);
+  const byte last[] = { START_SYSEX, SPI_DATA, SPI_WRITE, 1 << 3 | 0, 6, 1, 1, 0x55, 0, END_SYSEX };
+  process(last, sizeof(last));
+  CHECK(SPI.nativeGetTransfers() == 2 && !SPI.nativeInTransaction() && digitalRead(8) == HIGH);
+
+  // a channel without a host
+  spiDeviceConfig(2 << 3 | 2, 10, 1000000);
+  const byte transfer2[] = { START_SYSEX, SPI_DATA, SPI_TRANSFER, 2 << 3 | 2, 7, 1, 1, 0x66, 0, END_SYSEX };
+  process(transfer2, sizeof(transfer2));
+  CHECK(SPI.nativeGetTransfers() == 2 && spi1.nativeGetTransfers() == 3);
+  resetFirmata();
+  CHECK(!SPI.nativeIsBegun() && !spi1.nativeIsBegun());
+}
+
+static SerialFirmata serialFeature;
+
+static void modbusLoop()
+{
+  stream.clearOutput();
+  serialFeature.report(false);
+  Firmata.flush();
+}
+
+static bool serial1Is(const byte* expected, size_t length)
+{
+  return Serial1.nativeGetOutputLength() == length && memcmp(Serial1.nativeGetOutput(), expected, length) == 0;
+}
+
+static void testModbus()
+{
+  // Serial1 at 9600 baud, so the bus must be silent for 4 ms between the frames
+  const byte config[] = { START_SYSEX, MODBUS_DATA, MODBUS_CONFIG, HW_SERIAL1, 9600 & 0x7F, (9600 >> 7) & 0x7F, 0,
+    MODBUS_NO_PIN, END_SYSEX };
+  process(config, sizeof(config));
+  CHECK(stream.getOutputLength() == 0 && Serial1.nativeGetBaud() == 9600);
+  Serial1.nativeClearOutput();
+
+  // read 10 holding registers of slave 1: the frame ends with the CRC, low byte first
+  const byte request[] = { START_SYSEX, MODBUS_DATA, MODBUS_REQUEST, HW_SERIAL1, 5, 1, 3, 0, 0, 0, 0, 0, 0, 10, 0, END_SYSEX };
+  process(request, sizeof(request));
+  delay(5);
+  modbusLoop();
+  const byte frame[] = { 0x01, 0x03, 0x00, 0x00, 0x00, 0x0A, 0xC5, 0xCD };
+  CHECK(serial1Is(frame, sizeof(frame)) && stream.getOutputLength() == 0);
+  // the response is complete with the length of its header, without waiting for the silence
+  const byte response[] = { 0x01, 0x03, 0x02, 0x00, 0x2A, 0x39, 0x9B };
+  Serial1.nativeSetInput(response, sizeof(response));
+  modbusLoop();
+  const byte reply[] = { START_SYSEX, MODBUS_DATA, MODBUS_REPLY, HW_SERIAL1, 5, 1, 3, 0, 2, 0, 0, 0, 0x2A, 0, END_SYSEX };
+  CHECK(outputIs(reply, sizeof(reply)));
+
+  // a response with a bad CRC
+  const byte request6[] = { START_SYSEX, MODBUS_DATA, MODBUS_REQUEST, HW_SERIAL1, 6, 1, 3, 0, 0, 0, 0, 0, 0, 10, 0, END_SYSEX };
+  process(request6, sizeof(request6));
+  delay(5);
+  modbusLoop();
+  const byte corrupted[] = { 0x01, 0x03, 0x02, 0x00, 0x2A, 0x39, 0x9C };
+  Serial1.nativeSetInput(corrupted, sizeof(corrupted));
+  modbusLoop();
+  const byte error[] = { START_SYSEX, MODBUS_DATA, MODBUS_ERROR, HW_SERIAL1, MODBUS_SOURCE_REQUEST, 6, MODBUS_ERROR_FRAME, END_SYSEX };
+  CHECK(outputIs(error, sizeof(error)));
+  // a response longer than the frame buffer
+  const byte request9[] = { START_SYSEX, MODBUS_DATA, MODBUS_REQUEST, HW_SERIAL1, 9, 1, 3, 0, 0, 0, 0, 0, 0, 10, 0, END_SYSEX };
+  process(request9, sizeof(request9));
+  delay(5);
+  modbusLoop();
+  const byte tooLong[] = { 0x01, 0x03, 0xFF, 0x00 };
+  Serial1.nativeSetInput(tooLong, sizeof(tooLong));
+  modbusLoop();
+  const byte error9[] = { START_SYSEX, MODBUS_DATA, MODBUS_ERROR, HW_SERIAL1, MODBUS_SOURCE_REQUEST, 9, MODBUS_ERROR_FRAME, END_SYSEX };
+  CHECK(outputIs(error9, sizeof(error9)));
+
+  // a broadcast is confirmed once it is sent, the next frame waits for the turnaround delay
+  const byte broadcast[] = { START_SYSEX, MODBUS_DATA, MODBUS_REQUEST, HW_SERIAL1, 7, 0, 6, 0, 0, 1, 0, 0, 0, 3, 0, END_SYSEX };
+  process(broadcast, sizeof(broadcast));
+  delay(5);
+  Serial1.nativeClearOutput();
+  modbusLoop();
+  const byte broadcastFrame[] = { 0x00, 0x06, 0x00, 0x01, 0x00, 0x03, 0x99, 0xDA };
+  const byte confirmation[] = { START_SYSEX, MODBUS_DATA, MODBUS_REPLY, HW_SERIAL1, 7, 0, 6, 0, END_SYSEX };
+  CHECK(serial1Is(broadcastFrame, sizeof(broadcastFrame)) && outputIs(confirmation, sizeof(confirmation)));
+  const byte request8[] = { START_SYSEX, MODBUS_DATA, MODBUS_REQUEST, HW_SERIAL1, 8, 1, 3, 0, 0, 0, 0, 0, 0, 10, 0, END_SYSEX };
+  process(request8, sizeof(request8));
+  delay(5);
+  modbusLoop();
+  CHECK(Serial1.nativeGetOutputLength() == sizeof(broadcastFrame));
+  delay(MODBUS_TURNAROUND_DELAY);
+  modbusLoop();
+  CHECK(Serial1.nativeGetOutputLength() == sizeof(broadcastFrame) + sizeof(frame));
+  resetFirmata();
+  Serial1.nativeClearOutput();
+}
+
+static AccelStepperFirmata stepperFeature;
+
+// runs the stepper until its move is complete, returns the position the client tracked from the messages
+static long trackStepper(long start, int* telemetryFrames)
+{
+  long position = start;
+  bool complete = false;
+  unsigned long startTime = millis();
+  while (!complete && millis() - startTime < 1000) {
+    stream.clearOutput();
+    stepperFeature.report(false);
+    Firmata.flush();
+    const byte* out = stream.getOutput();
+    size_t length = stream.getOutputLength();
+    for (size_t i = 0; i + 2 < length; i++) {
+      if (out[i] != START_SYSEX || out[i + 1] != ACCELSTEPPER_DATA) {
+        continue;
+      }
+      if (out[i + 2] == ACCELSTEPPER_MOVE_COMPLETE) {
+        // the deltas got the client part of the way, without overshooting
+        const byte* p = out + i + 4;
+        long end = (p[0] | p[1] << 7 | p[2] << 14 | p[3] << 21) * ((p[4] & 0x08) ? -1 : 1);
+        CHECK(position != start && (position - start) * (end - position) >= 0);
+        position = end;
+        complete = true;
+      } else if (out[i + 2] == ACCELSTEPPER_TELEMETRY) {
+        (*telemetryFrames)++;
+        for (size_t j = i + 3; out[j] != END_SYSEX; ) {
+          CHECK(out[j++] == 0);
+          unsigned long zigzag = 0;
+          for (int shift = 0; ; shift += 6) {
+            byte b = out[j++];
+            zigzag |= (unsigned long)(b & 0x3F) << shift;
+            if (!(b & 0x40)) {
+              break;
+            }
+          }
+          position += (zigzag & 1) ? ~(long)(zigzag >> 1) : (long)(zigzag >> 1);
+        }
+      }
+    }
+  }
+  CHECK(complete);
+  return position;
+}
+
+static void testStepperTelemetry()
+{
+  const byte config[] = { START_SYSEX, ACCELSTEPPER_DATA, ACCELSTEPPER_CONFIG, 0, 0x10, 8, 9, 0, END_SYSEX };
+  process(config, sizeof(config));
+  const byte speed[] = { START_SYSEX, ACCELSTEPPER_DATA, ACCELSTEPPER_SET_SPEED, 0, 2, 0, 0, 15 << 2, END_SYSEX }; // 20000 steps/s
+  process(speed, sizeof(speed));
+  const byte on[] = { START_SYSEX, ACCELSTEPPER_DATA, ACCELSTEPPER_TELEMETRY, 0, 1, 2, 0, END_SYSEX };
+  process(on, sizeof(on));
+  CHECK(stream.getOutputLength() == 10 && stream.getOutput()[2] == ACCELSTEPPER_REPORT_POSITION);
+
+  const byte forward[] = { START_SYSEX, ACCELSTEPPER_DATA, ACCELSTEPPER_TO, 0, 200 & 0x7F, 200 >> 7, 0, 0, 0, END_SYSEX };
+  process(forward, sizeof(forward));
+  int frames = 0;
+  CHECK(trackStepper(0, &frames) == 200 && frames > 0);
+  const byte back[] = { START_SYSEX, ACCELSTEPPER_DATA, ACCELSTEPPER_TO, 0, 50, 0, 0, 0, 0x08, END_SYSEX };
+  process(back, sizeof(back));
+  frames = 0;
+  long tracked = trackStepper(200, &frames);
+  CHECK(tracked == -50 && frames > 0);
+
+  // after zeroing, the deltas are relative to the new origin
+  const byte zero[] = { START_SYSEX, ACCELSTEPPER_DATA, ACCELSTEPPER_ZERO, 0, END_SYSEX };
+  process(zero, sizeof(zero));
+  const byte again[] = { START_SYSEX, ACCELSTEPPER_DATA, ACCELSTEPPER_TO, 0, 30, 0, 0, 0, 0, END_SYSEX };
+  process(again, sizeof(again));
+  frames = 0;
+  CHECK(trackStepper(0, &frames) == 30 && frames > 0);
+
+  // nothing while the stepper stands still
+  delay(3);
+  stream.clearOutput();
+  stepperFeature.report(false);
+  Firmata.flush();
+  CHECK(stream.getOutputLength() == 0);
+
+  // configuring the stepper again turns telemetry off
+  process(config, sizeof(config));
+  process(again, sizeof(again));
+  delay(3);
+  stream.clearOutput();
+  stepperFeature.report(false);
+  Firmata.flush();
+  for (size_t i = 0; i + 2 < stream.getOutputLength(); i++) {
+    CHECK(stream.getOutput()[i + 2] != ACCELSTEPPER_TELEMETRY || stream.getOutput()[i] != START_SYSEX);
+  }
+  resetFirmata();
+}
+
+static void testSysexStream()
+{
+  byte message[STREAM_TEST_SIZE + 3];
+  size_t length = fillStreamMessage(message, STREAM_TEST_SIZE);
+  for (int bytewise = 0; bytewise < 2; bytewise++) {
+    resetFirmata();
+    stream.clearOutput();
+    for (size_t i = 0; i < length; i += bytewise ? 1 : length) {
+      nativeProcess(message + i, bytewise ? 1 : length);
+    }
+    const byte expected[] = { SYSEX_STREAM_BEGIN, SYSEX_STREAM_DATA, SYSEX_STREAM_DATA, SYSEX_STREAM_DATA, SYSEX_STREAM_DATA, SYSEX_STREAM_END };
+    CHECK(streamRecorder.numPhases == sizeof(expected) && memcmp(streamRecorder.phases, expected, sizeof(expected)) == 0);
+    CHECK(streamRecorder.received == STREAM_TEST_SIZE && memcmp(streamRecorder.bytes, message + 2, STREAM_TEST_SIZE) == 0);
+    CHECK(streamRecorder.shortMessages == 0);
+    CHECK(stream.getOutputLength() == 0);
+  }
+
+  // a message that fits into a chunk is not streamed
+  resetFirmata();
+  length = fillStreamMessage(message, SYSEX_STREAM_CHUNK_SIZE);
+  process(message, length);
+  CHECK(streamRecorder.shortMessages == 1 && streamRecorder.numPhases == 0);
+
+  // refused: discarded when it overflows the input buffer, like before
+  resetFirmata();
+  streamRecorder.accept = false;
+  unsigned long discarded = Firmata.getMessagesDiscarded();
+  length = fillStreamMessage(message, MAX_DATA_BYTES);
+  process(message, length);
+  CHECK(Firmata.getMessagesDiscarded() == discarded + 1);
+  CHECK(streamRecorder.numPhases == 1 && streamRecorder.shortMessages == 0);
+  streamRecorder.accept = true;
+
+  // interrupted: SYSTEM_RESET also goes through resetParser()
+  resetFirmata();
+  length = fillStreamMessage(message, SYSEX_STREAM_CHUNK_SIZE + 10);
+  process(message, length - 1);
+  Firmata.resetParser();
+  CHECK(streamRecorder.numPhases == 3 && streamRecorder.phases[2] == SYSEX_STREAM_ABORT);
+  resetFirmata();
+}
+
+int main()
+{
+  nativeSetup();
+  firmataExt.addFeature(streamRecorder);
+  firmataExt.addFeature(capture);
+  firmataExt.addFeature(encoderFeature);
+  firmataExt.addFeature(shiftFeature);
+  firmataExt.addFeature(sonar);
+  firmataExt.addFeature(control);
+  firmataExt.addFeature(scheduler);
+  firmataExt.addFeature(servoRecorder);
+  firmataExt.addFeature(i2cFeature);
+  firmataExt.addFeature(spiFeature);
+  firmataExt.addFeature(serialFeature);
+  firmataExt.addFeature(stepperFeature);
+  void (*tests[])() = {
+    testReportFirmware,
+    testDigitalOutput,
+    testExtendedAnalog,
+    testPinStateQuery,
+    testEncoder7BitRoundTrip,
+    testEncoder7BitBlocks,
+    testInputOverflow,
+    testNumericEvents,
+    testStatsQuery,
+    testBlockAndBytewiseParsing,
+    testStreamFlush,
+    testSysexStream,
+    testEnvelope,
+    testBootConfig,
+    testBootConfigTooLarge,
+    testSpscRing,
+    testArena,
+    testPinInterrupts,
+    testAnalogReportPolicy,
+    testAnalogFilter,
+    testCapture,
+    testEncoder,
+    testShift,
+    testSonar,
+    testControl,
+    testSchedulerTrigger,
+    testSchedulerServo,
+    testI2CBuses,
+    testSpiChannels,
+    testModbus,
+    testStepperTelemetry,
+    testOutputQueue,
+    testCapabilityCache,
+  };
+  for (auto test : tests)
+  {
+    resetFirmata();
+    test();
+  }
+  printf("%d checks, %d failures\n", checks, failures);
+  return failures == 0 ? 0 : 1;
+}
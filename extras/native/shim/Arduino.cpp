@@ -0,0 +1,142 @@
+/*
+  Arduino.cpp - Minimal Arduino core for the native build of ConfigurableFirmata
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <chrono>
+#include <thread>
+#include "Arduino.h"
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+
+// initialized on the first call, so the time is right in the constructors of static features, too
+static std::chrono::steady_clock::time_point startTime()
+{
+  static const auto start = std::chrono::steady_clock::now();
+  return start;
+}
+
+static int pinModes[NUM_DIGITAL_PINS];
+static int pinValues[NUM_DIGITAL_PINS];
+static int analogValues[NUM_ANALOG_INPUTS];
+static void (*writeHook)(uint8_t pin, uint8_t value) = NULL;
+
+unsigned long millis()
+{
+  return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime()).count();
+}
+
+unsigned long micros()
+{
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime()).count();
+}
+
+void delay(unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void yield()
+{
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  if (pin < NUM_DIGITAL_PINS)
+  {
+    pinModes[pin] = mode;
+    pinValues[pin] = mode == INPUT_PULLUP ? HIGH : pinValues[pin];
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  if (pin < NUM_DIGITAL_PINS)
+  {
+    pinValues[pin] = value ? HIGH : LOW;
+    if (writeHook)
+    {
+      writeHook(pin, pinValues[pin]);
+    }
+  }
+}
+
+int digitalRead(uint8_t pin)
+{
+  return pin < NUM_DIGITAL_PINS ? pinValues[pin] : LOW;
+}
+
+int analogRead(uint8_t channel)
+{
+  // like the AVR core, the pin number of an analog input (24 = channel 0) works as well
+  if (channel >= NUM_DIGITAL_PINS - NUM_ANALOG_INPUTS) {
+    channel -= NUM_DIGITAL_PINS - NUM_ANALOG_INPUTS;
+  }
+  return channel < NUM_ANALOG_INPUTS ? analogValues[channel] : 0;
+}
+
+void analogWrite(uint8_t pin, int value)
+{
+  if (pin < NUM_DIGITAL_PINS)
+  {
+    pinValues[pin] = value;
+  }
+}
+
+static voidFuncPtr interruptHandlers[NUM_DIGITAL_PINS];
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode)
+{
+  if (interrupt < NUM_DIGITAL_PINS)
+  {
+    interruptHandlers[interrupt] = isr;
+  }
+}
+
+void detachInterrupt(uint8_t interrupt)
+{
+  if (interrupt < NUM_DIGITAL_PINS)
+  {
+    interruptHandlers[interrupt] = nullptr;
+  }
+}
+
+voidFuncPtr nativeGetInterruptHandler(uint8_t interrupt)
+{
+  return interrupt < NUM_DIGITAL_PINS ? interruptHandlers[interrupt] : nullptr;
+}
+
+int nativeGetPinMode(uint8_t pin)
+{
+  return pin < NUM_DIGITAL_PINS ? pinModes[pin] : -1;
+}
+
+int nativeGetPwmValue(uint8_t pin)
+{
+  return pin < NUM_DIGITAL_PINS ? pinValues[pin] : 0;
+}
+
+void nativeSetAnalogValue(uint8_t channel, int value)
+{
+  if (channel < NUM_ANALOG_INPUTS)
+  {
+    analogValues[channel] = value;
+  }
+}
+
+void nativeSetWriteHook(void (*hook)(uint8_t pin, uint8_t value))
+{
+  writeHook = hook;
+}
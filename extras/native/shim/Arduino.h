@@ -0,0 +1,143 @@
+/*
+  Arduino.h - Minimal Arduino core for the native build of ConfigurableFirmata
+
+  Only what the library sources in the native build use. Pins are simulated: digitalWrite()
+  stores the value, digitalRead() returns it, and analogRead() returns the value set with
+  nativeSetAnalogValue(). millis() and micros() run on the host clock.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#include "binary.h"
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define LSBFIRST 0
+#define MSBFIRST 1
+#define DEC 10
+#define HEX 16
+
+#define NUM_DIGITAL_PINS 32
+#define NUM_ANALOG_INPUTS 8
+#define WIRE_INTERFACES_COUNT 2 // Wire and Wire1, see Wire.h
+// the pins of SPI, as on the Uno
+#define PIN_SPI_SS 10
+#define PIN_SPI_MOSI 11
+#define PIN_SPI_MISO 12
+#define PIN_SPI_SCK 13
+// the pins of Serial1, as on the Mega
+#define PIN_SERIAL1_RX 19
+#define PIN_SERIAL1_TX 18
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(p) (NOT_AN_INTERRUPT)
+#define MAX_SERVOS 12
+
+// there is no separate program memory
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper*)(s))
+#define PSTR(s) (s)
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t channel);
+void analogWrite(uint8_t pin, int value);
+typedef void (*voidFuncPtr)(void);
+void attachInterrupt(uint8_t interrupt, voidFuncPtr isr, int mode);
+void detachInterrupt(uint8_t interrupt);
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+// access to the simulated pins
+int nativeGetPinMode(uint8_t pin);
+int nativeGetPwmValue(uint8_t pin);
+// the handler attached to an interrupt, nullptr if there is none
+voidFuncPtr nativeGetInterruptHandler(uint8_t interrupt);
+void nativeSetAnalogValue(uint8_t channel, int value);
+// called after every digitalWrite(), to simulate the devices on the pins
+void nativeSetWriteHook(void (*hook)(uint8_t pin, uint8_t value));
+
+class Print
+{
+  public:
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size)
+    {
+      size_t n = 0;
+      while (size--)
+      {
+        n += write(*buffer++);
+      }
+      return n;
+    }
+    size_t write(const char* str) { return write((const uint8_t*)str, strlen(str)); }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+    size_t print(const char* str) { return write(str); }
+    size_t println(const char* str) { return print(str) + println(); }
+    size_t println() { return write("\r\n"); }
+    virtual ~Print() = default;
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    void setTimeout(unsigned long timeout) {}
+    // the native streams never block, so there is no timeout
+    virtual size_t readBytes(char* buffer, size_t length)
+    {
+      size_t count = 0;
+      while (count < length && available() > 0)
+      {
+        buffer[count++] = (char)read();
+      }
+      return count;
+    }
+    size_t readBytes(uint8_t* buffer, size_t length) { return readBytes((char*)buffer, length); }
+};
+
+#include "HardwareSerial.h"
+
+#endif
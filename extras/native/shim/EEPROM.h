@@ -0,0 +1,41 @@
+/*
+  EEPROM.h - The AVR EEPROM library for the native build of ConfigurableFirmata, kept in RAM
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include <Arduino.h>
+
+#define NATIVE_EEPROM_SIZE 4096
+
+class EEPROMClass
+{
+  public:
+    EEPROMClass() { memset(cells, 0xFF, sizeof(cells)); } // erased
+    uint8_t read(int address) { return cells[address]; }
+    void write(int address, uint8_t value) { cells[address] = value; writes++; }
+    void update(int address, uint8_t value)
+    {
+      if (cells[address] != value) {
+        write(address, value);
+      }
+    }
+    uint16_t length() { return NATIVE_EEPROM_SIZE; }
+    // number of cells written, to check the wear
+    unsigned long writes = 0;
+
+  private:
+    uint8_t cells[NATIVE_EEPROM_SIZE];
+};
+
+inline EEPROMClass EEPROM;
+
+#endif
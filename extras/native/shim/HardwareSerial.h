@@ -0,0 +1,59 @@
+/*
+  HardwareSerial.h - Serial ports of the native build
+
+  Every port is connected to a simulated device: the tests read what was written to it with
+  nativeGetOutput(), and give it the bytes to receive with nativeSetInput(). The output beyond
+  NATIVE_SERIAL_BUFFER_SIZE is discarded.
+*/
+
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include "Arduino.h"
+
+#define NATIVE_SERIAL_BUFFER_SIZE 512
+
+class HardwareSerial : public Stream
+{
+  public:
+    void begin(unsigned long baud) { this->baud = baud; }
+    void end() { baud = 0; }
+    int available() override { return rxLength - rxIndex; }
+    int read() override { return rxIndex < rxLength ? rxBuffer[rxIndex++] : -1; }
+    int peek() override { return rxIndex < rxLength ? rxBuffer[rxIndex] : -1; }
+    size_t write(uint8_t c) override
+    {
+      if (txLength < NATIVE_SERIAL_BUFFER_SIZE)
+      {
+        txBuffer[txLength++] = c;
+      }
+      return 1;
+    }
+    using Print::write;
+    operator bool() { return true; }
+
+    // access to the simulated device
+    void nativeSetInput(const uint8_t* data, size_t length)
+    {
+      rxLength = length < NATIVE_SERIAL_BUFFER_SIZE ? length : NATIVE_SERIAL_BUFFER_SIZE;
+      memcpy(rxBuffer, data, rxLength);
+      rxIndex = 0;
+    }
+    const uint8_t* nativeGetOutput() { return txBuffer; }
+    size_t nativeGetOutputLength() { return txLength; }
+    void nativeClearOutput() { txLength = 0; }
+    unsigned long nativeGetBaud() { return baud; }
+
+  private:
+    unsigned long baud = 0;
+    uint8_t txBuffer[NATIVE_SERIAL_BUFFER_SIZE];
+    size_t txLength = 0;
+    uint8_t rxBuffer[NATIVE_SERIAL_BUFFER_SIZE];
+    size_t rxLength = 0;
+    size_t rxIndex = 0;
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+#endif
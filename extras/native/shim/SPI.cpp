@@ -0,0 +1,32 @@
+/*
+  SPI.cpp - SPIClass for the native build of ConfigurableFirmata
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include "SPI.h"
+
+SPIClass SPI;
+
+void SPIClass::beginTransaction(SPISettings newSettings)
+{
+  settings = newSettings;
+  inTransaction = true;
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+  transfers++;
+  return data;
+}
+
+void SPIClass::transfer(void* buffer, size_t count)
+{
+  // the bytes received are the bytes sent
+  transfers++;
+}
@@ -0,0 +1,61 @@
+/*
+  SPI.h - SPIClass for the native build of ConfigurableFirmata
+
+  The MISO of every host is connected to its MOSI, so a transfer returns the bytes sent. Each
+  SPIClass counts its transfers, so the tests can tell which host a device is on.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef SPI_h
+#define SPI_h
+
+#include "Arduino.h"
+
+#define SPI_MODE0 0
+#define SPI_MODE1 1
+#define SPI_MODE2 2
+#define SPI_MODE3 3
+
+class SPISettings
+{
+  public:
+    SPISettings() : clock(4000000), bitOrder(MSBFIRST), dataMode(SPI_MODE0) {}
+    SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode) : clock(clock), bitOrder(bitOrder), dataMode(dataMode) {}
+    uint32_t clock;
+    uint8_t bitOrder;
+    uint8_t dataMode;
+};
+
+class SPIClass
+{
+  public:
+    void begin() { begun = true; }
+    void end() { begun = false; }
+    void beginTransaction(SPISettings settings);
+    void endTransaction() { inTransaction = false; }
+    uint8_t transfer(uint8_t data);
+    void transfer(void* buffer, size_t count);
+
+    // access to the simulated host
+    bool nativeIsBegun() { return begun; }
+    bool nativeInTransaction() { return inTransaction; }
+    int nativeGetTransfers() { return transfers; }
+    // the clock of the current or last transaction
+    uint32_t nativeGetClock() { return settings.clock; }
+
+  private:
+    bool begun = false;
+    bool inTransaction = false;
+    int transfers = 0;
+    SPISettings settings;
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,73 @@
+/*
+  Wire.cpp - TwoWire for the native build of ConfigurableFirmata
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include "Wire.h"
+
+TwoWire Wire;
+TwoWire Wire1;
+
+void TwoWire::beginTransmission(uint8_t address)
+{
+  txAddress = address;
+  txLength = 0;
+}
+
+size_t TwoWire::write(uint8_t c)
+{
+  if (txLength == NATIVE_WIRE_BUFFER_SIZE)
+  {
+    return 0;
+  }
+  txBuffer[txLength++] = c;
+  return 1;
+}
+
+uint8_t TwoWire::endTransmission(bool stop)
+{
+  if (txAddress != deviceAddress)
+  {
+    return 2; // address NACK
+  }
+  if (txLength > 0)
+  {
+    selected = txBuffer[0];
+    for (uint8_t i = 1; i < txLength; i++)
+    {
+      registers[(selected + i - 1) % NATIVE_WIRE_REGISTERS] = txBuffer[i];
+    }
+  }
+  return 0;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity)
+{
+  rxIndex = 0;
+  rxLength = 0;
+  if (address != deviceAddress)
+  {
+    return 0;
+  }
+  reads++;
+  while (rxLength < quantity && rxLength < NATIVE_WIRE_BUFFER_SIZE)
+  {
+    rxBuffer[rxLength++] = registers[selected++ % NATIVE_WIRE_REGISTERS];
+  }
+  return rxLength;
+}
+
+void TwoWire::nativeSetDevice(uint8_t address, const uint8_t* values, size_t length)
+{
+  deviceAddress = address;
+  memset(registers, 0, sizeof(registers));
+  memcpy(registers, values, length < sizeof(registers) ? length : sizeof(registers));
+  selected = 0;
+  reads = 0;
+}
@@ -0,0 +1,65 @@
+/*
+  Wire.h - TwoWire for the native build of ConfigurableFirmata
+
+  Every bus has one simulated device, set with nativeSetDevice(). Like most sensors, the first
+  byte written to it selects the register, the following bytes are written from there, and
+  reads continue at the selected register. Other addresses don't answer.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef TwoWire_h
+#define TwoWire_h
+
+#include "Arduino.h"
+
+#define NATIVE_WIRE_BUFFER_SIZE 32
+#define NATIVE_WIRE_REGISTERS 32
+
+class TwoWire : public Stream
+{
+  public:
+    void begin() { begun = true; }
+    void begin(int sda, int scl) { begun = true; }
+    void end() { begun = false; }
+    void setClock(uint32_t frequency) { clock = frequency; }
+    void beginTransmission(uint8_t address);
+    uint8_t endTransmission(bool stop = true);
+    uint8_t requestFrom(uint8_t address, uint8_t quantity);
+    size_t write(uint8_t c) override;
+    using Print::write;
+    int available() override { return rxLength - rxIndex; }
+    int read() override { return rxIndex < rxLength ? rxBuffer[rxIndex++] : -1; }
+    int peek() override { return rxIndex < rxLength ? rxBuffer[rxIndex] : -1; }
+
+    // access to the simulated device
+    void nativeSetDevice(uint8_t address, const uint8_t* registers, size_t length);
+    uint8_t nativeGetRegister(uint8_t reg) { return registers[reg % NATIVE_WIRE_REGISTERS]; }
+    int nativeGetReads() { return reads; }
+    bool nativeIsBegun() { return begun; }
+    uint32_t nativeGetClock() { return clock; }
+
+  private:
+    bool begun = false;
+    uint32_t clock = 0;
+    uint8_t deviceAddress = 0xFF;
+    uint8_t registers[NATIVE_WIRE_REGISTERS] = {};
+    uint8_t selected = 0;
+    int reads = 0;
+    uint8_t txAddress = 0;
+    uint8_t txBuffer[NATIVE_WIRE_BUFFER_SIZE];
+    uint8_t txLength = 0;
+    uint8_t rxBuffer[NATIVE_WIRE_BUFFER_SIZE];
+    uint8_t rxLength = 0;
+    uint8_t rxIndex = 0;
+};
+
+extern TwoWire Wire;
+extern TwoWire Wire1;
+
+#endif
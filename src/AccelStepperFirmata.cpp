@@ -19,6 +19,92 @@
 #include "AccelStepperFirmata.h"
 #include "utility/AccelStepper.h"
 #include "utility/MultiStepper.h"
+#include "FirmataArena.h"
+
+#ifdef ACCELSTEPPER_USE_TIMER
+static AccelStepperFirmata* timerInstance = NULL;
+// set while the loop works on the steppers, the interrupt then skips its turn
+static volatile bool timerPaused = false;
+
+#ifdef ESP32
+static hw_timer_t* stepTimer = NULL;
+
+static void IRAM_ATTR onStepTimer()
+{
+  timerInstance->runFromTimer();
+}
+#else
+ISR(TIMER1_COMPA_vect)
+{
+  if (timerInstance) {
+    timerInstance->runFromTimer();
+  }
+}
+#endif
+
+void AccelStepperFirmata::startTimer()
+{
+  if (timerInstance) {
+    return;
+  }
+  timerInstance = this;
+#ifdef ESP32
+  stepTimer = timerBegin(ACCELSTEPPER_TIMER_NUM, 80, true); // 1 MHz
+  timerAttachInterrupt(stepTimer, &onStepTimer, true);
+  timerAlarmWrite(stepTimer, ACCELSTEPPER_TIMER_INTERVAL, true);
+  timerAlarmEnable(stepTimer);
+#else
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | _BV(CS11); // CTC mode, clk/8
+  TCNT1 = 0;
+  OCR1A = (F_CPU / 8 / 1000000L) * ACCELSTEPPER_TIMER_INTERVAL - 1;
+  TIMSK1 |= _BV(OCIE1A);
+  interrupts();
+#endif
+}
+
+// once the last stepper is gone, so that the timer doesn't interrupt the loop for nothing
+void AccelStepperFirmata::stopTimer()
+{
+  if (!timerInstance) {
+    return;
+  }
+#ifdef ESP32
+  timerAlarmDisable(stepTimer);
+  timerDetachInterrupt(stepTimer);
+  timerEnd(stepTimer);
+  stepTimer = NULL;
+#else
+  noInterrupts();
+  TIMSK1 &= ~_BV(OCIE1A);
+  TCCR1B = 0; // stopped, Timer1 is free for the Servo library again
+  interrupts();
+#endif
+  timerInstance = NULL;
+}
+
+void ACCELSTEPPER_ISR_ATTR AccelStepperFirmata::runFromTimer()
+{
+  if (timerPaused) {
+    return;
+  }
+  for (byte i = 0; i < MAX_GROUPS; i++) {
+    if (group[i] && groupIsRunning[i] && !group[i]->run()) {
+      groupIsRunning[i] = false;
+      groupFinished[i] = true;
+    }
+  }
+  for (byte i = 0; i < MAX_ACCELSTEPPERS; i++) {
+    if (stepper[i] && isRunning[i] && pendingSteps[i] < ACCELSTEPPER_MAX_PENDING_STEPS) {
+      // as runSpeedToPosition(): the profile may lag behind, the target is never passed
+      if (stepper[i]->distanceToGo() != 0 && stepper[i]->runSpeed()) {
+        pendingSteps[i]++;
+      }
+    }
+  }
+}
+#endif
 
 boolean AccelStepperFirmata::handlePinMode(byte pin, int mode)
 {
@@ -39,6 +125,27 @@ void AccelStepperFirmata::handleCapability(byte pin)
   }
 }
 
+void AccelStepperFirmata::setSpeed(byte deviceNum, float speed)
+{
+  if (deviceNum >= MAX_ACCELSTEPPERS || !stepper[deviceNum] || (speed == 0 && !isRunning[deviceNum])) {
+    return;
+  }
+#ifdef ACCELSTEPPER_USE_TIMER
+  timerPaused = true;
+#endif
+  if (speed == 0) {
+    stepper[deviceNum]->stop();
+  } else {
+    // a target that is never reached, so that run() keeps the speed
+    stepper[deviceNum]->setMaxSpeed(fabs(speed));
+    stepper[deviceNum]->moveTo(stepper[deviceNum]->currentPosition() + (speed > 0 ? 1000000000L : -1000000000L));
+  }
+  isRunning[deviceNum] = true;
+#ifdef ACCELSTEPPER_USE_TIMER
+  timerPaused = false;
+#endif
+}
+
 // Send position data when it's requested or a move completes
 void AccelStepperFirmata::reportPosition(byte deviceNum, bool complete)
 {
@@ -46,6 +153,9 @@ void AccelStepperFirmata::reportPosition(byte deviceNum, bool complete)
     byte data[5];
     long position = stepper[deviceNum]->currentPosition();
     encode32BitSignedInteger(position, data);
+    // the position replaces the deltas that were not sent yet
+    Firmata.cancelTelemetry(ACCELSTEPPER_DATA << 8 | deviceNum);
+    reportedPosition[deviceNum] = position;
 
     Firmata.write(START_SYSEX);
     Firmata.write(ACCELSTEPPER_DATA);
@@ -64,6 +174,41 @@ void AccelStepperFirmata::reportPosition(byte deviceNum, bool complete)
   }
 }
 
+// Tells the client how many moves are queued for the group, and how many more it may send
+void AccelStepperFirmata::reportQueueStatus(byte deviceNum)
+{
+  Firmata.write(START_SYSEX);
+  Firmata.write(ACCELSTEPPER_DATA);
+  Firmata.write(MULTISTEPPER_QUEUE_STATUS);
+  Firmata.write(deviceNum);
+  Firmata.write(groupQueue[deviceNum].length);
+  Firmata.write(MULTISTEPPER_QUEUE_SIZE - groupQueue[deviceNum].length);
+  Firmata.write(END_SYSEX);
+}
+
+void AccelStepperFirmata::clearGroupQueue(byte deviceNum)
+{
+  groupQueue[deviceNum].start = 0;
+  groupQueue[deviceNum].length = 0;
+}
+
+// Starts the next queued move of a group, returns false if there is none
+boolean AccelStepperFirmata::startNextGroupMove(byte deviceNum)
+{
+  multistepper_queue *queue = &groupQueue[deviceNum];
+  if (queue->length == 0) {
+    return false;
+  }
+  // The steppers keep their last step time, so the first step of this move follows the
+  // last one of the previous move at the new speed, without a pause in between.
+  group[deviceNum]->moveTo(&queue->positions[queue->start * groupStepperCount[deviceNum]]);
+  queue->start = (queue->start + 1) % MULTISTEPPER_QUEUE_SIZE;
+  queue->length--;
+  groupIsRunning[deviceNum] = true;
+  reportQueueStatus(deviceNum);
+  return true;
+}
+
 void AccelStepperFirmata::reportGroupComplete(byte deviceNum)
 {
   if (group[deviceNum]) {
@@ -80,6 +225,22 @@ void AccelStepperFirmata::reportGroupComplete(byte deviceNum)
  *============================================================================*/
 
 boolean AccelStepperFirmata::handleSysex(byte command, byte argc, byte *argv)
+{
+#ifdef ACCELSTEPPER_USE_TIMER
+  // keep the interrupt away from the steppers while they are reconfigured
+  timerPaused = true;
+  boolean result = handleStepperCommand(command, argc, argv);
+  if (numSteppers > 0 || numGroups > 0) {
+    startTimer();
+  }
+  timerPaused = false;
+  return result;
+#else
+  return handleStepperCommand(command, argc, argv);
+#endif
+}
+
+boolean AccelStepperFirmata::handleStepperCommand(byte command, byte argc, byte *argv)
 {
   if (command == ACCELSTEPPER_DATA) {
     byte stepCommand, deviceNum, interface, wireCount, stepType;
@@ -134,19 +295,21 @@ boolean AccelStepperFirmata::handleSysex(byte command, byte argc, byte *argv)
             return false;
         }
 
-        // Instantiate our stepper
+        // Instantiate our stepper, in place of the one configured before
+        FirmataArena.destroy(stepper[deviceNum]);
+        stepper[deviceNum] = NULL;
         if (wireCount == 1) {
-          stepper[deviceNum] = new AccelStepper(AccelStepper::DRIVER, stepOrMotorPin1, directionOrMotorPin2);
+          stepper[deviceNum] = FirmataArena.create<AccelStepper>(AccelStepper::DRIVER, stepOrMotorPin1, directionOrMotorPin2);
         } else if (wireCount == 2) {
-          stepper[deviceNum] = new AccelStepper(AccelStepper::FULL2WIRE, stepOrMotorPin1, directionOrMotorPin2);
+          stepper[deviceNum] = FirmataArena.create<AccelStepper>(AccelStepper::FULL2WIRE, stepOrMotorPin1, directionOrMotorPin2);
         } else if (wireCount == 3 && stepType == STEP_TYPE_WHOLE) {
-          stepper[deviceNum] = new AccelStepper(AccelStepper::FULL3WIRE, stepOrMotorPin1, directionOrMotorPin2, motorPin3);
+          stepper[deviceNum] = FirmataArena.create<AccelStepper>(AccelStepper::FULL3WIRE, stepOrMotorPin1, directionOrMotorPin2, motorPin3);
         } else if (wireCount == 3 && stepType == STEP_TYPE_HALF) {
-          stepper[deviceNum] = new AccelStepper(AccelStepper::HALF3WIRE, stepOrMotorPin1, directionOrMotorPin2, motorPin3);
+          stepper[deviceNum] = FirmataArena.create<AccelStepper>(AccelStepper::HALF3WIRE, stepOrMotorPin1, directionOrMotorPin2, motorPin3);
         } else if (wireCount == 4 && stepType == STEP_TYPE_WHOLE) {
-          stepper[deviceNum] = new AccelStepper(AccelStepper::FULL4WIRE, stepOrMotorPin1, directionOrMotorPin2, motorPin3, motorPin4, false);
+          stepper[deviceNum] = FirmataArena.create<AccelStepper>(AccelStepper::FULL4WIRE, stepOrMotorPin1, directionOrMotorPin2, motorPin3, motorPin4, false);
         } else if (wireCount == 4 && stepType == STEP_TYPE_HALF) {
-          stepper[deviceNum] = new AccelStepper(AccelStepper::HALF4WIRE, stepOrMotorPin1, directionOrMotorPin2, motorPin3, motorPin4, false);
+          stepper[deviceNum] = FirmataArena.create<AccelStepper>(AccelStepper::HALF4WIRE, stepOrMotorPin1, directionOrMotorPin2, motorPin3, motorPin4, false);
         }
 
         // If there is still another byte to read we must be inverting some pins
@@ -176,6 +339,13 @@ boolean AccelStepperFirmata::handleSysex(byte command, byte argc, byte *argv)
         stepper[deviceNum]->setAcceleration(MAX_ACCELERATION);
 
         isRunning[deviceNum] = false;
+#ifdef ACCELSTEPPER_USE_TIMER
+        pendingSteps[deviceNum] = 0;
+#endif
+        // a new stepper starts at 0, without telemetry
+        telemetry[deviceNum] = false;
+        reportedPosition[deviceNum] = 0;
+        Firmata.cancelTelemetry(ACCELSTEPPER_DATA << 8 | deviceNum);
 
       }
 
@@ -192,6 +362,9 @@ boolean AccelStepperFirmata::handleSysex(byte command, byte argc, byte *argv)
       else if (stepCommand == ACCELSTEPPER_ZERO) {
         if (stepper[deviceNum]) {
           stepper[deviceNum]->setCurrentPosition(0);
+          // the client zeroes its position as well, the next delta is relative to 0
+          reportedPosition[deviceNum] = 0;
+          Firmata.cancelTelemetry(ACCELSTEPPER_DATA << 8 | deviceNum);
         }
       }
 
@@ -217,6 +390,9 @@ boolean AccelStepperFirmata::handleSysex(byte command, byte argc, byte *argv)
         if (stepper[deviceNum]) {
           stepper[deviceNum]->stop();
           isRunning[deviceNum] = false;
+#ifdef ACCELSTEPPER_USE_TIMER
+          pendingSteps[deviceNum] = 0;
+#endif
           reportPosition(deviceNum, true);
         }
       }
@@ -262,10 +438,28 @@ boolean AccelStepperFirmata::handleSysex(byte command, byte argc, byte *argv)
         }
       }
 
+      else if (stepCommand == ACCELSTEPPER_TELEMETRY) {
+        if (stepper[deviceNum] && argc >= 3) {
+          telemetry[deviceNum] = argv[2] != 0;
+          if (argc >= 5 && (argv[3] | argv[4]) != 0) {
+            telemetryInterval = argv[3] | argv[4] << 7;
+          }
+          if (telemetry[deviceNum]) {
+            reportPosition(deviceNum, false);
+          }
+        }
+      }
+
       else if (stepCommand == MULTISTEPPER_CONFIG) {
         if (!group[deviceNum]) {
           numGroups++;
-          group[deviceNum] = new MultiStepper();
+          group[deviceNum] = FirmataArena.create<MultiStepper>();
+        }
+        // the queued moves depend on the number of steppers in the group
+        clearGroupQueue(deviceNum);
+        if (groupQueue[deviceNum].positions) {
+          FirmataArena.release(groupQueue[deviceNum].positions);
+          groupQueue[deviceNum].positions = NULL;
         }
 
         for (byte i = index; i < argc; i++) {
@@ -278,6 +472,9 @@ boolean AccelStepperFirmata::handleSysex(byte command, byte argc, byte *argv)
         }
 
         groupIsRunning[deviceNum] = false;
+#ifdef ACCELSTEPPER_USE_TIMER
+        groupFinished[deviceNum] = false;
+#endif
       }
 
       else if (stepCommand == MULTISTEPPER_TO) {
@@ -289,11 +486,57 @@ boolean AccelStepperFirmata::handleSysex(byte command, byte argc, byte *argv)
           positions[i] = decode32BitSignedInteger(argv[offset], argv[offset + 1], argv[offset + 2], argv[offset + 3], argv[offset + 4]);
         }
 
+        clearGroupQueue(deviceNum);
         group[deviceNum]->moveTo(positions);
       }
 
+      else if (stepCommand == MULTISTEPPER_QUEUE) {
+        // Like MULTISTEPPER_TO, but the move starts right after the ones queued before,
+        // without waiting for the client to react to MULTISTEPPER_MOVE_COMPLETE
+        if (deviceNum >= MAX_GROUPS || !group[deviceNum]) {
+          return true;
+        }
+        byte count = groupStepperCount[deviceNum];
+        multistepper_queue *queue = &groupQueue[deviceNum];
+        if (argc < index + count * 5) {
+          Firmata.sendString(F("Not enough positions for the group"));
+          return true;
+        }
+        if (queue->positions == NULL) {
+          queue->positions = (long*)FirmataArena.allocate(MULTISTEPPER_QUEUE_SIZE * count * sizeof(long));
+          queue->start = 0;
+          queue->length = 0;
+          if (queue->positions == NULL) {
+            Firmata.sendEvent(EVENT_ACCELSTEPPER_OUT_OF_MEMORY, F("AccelStepper: Out of memory"));
+            return true;
+          }
+        }
+        if (queue->length >= MULTISTEPPER_QUEUE_SIZE) {
+          // the client sent more than it was told there was room for
+          reportQueueStatus(deviceNum);
+          return true;
+        }
+
+        long *positions = &queue->positions[((queue->start + queue->length) % MULTISTEPPER_QUEUE_SIZE) * count];
+        for (byte i = 0, offset = 0; i < count; i++) {
+          offset = index + (i * 5);
+          positions[i] = decode32BitSignedInteger(argv[offset], argv[offset + 1], argv[offset + 2], argv[offset + 3], argv[offset + 4]);
+        }
+        queue->length++;
+
+#ifdef ACCELSTEPPER_USE_TIMER
+        // a move that just finished in the interrupt is continued by report()
+        if (!groupIsRunning[deviceNum] && !groupFinished[deviceNum]) {
+#else
+        if (!groupIsRunning[deviceNum]) {
+#endif
+          startNextGroupMove(deviceNum);
+        }
+      }
+
       else if (stepCommand == MULTISTEPPER_STOP) {
         groupIsRunning[deviceNum] = false;
+        clearGroupQueue(deviceNum);
         reportGroupComplete(deviceNum);
       }
     }
@@ -307,11 +550,25 @@ boolean AccelStepperFirmata::handleSysex(byte command, byte argc, byte *argv)
  * SETUP()
  *============================================================================*/
 
+// the steppers and their moves are not saved in the boot configuration
+boolean AccelStepperFirmata::canWriteConfiguration()
+{
+  for (byte i = 0; i < MAX_ACCELSTEPPERS; i++) {
+    if (stepper[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void AccelStepperFirmata::reset()
 {
+#ifdef ACCELSTEPPER_USE_TIMER
+  timerPaused = true;
+#endif
   for (byte i = 0; i < MAX_ACCELSTEPPERS; i++) {
     if (stepper[i]) {
-      free(stepper[i]);
+      FirmataArena.destroy(stepper[i]);
       stepper[i] = 0;
     }
   }
@@ -319,11 +576,32 @@ void AccelStepperFirmata::reset()
 
   for (byte i = 0; i < MAX_GROUPS; i++) {
     if (group[i]) {
-      free(group[i]);
+      FirmataArena.destroy(group[i]);
       group[i] = 0;
     }
+    clearGroupQueue(i);
+    if (groupQueue[i].positions) {
+      FirmataArena.release(groupQueue[i].positions);
+      groupQueue[i].positions = NULL;
+    }
   }
   numGroups = 0;
+  for (byte i = 0; i < MAX_ACCELSTEPPERS; i++) {
+    telemetry[i] = false;
+  }
+  telemetryInterval = ACCELSTEPPER_DEFAULT_TELEMETRY_INTERVAL;
+#ifdef ACCELSTEPPER_USE_TIMER
+  for (byte i = 0; i < MAX_ACCELSTEPPERS; i++) {
+    isRunning[i] = false;
+    pendingSteps[i] = 0;
+  }
+  for (byte i = 0; i < MAX_GROUPS; i++) {
+    groupIsRunning[i] = false;
+    groupFinished[i] = false;
+  }
+  stopTimer();
+  timerPaused = false;
+#endif
 }
 
 /*==============================================================================
@@ -383,6 +661,42 @@ void AccelStepperFirmata::encode32BitSignedInteger(long value, byte pdata[])
  *============================================================================*/
 void AccelStepperFirmata::report(bool elapsed)
 {
+#ifdef ACCELSTEPPER_USE_TIMER
+  // The steps are done by the timer interrupt. Here, the speed profile is computed
+  // for the steps done since the last call, and completed moves are reported.
+  for (byte i = 0; i < MAX_GROUPS; i++) {
+    if (groupFinished[i]) {
+      groupFinished[i] = false;
+      timerPaused = true;
+      bool next = startNextGroupMove(i);
+      timerPaused = false;
+      if (!next) {
+        reportGroupComplete(i);
+      }
+    }
+  }
+
+  for (byte i = 0; i < MAX_ACCELSTEPPERS; i++) {
+    if (stepper[i] && isRunning[i] == true) {
+      timerPaused = true;
+      while (pendingSteps[i] > 0) {
+        stepper[i]->updateSpeed();
+        pendingSteps[i]--;
+      }
+      if (stepper[i]->distanceToGo() == 0) {
+        // the timer stopped on the target, also if the profile hadn't slowed down to zero yet
+        stepper[i]->setCurrentPosition(stepper[i]->currentPosition());
+      }
+      bool stepsLeft = stepper[i]->isRunning();
+      timerPaused = false;
+
+      if (!stepsLeft) {
+        isRunning[i] = false;
+        reportPosition(i, true);
+      }
+    }
+  }
+#else
   bool stepsLeft;
 
   if (numGroups > 0) {
@@ -391,8 +705,8 @@ void AccelStepperFirmata::report(bool elapsed)
       if (group[i] && groupIsRunning[i] == true) {
         stepsLeft = group[i]->run();
 
-        // send command to client application when stepping is complete
-        if (stepsLeft != true) {
+        // continue with the next queued move, or tell the client that stepping is complete
+        if (stepsLeft != true && !startNextGroupMove(i)) {
           groupIsRunning[i] = false;
           reportGroupComplete(i);
         }
@@ -416,5 +730,56 @@ void AccelStepperFirmata::report(bool elapsed)
       }
     }
   }
+#endif
+  if (millis() - lastTelemetry >= telemetryInterval) {
+    lastTelemetry = millis();
+    sendTelemetry();
+  }
+}
 
+void AccelStepperFirmata::sendTelemetry()
+{
+  bool started = false;
+  for (byte i = 0; i < MAX_ACCELSTEPPERS; i++) {
+    if (!stepper[i] || !telemetry[i]) {
+      continue;
+    }
+#ifdef ACCELSTEPPER_USE_TIMER
+    timerPaused = true;
+#endif
+    long position = stepper[i]->currentPosition();
+#ifdef ACCELSTEPPER_USE_TIMER
+    timerPaused = false;
+#endif
+    // nothing for the steppers that stand still, a delta that was not sent yet is never replaced
+    if (position == reportedPosition[i] || Firmata.isTelemetryQueued(ACCELSTEPPER_DATA << 8 | i)) {
+      continue;
+    }
+    if (!started) {
+      Firmata.beginMessage(FIRMATA_LANE_TELEMETRY, ACCELSTEPPER_DATA << 8 | i);
+      Firmata.write(START_SYSEX);
+      Firmata.write(ACCELSTEPPER_DATA);
+      Firmata.write(ACCELSTEPPER_TELEMETRY);
+      started = true;
+    }
+    long delta = position - reportedPosition[i];
+    unsigned long zigzag = delta < 0 ? ((unsigned long)~delta << 1) | 1 : (unsigned long)delta << 1;
+    Firmata.write(i);
+    while (zigzag >= 0x40) {
+      Firmata.write((zigzag & 0x3F) | 0x40);
+      zigzag >>= 6;
+    }
+    Firmata.write(zigzag);
+    reportedPosition[i] = position;
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+    // with the output queue, every stepper is a telemetry source of its own
+    Firmata.write(END_SYSEX);
+    Firmata.endMessage();
+    started = false;
+#endif
+  }
+  if (started) {
+    Firmata.write(END_SYSEX);
+    Firmata.endMessage();
+  }
 }
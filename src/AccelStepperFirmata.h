@@ -37,10 +37,53 @@
 #define ACCELSTEPPER_SET_ACCELERATION 0x08
 #define ACCELSTEPPER_SET_SPEED 0x09
 #define ACCELSTEPPER_MOVE_COMPLETE 0x0a
+#define ACCELSTEPPER_TELEMETRY 0x0b
 #define MULTISTEPPER_CONFIG 0x20
 #define MULTISTEPPER_TO 0x21
 #define MULTISTEPPER_STOP 0x23
 #define MULTISTEPPER_MOVE_COMPLETE 0x24
+#define MULTISTEPPER_QUEUE 0x25
+#define MULTISTEPPER_QUEUE_STATUS 0x26
+
+#ifdef LARGE_MEM_DEVICE
+#define MULTISTEPPER_QUEUE_SIZE 16 // queued moves per group
+#else
+#define MULTISTEPPER_QUEUE_SIZE 4
+#endif
+
+// Where a hardware timer is available, the steps are done from its interrupt, so the step rate
+// no longer depends on how long the rest of the loop takes. The speed profile is still computed in
+// report(). The timer runs from the first stepper command until the steppers are removed by a
+// reset. On AVR, Timer1 is also used by the Servo library, so this has to be enabled explicitly
+// by defining ACCELSTEPPER_USE_TIMER1.
+#if defined(ESP32)
+#define ACCELSTEPPER_USE_TIMER
+#define ACCELSTEPPER_TIMER_NUM 3
+#define ACCELSTEPPER_TIMER_INTERVAL 20 // us
+#elif defined(ARDUINO_ARCH_AVR) && defined(ACCELSTEPPER_USE_TIMER1)
+#define ACCELSTEPPER_USE_TIMER
+#define ACCELSTEPPER_TIMER_INTERVAL 100 // us
+#endif
+// Steps the interrupt may do ahead of the speed profile before it waits for report() to catch up.
+// It stops on the target of a move, even if the profile wasn't updated for the last steps.
+#define ACCELSTEPPER_MAX_PENDING_STEPS 16
+
+// Telemetry sends the positions of the steppers that moved, every telemetry interval while they move:
+// START_SYSEX, ACCELSTEPPER_DATA, ACCELSTEPPER_TELEMETRY, deviceNum, on (0/1), interval in ms (2 x 7 bit), END_SYSEX
+// START_SYSEX, ACCELSTEPPER_DATA, ACCELSTEPPER_TELEMETRY, n x (deviceNum, delta), END_SYSEX
+// The interval is the same for all steppers, 0 keeps it. Turning it on reports the position with
+// ACCELSTEPPER_REPORT_POSITION. The delta is the signed change since the last position the client
+// got for the stepper, in any message, zigzag encoded in 6 bit groups, LSB first, with 0x40 set
+// on all but the last byte. With the output queue (LARGE_MEM_DEVICE), every stepper comes in a message
+// of its own, and a stepper whose last one is still queued waits for the next interval.
+#define ACCELSTEPPER_DEFAULT_TELEMETRY_INTERVAL 50 // ms
+
+struct multistepper_queue
+{
+  long* positions; // MULTISTEPPER_QUEUE_SIZE moves of one position per stepper of the group
+  byte start;
+  byte length;
+};
 
 class AccelStepperFirmata: public FirmataFeature
 {
@@ -49,21 +92,45 @@ class AccelStepperFirmata: public FirmataFeature
     void handleCapability(byte pin);
     void reportPosition(byte deviceNum, bool complete);
     void reportGroupComplete(byte deviceNum);
+    void reportQueueStatus(byte deviceNum);
     boolean handleSysex(byte command, byte argc, byte *argv);
+    boolean ownsSysexCommand(byte command) override { return command == ACCELSTEPPER_DATA; }
     float decodeCustomFloat(byte arg1, byte arg2, byte arg3, byte arg4);
     long decode28BitUnsignedInteger(byte arg1, byte arg2, byte arg3, byte arg4);
     long decode32BitSignedInteger(byte arg1, byte arg2, byte arg3, byte arg4, byte arg5);
     void encode32BitSignedInteger(long value, byte pdata[]);
     void report(bool elapsed) override;
     void reset();
+    boolean canWriteConfiguration() override;
+    // Runs the stepper on and on at the speed in steps/s (negative is backwards), with its acceleration.
+    // 0 decelerates to a stop. For closed loop control, this replaces the maximum speed of the stepper.
+    void setSpeed(byte deviceNum, float speed);
+#ifdef ACCELSTEPPER_USE_TIMER
+    void runFromTimer();
+#endif
   private:
+    boolean handleStepperCommand(byte command, byte argc, byte *argv);
     AccelStepper *stepper[MAX_ACCELSTEPPERS];
     MultiStepper *group[MAX_GROUPS];
-    bool isRunning[MAX_ACCELSTEPPERS];
-    bool groupIsRunning[MAX_GROUPS];
+    volatile bool isRunning[MAX_ACCELSTEPPERS];
+    volatile bool groupIsRunning[MAX_GROUPS];
+#ifdef ACCELSTEPPER_USE_TIMER
+    volatile byte pendingSteps[MAX_ACCELSTEPPERS];
+    volatile bool groupFinished[MAX_GROUPS];
+    void startTimer();
+    void stopTimer();
+#endif
     byte numSteppers;
     byte numGroups;
     byte groupStepperCount[MAX_GROUPS];
+    multistepper_queue groupQueue[MAX_GROUPS];
+    bool telemetry[MAX_ACCELSTEPPERS];
+    long reportedPosition[MAX_ACCELSTEPPERS]; // the last one sent to the client
+    unsigned int telemetryInterval;
+    unsigned long lastTelemetry;
+    void sendTelemetry();
+    void clearGroupQueue(byte deviceNum);
+    boolean startNextGroupMove(byte deviceNum);
 };
 
 #endif /* AccelStepperFirmata_h */
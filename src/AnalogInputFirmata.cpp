@@ -18,6 +18,7 @@
 
 #include <ConfigurableFirmata.h>
 #include "AnalogInputFirmata.h"
+#include "FirmataExt.h"
 
 AnalogInputFirmata *AnalogInputFirmataInstance;
 
@@ -43,6 +44,9 @@ AnalogInputFirmata::AnalogInputFirmata()
 {
   AnalogInputFirmataInstance = this;
   analogInputsToReport = 0;
+  batchedReporting = false;
+  setReportPolicy(127, ANALOG_REPORT_ALWAYS, 0, 0);
+  setFilter(127, 0, ANALOG_FILTER_NONE, 0);
   Firmata.attach(REPORT_ANALOG, reportAnalogInputCallback);
 }
 
@@ -66,11 +70,53 @@ void AnalogInputFirmata::reportAnalog(byte analogPin, bool enable, byte physical
             // Send pin value immediately. This is helpful when connected via
             // ethernet, wi-fi or bluetooth so pin states can be known upon
             // reconnecting.
-		    Firmata.sendAnalog(analogPin, analogRead(physicalPin));
+		    sendAnalog(analogPin, sample(physicalPin, analogPin));
         }
     }
   }
-  // TODO: save status to EEPROM here, if changed
+}
+
+void AnalogInputFirmata::writeConfiguration(Print& out)
+{
+  // PIN_MODE_ANALOG turns reporting on, it may have been switched off since
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    if (IS_PIN_ANALOG(pin) && Firmata.getPinMode(pin) == PIN_MODE_ANALOG && PIN_TO_ANALOG(pin) < 16 &&
+        !(analogInputsToReport & (1 << PIN_TO_ANALOG(pin)))) {
+      out.write(REPORT_ANALOG | PIN_TO_ANALOG(pin));
+      out.write((byte)0);
+    }
+  }
+  for (byte i = 0; i < ANALOG_POLICY_CHANNELS; i++) {
+    if (policies[i].threshold != 0) {
+      out.write(START_SYSEX);
+      out.write(ANALOG_CONFIG);
+      out.write(ANALOG_CONFIG_REPORT_POLICY);
+      out.write(i);
+      out.write((byte)ANALOG_REPORT_ON_CHANGE);
+      out.write((byte)((policies[i].threshold - 1) & 0x7F));
+      out.write((byte)((policies[i].threshold - 1) >> 7));
+      out.write((byte)(policies[i].heartbeat & 0x7F));
+      out.write((byte)(policies[i].heartbeat >> 7));
+      out.write(END_SYSEX);
+    }
+    if (filters[i].oversampling != 0 || filters[i].filter != ANALOG_FILTER_NONE) {
+      out.write(START_SYSEX);
+      out.write(ANALOG_CONFIG);
+      out.write(ANALOG_CONFIG_FILTER);
+      out.write(i);
+      out.write(filters[i].oversampling);
+      out.write(filters[i].filter);
+      out.write(filters[i].strength);
+      out.write(END_SYSEX);
+    }
+  }
+  if (batchedReporting) {
+    out.write(START_SYSEX);
+    out.write(ANALOG_CONFIG);
+    out.write(ANALOG_CONFIG_BATCHED_REPORT);
+    out.write((byte)1);
+    out.write(END_SYSEX);
+  }
 }
 
 boolean AnalogInputFirmata::handlePinMode(byte pin, int mode)
@@ -93,19 +139,22 @@ void AnalogInputFirmata::handleCapability(byte pin)
 {
   if (IS_PIN_ANALOG(pin)) {
     Firmata.write(PIN_MODE_ANALOG);
-    Firmata.write(DEFAULT_ADC_RESOLUTION); // Defaults to 10-bit resolution
+    Firmata.write(resolution(PIN_TO_ANALOG(pin))); // Defaults to 10-bit resolution
   }
 }
 
 boolean AnalogInputFirmata::handleSysex(byte command, byte argc, byte* argv)
 {
   if (command == ANALOG_MAPPING_QUERY) {
-    Firmata.write(START_SYSEX);
-    Firmata.write(ANALOG_MAPPING_RESPONSE);
+    // only depends on the board, built on the stack and written in one go
+    byte response[TOTAL_PINS + 3];
+    response[0] = START_SYSEX;
+    response[1] = ANALOG_MAPPING_RESPONSE;
     for (byte pin = 0; pin < TOTAL_PINS; pin++) {
-      Firmata.write(IS_PIN_ANALOG(pin) ? PIN_TO_ANALOG(pin) : 127);
+      response[2 + pin] = IS_PIN_ANALOG(pin) ? PIN_TO_ANALOG(pin) : 127;
     }
-    Firmata.write(END_SYSEX);
+    response[TOTAL_PINS + 2] = END_SYSEX;
+    Firmata.write(response, sizeof(response));
     return true;
   }
   if (command == EXTENDED_REPORT_ANALOG && argc >= 2)
@@ -114,13 +163,143 @@ boolean AnalogInputFirmata::handleSysex(byte command, byte argc, byte* argv)
   	reportAnalog(analogChannel, argv[1] == 1, (byte)AnalogToPin(analogChannel));
 	return true;
   }
+  if (command == ANALOG_CONFIG && argc >= 2 && argv[0] == ANALOG_CONFIG_BATCHED_REPORT)
+  {
+    batchedReporting = argv[1] == 1;
+    return true;
+  }
+  if (command == ANALOG_CONFIG && argc >= 7 && argv[0] == ANALOG_CONFIG_REPORT_POLICY)
+  {
+    setReportPolicy(argv[1], argv[2], Firmata.decodePackedUInt14(argv + 3), Firmata.decodePackedUInt14(argv + 5));
+    return true;
+  }
+  if (command == ANALOG_CONFIG && argc >= 5 && argv[0] == ANALOG_CONFIG_FILTER)
+  {
+    if (!setFilter(argv[1], argv[2], argv[3], argv[4])) {
+      Firmata.sendString(F("Unsupported analog filter"));
+    }
+    return true;
+  }
   return false;
 }
 
+bool AnalogInputFirmata::setFilter(byte analogPin, byte oversampling, byte filter, byte strength)
+{
+  if (DEFAULT_ADC_RESOLUTION + oversampling / 2 > ANALOG_MAX_RESOLUTION || oversampling > ANALOG_MAX_OVERSAMPLING ||
+      (filter == ANALOG_FILTER_IIR && (strength == 0 || strength > ANALOG_MAX_IIR_STRENGTH)) ||
+      (filter == ANALOG_FILTER_MOVING_AVERAGE && (strength > 7 || (1 << strength) > ANALOG_FILTER_WINDOW)) ||
+      filter > ANALOG_FILTER_MOVING_AVERAGE) {
+    return false;
+  }
+  for (byte i = 0; i < ANALOG_POLICY_CHANNELS; i++) {
+    if (analogPin == i || analogPin == 127) {
+      filters[i].oversampling = oversampling;
+      filters[i].filter = filter;
+      filters[i].strength = filter == ANALOG_FILTER_NONE ? 0 : strength;
+      filters[i].count = 0;
+      filters[i].next = 0;
+      // the scale of the reported values changes
+      policies[i].lastValue = -1;
+    }
+  }
+  // and so does the resolution in the capability response
+  if (FirmataExtInstance != NULL) {
+    FirmataExtInstance->invalidateCapabilities();
+  }
+  return true;
+}
+
+byte AnalogInputFirmata::resolution(byte analogPin)
+{
+  if (analogPin >= ANALOG_POLICY_CHANNELS) {
+    return DEFAULT_ADC_RESOLUTION;
+  }
+  return DEFAULT_ADC_RESOLUTION + filters[analogPin].oversampling / 2;
+}
+
+int AnalogInputFirmata::sample(byte pin, byte analogPin)
+{
+  if (analogPin >= ANALOG_POLICY_CHANNELS) {
+    return analogRead(pin);
+  }
+  analog_filter *f = &filters[analogPin];
+  int value;
+  if (f->oversampling == 0) {
+    value = analogRead(pin);
+  } else {
+    uint32_t sum = 0;
+    for (int i = 0; i < (1 << f->oversampling); i++) {
+      sum += analogRead(pin);
+    }
+    value = (int)(sum >> (f->oversampling - f->oversampling / 2));
+  }
+
+  if (f->filter == ANALOG_FILTER_IIR) {
+    if (f->count == 0) {
+      f->state = (int32_t)value << 8;
+      f->count = 1;
+    } else {
+      f->state += (((int32_t)value << 8) - f->state) >> f->strength;
+    }
+    value = (int)((f->state + 0x80) >> 8);
+  } else if (f->filter == ANALOG_FILTER_MOVING_AVERAGE) {
+    byte length = 1 << f->strength;
+    if (f->count == 0) {
+      f->state = 0;
+    }
+    if (f->count == length) {
+      f->state -= f->window[f->next];
+    } else {
+      f->count++;
+    }
+    f->window[f->next] = value;
+    f->state += value;
+    f->next = (f->next + 1) & (length - 1);
+    value = (int)((f->state + f->count / 2) / f->count);
+  }
+  return value;
+}
+
+void AnalogInputFirmata::setReportPolicy(byte analogPin, byte policy, uint16_t deadband, uint16_t heartbeat)
+{
+  for (byte i = 0; i < ANALOG_POLICY_CHANNELS; i++) {
+    if (analogPin == i || analogPin == 127) {
+      policies[i].threshold = policy == ANALOG_REPORT_ON_CHANGE ? deadband + 1 : 0;
+      policies[i].heartbeat = heartbeat;
+      policies[i].lastValue = -1;
+    }
+  }
+}
+
+bool AnalogInputFirmata::takeReport(byte analogPin, int value)
+{
+  if (analogPin >= ANALOG_POLICY_CHANNELS) {
+    return true;
+  }
+  analog_report_policy *p = &policies[analogPin];
+  uint16_t now = (uint16_t)millis();
+  if (p->threshold != 0 && p->lastValue >= 0 && abs(value - p->lastValue) < p->threshold &&
+      (p->heartbeat == 0 || (uint16_t)(now - p->lastSent) < p->heartbeat)) {
+    return false;
+  }
+  p->lastValue = value;
+  p->lastSent = now;
+  return true;
+}
+
+void AnalogInputFirmata::sendAnalog(byte analogPin, int value)
+{
+  takeReport(analogPin, value);
+  Firmata.sendAnalog(analogPin, value);
+}
+
 void AnalogInputFirmata::reset()
 {
   // by default, do not report any analog inputs
   analogInputsToReport = 0;
+  batchedReporting = false;
+  setReportPolicy(127, ANALOG_REPORT_ALWAYS, 0, 0);
+  setFilter(127, 0, ANALOG_FILTER_NONE, 0);
 }
 
 void AnalogInputFirmata::report(bool elapsed)
@@ -130,14 +309,70 @@ void AnalogInputFirmata::report(bool elapsed)
     return;
   }
 
+  if (batchedReporting)
+  {
+    reportBatched();
+    return;
+  }
+
   byte pin, analogPin;
   /* ANALOGREAD - do all analogReads() at the configured sampling interval */
   for (pin = 0; pin < TOTAL_PINS; pin++) {
     if (IS_PIN_ANALOG(pin) && Firmata.getPinMode(pin) == PIN_MODE_ANALOG) {
       analogPin = PIN_TO_ANALOG(pin);
       if (analogInputsToReport & (1 << analogPin)) {
-        Firmata.sendAnalog(analogPin, analogRead(pin));
+        int value = sample(pin, analogPin);
+        if (takeReport(analogPin, value)) {
+          // a sample that is still queued is replaced by the new one
+          Firmata.beginMessage(FIRMATA_LANE_TELEMETRY, ANALOG_MESSAGE << 8 | analogPin);
+          Firmata.sendAnalog(analogPin, value);
+          Firmata.endMessage();
+        }
+      }
+    }
+  }
+}
+
+/// <summary>
+/// Samples all enabled channels in one pass and sends them as a single frame:
+/// START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_BATCHED_REPORT, timestamp (packed uint32, millis at the start of the scan),
+/// number of mask bytes, channel mask (7 channels per byte, LSB first), 2 bytes per enabled channel in ascending order, END_SYSEX
+/// </summary>
+void AnalogInputFirmata::reportBatched()
+{
+  // sample first, the policies decide which channels go into the mask
+  unsigned long timestamp = millis();
+  int values[ANALOG_POLICY_CHANNELS];
+  int activeChannels = 0;
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    if (IS_PIN_ANALOG(pin) && Firmata.getPinMode(pin) == PIN_MODE_ANALOG &&
+        (analogInputsToReport & (1 << PIN_TO_ANALOG(pin)))) {
+      byte analogPin = PIN_TO_ANALOG(pin);
+      int value = sample(pin, analogPin);
+      if (analogPin < ANALOG_POLICY_CHANNELS && takeReport(analogPin, value)) {
+        values[analogPin] = value;
+        activeChannels |= 1 << analogPin;
       }
     }
   }
+  if (activeChannels == 0)
+  {
+    return;
+  }
+
+  const byte maskBytes = (TOTAL_ANALOG_PINS + 6) / 7;
+  Firmata.startSysex();
+  Firmata.write(ANALOG_CONFIG);
+  Firmata.write(ANALOG_CONFIG_BATCHED_REPORT);
+  Firmata.sendPackedUInt32(timestamp);
+  Firmata.write(maskBytes);
+  for (byte i = 0; i < maskBytes; i++) {
+    Firmata.write((byte)((activeChannels >> (i * 7)) & 0x7F));
+  }
+  for (byte i = 0; i < ANALOG_POLICY_CHANNELS; i++) {
+    if (activeChannels & (1 << i)) {
+      Firmata.sendPackedUInt14(values[i]);
+    }
+  }
+  Firmata.endSysex();
 }
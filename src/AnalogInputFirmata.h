@@ -21,6 +21,69 @@
 #include "FirmataFeature.h"
 #include "FirmataReporting.h"
 
+// ANALOG_CONFIG subcommands
+#define ANALOG_CONFIG_BATCHED_REPORT  0x01 // enable/disable reporting all channels in a single ANALOG_CONFIG frame
+#define ANALOG_CONFIG_REPORT_POLICY   0x02 // when a channel is reported, see below
+#define ANALOG_CONFIG_FILTER          0x03 // oversampling and filtering of a channel, see below
+
+// ANALOG_CONFIG_REPORT_POLICY policies
+#define ANALOG_REPORT_ALWAYS          0x00 // every sampling interval (the default)
+#define ANALOG_REPORT_ON_CHANGE       0x01 // when the value moved by more than the deadband
+
+// ANALOG_CONFIG_FILTER filters
+#define ANALOG_FILTER_NONE            0x00
+#define ANALOG_FILTER_IIR             0x01 // y += (x - y) / 2^strength
+#define ANALOG_FILTER_MOVING_AVERAGE  0x02 // over the last 2^strength values
+
+#define ANALOG_MAX_OVERSAMPLING       6  // 64 reads
+#define ANALOG_MAX_RESOLUTION         14 // what ANALOG_MESSAGE can carry
+#define ANALOG_MAX_IIR_STRENGTH       8
+#ifndef ANALOG_FILTER_WINDOW
+#ifdef LARGE_MEM_DEVICE
+#define ANALOG_FILTER_WINDOW          16 // the longest moving average, a power of 2
+#else
+#define ANALOG_FILTER_WINDOW          4
+#endif
+#endif
+
+// Channels with a policy, as many as analogInputsToReport has bits
+#define ANALOG_POLICY_CHANNELS        (TOTAL_ANALOG_PINS == 0 ? 1 : TOTAL_ANALOG_PINS < sizeof(int) * 8 ? TOTAL_ANALOG_PINS : sizeof(int) * 8)
+
+/*
+  START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_REPORT_POLICY, channel (127 = all), policy,
+  deadband (2 x 7 bit, 0 = any change), heartbeat in ms (2 x 7 bit, 0 = none), END_SYSEX
+
+  With ANALOG_REPORT_ON_CHANGE, a channel is reported when its value differs from the one last
+  reported by more than the deadband, or when it was not reported for the heartbeat interval.
+  This applies to the batched report, too: unchanged channels are left out of its mask.
+  Setting a policy sends the next sample of the channel in any case.
+*/
+/*
+  START_SYSEX, ANALOG_CONFIG, ANALOG_CONFIG_FILTER, channel (127 = all), oversampling n,
+  filter, strength, END_SYSEX
+
+  With oversampling, every sample of the channel is the sum of 2^n reads, shifted right by
+  n - n / 2, which adds n / 2 bits of resolution. The capability response shows the resulting
+  resolution of the pin. The filter runs on these samples, once per sampling interval, and its
+  output is what gets reported. All values stay within ANALOG_MAX_RESOLUTION bits.
+*/
+struct analog_filter {
+  byte oversampling;
+  byte filter;
+  byte strength;
+  byte count;        // samples in the moving average window, 0 = the filter starts over
+  int32_t state;     // IIR: the output with 8 fractional bits, moving average: the sum of the window
+  uint16_t window[ANALOG_FILTER_WINDOW];
+  byte next;         // where the next sample of the window goes
+};
+
+struct analog_report_policy {
+  uint16_t threshold; // the least change that is reported, 0 = report every sample
+  uint16_t heartbeat; // ms
+  int16_t lastValue;  // the value last reported, -1 = none yet
+  uint16_t lastSent;  // low 16 bits of millis()
+};
+
 void reportAnalogInputCallback(byte analogPin, int value);
 
 class AnalogInputFirmata: public FirmataFeature
@@ -31,11 +94,25 @@ class AnalogInputFirmata: public FirmataFeature
     void handleCapability(byte pin);
     boolean handlePinMode(byte pin, int mode);
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean ownsSysexCommand(byte command) override { return command == ANALOG_MAPPING_QUERY || command == EXTENDED_REPORT_ANALOG || command == ANALOG_CONFIG; }
     void reset();
     void report(bool elapsed) override;
+    void writeConfiguration(Print& out) override;
   private:
+    void reportBatched();
+    void setReportPolicy(byte analogPin, byte policy, uint16_t deadband, uint16_t heartbeat);
+    // whether the value is due according to the policy of the channel; if so, it counts as sent
+    bool takeReport(byte analogPin, int value);
+    void sendAnalog(byte analogPin, int value);
+    bool setFilter(byte analogPin, byte oversampling, byte filter, byte strength);
+    // one oversampled and filtered sample of the channel
+    int sample(byte pin, byte analogPin);
+    byte resolution(byte analogPin);
     /* analog inputs */
     int analogInputsToReport; // bitwise array to store pin reporting (bit0 = A0, bit1 = A1, etc.)
+    bool batchedReporting;
+    analog_report_policy policies[ANALOG_POLICY_CHANNELS];
+    analog_filter filters[ANALOG_POLICY_CHANNELS];
 };
 
 #endif
@@ -23,10 +23,16 @@
 
 AnalogOutputFirmata::AnalogOutputFirmata()
 {
+    for (int i = 0; i < PWM_MAX_PLAYBACKS; i++)
+    {
+        _playbacks[i].pin = 255;
+    }
+    _activePlaybacks = 0;
 }
 
 void AnalogOutputFirmata::reset()
 {
+    stopPlayback(PWM_PLAYBACK_ALL_PINS);
 }
 
 
@@ -38,6 +44,7 @@ void AnalogOutputFirmata::setupPwmPin(byte pin)
 
 boolean AnalogOutputFirmata::handlePinMode(byte pin, int mode)
 {
+    stopPlayback(pin);
     if (mode == PIN_MODE_PWM && IS_PIN_PWM(pin)) {
         setupPwmPin(pin);
         return true;
@@ -58,6 +65,225 @@ void AnalogOutputFirmata::analogWriteInternal(byte pin, uint32_t value)
     analogWrite(pin, (int)value);
 }
 
+// Without a hardware fader the value is interpolated from report(), i.e. once per loop iteration
+void AnalogOutputFirmata::startSegment(pwm_playback& playback, uint32_t to, uint32_t duration)
+{
+    playback.to = to;
+    playback.duration = duration;
+    playback.start = micros();
+    analogWriteInternal(playback.pin, playback.from);
+}
+
+void AnalogOutputFirmata::updateSegment(pwm_playback& playback, uint32_t elapsed)
+{
+    analogWriteInternal(playback.pin, interpolate(playback, elapsed));
+}
+
+void AnalogOutputFirmata::stopSegment(pwm_playback& playback)
+{
+}
+
+uint32_t AnalogOutputFirmata::currentValue(byte pin)
+{
+    pwm_playback* playback = playbackForPin(pin, false);
+    if (playback == nullptr)
+    {
+        return 0;
+    }
+    uint32_t elapsed = micros() - playback->start;
+    return interpolate(*playback, min(elapsed, playback->duration));
+}
 
 #endif /* NOT ESP32 */
 
+#define PWM_MAX_DURATION_MS ((uint32_t)2000000)
+
+/*
+ * Fades and waveforms (PWM_PLAYBACK), shared by all boards. The boards differ in the segment
+ * functions: the ESP32 lets the LEDC hardware fade each segment, other boards interpolate in software.
+ */
+
+void AnalogOutputFirmata::handlePlayback(byte argc, byte* argv)
+{
+    if (argc < 2)
+    {
+        return;
+    }
+    byte subCommand = argv[0];
+    byte pin = argv[1];
+    if (subCommand == PWM_PLAYBACK_STOP)
+    {
+        stopPlayback(pin);
+        return;
+    }
+    if (pin >= TOTAL_PINS || Firmata.getPinMode(pin) != PIN_MODE_PWM)
+    {
+        Firmata.sendString(F("Error: Pin is not set to PWM"));
+        return;
+    }
+
+    if (subCommand == PWM_PLAYBACK_FADE && argc >= 10)
+    {
+        uint32_t target = min(argv[2] | (argv[3] << 7) | ((uint32_t)argv[4] << 14), (uint32_t)0xFFFF);
+        // durations are kept in microseconds, which limits them to about 35 minutes
+        uint32_t duration = min(Firmata.decodePackedUInt32(argv + 5), PWM_MAX_DURATION_MS);
+        uint32_t from = argc >= 13 ? argv[10] | (argv[11] << 7) | ((uint32_t)argv[12] << 14) : currentValue(pin);
+        from = min(from, (uint32_t)0xFFFF);
+        pwm_playback* playback = playbackForPin(pin, true);
+        if (playback == nullptr)
+        {
+            Firmata.sendString(F("Error: Too many PWM playbacks"));
+            return;
+        }
+        stopSegment(*playback);
+        playback->numSamples = 0;
+        playback->from = from;
+        startSegment(*playback, target, duration * 1000);
+    }
+    else if (subCommand == PWM_PLAYBACK_WAVEFORM && argc >= 12)
+    {
+        uint32_t step = min(Firmata.decodePackedUInt32(argv + 2), PWM_MAX_DURATION_MS);
+        uint16_t repeat = argv[7] | (argv[8] << 7);
+        int numSamples = (argc - 9) / 3;
+        if (numSamples > PWM_MAX_WAVEFORM_SAMPLES)
+        {
+            Firmata.sendString(F("Error: Waveform too long"));
+            return;
+        }
+        uint32_t from = currentValue(pin);
+        pwm_playback* playback = playbackForPin(pin, true);
+        if (playback == nullptr)
+        {
+            Firmata.sendString(F("Error: Too many PWM playbacks"));
+            return;
+        }
+        stopSegment(*playback);
+        for (int i = 0; i < numSamples; i++)
+        {
+            byte* sample = argv + 9 + i * 3;
+            playback->samples[i] = min(sample[0] | (sample[1] << 7) | ((uint32_t)sample[2] << 14), (uint32_t)0xFFFF);
+        }
+        playback->numSamples = numSamples;
+        playback->nextSample = 0;
+        playback->repeat = repeat;
+        // move from the current value to the first sample within the first step
+        playback->from = from;
+        startSegment(*playback, playback->samples[0], step * 1000);
+    }
+}
+
+void AnalogOutputFirmata::report(bool elapsed)
+{
+    if (_activePlaybacks == 0)
+    {
+        return;
+    }
+    uint32_t now = micros();
+    for (int i = 0; i < PWM_MAX_PLAYBACKS; i++)
+    {
+        pwm_playback& playback = _playbacks[i];
+        if (playback.pin == 255)
+        {
+            continue;
+        }
+        uint32_t time = now - playback.start;
+        if (time < playback.duration)
+        {
+            updateSegment(playback, time);
+            continue;
+        }
+        updateSegment(playback, playback.duration);
+
+        // segment done, go on to the next sample of a waveform
+        if (playback.numSamples == 0)
+        {
+            finishPlayback(playback);
+            continue;
+        }
+        playback.nextSample++;
+        if (playback.nextSample == playback.numSamples)
+        {
+            if (playback.repeat == 1)
+            {
+                finishPlayback(playback);
+                continue;
+            }
+            if (playback.repeat > 1)
+            {
+                playback.repeat--;
+            }
+            playback.nextSample = 0;
+        }
+        playback.from = playback.to;
+        startSegment(playback, playback.samples[playback.nextSample], playback.duration);
+    }
+}
+
+uint32_t AnalogOutputFirmata::interpolate(pwm_playback& playback, uint32_t elapsed)
+{
+    if (elapsed >= playback.duration)
+    {
+        return playback.to;
+    }
+    // values have at most 16 bits, so with both times below 2^15 the product fits 32 bits
+    uint32_t duration = playback.duration;
+    while (duration >= 0x8000)
+    {
+        duration >>= 1;
+        elapsed >>= 1;
+    }
+    int32_t delta = (int32_t)playback.to - (int32_t)playback.from;
+    return (uint32_t)((int32_t)playback.from + delta * (int32_t)elapsed / (int32_t)duration);
+}
+
+pwm_playback* AnalogOutputFirmata::playbackForPin(byte pin, boolean allocate)
+{
+    pwm_playback* freeSlot = nullptr;
+    for (int i = 0; i < PWM_MAX_PLAYBACKS; i++)
+    {
+        if (_playbacks[i].pin == pin)
+        {
+            return &_playbacks[i];
+        }
+        if (_playbacks[i].pin == 255 && freeSlot == nullptr)
+        {
+            freeSlot = &_playbacks[i];
+        }
+    }
+    if (!allocate || freeSlot == nullptr)
+    {
+        return nullptr;
+    }
+    freeSlot->pin = pin;
+    _activePlaybacks++;
+    return freeSlot;
+}
+
+void AnalogOutputFirmata::stopPlayback(byte pin)
+{
+    if (_activePlaybacks == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < PWM_MAX_PLAYBACKS; i++)
+    {
+        if (_playbacks[i].pin != 255 && (pin == PWM_PLAYBACK_ALL_PINS || _playbacks[i].pin == pin))
+        {
+            stopSegment(_playbacks[i]);
+            _playbacks[i].pin = 255;
+            _activePlaybacks--;
+        }
+    }
+}
+
+void AnalogOutputFirmata::finishPlayback(pwm_playback& playback)
+{
+    Firmata.startSysex();
+    Firmata.write(PWM_PLAYBACK);
+    Firmata.write(PWM_PLAYBACK_DONE);
+    Firmata.write(playback.pin);
+    Firmata.endSysex();
+    playback.pin = 255;
+    _activePlaybacks--;
+}
+
@@ -20,6 +20,42 @@
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
 
+// PWM_PLAYBACK subcommands
+#define PWM_PLAYBACK_FADE       0x00 // pin, target value (3 x 7 bit), duration in ms (packed uint32) [, start value (3 x 7 bit)]
+#define PWM_PLAYBACK_WAVEFORM   0x01 // pin, step duration in ms (packed uint32), repetitions (2 x 7 bit, 0 = forever), values (3 x 7 bit each)
+#define PWM_PLAYBACK_STOP       0x02 // pin, PWM_PLAYBACK_ALL_PINS stops all
+#define PWM_PLAYBACK_DONE       0x03 // board -> host: pin, sent when a fade or waveform has finished
+#define PWM_PLAYBACK_ALL_PINS   127
+
+#ifdef LARGE_MEM_DEVICE
+#define PWM_MAX_PLAYBACKS         8 // pins that can play a fade or waveform at the same time
+#define PWM_MAX_WAVEFORM_SAMPLES 64
+#else
+#define PWM_MAX_PLAYBACKS         2
+#define PWM_MAX_WAVEFORM_SAMPLES 16
+#endif
+
+// A fade is a single segment, a waveform moves linearly from sample to sample
+struct pwm_playback
+{
+  byte pin;               // 255 if the slot is unused
+  byte numSamples;        // 0 for a fade
+  byte nextSample;
+  uint16_t repeat;        // remaining repetitions of the waveform, 0 = forever
+  uint32_t from;          // value at the start of the current segment
+  uint32_t to;            // value at the end of the current segment
+  uint32_t start;         // micros() at the start of the current segment
+  uint32_t duration;      // length of the current segment in microseconds
+  uint16_t samples[PWM_MAX_WAVEFORM_SAMPLES];
+};
+
+#if ESP32
+#define LEDC_BASE_FREQ 5000
+#define MAX_PWM_CHANNELS 16
+// PWM_CONFIG pin number that sets the defaults for pins configured later
+#define PWM_CONFIG_DEFAULT 127
+#endif
+
 class AnalogOutputFirmata: public FirmataFeature
 {
   public:
@@ -28,13 +64,38 @@ class AnalogOutputFirmata: public FirmataFeature
     boolean handlePinMode(byte pin, int mode);
     void reset();
     void analogWriteInternal(byte pin, uint32_t value);
+    void report(bool elapsed) override;
+#if ESP32
+    void writeConfiguration(Print& out) override;
+#endif
   private:
       void setupPwmPin(byte pin);
+      pwm_playback _playbacks[PWM_MAX_PLAYBACKS];
+      byte _activePlaybacks;
+      void handlePlayback(byte argc, byte* argv);
+      pwm_playback* playbackForPin(byte pin, boolean allocate);
+      void stopPlayback(byte pin);
+      void finishPlayback(pwm_playback& playback);
+      void startSegment(pwm_playback& playback, uint32_t to, uint32_t duration);
+      void updateSegment(pwm_playback& playback, uint32_t elapsed);
+      void stopSegment(pwm_playback& playback);
+      uint32_t interpolate(pwm_playback& playback, uint32_t elapsed);
+      uint32_t currentValue(byte pin);
 #if ESP32
       int getChannelForPin(byte pin);
+      byte allocateChannel(uint32_t frequency, byte resolution);
+      boolean attachChannel(byte pin, byte channel, uint32_t frequency, byte resolution);
+      void configurePwm(byte pin, uint32_t frequency, byte resolution);
       void internalReset();
-      // This gives the active pin for each pwm channel. -1 if unused
-      byte _pwmChannelMap[16];
+      void writePwmConfig(Print& out, byte pin, uint32_t frequency, byte resolution);
+      // This gives the active pin for each pwm channel. 255 if unused
+      byte _pwmChannelMap[MAX_PWM_CHANNELS];
+      // The channel of each pin, 255 if none
+      byte _pinToChannel[TOTAL_PINS];
+      uint32_t _channelFrequency[MAX_PWM_CHANNELS];
+      byte _channelResolution[MAX_PWM_CHANNELS];
+      uint32_t _defaultFrequency;
+      byte _defaultResolution;
 #endif
 	boolean handleSysex(byte command, byte argc, byte* argv)
 	{
@@ -47,16 +108,41 @@ class AnalogOutputFirmata: public FirmataFeature
 				if (argc > 2) val |= (argv[2] << 7);
 				if (argc > 3) val |= (argv[3] << 14);
 				byte mode = Firmata.getPinMode(pin);
-				if (mode == PIN_MODE_ANALOG || mode == PIN_MODE_PWM)
+				if (mode != PIN_MODE_ANALOG && mode != PIN_MODE_PWM)
 				{
-					analogWriteInternal(argv[0], val);
+					// e.g. a servo, for another feature
+					return false;
 				}
+				// a value from the host ends any fade on the pin
+				stopPlayback(pin);
+				analogWriteInternal(argv[0], val);
 				return true;
 			}
 		}
+		if (command == PWM_PLAYBACK)
+		{
+			handlePlayback(argc, argv);
+			return true;
+		}
+#if ESP32
+		// PWM_CONFIG, pin (or PWM_CONFIG_DEFAULT), frequency in Hz (packed uint32), resolution in bits
+		if (command == PWM_CONFIG && argc >= 7)
+		{
+			configurePwm(argv[0], Firmata.decodePackedUInt32(argv + 1), argv[6]);
+			return true;
+		}
+#endif
 
 	  return false;
 	}
+	boolean ownsSysexCommand(byte command) override
+	{
+#if ESP32
+		return command == EXTENDED_ANALOG || command == PWM_PLAYBACK || command == PWM_CONFIG;
+#else
+		return command == EXTENDED_ANALOG || command == PWM_PLAYBACK;
+#endif
+	}
 };
 
 #endif
@@ -19,10 +19,13 @@
 #include <ConfigurableFirmata.h>
 #include "AnalogOutputFirmata.h"
 #ifdef ESP32
+#include "driver/ledc.h"
+#if __has_include("esp_idf_version.h")
+#include "esp_idf_version.h"
+#endif
 
-#define LEDC_BASE_FREQ 5000
-#define MAX_PWM_CHANNELS 16
-
+// Each pair of channels (2n, 2n+1) shares a timer, so both always run at the same frequency and resolution
+#define PWM_MAX_RESOLUTION 16
 
 AnalogOutputFirmata::AnalogOutputFirmata()
 {
@@ -30,76 +33,193 @@ AnalogOutputFirmata::AnalogOutputFirmata()
     {
         _pwmChannelMap[i] = 255;
     }
+    for (int i = 0; i < TOTAL_PINS; i++)
+    {
+        _pinToChannel[i] = 255;
+    }
+    _defaultFrequency = LEDC_BASE_FREQ;
+    _defaultResolution = DEFAULT_PWM_RESOLUTION;
+    for (int i = 0; i < PWM_MAX_PLAYBACKS; i++)
+    {
+        _playbacks[i].pin = 255;
+    }
+    _activePlaybacks = 0;
 }
 
 void AnalogOutputFirmata::reset()
 {
+    stopPlayback(PWM_PLAYBACK_ALL_PINS);
     internalReset();
+    _defaultFrequency = LEDC_BASE_FREQ;
+    _defaultResolution = DEFAULT_PWM_RESOLUTION;
 }
 
 
 void AnalogOutputFirmata::analogWriteInternal(uint8_t pin, uint32_t value) {
-    // calculate duty, 8191 from 2 ^ 13 - 1
-    uint32_t valueMax = (1 << DEFAULT_PWM_RESOLUTION) - 1;
-    uint32_t duty = min(value, valueMax);
-    // write duty to matching channel number
-    int channel = getChannelForPin(pin);
+    int channel = pin < TOTAL_PINS ? _pinToChannel[pin] : 255;
     if (channel != 255)
     {
-        ledcWrite(channel, duty);
-        // Firmata.sendStringf(F("Channel %d has duty %d/%d"),  channel, duty, valueMax);
+        uint32_t valueMax = (1 << _channelResolution[channel]) - 1;
+        ledcWrite(channel, min(value, valueMax));
     }
     else
 	{
-		Firmata.sendStringf(F("Error: Pin %d is not set to PWM"), pin);
+		Firmata.sendString(F("Error: Pin is not set to PWM"));
 	}
 }
 
 int AnalogOutputFirmata::getChannelForPin(byte pin)
 {
-    for (int i = 0; i < MAX_PWM_CHANNELS; i++)
+    return pin < TOTAL_PINS ? _pinToChannel[pin] : 255;
+}
+
+/*
+ * Find a free channel for the given settings. A channel whose partner already runs at the same
+ * settings is preferred, otherwise one with an unused partner is taken, so that the timer can be set up freely.
+ */
+byte AnalogOutputFirmata::allocateChannel(uint32_t frequency, byte resolution)
+{
+    for (int pass = 0; pass < 2; pass++)
     {
-        if (_pwmChannelMap[i] == pin)
+        for (int i = 0; i < MAX_PWM_CHANNELS; i++)
         {
-            return i;
+            if (_pwmChannelMap[i] != 255)
+            {
+                continue;
+            }
+            int partner = i ^ 1;
+            if (pass == 0 && _pwmChannelMap[partner] != 255 &&
+                _channelFrequency[partner] == frequency && _channelResolution[partner] == resolution)
+            {
+                return i;
+            }
+            if (pass == 1 && _pwmChannelMap[partner] == 255)
+            {
+                return i;
+            }
         }
     }
-
     return 255;
 }
 
+boolean AnalogOutputFirmata::attachChannel(byte pin, byte channel, uint32_t frequency, byte resolution)
+{
+    if (ledcSetup(channel, frequency, resolution) == 0)
+    {
+        return false;
+    }
+    _pwmChannelMap[channel] = pin;
+    _pinToChannel[pin] = channel;
+    _channelFrequency[channel] = frequency;
+    _channelResolution[channel] = resolution;
+    ledcAttachPin(pin, channel);
+    ledcWrite(channel, 0);
+    return true;
+}
+
 void AnalogOutputFirmata::setupPwmPin(byte pin) {
-  // Setup timer and attach timer to a led pin
+    if (pin >= TOTAL_PINS)
+    {
+        return;
+    }
+    int channel = _pinToChannel[pin];
+    if (channel != 255) // pin already assigned to a channel?
+    {
+        Firmata.sendStringf(F("Warning: Pin %d already assigned to channel %d"), pin, channel);
+        ledcWrite(channel, 0);
+        return;
+    }
+
+    channel = allocateChannel(_defaultFrequency, _defaultResolution);
+    if (channel == 255)
+    {
+        Firmata.sendStringf(F("Unable to setup pin %d for PWM - no more channels."), pin);
+        return;
+    }
+
+    pinMode(pin, OUTPUT);
+    if (!attachChannel(pin, channel, _defaultFrequency, _defaultResolution))
+    {
+        Firmata.sendStringf(F("Unable to setup pin %d for PWM - invalid frequency or resolution."), pin);
+    }
+}
+
+/*
+ * Set the frequency and resolution of a PWM pin, or the defaults for pins configured later. If the
+ * channel shares its timer with another pin that uses different settings, the pin moves to another channel.
+ */
+void AnalogOutputFirmata::configurePwm(byte pin, uint32_t frequency, byte resolution)
+{
+    if (frequency == 0 || resolution == 0 || resolution > PWM_MAX_RESOLUTION)
+    {
+        Firmata.sendString(F("Error: Invalid PWM frequency or resolution"));
+        return;
+    }
+    if (pin == PWM_CONFIG_DEFAULT)
+    {
+        _defaultFrequency = frequency;
+        _defaultResolution = resolution;
+        return;
+    }
+    stopPlayback(pin);
     int channel = getChannelForPin(pin);
-    if (channel == 255) // pin already assigned to a channel?
+    if (channel == 255)
+    {
+        Firmata.sendString(F("Error: Pin is not set to PWM"));
+        return;
+    }
+
+    int partner = channel ^ 1;
+    // Move the pin if its partner runs at different settings
+    if (_pwmChannelMap[partner] != 255 &&
+        (_channelFrequency[partner] != frequency || _channelResolution[partner] != resolution))
     {
-        int i;
-        for (i = 0; i < MAX_PWM_CHANNELS; i++)
+        byte newChannel = allocateChannel(frequency, resolution);
+        if (newChannel == 255)
         {
-            if (_pwmChannelMap[i] == 255)
-            {
-                channel = i;
-                break;
-            }
+            Firmata.sendString(F("Error: No PWM timer free for these settings"));
+            return;
         }
+        ledcDetachPin(pin);
+        _pwmChannelMap[channel] = 255;
+        _pinToChannel[pin] = 255;
+        channel = newChannel;
+    }
 
-        if (i >= MAX_PWM_CHANNELS)
+    if (!attachChannel(pin, channel, frequency, resolution))
+    {
+        Firmata.sendString(F("Error: Invalid PWM frequency or resolution"));
+        // fall back to the default settings if the pin was moved
+        if (_pwmChannelMap[channel] == 255)
         {
-            Firmata.sendStringf(F("Unable to setup pin %d for PWM - no more channels."), pin);
-            return;
+            setupPwmPin(pin);
+        }
+    }
+}
+
+// The pin modes are restored first, so the pins start out at the original defaults
+void AnalogOutputFirmata::writeConfiguration(Print& out)
+{
+    for (int i = 0; i < MAX_PWM_CHANNELS; i++)
+    {
+        if (_pwmChannelMap[i] != 255 &&
+            (_channelFrequency[i] != LEDC_BASE_FREQ || _channelResolution[i] != DEFAULT_PWM_RESOLUTION))
+        {
+            writePwmConfig(out, _pwmChannelMap[i], _channelFrequency[i], _channelResolution[i]);
         }
-        
-		// Firmata.sendStringf(F("Assigning channel %d to pin %d"), channel, pin);
-        _pwmChannelMap[channel] = pin;
-        pinMode(pin, OUTPUT);
-        ledcSetup(channel, LEDC_BASE_FREQ, DEFAULT_PWM_RESOLUTION);
-        ledcAttachPin(pin, channel);
-        ledcWrite(pin, 0);
-		return;
     }
-	
-	Firmata.sendStringf(F("Warning: Pin %d already assigned to channel %d"), pin, channel);
-	ledcWrite(pin, 0);
+    if (_defaultFrequency != LEDC_BASE_FREQ || _defaultResolution != DEFAULT_PWM_RESOLUTION)
+    {
+        writePwmConfig(out, PWM_CONFIG_DEFAULT, _defaultFrequency, _defaultResolution);
+    }
+}
+
+void AnalogOutputFirmata::writePwmConfig(Print& out, byte pin, uint32_t frequency, byte resolution)
+{
+    const byte config[] = { START_SYSEX, PWM_CONFIG, pin,
+        (byte)(frequency & 0x7F), (byte)((frequency >> 7) & 0x7F), (byte)((frequency >> 14) & 0x7F),
+        (byte)((frequency >> 21) & 0x7F), (byte)((frequency >> 28) & 0x7F), resolution, END_SYSEX };
+    out.write(config, sizeof(config));
 }
 
 void AnalogOutputFirmata::internalReset()
@@ -109,6 +229,7 @@ void AnalogOutputFirmata::internalReset()
         if (_pwmChannelMap[i] != 255)
         {
             ledcDetachPin(_pwmChannelMap[i]);
+            _pinToChannel[_pwmChannelMap[i]] = 255;
         }
         _pwmChannelMap[i] = 255;
     }
@@ -116,6 +237,7 @@ void AnalogOutputFirmata::internalReset()
 
 boolean AnalogOutputFirmata::handlePinMode(byte pin, int mode)
 {
+    stopPlayback(pin);
     if (mode == PIN_MODE_PWM && IS_PIN_PWM(pin)) {
         setupPwmPin(pin);
         return true;
@@ -127,10 +249,62 @@ boolean AnalogOutputFirmata::handlePinMode(byte pin, int mode)
         // Firmata.sendStringf(F("Detaching pin %d"), pin);
         ledcDetachPin(pin);
         _pwmChannelMap[channel] = 255;
+        _pinToChannel[pin] = 255;
     }
     return false;
 }
 
+// The LEDC hardware fades each segment, report() only moves on to the next one
+void AnalogOutputFirmata::startSegment(pwm_playback& playback, uint32_t to, uint32_t duration)
+{
+    static bool fadeInstalled = false;
+    playback.to = to;
+    playback.duration = duration;
+    playback.start = micros();
+    int channel = getChannelForPin(playback.pin);
+    if (channel == 255)
+    {
+        return;
+    }
+    uint32_t valueMax = (1 << _channelResolution[channel]) - 1;
+    ledcWrite(channel, min(playback.from, valueMax));
+    if (duration < 1000)
+    {
+        ledcWrite(channel, min(to, valueMax));
+        return;
+    }
+    if (!fadeInstalled)
+    {
+        ledc_fade_func_install(0);
+        fadeInstalled = true;
+    }
+    ledc_mode_t mode = (ledc_mode_t)(channel / 8);
+    ledc_channel_t ledcChannel = (ledc_channel_t)(channel % 8);
+    ledc_set_fade_with_time(mode, ledcChannel, min(to, valueMax), duration / 1000);
+    ledc_fade_start(mode, ledcChannel, LEDC_FADE_NO_WAIT);
+}
+
+void AnalogOutputFirmata::updateSegment(pwm_playback& playback, uint32_t elapsed)
+{
+}
+
+void AnalogOutputFirmata::stopSegment(pwm_playback& playback)
+{
+#if defined(ESP_IDF_VERSION) && ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 4, 0)
+    int channel = getChannelForPin(playback.pin);
+    if (channel != 255)
+    {
+        ledc_fade_stop((ledc_mode_t)(channel / 8), (ledc_channel_t)(channel % 8));
+    }
+#endif
+}
+
+uint32_t AnalogOutputFirmata::currentValue(byte pin)
+{
+    int channel = getChannelForPin(pin);
+    return channel != 255 ? ledcRead(channel) : 0;
+}
+
 void AnalogOutputFirmata::handleCapability(byte pin)
 {
   if (IS_PIN_PWM(pin)) {
@@ -24,6 +24,11 @@ extern "C" {
 #include <stdlib.h>
 }
 
+// sysexStreamState: whether the current sysex message is streamed to currentSysexStreamCallback
+#define STREAM_UNDECIDED 0 // not longer than a chunk so far
+#define STREAM_ACTIVE    1
+#define STREAM_REFUSED   2 // buffered as usual, discarded if it overflows
+
 //******************************************************************************
 //* Support Functions
 //******************************************************************************
@@ -34,8 +39,8 @@ extern "C" {
  */
 void FirmataClass::sendValueAsTwo7bitBytes(int value)
 {
-  FirmataStream->write(value & B01111111); // LSB
-  FirmataStream->write(value >> 7 & B01111111); // MSB
+  write(value & B01111111); // LSB
+  write(value >> 7 & B01111111); // MSB
 }
 
 /**
@@ -43,7 +48,7 @@ void FirmataClass::sendValueAsTwo7bitBytes(int value)
  */
 void FirmataClass::startSysex(void)
 {
-  FirmataStream->write(START_SYSEX);
+  write(START_SYSEX);
 }
 
 /**
@@ -51,8 +56,8 @@ void FirmataClass::startSysex(void)
  */
 void FirmataClass::endSysex(void)
 {
-  FirmataStream->write(END_SYSEX);
-  FirmataStream->flush();
+  write(END_SYSEX);
+  flush();
 }
 
 //******************************************************************************
@@ -69,6 +74,27 @@ FirmataClass::FirmataClass()
   firmwareVersionMajor = 0;
   firmwareVersionName = "";
   blinkVersionDisabled = false;
+  txBufferPos = 0;
+  streamWritten = false;
+  captureBuffer = nullptr;
+  bytesWritten = 0;
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+  outputQueued = false;
+  lane = FIRMATA_LANE_CONTROL;
+  laneDepth = 0;
+  controlRing = { controlData, sizeof(controlData), 0, 0 };
+  eventRing = { eventData, sizeof(eventData), 0, 0 };
+  activeRing = nullptr;
+  for (byte i = 0; i < FIRMATA_TELEMETRY_SLOTS; i++)
+  {
+    telemetrySlots[i].length = 0;
+  }
+  telemetrySequence = 0;
+  messagesDropped = 0;
+#endif
+  bytesRead = 0;
+  sysexMessagesParsed = 0;
+  messagesDiscarded = 0;
   systemReset();
 }
 
@@ -124,9 +150,10 @@ void FirmataClass::begin(Stream& s, bool isConsole)
  */
 void FirmataClass::printVersion(void)
 {
-  FirmataStream->write(REPORT_VERSION);
-  FirmataStream->write(FIRMATA_PROTOCOL_MAJOR_VERSION);
-  FirmataStream->write(FIRMATA_PROTOCOL_MINOR_VERSION);
+  write(REPORT_VERSION);
+  write(FIRMATA_PROTOCOL_MAJOR_VERSION);
+  write(FIRMATA_PROTOCOL_MINOR_VERSION);
+  flush();
 }
 
 /**
@@ -168,9 +195,9 @@ void FirmataClass::printFirmwareVersion(void)
 {
     if (firmwareVersionMajor != 0 && FirmataStream != nullptr) { // make sure that the name has been set before reporting
         startSysex();
-        FirmataStream->write(REPORT_FIRMWARE);
-        FirmataStream->write(firmwareVersionMajor); // major version number
-        FirmataStream->write(firmwareVersionMinor); // minor version number
+        write(REPORT_FIRMWARE);
+        write(firmwareVersionMajor); // major version number
+        write(firmwareVersionMinor); // minor version number
         size_t len = strlen(firmwareVersionName);
         for (size_t i = 0; i < len; ++i)
         {
@@ -244,6 +271,15 @@ void FirmataClass::processSysexMessage(void)
         (*currentStringCallback)((char *)&storedInputData[0]);
       }
       break;
+    case EVENT_REPORT:
+      // EVENT_CONFIG, 1 = numeric events / 0 = text [, rate limiting window in ms]
+      if (sysexBytesRead >= 3 && storedInputData[1] == EVENT_CONFIG) {
+        numericEvents = storedInputData[2] != 0;
+        if (sysexBytesRead >= 5) {
+          eventWindow = decodePackedUInt14(storedInputData + 3);
+        }
+      }
+      break;
     default:
       if (currentSysexCallback)
         (*currentSysexCallback)(storedInputData[0], sysexBytesRead - 1, storedInputData + 1);
@@ -252,45 +288,115 @@ void FirmataClass::processSysexMessage(void)
 
 
 /**
- * Read a single int from the input stream. If the value is not = -1, pass it on to parse(byte)
+ * Read the available input in blocks and pass it on to the parser.
  */
 void FirmataClass::processInput(void)
 {
 #ifdef LARGE_MEM_DEVICE
-    int readCachePos = 0;
-    const int writeCachePos = FirmataStream->readBytes(readCache, LARGE_MEM_RCV_BUF_SIZE);
-    
-    while (parsingSysex && writeCachePos > readCachePos + 4)
-    {
-        uint32_t nextWord = *(uint32_t*)(readCache + readCachePos);
-        // Any special character in the current word?
-        if (nextWord & 0x80808080)
+    const int length = FirmataStream->readBytes(readCache, RCV_BUF_SIZE);
+    if (length > 0)
+    {
+        bytesRead += length;
+    }
+    parseBlock(readCache, length);
+#else
+    // Only request as much as is available, so readBytes() doesn't wait for a timeout
+    int budget = MAX_RCV_BYTES_PER_CALL;
+    while (budget > 0)
+    {
+        int length = FirmataStream->available();
+        if (length <= 0)
+        {
+            break;
+        }
+        if (length > RCV_BUF_SIZE)
+        {
+            length = RCV_BUF_SIZE;
+        }
+        length = FirmataStream->readBytes(readCache, length);
+        if (length <= 0)
         {
-            break; // And don't increment (we read the bytes again)
+            break;
         }
-        readCachePos += 4;
-        *(uint32_t*)(storedInputData + sysexBytesRead) = nextWord;
-        sysexBytesRead += 4;
+        bytesRead += length;
+        parseBlock(readCache, length);
+        budget -= length;
     }
+#endif
+}
 
-    while (writeCachePos > readCachePos)
+/**
+ * Parse a block of input data. Within sysex messages, data bytes are copied 4 at a time
+ * as long as none of them has the high bit set.
+ */
+void FirmataClass::parseBlock(const byte* data, int length)
+{
+    int pos = 0;
+    while (pos < length)
     {
-        const byte inputData = readCache[readCachePos];
-        readCachePos++;
-        parse(inputData);
+        if (parsingSysex)
+        {
+            // stay below MAX_DATA_BYTES, parse() handles an overflowing message and the chunks of a stream
+            int limit = sysexStreamState == STREAM_REFUSED ? MAX_DATA_BYTES - 1 : SYSEX_STREAM_CHUNK_SIZE + 1;
+            while (length - pos >= 4 && sysexBytesRead + 4 <= limit)
+            {
+                uint32_t nextWord;
+                memcpy(&nextWord, data + pos, 4); // the compiler turns this into a single load where alignment permits
+                // Any special character in the current word?
+                if (nextWord & 0x80808080)
+                {
+                    break; // And don't increment (we parse these bytes one by one)
+                }
+                memcpy(storedInputData + sysexBytesRead, &nextWord, 4);
+                pos += 4;
+                sysexBytesRead += 4;
+            }
+            if (pos >= length)
+            {
+                break;
+            }
+        }
+        parse(data[pos]);
+        pos++;
     }
+}
 
-#else
-    int inputData = FirmataStream->read();
-    if (inputData != -1)
-    {
-        parse(inputData);
+/**
+ * Hand the data bytes collected so far to the stream callback, starting the stream with the
+ * first chunk if the callback accepts the message.
+ */
+void FirmataClass::streamSysexChunk()
+{
+  if (sysexStreamState == STREAM_UNDECIDED) {
+    // the first chunk is passed along, so that the callback can look at the header of the message
+    if (!(*currentSysexStreamCallback)(storedInputData[0], SYSEX_STREAM_BEGIN, sysexBytesRead - 1, storedInputData + 1)) {
+      sysexStreamState = STREAM_REFUSED;
+      return;
     }
-#endif
+    sysexStreamState = STREAM_ACTIVE;
+  }
+  (*currentSysexStreamCallback)(storedInputData[0], SYSEX_STREAM_DATA, sysexBytesRead - 1, storedInputData + 1);
+  sysexBytesRead = 1; // keep the command
+}
+
+/**
+ * Finish a streamed sysex message with the remaining data bytes (if complete) and the given phase.
+ */
+void FirmataClass::endSysexStream(byte phase)
+{
+  if (phase == SYSEX_STREAM_END && sysexBytesRead > 1) {
+    (*currentSysexStreamCallback)(storedInputData[0], SYSEX_STREAM_DATA, sysexBytesRead - 1, storedInputData + 1);
+  }
+  (*currentSysexStreamCallback)(storedInputData[0], phase, 0, storedInputData + 1);
+  sysexStreamState = STREAM_UNDECIDED;
 }
 
 void FirmataClass::resetParser()
 {
+    if (parsingSysex && sysexStreamState == STREAM_ACTIVE)
+    {
+        endSysexStream(SYSEX_STREAM_ABORT);
+    }
     parsingSysex = false;
     sysexBytesRead = 0;
     waitForData = 0;
@@ -312,9 +418,7 @@ void FirmataClass::parse(byte inputData)
   if (inputData == SYSTEM_RESET)
   {
       // A system reset shall always be done, regardless of the state of the parser.
-      parsingSysex = false;
-      sysexBytesRead = 0;
-      waitForData = 0;
+      resetParser();
       systemReset();
       return;
   }
@@ -322,15 +426,24 @@ void FirmataClass::parse(byte inputData)
     if (inputData == END_SYSEX) {
 		//stop sysex byte
       parsingSysex = false;
+      sysexMessagesParsed++;
       //fire off handler function
-      processSysexMessage();
+      if (sysexStreamState == STREAM_ACTIVE) {
+        endSysexStream(SYSEX_STREAM_END);
+      } else {
+        processSysexMessage();
+      }
     } else {
+      if (sysexBytesRead == SYSEX_STREAM_CHUNK_SIZE + 1 && sysexStreamState != STREAM_REFUSED) {
+        streamSysexChunk();
+      }
       //normal data byte - add to buffer
       storedInputData[sysexBytesRead] = inputData;
       sysexBytesRead++;
 	  if (sysexBytesRead == MAX_DATA_BYTES)
 	  {
-		  Firmata.sendString(F("Discarding input message, out of buffer"));
+		  messagesDiscarded++;
+		  Firmata.sendEvent(EVENT_INPUT_OVERFLOW, F("Discarding input message, out of buffer"));
 		  parsingSysex = false;
 		  sysexBytesRead = 0;
         waitForData = 0;
@@ -405,6 +518,7 @@ void FirmataClass::parse(byte inputData)
       case START_SYSEX:
         parsingSysex = true;
         sysexBytesRead = 0;
+        sysexStreamState = currentSysexStreamCallback ? STREAM_UNDECIDED : STREAM_REFUSED;
         break;
       case SYSTEM_RESET:
         systemReset();
@@ -449,14 +563,14 @@ void FirmataClass::sendAnalog(byte analogPin, int value)
     if (analogPin <= 15)
     {
         // pin can only be 0-15, so chop higher bits
-        FirmataStream->write(ANALOG_MESSAGE | (analogPin & 0xF));
+        write(ANALOG_MESSAGE | (analogPin & 0xF));
         sendValueAsTwo7bitBytes(value);
     }
     else
     {
         startSysex();
-        FirmataStream->write(EXTENDED_ANALOG);
-        FirmataStream->write(analogPin);
+        write(EXTENDED_ANALOG);
+        write(analogPin);
         sendValueAsTwo7bitBytes(value);
         endSysex();
     }
@@ -504,7 +618,7 @@ void FirmataClass::sendDigitalPort(byte portNumber, int portData)
     msg[0] = (DIGITAL_MESSAGE | (portNumber & 0xF));
     msg[1] = ((byte)portData % 128); // Tx bits 0-6
     msg[2] = (portData >> 7);  // Tx bits 7-13
-    FirmataStream->write(msg, 3);
+    write(msg, 3);
 }
 
 /**
@@ -518,7 +632,7 @@ void FirmataClass::sendSysex(byte command, byte bytec, byte *bytev)
 {
   byte i;
   startSysex();
-  FirmataStream->write(command);
+  write(command);
   for (i = 0; i < bytec; i++) {
     sendValueAsTwo7bitBytes(bytev[i]);
   }
@@ -539,51 +653,92 @@ void FirmataClass::sendString(byte command, const char *string)
   sendSysex(command, (byte)strlen(string), (byte *)string);
 }
 
+#ifndef FIRMATA_NO_STRINGS
 /**
- * Send a string to the Firmata host application.
- * @param flashString A pointer to the char string
+ * Send a formatted string to the Firmata host application. The format is read from flash and
+ * the output is encoded directly into the outgoing message, without buffers or heap allocations.
+ * Supported are %d, %i, %u, %x, %X (with an optional l prefix, zero padding and width), %c, %s and %%.
+ * @param flashString A pointer to the format string in flash memory
  */
-void FirmataClass::sendStringf(const FlashString* flashString, ...) 
+void FirmataClass::sendStringf(const FlashString* flashString, ...)
 {
-	// The parameter "sizeOfArgs" is currently unused.
-	// 16 bit board?
-#ifdef ARDUINO_ARCH_AVR
-    const int maxSize = 32;
-#else
-    const int maxSize = 255;
-#endif
-	int len = strlen_P((const char*)flashString);
-    if (len >= maxSize)
+  va_list va;
+  va_start(va, flashString);
+  beginMessage(FIRMATA_LANE_EVENT);
+  startSysex();
+  write(STRING_DATA);
+  const char* format = (const char*)flashString;
+  char c;
+  while ((c = pgm_read_byte(format++)) != 0)
+  {
+    if (c != '%')
     {
-        return;
+      writeStringChar(c);
+      continue;
     }
-	va_list va;
-    va_start (va, flashString);
-	char bytesInput[maxSize];
-	char bytesOutput[maxSize];
-	startSysex();
-	FirmataStream->write(STRING_DATA);
-	for (int i = 0; i < len; i++) 
-	{
-		bytesInput[i] = (pgm_read_byte(((const char*)flashString) + i));
-    }
-	bytesInput[len] = 0;
-	memset(bytesOutput, 0, sizeof(char) * maxSize);
-	
-	vsnprintf(bytesOutput, maxSize, bytesInput, va);
-    if (!outputIsConsole)
+    char pad = ' ';
+    byte width = 0;
+    boolean isLong = false;
+    c = pgm_read_byte(format++);
+    if (c == '0')
     {
-        Serial.println(bytesOutput);
+      pad = '0';
+      c = pgm_read_byte(format++);
     }
-
-	len = strlen(bytesOutput);
-	for (int i = 0; i < len; i++) 
-	{
-		sendValueAsTwo7bitBytes(bytesOutput[i]);
+    while (c >= '0' && c <= '9')
+    {
+      width = width * 10 + (c - '0');
+      c = pgm_read_byte(format++);
+    }
+    while (c == 'l')
+    {
+      isLong = true;
+      c = pgm_read_byte(format++);
+    }
+    switch (c)
+    {
+      case 'd':
+      case 'i':
+      {
+        long value = isLong ? va_arg(va, long) : va_arg(va, int);
+        writeStringNumber(value < 0 ? 0UL - (unsigned long)value : (unsigned long)value, 10, value < 0, width, pad, false);
+        break;
+      }
+      case 'u':
+        writeStringNumber(isLong ? va_arg(va, unsigned long) : va_arg(va, unsigned int), 10, false, width, pad, false);
+        break;
+      case 'x':
+      case 'X':
+        writeStringNumber(isLong ? va_arg(va, unsigned long) : va_arg(va, unsigned int), 16, false, width, pad, c == 'X');
+        break;
+      case 'c':
+        writeStringChar((char)va_arg(va, int));
+        break;
+      case 's':
+      {
+        const char* string = va_arg(va, const char*);
+        while (string != nullptr && *string != 0)
+        {
+          writeStringChar(*string++);
+        }
+        break;
+      }
+      case 0:
+        format--; // format ends after the %
+        break;
+      default:
+        writeStringChar('%');
+        writeStringChar(c);
+        break;
     }
-	
-	endSysex();
-    va_end (va);
+  }
+  endSysex();
+  endMessage();
+  if (!outputIsConsole)
+  {
+    Serial.println();
+  }
+  va_end(va);
 }
 
 /**
@@ -592,18 +747,16 @@ void FirmataClass::sendStringf(const FlashString* flashString, ...)
  */
 void FirmataClass::sendString(const FlashString* flashString)
 {
-    int len = strlen_P((const char*)flashString);
-    if (!outputIsConsole)
-    {
-        Serial.println(flashString);
-    }
+    beginMessage(FIRMATA_LANE_EVENT);
     startSysex();
-    FirmataStream->write(STRING_DATA);
-    for (int i = 0; i < len; i++) 
+    write(STRING_DATA);
+    writeStringText(flashString);
+    endSysex();
+    endMessage();
+    if (!outputIsConsole)
     {
-        sendValueAsTwo7bitBytes(pgm_read_byte(((const char*)flashString) + i));
+        Serial.println();
     }
-    endSysex();
 }
 
 /**
@@ -613,41 +766,392 @@ void FirmataClass::sendString(const FlashString* flashString)
  */
 void FirmataClass::sendString(const FlashString* flashString, uint32_t errorData)
 {
-    int len = strlen_P((const char*)flashString);
+#ifdef SIM
+    // no console echo of the error messages in the simulator
+    boolean isConsole = outputIsConsole;
+    outputIsConsole = true;
+#endif
+    beginMessage(FIRMATA_LANE_EVENT);
+    startSysex();
+    write(STRING_DATA);
+    writeStringText(flashString);
+    writeStringNumber(errorData, 16, false, 0, ' ', false);
+    endSysex();
+    endMessage();
 #ifndef SIM
     if (!outputIsConsole)
     {
-        Serial.print(flashString);
-        Serial.println(errorData);
+        Serial.println();
     }
+#else
+    outputIsConsole = isConsole;
 #endif
-    startSysex();
-    FirmataStream->write(STRING_DATA);
-    for (int i = 0; i < len; i++) {
-        sendValueAsTwo7bitBytes(pgm_read_byte(((const char*)flashString) + i));
+}
+
+/**
+ * Write a constant string from flash memory into a STRING_DATA message.
+ */
+void FirmataClass::writeStringText(const FlashString* flashString)
+{
+  const char* string = (const char*)flashString;
+  char c;
+  while ((c = pgm_read_byte(string++)) != 0)
+  {
+    writeStringChar(c);
+  }
+}
+
+/**
+ * Write one character of a STRING_DATA message, and echo it to the console if that is separate.
+ */
+void FirmataClass::writeStringChar(char c)
+{
+  sendValueAsTwo7bitBytes((byte)c);
+  if (!outputIsConsole)
+  {
+    Serial.write(c);
+  }
+}
+
+/**
+ * Write a number as text into a STRING_DATA message.
+ */
+void FirmataClass::writeStringNumber(unsigned long value, byte base, boolean negative, byte width, char pad, boolean upperCase)
+{
+  char digits[11]; // enough for 32 bits in base 10 or 16
+  byte count = 0;
+  do
+  {
+    byte digit = value % base;
+    digits[count++] = digit < 10 ? '0' + digit : (upperCase ? 'A' : 'a') + digit - 10;
+    value /= base;
+  } while (value != 0 && count < sizeof(digits));
+  byte length = count + (negative ? 1 : 0);
+  if (negative && pad == '0')
+  {
+    writeStringChar('-');
+  }
+  for (; length < width; width--)
+  {
+    writeStringChar(pad);
+  }
+  if (negative && pad != '0')
+  {
+    writeStringChar('-');
+  }
+  while (count > 0)
+  {
+    writeStringChar(digits[--count]);
+  }
+}
+#endif
+
+void FirmataClass::sendEvent(uint16_t id, const FlashString* text)
+{
+  sendEvent(id, text, 0, nullptr);
+}
+
+void FirmataClass::sendEvent(uint16_t id, const FlashString* text, uint32_t arg)
+{
+  sendEvent(id, text, 1, &arg);
+}
+
+void FirmataClass::sendEvent(uint16_t id, const FlashString* text, uint32_t arg1, uint32_t arg2)
+{
+  uint32_t argv[2] = { arg1, arg2 };
+  sendEvent(id, text, 2, argv);
+}
+
+/**
+ * Send a diagnostic event. The first occurrence is sent right away, further occurrences within
+ * the rate limiting window are only counted and reported by a single message once it is over.
+ * @param id The event id (see FirmataEvents.h)
+ * @param text The text for hosts that did not enable numeric events, the arguments are appended in decimal
+ * @param argc The number of arguments, at most FIRMATA_EVENT_MAX_ARGS
+ * @param argv The arguments
+ */
+void FirmataClass::sendEvent(uint16_t id, const FlashString* text, byte argc, const uint32_t* argv)
+{
+  if (argc > FIRMATA_EVENT_MAX_ARGS)
+  {
+    argc = FIRMATA_EVENT_MAX_ARGS;
+  }
+  unsigned long now = millis();
+  firmata_event_slot* slot = eventSlots;
+  byte i = 0;
+  while (i < FIRMATA_EVENT_SLOTS && eventSlots[i].id != id)
+  {
+    i++;
+  }
+  if (i < FIRMATA_EVENT_SLOTS)
+  {
+    slot = &eventSlots[i];
+    if (now - slot->windowStart < eventWindow)
+    {
+      if (slot->repeats < 0x3FFF)
+      {
+        slot->repeats++;
+      }
+      slot->argc = argc;
+      for (i = 0; i < argc; i++)
+      {
+        slot->argv[i] = argv[i];
+      }
+      eventsPending = true;
+      return;
     }
-    String error = String(errorData, HEX);
-    for (unsigned int i = 0; i < error.length(); i++) {
-        sendValueAsTwo7bitBytes((byte)error.charAt(i));
+  }
+  else
+  {
+    // take a free slot, otherwise the one whose window started first
+    for (i = 1; i < FIRMATA_EVENT_SLOTS && slot->id != 0; i++)
+    {
+      if (eventSlots[i].id == 0 || now - eventSlots[i].windowStart > now - slot->windowStart)
+      {
+        slot = &eventSlots[i];
+      }
     }
+  }
+  if (slot->repeats != 0)
+  {
+    writeEvent(*slot);
+  }
+  slot->id = id;
+  slot->repeats = 0;
+  slot->windowStart = now;
+  slot->text = text;
+  slot->argc = argc;
+  for (i = 0; i < argc; i++)
+  {
+    slot->argv[i] = argv[i];
+  }
+  writeEvent(*slot);
+}
 
-    endSysex();
+void FirmataClass::flushEvents()
+{
+  if (!eventsPending)
+  {
+    return;
+  }
+  unsigned long now = millis();
+  eventsPending = false;
+  for (byte i = 0; i < FIRMATA_EVENT_SLOTS; i++)
+  {
+    firmata_event_slot& slot = eventSlots[i];
+    if (slot.repeats == 0)
+    {
+      continue;
+    }
+    if (now - slot.windowStart >= eventWindow)
+    {
+      writeEvent(slot);
+      // start a new window, so that a continuous burst results in one message per window
+      slot.repeats = 0;
+      slot.windowStart = now;
+    }
+    else
+    {
+      eventsPending = true;
+    }
+  }
 }
 
+/**
+ * Send an event as EVENT_REPORT or as STRING_DATA, depending on what the host asked for.
+ * @private
+ */
+void FirmataClass::writeEvent(const firmata_event_slot& event)
+{
+  if (numericEvents)
+  {
+    beginMessage(FIRMATA_LANE_EVENT);
+    startSysex();
+    write(EVENT_REPORT);
+    write(EVENT_DATA);
+    sendPackedUInt14(event.id);
+    sendPackedUInt14(event.repeats);
+    for (byte i = 0; i < event.argc; i++)
+    {
+      sendPackedUInt32(event.argv[i]);
+    }
+    endSysex();
+    endMessage();
+    return;
+  }
+#ifndef FIRMATA_NO_STRINGS
+  beginMessage(FIRMATA_LANE_EVENT);
+  startSysex();
+  write(STRING_DATA);
+  writeStringText(event.text);
+  for (byte i = 0; i < event.argc; i++)
+  {
+    if (i > 0)
+    {
+      writeStringText(F(", "));
+    }
+    writeStringNumber(event.argv[i], 10, false, 0, ' ', false);
+  }
+  if (event.repeats != 0)
+  {
+    writeStringText(F(" (repeated "));
+    writeStringNumber(event.repeats, 10, false, 0, ' ', false);
+    writeStringText(F(" times)"));
+  }
+  endSysex();
+  endMessage();
+  if (!outputIsConsole)
+  {
+    Serial.println();
+  }
+#endif
+}
 
 /**
- * A wrapper for Stream::available().
  * Write a single byte to the output stream.
+ * The byte is collected in the transmit buffer, which is sent when it is full, at the end of
+ * a sysex message or when flush() is called.
  * @param c The byte to be written.
  */
 void FirmataClass::write(byte c)
 {
-  FirmataStream->write(c);
+  txBuffer[txBufferPos++] = c;
+  bytesWritten++;
+  if (txBufferPos == TX_BUFFER_SIZE)
+  {
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+    lane = FIRMATA_LANE_CONTROL; // too long for its lane, it goes out as a reply
+#endif
+    sendTxBuffer();
+  }
 }
 
+/**
+ * Write a block of bytes to the output stream.
+ * Blocks that fit are appended to the transmit buffer, larger blocks are sent directly.
+ * @param buf The bytes to be written.
+ * @param length The number of bytes to write.
+ * @return The number of bytes written.
+ */
 size_t FirmataClass::write(byte* buf, size_t length)
 {
-    return FirmataStream->write(buf, length);
+  bytesWritten += length;
+  if (txBufferPos + length > TX_BUFFER_SIZE)
+  {
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+    lane = FIRMATA_LANE_CONTROL;
+#endif
+    sendTxBuffer();
+    if (length > TX_BUFFER_SIZE)
+    {
+      if (captureBuffer != nullptr)
+      {
+        capture(buf, length);
+        return length;
+      }
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+      if (outputQueued)
+      {
+        enqueue(&controlRing, buf, length);
+        pumpOutput(false);
+        return length;
+      }
+#endif
+      if (FirmataStream == nullptr)
+      {
+        return 0;
+      }
+      streamWritten = true;
+      return FirmataStream->write(buf, length);
+    }
+  }
+  memcpy(txBuffer + txBufferPos, buf, length);
+  txBufferPos += length;
+  return length;
+}
+
+/**
+ * Collect the output in a buffer instead of sending it, e.g. to build a response once and send
+ * it from the buffer afterwards. The output written before is sent first.
+ * @param buffer Where the output goes.
+ * @param size The size of the buffer.
+ */
+void FirmataClass::beginCapture(byte* buffer, size_t size)
+{
+  flush();
+  captureBuffer = buffer;
+  captureSize = size;
+  captureLength = 0;
+}
+
+/**
+ * Send the output to the stream again.
+ * @return The number of bytes in the buffer, 0 if the output didn't fit.
+ */
+size_t FirmataClass::endCapture()
+{
+  sendTxBuffer();
+  captureBuffer = nullptr;
+  // the captured bytes are counted when they are sent
+  bytesWritten -= captureLength;
+  return captureLength <= captureSize ? captureLength : 0;
+}
+
+/**
+ * The total number of bytes written since startup. Wraps around when it overflows.
+ */
+unsigned long FirmataClass::getBytesWritten()
+{
+  return bytesWritten;
+}
+
+/**
+ * The total number of bytes read from the stream since startup.
+ */
+unsigned long FirmataClass::getBytesRead()
+{
+  return bytesRead;
+}
+
+/**
+ * The number of complete sysex messages received since startup.
+ */
+unsigned long FirmataClass::getSysexMessagesParsed()
+{
+  return sysexMessagesParsed;
+}
+
+/**
+ * The number of incoming messages that were dropped because they did not fit into the input buffer.
+ */
+unsigned long FirmataClass::getMessagesDiscarded()
+{
+  return messagesDiscarded;
+}
+
+/**
+ * Send all buffered output to the stream. This is called at the end of each sysex message
+ * and from FirmataExt::report() at the end of each loop iteration, but may also be called
+ * directly to force out pending data.
+ */
+void FirmataClass::flush()
+{
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+  if (outputQueued)
+  {
+    // Stream::flush() would wait until everything is out
+    sendTxBuffer();
+    pumpOutput(false);
+    return;
+  }
+#endif
+  sendTxBuffer();
+  // also after output that didn't go through the buffer, e.g. a datagram stream sends on flush()
+  if (streamWritten)
+  {
+    streamWritten = false;
+    FirmataStream->flush();
+  }
 }
 
 
@@ -668,6 +1172,23 @@ void FirmataClass::attach(byte command, callbackFunction newFunction)
   }
 }
 
+/**
+ * Get the callback function attached to a command (see above), so it can be called directly.
+ * @param command The ID of the command.
+ * @return The callback function, or NULL if none is attached.
+ */
+callbackFunction FirmataClass::getCallback(byte command)
+{
+  switch (command) {
+    case DIGITAL_MESSAGE: return currentDigitalCallback;
+    case REPORT_ANALOG: return currentReportAnalogCallback;
+    case REPORT_DIGITAL: return currentReportDigitalCallback;
+    case SET_PIN_MODE: return currentPinModeCallback;
+    case SET_DIGITAL_PIN_VALUE: return currentPinValueCallback;
+  }
+  return NULL;
+}
+
 /**
  * Attach a callback function for the SYSTEM_RESET command.
  * @param command Must be set to SYSTEM_RESET or it will be ignored.
@@ -718,6 +1239,16 @@ void FirmataClass::detach(byte command)
   }
 }
 
+/**
+ * Attach the callback that receives sysex messages longer than SYSEX_STREAM_CHUNK_SIZE data bytes
+ * in chunks while they arrive, instead of discarding them when they don't fit into the input buffer.
+ * @param newFunction The stream callback function, see FirmataFeature::handleSysexStream.
+ */
+void FirmataClass::attachSysexStream(sysexStreamCallbackFunction newFunction)
+{
+  currentSysexStreamCallback = newFunction;
+}
+
 /**
  * Detach a callback function for a delayed task when using FirmataScheduler
  * @see FirmataScheduler
@@ -761,7 +1292,19 @@ void FirmataClass::setPinMode(byte pin, byte config)
 {
   if (pinConfig[pin] == PIN_MODE_IGNORE)
     return;
+  byte port = pin / 8;
+  byte bit = 1 << (pin & 7);
   pinState[pin] = 0;
+  portState[port] &= ~bit;
+  portOutputMask[port] &= ~bit;
+  portInputMask[port] &= ~bit;
+  if (IS_PIN_DIGITAL(pin)) {
+    if (config == PIN_MODE_OUTPUT) {
+      portOutputMask[port] |= bit;
+    } else if (config == PIN_MODE_INPUT) {
+      portInputMask[port] |= bit;
+    }
+  }
   pinConfig[pin] = config;
   if (currentPinModeCallback)
     (*currentPinModeCallback)(pin, config);
@@ -773,9 +1316,64 @@ void FirmataClass::setPinMode(byte pin, byte config)
  */
 int FirmataClass::getPinState(byte pin)
 {
+  byte port = pin / 8;
+  byte bit = 1 << (pin & 7);
+  // setPortState() only updates the bits of the digital pins
+  if ((portOutputMask[port] | portInputMask[port]) & bit) {
+    return (portState[port] & bit) ? 1 : 0;
+  }
   return pinState[pin];
 }
 
+/**
+ * @param port The port (group of 8 pins)
+ * @return Bit mask of the digital pins of the port that are configured as PIN_MODE_OUTPUT.
+ */
+byte FirmataClass::getPortOutputMask(byte port)
+{
+  return port < PIN_STATE_PORTS ? portOutputMask[port] : 0;
+}
+
+/**
+ * @param port The port (group of 8 pins)
+ * @return Bit mask of the digital pins of the port that are configured as PIN_MODE_INPUT.
+ */
+byte FirmataClass::getPortInputMask(byte port)
+{
+  return port < PIN_STATE_PORTS ? portInputMask[port] : 0;
+}
+
+/**
+ * @param port The port (group of 8 pins)
+ * @return Bit mask of the input pins of the port that have their pull-up enabled.
+ */
+byte FirmataClass::getPortPullupMask(byte port)
+{
+  return port < PIN_STATE_PORTS ? portState[port] & portInputMask[port] : 0;
+}
+
+/**
+ * @param port The port (group of 8 pins)
+ * @return The states of the pins of the port, one bit per pin.
+ */
+byte FirmataClass::getPortState(byte port)
+{
+  return port < PIN_STATE_PORTS ? portState[port] : 0;
+}
+
+/**
+ * Set the states of several pins of a port at once.
+ * @param port The port (group of 8 pins)
+ * @param state The new states, one bit per pin
+ * @param mask The pins to update
+ */
+void FirmataClass::setPortState(byte port, byte state, byte mask)
+{
+  if (port < PIN_STATE_PORTS) {
+    portState[port] = (portState[port] & ~mask) | (state & mask);
+  }
+}
+
 /// <summary>
 /// Decodes an uint 32 from 5 bytes
 /// </summary>
@@ -834,12 +1432,19 @@ void FirmataClass::sendPackedUInt14(uint16_t value)
 /**
  * Set the pin state. The pin state of an output pin is the pin value. The state of an
  * input pin is 0, unless the pin has it's internal pull up resistor enabled, then the value is 1.
+ * Other pins can store any value, e.g. the PWM duty cycle of an analog output.
  * @param pin The pin to set the state of
  * @param state Set the state of the specified pin
  */
 void FirmataClass::setPinState(byte pin, byte state)
 {
+  byte bit = 1 << (pin & 7);
   pinState[pin] = state;
+  if (state) {
+    portState[pin / 8] |= bit;
+  } else {
+    portState[pin / 8] &= ~bit;
+  }
 }
 
 
@@ -885,12 +1490,340 @@ void FirmataClass::systemReset(void)
   parsingSysex = false;
   sysexBytesRead = 0;
 
+  for (i = 0; i < FIRMATA_EVENT_SLOTS; i++) {
+    eventSlots[i].id = 0;
+    eventSlots[i].repeats = 0;
+  }
+#ifdef FIRMATA_NO_STRINGS
+  numericEvents = true; // there is no text to send
+#else
+  numericEvents = false;
+#endif
+  eventsPending = false;
+  eventWindow = FIRMATA_EVENT_WINDOW;
+
   if (currentSystemResetCallback)
     (*currentSystemResetCallback)();
 
   resetting = false;
 }
 
+/**
+ * Hands the content of the transmit buffer to the stream in a single call.
+ * @private
+ */
+void FirmataClass::sendTxBuffer()
+{
+  if (captureBuffer != nullptr)
+  {
+    capture(txBuffer, txBufferPos);
+  }
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+  else if (outputQueued)
+  {
+    if (lane != FIRMATA_LANE_CONTROL)
+    {
+      return; // the message is queued by endMessage()
+    }
+    if (txBufferPos > 0)
+    {
+      enqueue(&controlRing, txBuffer, txBufferPos);
+    }
+  }
+#endif
+  else if (txBufferPos > 0 && FirmataStream != nullptr)
+  {
+    FirmataStream->write(txBuffer, txBufferPos);
+    streamWritten = true;
+  }
+  txBufferPos = 0;
+}
+
+/**
+ * Appends output to the capture buffer, the length keeps counting when it is full.
+ * @private
+ */
+void FirmataClass::capture(const byte* data, size_t length)
+{
+  if (captureLength + length <= captureSize)
+  {
+    memcpy(captureBuffer + captureLength, data, length);
+  }
+  captureLength += length;
+}
+
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+/**
+ * Queue the output and only write as much as the stream takes without blocking, in the order
+ * replies, events, telemetry. Turning it off writes everything that is still queued.
+ * @param enable true to queue the output.
+ */
+void FirmataClass::setOutputQueue(boolean enable)
+{
+  flush();
+  if (outputQueued && !enable)
+  {
+    pumpOutput(true);
+    writeRing(&eventRing, eventRing.length);
+    firmata_telemetry_slot* slot;
+    while ((slot = oldestTelemetry()) != nullptr)
+    {
+      FirmataStream->write(slot->data, slot->length);
+      slot->length = 0;
+    }
+  }
+  outputQueued = enable;
+}
+
+/**
+ * Start a message for a lane of the output queue. Without the queue, the message is written as usual.
+ * @param lane FIRMATA_LANE_EVENT or FIRMATA_LANE_TELEMETRY, the rest is FIRMATA_LANE_CONTROL.
+ * @param key The source of a telemetry message, e.g. the command and channel.
+ */
+void FirmataClass::beginMessage(byte lane, uint16_t key)
+{
+  if (!outputQueued || captureBuffer != nullptr || laneDepth++ > 0)
+  {
+    return;
+  }
+  // the replies written before go first
+  sendTxBuffer();
+  this->lane = lane;
+  laneKey = key;
+}
+
+/**
+ * Queue the message started with beginMessage().
+ */
+void FirmataClass::endMessage()
+{
+  if (!outputQueued || captureBuffer != nullptr || laneDepth == 0 || --laneDepth > 0)
+  {
+    return;
+  }
+  byte current = lane;
+  lane = FIRMATA_LANE_CONTROL;
+  if (current == FIRMATA_LANE_EVENT)
+  {
+    if (!enqueue(&eventRing, txBuffer, txBufferPos))
+    {
+      messagesDropped++;
+    }
+    txBufferPos = 0;
+  }
+  else if (current == FIRMATA_LANE_TELEMETRY && txBufferPos <= FIRMATA_TELEMETRY_SLOT_SIZE)
+  {
+    // the unsent sample of the source is replaced, it keeps its place in the queue
+    firmata_telemetry_slot* slot = findTelemetry(laneKey);
+    if (slot != nullptr)
+    {
+      messagesDropped++;
+    }
+    for (byte i = 0; i < FIRMATA_TELEMETRY_SLOTS && slot == nullptr; i++)
+    {
+      if (telemetrySlots[i].length == 0)
+      {
+        slot = &telemetrySlots[i];
+        slot->sequence = telemetrySequence++;
+      }
+    }
+    // without a free slot, the message goes out as a reply, the other sources lose nothing
+    if (slot != nullptr)
+    {
+      slot->key = laneKey;
+      slot->length = txBufferPos;
+      memcpy(slot->data, txBuffer, txBufferPos);
+      txBufferPos = 0;
+    }
+  }
+  // a larger telemetry message stays in txBuffer and goes out as a reply
+  pumpOutput(false);
+}
+
+/**
+ * Whether a telemetry message of the source waits in the queue. A source that sends changes
+ * rather than values skips a sample while its last one is queued, so that none is replaced.
+ * @param key The key passed to beginMessage().
+ */
+boolean FirmataClass::isTelemetryQueued(uint16_t key)
+{
+  return outputQueued && findTelemetry(key) != nullptr;
+}
+
+/**
+ * Drops the unsent telemetry message of the source, when a reply or command makes it wrong.
+ * @param key The key passed to beginMessage().
+ */
+void FirmataClass::cancelTelemetry(uint16_t key)
+{
+  firmata_telemetry_slot* slot = findTelemetry(key);
+  if (slot != nullptr)
+  {
+    slot->length = 0;
+  }
+}
+
+/**
+ * The number of telemetry messages that were replaced by a newer sample before they were sent,
+ * and of events that were dropped because the event queue was full.
+ */
+unsigned long FirmataClass::getMessagesDropped()
+{
+  return messagesDropped;
+}
+
+/**
+ * Appends a message to a ring of the output queue. Replies that don't fit wait for the stream.
+ * @private
+ */
+boolean FirmataClass::enqueue(firmata_output_ring* ring, const byte* data, size_t length)
+{
+  if (length > ring->size - ring->length)
+  {
+    if (ring != &controlRing)
+    {
+      return false;
+    }
+    // the backlog goes out first, so that the replies keep their order
+    pumpOutput(true);
+    if (length > ring->size - ring->length)
+    {
+      if (FirmataStream == nullptr || ring->length > 0)
+      {
+        return false; // the stream takes nothing more
+      }
+      FirmataStream->write(data, length);
+      return true;
+    }
+  }
+  while (length > 0)
+  {
+    size_t end = (ring->start + ring->length) % ring->size;
+    size_t chunk = min(length, ring->size - end);
+    memcpy(ring->data + end, data, chunk);
+    ring->length += chunk;
+    data += chunk;
+    length -= chunk;
+  }
+  return true;
+}
+
+/**
+ * Writes up to space bytes of a ring, returns how many the stream took.
+ * @private
+ */
+size_t FirmataClass::writeRing(firmata_output_ring* ring, size_t space)
+{
+  size_t written = 0;
+  while (ring->length > 0 && written < space)
+  {
+    size_t chunk = min(min(ring->length, ring->size - ring->start), space - written);
+    size_t count = FirmataStream->write(ring->data + ring->start, chunk);
+    ring->start = (ring->start + count) % ring->size;
+    ring->length -= count;
+    written += count;
+    if (count < chunk)
+    {
+      break;
+    }
+  }
+  if (ring->length == 0)
+  {
+    ring->start = 0;
+  }
+  // a ring that was cut off may stop in the middle of a message
+  activeRing = ring->length > 0 ? ring : nullptr;
+  return written;
+}
+
+/**
+ * The unsent telemetry message with the key, or nullptr.
+ * @private
+ */
+firmata_telemetry_slot* FirmataClass::findTelemetry(uint16_t key)
+{
+  for (byte i = 0; i < FIRMATA_TELEMETRY_SLOTS; i++)
+  {
+    if (telemetrySlots[i].length != 0 && telemetrySlots[i].key == key)
+    {
+      return &telemetrySlots[i];
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * The telemetry message that waits the longest, or nullptr.
+ * @private
+ */
+firmata_telemetry_slot* FirmataClass::oldestTelemetry()
+{
+  firmata_telemetry_slot* oldest = nullptr;
+  for (byte i = 0; i < FIRMATA_TELEMETRY_SLOTS; i++)
+  {
+    firmata_telemetry_slot* slot = &telemetrySlots[i];
+    if (slot->length != 0 && (oldest == nullptr || (long)(slot->sequence - oldest->sequence) < 0))
+    {
+      oldest = slot;
+    }
+  }
+  return oldest;
+}
+
+/**
+ * Writes as much of the queue as the stream takes, blocking writes all replies unless the stream stalls.
+ * @private
+ */
+void FirmataClass::pumpOutput(boolean blocking)
+{
+  if (FirmataStream == nullptr)
+  {
+    return;
+  }
+  if (blocking)
+  {
+    // a stream that takes a part at a time is called again, until it takes nothing
+    while (activeRing != nullptr || controlRing.length > 0)
+    {
+      firmata_output_ring* ring = activeRing != nullptr ? activeRing : &controlRing;
+      if (writeRing(ring, ring->length) == 0)
+      {
+        return;
+      }
+    }
+    return;
+  }
+  int space = FirmataStream->availableForWrite();
+  while (space > 0)
+  {
+    firmata_output_ring* ring = activeRing;
+    if (ring == nullptr)
+    {
+      ring = controlRing.length > 0 ? &controlRing : eventRing.length > 0 ? &eventRing : nullptr;
+    }
+    if (ring != nullptr)
+    {
+      size_t written = writeRing(ring, space);
+      if (written == 0)
+      {
+        return;
+      }
+      space -= written;
+      continue;
+    }
+    // telemetry only goes out in whole messages
+    firmata_telemetry_slot* slot = oldestTelemetry();
+    if (slot == nullptr || slot->length > space)
+    {
+      return;
+    }
+    FirmataStream->write(slot->data, slot->length);
+    space -= slot->length;
+    slot->length = 0;
+  }
+}
+#endif
+
 /**
  * Flashing the pin for the version number
  * @private
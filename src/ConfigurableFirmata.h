@@ -16,6 +16,7 @@
 #define Configurable_Firmata_h
 
 #include "utility/Boards.h"  /* Hardware Abstraction Layer + Wiring/Arduino */
+#include "FirmataEvents.h"
 
 /* Version numbers for the protocol.  The protocol is still changing, so these
  * version numbers are important.
@@ -37,10 +38,69 @@
 
 #ifdef LARGE_MEM_DEVICE
 #define MAX_DATA_BYTES         252 // The ESP32 has enough RAM so we can reduce the number of packets, but the value must not exceed 2^8 - 1, because many methods use byte-indexing only
+#define TX_BUFFER_SIZE        1024 // Outgoing messages are collected in a buffer of this size, so that network streams can send them in one packet
 #else
 #define MAX_DATA_BYTES          64 // max number of data bytes in incoming messages
+#define TX_BUFFER_SIZE          32 // size of the buffer for outgoing messages
 #endif
+#ifndef LARGE_MEM_RCV_BUF_SIZE
 #define LARGE_MEM_RCV_BUF_SIZE 4096 // Size of the wifi receive buffer for large mem devices. If this is smaller than 1024, heavy transactions are significantly slower
+#endif
+#ifdef LARGE_MEM_DEVICE
+#define RCV_BUF_SIZE           LARGE_MEM_RCV_BUF_SIZE
+#else
+#define RCV_BUF_SIZE           MAX_DATA_BYTES // input is read in blocks of this size
+#define MAX_RCV_BYTES_PER_CALL 256 // upper limit for the number of input bytes processed by a single call to processInput()
+#endif
+
+// diagnostic events (see FirmataEvents.h)
+#ifndef FIRMATA_EVENT_SLOTS
+#ifdef LARGE_MEM_DEVICE
+#define FIRMATA_EVENT_SLOTS      8 // number of different events that are rate limited at the same time
+#else
+#define FIRMATA_EVENT_SLOTS      3
+#endif
+#endif
+#define FIRMATA_EVENT_MAX_ARGS   4
+#define FIRMATA_EVENT_WINDOW  1000 // default rate limiting window in ms
+
+// Outbound queue, turned on with Firmata.setOutputQueue(true): the output is only written as far
+// as the stream's availableForWrite() allows, so a slow link doesn't stall the loop. Replies go out
+// first, then events and strings, then the latest sample of each telemetry source. Telemetry that
+// is not sent before the next sample of its source is replaced, events that don't fit are dropped.
+#ifndef FIRMATA_OUTPUT_QUEUE_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define FIRMATA_OUTPUT_QUEUE_SIZE 4096 // bytes of replies, 0 leaves the queue out
+#else
+#define FIRMATA_OUTPUT_QUEUE_SIZE    0
+#endif
+#endif
+#ifndef FIRMATA_EVENT_QUEUE_SIZE
+#define FIRMATA_EVENT_QUEUE_SIZE (FIRMATA_OUTPUT_QUEUE_SIZE / 8)
+#endif
+#ifndef FIRMATA_TELEMETRY_SLOTS
+#define FIRMATA_TELEMETRY_SLOTS   32 // sources with an unsent sample
+#endif
+// A source is a single channel (a pin, port, sensor, control block, stepper or continuous I2C read),
+// so its message is short. Longer I2C reads, and messages that find all slots taken, are queued as replies.
+#ifndef FIRMATA_TELEMETRY_SLOT_SIZE
+#define FIRMATA_TELEMETRY_SLOT_SIZE 24
+#endif
+
+// the lanes of the outbound queue, see beginMessage()
+#define FIRMATA_LANE_CONTROL      0
+#define FIRMATA_LANE_EVENT        1
+#define FIRMATA_LANE_TELEMETRY    2
+
+// streamed sysex messages (see FirmataFeature::handleSysexStream)
+#define SYSEX_STREAM_CHUNK_SIZE ((MAX_DATA_BYTES - 1) & ~7) // data bytes per chunk, a multiple of 8 for Encoder7Bit
+#define SYSEX_STREAM_BEGIN       0 // the message is longer than a chunk, return true to receive it
+#define SYSEX_STREAM_DATA        1 // the next chunk of data bytes
+#define SYSEX_STREAM_END         2 // END_SYSEX was received
+#define SYSEX_STREAM_ABORT       3 // the message was interrupted by a reset
+
+// pin states and mode masks are kept per 8 pins, covering all pins even where TOTAL_PORTS does not
+#define PIN_STATE_PORTS ((TOTAL_PINS + 7) / 8)
 
 // Arduino 101 also defines SET_PIN_MODE as a macro in scss_registers.h
 #ifdef SET_PIN_MODE
@@ -64,12 +124,24 @@
 
 // extended command set using sysex (0-127/0x00-0x7F)
 /* 0x00-0x0F reserved for user-defined commands */
+#define MODBUS_DATA             0x56 // Modbus RTU master on a serial port
+#define FIRMATA_CONTROL         0x57 // closed loop control blocks (PID, threshold) from inputs to outputs
+#define SONAR_DATA              0x58 // configure HC-SR04 ultrasonic sensors / their distances
+#define FIRMATA_CAPTURE         0x59 // sample at a high rate into a buffer, send it afterwards
+#define FIRMATA_BOOT_CONFIG     0x5A // save the configuration to EEPROM and restore it at boot
+#define FIRMATA_ENVELOPE        0x5B // a batch of Firmata messages with a sequence id, acknowledged as a whole
+#define FIRMATA_STATS           0x5C // query run-time statistics (loop time, traffic, free memory)
+#define EVENT_REPORT            0x5D // numeric diagnostic events instead of STRING_DATA
+#define PWM_PLAYBACK            0x5E // play fades and waveforms on PWM outputs
+#define PWM_CONFIG              0x5F // set frequency and resolution of PWM outputs (ESP32)
 #define SERIAL_MESSAGE          0x60 // communicate with serial devices, including other boards
 #define ENCODER_DATA            0x61 // reply with encoders current positions
 #define ACCELSTEPPER_DATA       0x62 // control a stepper motor
 #define REPORT_DIGITAL_PIN      0x63 // (reserved)
 #define EXTENDED_REPORT_ANALOG  0x64 // Enable reporting analog channels > 15. Supported with v3.1 or later.
 #define REPORT_FEATURES         0x65 // (reserved)
+#define REPORT_INTERVAL         0x66 // set the report interval of a single feature
+#define TIMESTAMP_DATA          0x67 // configure report timestamps / a timestamp for the preceding reports
 #define SPI_DATA                0x68 // SPI Commands start with this byte
 #define ANALOG_MAPPING_QUERY    0x69 // ask for mapping of analog to pin numbers
 #define ANALOG_MAPPING_RESPONSE 0x6A // reply with mapping info
@@ -90,7 +162,7 @@
 #define REPORT_FIRMWARE         0x79 // report name and version of the firmware
 #define SAMPLING_INTERVAL       0x7A // set the poll rate of the main loop
 #define SCHEDULER_DATA          0x7B // send a createtask/deletetask/addtotask/schedule/querytasks/querytask request to the scheduler
-#define ANALOG_CONFIG           0x7C // (reserved)
+#define ANALOG_CONFIG           0x7C // configure analog input reporting
 #define FREQUENCY_COMMAND       0x7D // Command for the Frequency module
 #define SYSEX_NON_REALTIME      0x7E // MIDI Reserved for non-realtime messages
 #define SYSEX_REALTIME          0x7F // MIDI Reserved for realtime messages
@@ -117,8 +189,8 @@
 #define PIN_MODE_PULLUP         0x0B // enable internal pull-up resistor for pin
 // Extensions under development
 #define PIN_MODE_SPI            0x0C // pin configured for SPI
-#define PIN_MODE_SONAR =        0x0D // pin configured for HC-SR04
-#define PIN_MODE_TONE =         0x0E // pin configured for tone
+#define PIN_MODE_SONAR          0x0D // pin configured for HC-SR04
+#define PIN_MODE_TONE           0x0E // pin configured for tone
 #define PIN_MODE_DHT            0x0F // pin configured for DHT
 #define PIN_MODE_FREQUENCY      0x10 // pin configured for frequency measurement
 
@@ -131,11 +203,38 @@ extern "C" {
   typedef void (*systemResetCallbackFunction)(void);
   typedef void (*stringCallbackFunction)(char *);
   typedef void (*sysexCallbackFunction)(byte command, byte argc, byte *argv);
+  typedef boolean (*sysexStreamCallbackFunction)(byte command, byte phase, byte length, byte *data);
   typedef void (*delayTaskCallbackFunction)(long delay);
 }
 
 typedef const __FlashStringHelper FlashString;
 
+struct firmata_output_ring
+{
+  byte* data;
+  size_t size;
+  size_t start;
+  size_t length;
+};
+
+struct firmata_telemetry_slot
+{
+  uint16_t key;
+  byte length; // 0 = unused
+  unsigned long sequence; // the oldest one goes out first
+  byte data[FIRMATA_TELEMETRY_SLOT_SIZE];
+};
+
+struct firmata_event_slot
+{
+  uint16_t id; // 0 = unused
+  uint16_t repeats; // occurrences within the window that have not been reported yet
+  unsigned long windowStart;
+  const FlashString* text;
+  byte argc;
+  uint32_t argv[FIRMATA_EVENT_MAX_ARGS]; // arguments of the last occurrence
+};
+
 // TODO make it a subclass of a generic Serial/Stream base class
 class FirmataClass
 {
@@ -163,14 +262,59 @@ class FirmataClass
     void sendAnalog(byte pin, int value);
     void sendDigital(byte pin, int value); // TODO implement this
     void sendDigitalPort(byte portNumber, int portData);
+    // define FIRMATA_NO_STRINGS for the whole build to strip all text messages (errors and diagnostics)
+#ifndef FIRMATA_NO_STRINGS
     void sendString(const FlashString* flashString);
     void sendString(const FlashString* flashString, uint32_t errorData);
     void sendStringf(const FlashString* fmt, ...);
+#else
+    // the unused strings are removed from flash by the linker
+    inline void sendString(const FlashString* flashString) {}
+    inline void sendString(const FlashString* flashString, uint32_t errorData) {}
+    inline void sendStringf(const FlashString* fmt, ...) {}
+#endif
     void sendString(byte command, const char *string);
+    /* diagnostics with an id from FirmataEvents.h, sent as text or as EVENT_REPORT and rate limited */
+    void sendEvent(uint16_t id, const FlashString* text);
+    void sendEvent(uint16_t id, const FlashString* text, uint32_t arg);
+    void sendEvent(uint16_t id, const FlashString* text, uint32_t arg1, uint32_t arg2);
+    void sendEvent(uint16_t id, const FlashString* text, byte argc, const uint32_t* argv);
+    /* report the repeat counts of events whose window is over, called once per loop */
+    void flushEvents();
     void sendSysex(byte command, byte bytec, byte *bytev);
     void write(byte c);
 
     size_t write(byte* buf, size_t length);
+    void flush();
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+    /* queue the output and write it without blocking, see FIRMATA_OUTPUT_QUEUE_SIZE */
+    void setOutputQueue(boolean enable);
+    /* the message up to endMessage() goes into the lane, telemetry replaces the unsent one with the same key */
+    void beginMessage(byte lane, uint16_t key = 0);
+    void endMessage();
+    /* whether an unsent telemetry message with the key is queued */
+    boolean isTelemetryQueued(uint16_t key);
+    /* drops the unsent telemetry message with the key, e.g. when a reply supersedes it */
+    void cancelTelemetry(uint16_t key);
+    /* telemetry and events that were replaced or dropped */
+    unsigned long getMessagesDropped();
+#else
+    inline void setOutputQueue(boolean enable) {}
+    inline void beginMessage(byte lane, uint16_t key = 0) {}
+    inline void endMessage() {}
+    inline boolean isTelemetryQueued(uint16_t key) { return false; }
+    inline void cancelTelemetry(uint16_t key) {}
+    inline unsigned long getMessagesDropped() { return 0; }
+#endif
+    /* until endCapture(), the output goes into the buffer instead of the stream */
+    void beginCapture(byte* buffer, size_t size);
+    /* the number of bytes captured, 0 if they didn't fit */
+    size_t endCapture();
+    unsigned long getBytesWritten();
+    /* input statistics, see FirmataStats */
+    unsigned long getBytesRead();
+    unsigned long getSysexMessagesParsed();
+    unsigned long getMessagesDiscarded();
 
     void sendPackedUInt14(uint16_t value);
     void sendPackedUInt32(uint32_t value);
@@ -180,10 +324,13 @@ class FirmataClass
     uint64_t decodePackedUInt64(byte* argv);
     /* attach & detach callback functions to messages */
     void attach(byte command, callbackFunction newFunction);
+    callbackFunction getCallback(byte command);
     void attach(byte command, systemResetCallbackFunction newFunction);
     void attach(byte command, stringCallbackFunction newFunction);
     void attach(byte command, sysexCallbackFunction newFunction);
     void detach(byte command);
+    /* receive sysex messages longer than SYSEX_STREAM_CHUNK_SIZE in chunks, see FirmataFeature::handleSysexStream */
+    void attachSysexStream(sysexStreamCallbackFunction newFunction);
     /* delegate to Scheduler (if any) */
     void attachDelayTask(delayTaskCallbackFunction newFunction);
     void delayTask(long delay);
@@ -193,6 +340,14 @@ class FirmataClass
     /* access pin state */
     int getPinState(byte pin);
     void setPinState(byte pin, byte state);
+    /* per port masks of the digital pins in PIN_MODE_OUTPUT and PIN_MODE_INPUT, kept up to date by setPinMode() */
+    byte getPortOutputMask(byte port);
+    byte getPortInputMask(byte port);
+    /* input pins of the port with the pull-up enabled, i.e. with a pin state of 1 */
+    byte getPortPullupMask(byte port);
+    /* pin states of a port, one bit per pin */
+    byte getPortState(byte port);
+    void setPortState(byte port, byte state, byte mask);
 
     /* utility methods */
     void sendValueAsTwo7bitBytes(int value);
@@ -213,9 +368,13 @@ class FirmataClass
     /* sysex */
     boolean parsingSysex;
     int sysexBytesRead;
+    byte sysexStreamState;
     /* pins configuration */
     byte pinConfig[TOTAL_PINS];         // configuration of every pin
     byte pinState[TOTAL_PINS];           // any value that has been written
+    byte portState[PIN_STATE_PORTS];     // one bit per pin, set if the pin state is not 0
+    byte portOutputMask[PIN_STATE_PORTS];
+    byte portInputMask[PIN_STATE_PORTS];
 
     boolean resetting;
 
@@ -232,17 +391,62 @@ class FirmataClass
     systemResetCallbackFunction currentSystemResetCallback;
     stringCallbackFunction currentStringCallback;
     sysexCallbackFunction currentSysexCallback;
+    sysexStreamCallbackFunction currentSysexStreamCallback;
     delayTaskCallbackFunction delayTaskCallback;
 
     boolean blinkVersionDisabled;
 
+    /* output buffering */
+    byte txBuffer[TX_BUFFER_SIZE];
+    size_t txBufferPos;
+    bool streamWritten; // since the last FirmataStream->flush()
+    byte* captureBuffer;
+    size_t captureSize;
+    size_t captureLength;
+    unsigned long bytesWritten;
+    unsigned long bytesRead;
+    unsigned long sysexMessagesParsed;
+    unsigned long messagesDiscarded;
+
+    /* diagnostic events */
+    firmata_event_slot eventSlots[FIRMATA_EVENT_SLOTS];
+    boolean numericEvents;
+    boolean eventsPending;
+    uint16_t eventWindow;
+
     /* private methods ------------------------------ */
     void processSysexMessage(void);
     void systemReset(void);
     void strobeBlinkPin(byte pin, int count, int onInterval, int offInterval);
-#ifdef LARGE_MEM_DEVICE
-    byte readCache[LARGE_MEM_RCV_BUF_SIZE];
+    void sendTxBuffer();
+    void capture(const byte* data, size_t length);
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+    boolean outputQueued;
+    byte lane; // of the message in txBuffer
+    uint16_t laneKey;
+    firmata_output_ring controlRing;
+    firmata_output_ring eventRing;
+    firmata_output_ring* activeRing; // cut off in the middle, goes on before anything else
+    byte controlData[FIRMATA_OUTPUT_QUEUE_SIZE];
+    byte eventData[FIRMATA_EVENT_QUEUE_SIZE];
+    firmata_telemetry_slot telemetrySlots[FIRMATA_TELEMETRY_SLOTS];
+    unsigned long telemetrySequence;
+    unsigned long messagesDropped;
+    byte laneDepth; // nested beginMessage() calls stay in the outer lane
+    boolean enqueue(firmata_output_ring* ring, const byte* data, size_t length);
+    size_t writeRing(firmata_output_ring* ring, size_t space);
+    firmata_telemetry_slot* findTelemetry(uint16_t key);
+    firmata_telemetry_slot* oldestTelemetry();
+    void pumpOutput(boolean blocking);
 #endif
+    void parseBlock(const byte* data, int length);
+    void streamSysexChunk();
+    void endSysexStream(byte phase);
+    void writeEvent(const firmata_event_slot& event);
+    void writeStringText(const FlashString* flashString);
+    void writeStringChar(char c);
+    void writeStringNumber(unsigned long value, byte base, boolean negative, byte width, char pad, boolean upperCase);
+    byte readCache[RCV_BUF_SIZE];
 };
 
 extern FirmataClass Firmata;
@@ -0,0 +1,319 @@
+/*
+  ControlFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "ControlFirmata.h"
+#include "FirmataExt.h"
+#include "EncoderFirmata.h"
+#include "Frequency.h"
+#include "AccelStepperFirmata.h"
+
+// the feature that handles a sysex command, for the inputs and outputs
+static FirmataFeature* featureFor(byte command)
+{
+  return FirmataExtInstance != NULL ? FirmataExtInstance->getSysexOwner(command) : NULL;
+}
+
+ControlFirmata::ControlFirmata()
+{
+  for (byte i = 0; i < CONTROL_MAX_BLOCKS; i++) {
+    blocks[i].type = 127;
+  }
+  interval = CONTROL_DEFAULT_INTERVAL;
+  lastStep = millis();
+}
+
+boolean ControlFirmata::handlePinMode(byte pin, int mode)
+{
+  // an output pin that gets another mode is no longer written, see writeOutput()
+  return false;
+}
+
+boolean ControlFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != FIRMATA_CONTROL || argc < 1) {
+    return false;
+  }
+  if (argv[0] == CONTROL_INTERVAL) {
+    if (argc >= 3 && Firmata.decodePackedUInt14(argv + 1) != 0) {
+      interval = Firmata.decodePackedUInt14(argv + 1);
+    }
+    return true;
+  }
+  if (argc < 2 || argv[1] >= CONTROL_MAX_BLOCKS) {
+    Firmata.sendString(F("Invalid control block"));
+    return true;
+  }
+  control_block* b = &blocks[argv[1]];
+  if (argv[0] != CONTROL_CONFIG && b->type == 127) {
+    Firmata.sendString(F("Control block not configured"));
+    return true;
+  }
+  switch (argv[0]) {
+    case CONTROL_CONFIG:
+      if (!configure(argv[1], argc, argv)) {
+        Firmata.sendString(F("Invalid control block configuration"));
+      }
+      return true;
+    case CONTROL_PID:
+      if (argc >= 17) {
+        for (byte i = 0; i < 3; i++) {
+          b->gains[i] = (int32_t)Firmata.decodePackedUInt32(argv + 2 + 5 * i);
+        }
+      }
+      return true;
+    case CONTROL_THRESHOLD:
+      if (argc >= 7) {
+        b->gains[0] = (int32_t)Firmata.decodePackedUInt32(argv + 2);
+      }
+      return true;
+    case CONTROL_SETPOINT:
+      if (argc >= 7) {
+        b->setpoint = (int32_t)Firmata.decodePackedUInt32(argv + 2);
+      }
+      return true;
+    case CONTROL_ENABLE:
+      if (argc >= 3) {
+        if ((argv[2] & CONTROL_RUN) && !(b->flags & CONTROL_RUN)) {
+          b->started = false;
+        }
+        b->flags = argv[2];
+      }
+      return true;
+  }
+  return false;
+}
+
+bool ControlFirmata::configure(byte block, byte argc, byte* argv)
+{
+  if (argc < 17 || argv[2] > CONTROL_TYPE_THRESHOLD || argv[3] > CONTROL_INPUT_ENCODER || argv[5] > CONTROL_OUTPUT_STEPPER) {
+    return false;
+  }
+  control_block* b = &blocks[block];
+  b->type = 127;
+  b->input = argv[3];
+  b->inputIndex = argv[4];
+  b->output = argv[5];
+  b->outputIndex = argv[6];
+  b->outputMin = (int32_t)Firmata.decodePackedUInt32(argv + 7);
+  b->outputMax = (int32_t)Firmata.decodePackedUInt32(argv + 12);
+  if (b->input == CONTROL_INPUT_ANALOG) {
+    byte pin = 0;
+    while (pin < TOTAL_PINS && !(IS_PIN_ANALOG(pin) && PIN_TO_ANALOG(pin) == b->inputIndex)) {
+      pin++;
+    }
+    if (pin == TOTAL_PINS) {
+      return false;
+    }
+    b->inputPin = pin;
+  }
+  // the features of the other inputs and outputs are looked up when they are used, they may come later
+  if ((b->output == CONTROL_OUTPUT_PWM || b->output == CONTROL_OUTPUT_SERVO) && !IS_PIN_DIGITAL(b->outputIndex)) {
+    return false;
+  }
+  b->type = argv[2];
+  b->flags = 0;
+  b->setpoint = 0;
+  b->gains[0] = b->gains[1] = b->gains[2] = 0;
+  b->inputValue = 0;
+  b->outputValue = b->outputMin;
+  return true;
+}
+
+bool ControlFirmata::readInput(control_block* b, int32_t* value)
+{
+  switch (b->input) {
+    case CONTROL_INPUT_ANALOG:
+      *value = analogRead(b->inputPin);
+      return true;
+    case CONTROL_INPUT_FREQUENCY: {
+      Frequency* frequency = static_cast<Frequency*>(featureFor(FREQUENCY_COMMAND));
+      uint32_t ticks;
+      if (frequency == NULL || !frequency->getTicks(b->inputIndex, ticks)) {
+        return false;
+      }
+      // ticks/s over the last loop interval
+      *value = b->started ? (int32_t)((ticks - b->lastTicks) * 1000 / interval) : b->inputValue;
+      b->lastTicks = ticks;
+      return true;
+    }
+    case CONTROL_INPUT_ENCODER: {
+      EncoderFirmata* encoder = static_cast<EncoderFirmata*>(featureFor(ENCODER_DATA));
+      if (encoder == NULL || b->inputIndex >= MAX_ENCODERS) {
+        return false;
+      }
+      *value = encoder->getPosition(b->inputIndex);
+      return true;
+    }
+  }
+  return false;
+}
+
+void ControlFirmata::writeOutput(control_block* b, int32_t value)
+{
+  b->outputValue = value;
+  if (b->output == CONTROL_OUTPUT_STEPPER) {
+    AccelStepperFirmata* stepper = static_cast<AccelStepperFirmata*>(featureFor(ACCELSTEPPER_DATA));
+    if (stepper != NULL) {
+      stepper->setSpeed(b->outputIndex, value);
+    }
+    return;
+  }
+  // PWM and servo outputs get the same EXTENDED_ANALOG message as from the host
+  byte mode = b->output == CONTROL_OUTPUT_PWM ? PIN_MODE_PWM : PIN_MODE_SERVO;
+  FirmataFeature* feature = featureFor(mode == PIN_MODE_PWM ? EXTENDED_ANALOG : SERVO_CONFIG);
+  if (feature == NULL || Firmata.getPinMode(b->outputIndex) != mode || value < 0) {
+    return;
+  }
+  byte args[4] = { b->outputIndex, (byte)(value & 0x7F), (byte)((value >> 7) & 0x7F), (byte)((value >> 14) & 0x7F) };
+  feature->handleSysex(EXTENDED_ANALOG, 4, args);
+}
+
+void ControlFirmata::stepBlock(control_block* b)
+{
+  int32_t input;
+  if (!readInput(b, &input)) {
+    return;
+  }
+  b->inputValue = input;
+  bool first = !b->started;
+  int32_t output;
+  if (b->type == CONTROL_TYPE_THRESHOLD) {
+    int32_t hysteresis = b->gains[0];
+    if (input < b->setpoint - hysteresis) {
+      output = b->outputMax;
+    } else if (input > b->setpoint + hysteresis) {
+      output = b->outputMin;
+    } else {
+      output = first ? b->outputMin : b->outputValue;
+    }
+  } else {
+    float dt = interval / 1000.0f;
+    float error = (float)(b->setpoint - input);
+    if (first) {
+      b->integral = 0;
+      b->lastInput = input;
+    }
+    // the integral is limited to the output range, so that it doesn't wind up while the output saturates
+    b->integral += b->gains[1] / 1000.0f * error * dt;
+    b->integral = constrain(b->integral, (float)b->outputMin, (float)b->outputMax);
+    // the derivative of the input rather than of the error, so that a new setpoint doesn't kick the output
+    float derivative = (input - b->lastInput) / dt;
+    b->lastInput = input;
+    float value = b->gains[0] / 1000.0f * error + b->integral - b->gains[2] / 1000.0f * derivative;
+    output = (int32_t)constrain(value, (float)b->outputMin, (float)b->outputMax);
+  }
+  b->started = true;
+  if (first || output != b->outputValue) {
+    writeOutput(b, output);
+  }
+}
+
+void ControlFirmata::step()
+{
+  for (byte i = 0; i < CONTROL_MAX_BLOCKS; i++) {
+    if (blocks[i].type != 127 && (blocks[i].flags & CONTROL_RUN)) {
+      stepBlock(&blocks[i]);
+    }
+  }
+}
+
+void ControlFirmata::report(bool elapsed)
+{
+  unsigned long now = millis();
+  if (now - lastStep >= interval) {
+    // a fixed rate, but no burst of steps to catch up after a long loop
+    lastStep = now - lastStep >= 2 * (unsigned long)interval ? now : lastStep + interval;
+    step();
+  }
+  if (elapsed) {
+    sendTelemetry();
+  }
+}
+
+void ControlFirmata::sendTelemetry()
+{
+  bool started = false;
+  for (byte i = 0; i < CONTROL_MAX_BLOCKS; i++) {
+    control_block* b = &blocks[i];
+    if (b->type == 127 || (b->flags & (CONTROL_RUN | CONTROL_REPORT)) != (CONTROL_RUN | CONTROL_REPORT)) {
+      continue;
+    }
+    if (!started) {
+      Firmata.beginMessage(FIRMATA_LANE_TELEMETRY, FIRMATA_CONTROL << 8 | i);
+      Firmata.startSysex();
+      Firmata.write(FIRMATA_CONTROL);
+      Firmata.write(CONTROL_TELEMETRY);
+      started = true;
+    }
+    Firmata.write(i);
+    Firmata.sendPackedUInt32((uint32_t)b->inputValue);
+    Firmata.sendPackedUInt32((uint32_t)b->outputValue);
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+    // with the output queue, every block is a telemetry source of its own
+    Firmata.endSysex();
+    Firmata.endMessage();
+    started = false;
+#endif
+  }
+  if (started) {
+    Firmata.endSysex();
+    Firmata.endMessage();
+  }
+}
+
+static void writePackedUInt32(Print& out, uint32_t value)
+{
+  for (byte i = 0; i < 5; i++) {
+    out.write((byte)(value & 0x7F));
+    value >>= 7;
+  }
+}
+
+void ControlFirmata::writeConfiguration(Print& out)
+{
+  const byte intervalMessage[] = { START_SYSEX, FIRMATA_CONTROL, CONTROL_INTERVAL, (byte)(interval & 0x7F), (byte)(interval >> 7), END_SYSEX };
+  out.write(intervalMessage, sizeof(intervalMessage));
+  for (byte i = 0; i < CONTROL_MAX_BLOCKS; i++) {
+    control_block* b = &blocks[i];
+    if (b->type == 127) {
+      continue;
+    }
+    const byte config[] = { START_SYSEX, FIRMATA_CONTROL, CONTROL_CONFIG, i, b->type, b->input, b->inputIndex, b->output, b->outputIndex };
+    out.write(config, sizeof(config));
+    writePackedUInt32(out, (uint32_t)b->outputMin);
+    writePackedUInt32(out, (uint32_t)b->outputMax);
+    out.write(END_SYSEX);
+
+    const byte gains[] = { START_SYSEX, FIRMATA_CONTROL, b->type == CONTROL_TYPE_PID ? (byte)CONTROL_PID : (byte)CONTROL_THRESHOLD, i };
+    out.write(gains, sizeof(gains));
+    for (byte g = 0; g < (b->type == CONTROL_TYPE_PID ? 3 : 1); g++) {
+      writePackedUInt32(out, (uint32_t)b->gains[g]);
+    }
+    out.write(END_SYSEX);
+
+    const byte setpoint[] = { START_SYSEX, FIRMATA_CONTROL, CONTROL_SETPOINT, i };
+    out.write(setpoint, sizeof(setpoint));
+    writePackedUInt32(out, (uint32_t)b->setpoint);
+    out.write(END_SYSEX);
+
+    const byte enable[] = { START_SYSEX, FIRMATA_CONTROL, CONTROL_ENABLE, i, b->flags, END_SYSEX };
+    out.write(enable, sizeof(enable));
+  }
+}
+
+void ControlFirmata::reset()
+{
+  for (byte i = 0; i < CONTROL_MAX_BLOCKS; i++) {
+    blocks[i].type = 127;
+  }
+  interval = CONTROL_DEFAULT_INTERVAL;
+}
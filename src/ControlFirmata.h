@@ -0,0 +1,127 @@
+/*
+  ControlFirmata.h - Firmata library
+
+  Closed loop control on the board: each block reads an input, compares it to its setpoint and
+  drives an output, at a fixed rate and without the round trip through the host. A block is
+  either a PID controller or a threshold switch with hysteresis.
+
+  Inputs: an analog channel (the raw reading), a pin measured by Frequency (ticks/s) or an
+  encoder of EncoderFirmata (its position). Outputs: a PWM pin (duty, as written by
+  AnalogOutputFirmata), a servo pin (degrees or microseconds) or an AccelStepperFirmata stepper
+  (speed in steps/s). The features for the encoder, frequency, servo and stepper have to be added
+  to FirmataExt as well, the control blocks find them by their sysex commands.
+
+  Host -> board (int32 values are packed with Firmata.sendPackedUInt32, gains are in 1/1000):
+  START_SYSEX, FIRMATA_CONTROL, CONTROL_CONFIG, block, type, input, input channel / pin / encoder,
+  output, output pin / stepper, output min (int32), output max (int32), END_SYSEX
+  START_SYSEX, FIRMATA_CONTROL, CONTROL_PID, block, kp (int32), ki (int32), kd (int32), END_SYSEX
+  START_SYSEX, FIRMATA_CONTROL, CONTROL_THRESHOLD, block, hysteresis (int32), END_SYSEX
+  START_SYSEX, FIRMATA_CONTROL, CONTROL_SETPOINT, block, setpoint (int32), END_SYSEX
+  START_SYSEX, FIRMATA_CONTROL, CONTROL_ENABLE, block, CONTROL_RUN | CONTROL_REPORT, END_SYSEX
+  START_SYSEX, FIRMATA_CONTROL, CONTROL_INTERVAL, loop interval in ms (2 x 7 bit), END_SYSEX
+
+  A threshold block sets its output to max below setpoint - hysteresis and to min above
+  setpoint + hysteresis (swap min and max to get the opposite). Disabled blocks leave their
+  output alone. The PID is reset when it is enabled.
+
+  Board -> host, every sampling interval for the blocks with CONTROL_REPORT:
+  START_SYSEX, FIRMATA_CONTROL, CONTROL_TELEMETRY, n x (block, input (int32), output (int32)), END_SYSEX
+  With the output queue (LARGE_MEM_DEVICE), every block comes in a message of its own.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef ControlFirmata_h
+#define ControlFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+
+// FIRMATA_CONTROL subcommands
+#define CONTROL_CONFIG          0x00
+#define CONTROL_PID             0x01
+#define CONTROL_THRESHOLD       0x02
+#define CONTROL_SETPOINT        0x03
+#define CONTROL_ENABLE          0x04
+#define CONTROL_INTERVAL        0x05
+#define CONTROL_TELEMETRY       0x06
+
+// block types
+#define CONTROL_TYPE_PID        0x00
+#define CONTROL_TYPE_THRESHOLD  0x01
+
+// inputs
+#define CONTROL_INPUT_ANALOG    0x00
+#define CONTROL_INPUT_FREQUENCY 0x01
+#define CONTROL_INPUT_ENCODER   0x02
+
+// outputs
+#define CONTROL_OUTPUT_PWM      0x00
+#define CONTROL_OUTPUT_SERVO    0x01
+#define CONTROL_OUTPUT_STEPPER  0x02
+
+// CONTROL_ENABLE flags
+#define CONTROL_RUN             0x01
+#define CONTROL_REPORT          0x02
+
+#ifndef CONTROL_MAX_BLOCKS
+#ifdef LARGE_MEM_DEVICE
+#define CONTROL_MAX_BLOCKS      8
+#else
+#define CONTROL_MAX_BLOCKS      4
+#endif
+#endif
+#define CONTROL_DEFAULT_INTERVAL 10 // ms
+
+class ControlFirmata: public FirmataFeature
+{
+  public:
+    ControlFirmata();
+    boolean handlePinMode(byte pin, int mode) override;
+    void handleCapability(byte pin) override {}
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    boolean ownsSysexCommand(byte command) override { return command == FIRMATA_CONTROL; }
+    void reset() override;
+    void report(bool elapsed) override;
+    void writeConfiguration(Print& out) override;
+
+    // one step of all running blocks, done by report() every loop interval
+    void step();
+
+  private:
+    struct control_block {
+      byte type; // 127 = unused
+      byte input;
+      byte inputIndex;
+      byte inputPin; // the analog input pin of the channel
+      byte output;
+      byte outputIndex;
+      byte flags;
+      int32_t outputMin;
+      int32_t outputMax;
+      int32_t setpoint;
+      int32_t gains[3]; // kp, ki, kd in 1/1000, or the hysteresis
+      bool started; // false until the first step after enabling
+      uint32_t lastTicks; // of a frequency input
+      float integral;
+      float lastInput;
+      int32_t inputValue;
+      int32_t outputValue;
+    };
+    control_block blocks[CONTROL_MAX_BLOCKS];
+    uint16_t interval; // ms
+    unsigned long lastStep;
+
+    bool configure(byte block, byte argc, byte* argv);
+    bool readInput(control_block* b, int32_t* value);
+    void writeOutput(control_block* b, int32_t value);
+    void stepBlock(control_block* b);
+    void sendTelemetry();
+};
+
+#endif
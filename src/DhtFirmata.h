@@ -17,14 +17,37 @@
 
 #include "FirmataFeature.h"
 #include "FirmataReporting.h"
+#include "utility/PinInterrupts.h"
 
 #define DHTSENSOR_RESPONSE (0)
 #define DHTSENSOR_ATTACH_DHT11 (0x01)
 #define DHTSENSOR_ATTACH_DHT22 (0x02)
 #define DHTSENSOR_DETACH (0x03)
 
-#include <DHT.h>
+#ifdef LARGE_MEM_DEVICE
+#define DHT_MAX_SENSORS 8
+#else
+#define DHT_MAX_SENSORS 4
+#endif
 
+#define DHT_START_SIGNAL_DHT11 18000 // us the data line is pulled low to start a measurement
+#define DHT_START_SIGNAL_DHT22 1100
+#define DHT_READ_TIMEOUT 10000 // us, a complete transmission takes about 5ms
+#define DHT_BIT_THRESHOLD 100 // us between falling edges: a 0 bit takes about 78us, a 1 about 120us
+#define DHT_EDGES 42 // falling edges in a transmission: response signal, start of the first bit and 40 bits
+
+struct dht_sensor {
+  int pin; // -1 if unused
+  byte type; // 11 or 22
+  bool requested; // the host asked for a measurement
+  unsigned int interval; // ms between automatic measurements, 0 = only on request
+  unsigned long lastRead;
+};
+
+// Reads DHT11/DHT22 sensors without blocking the main loop: The data line is sampled by an interrupt on falling edges,
+// the bit values are derived from the time between the edges. Pins without interrupt capability are sampled by polling,
+// which blocks for the duration of the transmission (about 5ms).
+// One measurement is done at a time, the responses are sent from report().
 class DhtFirmata: public FirmataFeature
 {
   public:
@@ -32,22 +55,82 @@ class DhtFirmata: public FirmataFeature
     boolean handlePinMode(byte pin, int mode);
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean ownsSysexCommand(byte command) override { return command == DHTSENSOR_DATA; }
     void reset();
-    void report();
+    void report(bool elapsed) override;
+    void writeConfiguration(Print& out) override;
 
   private:
+    enum AcquisitionState
+    {
+      DHT_IDLE,
+      DHT_START_SIGNAL,
+      DHT_RECEIVING,
+    };
+
     void performDhtTransfer(byte command, byte argc, byte *argv);
-    void disableDht();
-    bool _isDhtEnabled;
-    int _dhtPin; // Only one sensor supported
-    DHT* _dht;
+    void disableDht(int index);
+    int findSensor(int pin);
+    void startAcquisition(int index);
+    void receive();
+    void finishAcquisition();
+
+#ifdef ESP32
+    static void IRAM_ATTR onFallingEdge();
+    static void IRAM_ATTR edgeIsr();
+#else
+    static void onFallingEdge();
+    static void edgeIsr();
+#endif
+
+    dht_sensor _sensors[DHT_MAX_SENSORS];
+    int _activeSensor; // the sensor that is currently being read, -1 if none
+    AcquisitionState _state;
+    unsigned long _stateStart;
+    bool _interruptAttached;
+
+    // written by the edge interrupt
+    static volatile byte _edges;
+    static volatile unsigned long _lastEdge;
+    static volatile byte _data[5];
 };
 
+volatile byte DhtFirmata::_edges;
+volatile unsigned long DhtFirmata::_lastEdge;
+volatile byte DhtFirmata::_data[5];
 
 DhtFirmata::DhtFirmata()
 {
-  _isDhtEnabled = false;
-  _dhtPin = -1;
+  for (int i = 0; i < DHT_MAX_SENSORS; i++)
+  {
+    _sensors[i].pin = -1;
+  }
+  _activeSensor = -1;
+  _state = DHT_IDLE;
+  _stateStart = 0;
+  _interruptAttached = false;
+}
+
+void DhtFirmata::onFallingEdge()
+{
+  unsigned long now = micros();
+  byte edge = _edges;
+  if (edge >= 2 && edge < DHT_EDGES)
+  {
+    // The time since the previous falling edge is the length of bit (edge - 2)
+    byte bit = edge - 2;
+    if (now - _lastEdge > DHT_BIT_THRESHOLD)
+    {
+      _data[bit / 8] |= (0x80 >> (bit % 8));
+    }
+  }
+  _lastEdge = now;
+  _edges = edge + 1;
+}
+
+void DhtFirmata::edgeIsr()
+{
+  onFallingEdge();
 }
 
 boolean DhtFirmata::handlePinMode(byte pin, int mode)
@@ -56,9 +139,10 @@ boolean DhtFirmata::handlePinMode(byte pin, int mode)
     if (mode == PIN_MODE_DHT) {
       return true;
     }
-	else if (_isDhtEnabled) 
+	int index = findSensor(pin);
+	if (index >= 0)
 	{
-		disableDht();
+		disableDht(index);
 	}
   }
   return false;
@@ -78,7 +162,7 @@ boolean DhtFirmata::handleSysex(byte command, byte argc, byte *argv)
     case DHTSENSOR_DATA:
 		  if (argc < 2)
 		  {
-			  Firmata.sendString(F("Error in DHT command: Not enough parameters"));
+			  Firmata.sendEvent(EVENT_DHT_MESSAGE_TOO_SHORT, F("Error in DHT command: Not enough parameters"));
 			  return false;
 		  }
         performDhtTransfer(argv[0], argc - 1, argv + 1);
@@ -88,11 +172,31 @@ boolean DhtFirmata::handleSysex(byte command, byte argc, byte *argv)
   return false;
 }
 
+int DhtFirmata::findSensor(int pin)
+{
+	for (int i = 0; i < DHT_MAX_SENSORS; i++)
+	{
+		if (_sensors[i].pin == pin)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Format: DHT type or DHTSENSOR_DETACH, pin, optional interval for automatic measurements in ms (2 x 7 bit).
+// A measurement is started right away, the response follows once it's complete.
 void DhtFirmata::performDhtTransfer(byte command, byte argc, byte *argv)
 {
+	// first byte: pin
+	byte pin = argv[0];
 	if (command == DHTSENSOR_DETACH)
 	{
-		disableDht();
+		int index = findSensor(pin);
+		if (index >= 0)
+		{
+			disableDht(index);
+		}
 		return;
 	}
 	// command byte: DHT Type
@@ -107,33 +211,130 @@ void DhtFirmata::performDhtTransfer(byte command, byte argc, byte *argv)
 	{
 		dhtType = 22;
 	}
-	
-	// first byte: pin
-	byte pin = argv[0];
-	if (!_isDhtEnabled)
+	if (dhtType != 11 && dhtType != 22)
 	{
-		_dhtPin = pin;
-		_isDhtEnabled = true;
-		_dht = new DHT(pin, dhtType);
-		_dht->begin();
+		Firmata.sendEvent(EVENT_DHT_SENSOR_TYPE, F("DHT: Unsupported sensor type "), dhtType);
+		return;
 	}
-	else if (_dhtPin != pin)
+	if (pin >= TOTAL_PINS || !IS_PIN_DIGITAL(pin))
 	{
-		// Switching the pin unfortunately requires re-loading the DHT class
-		delete _dht;
-		_dht = nullptr;
-		_dht = new DHT(pin, dhtType);
-		_dht->begin();
+		Firmata.sendEvent(EVENT_DHT_INVALID_PIN, F("DHT: Invalid pin "), pin);
+		return;
 	}
-	
-	// Accuracy of the sensor is very limited, only 8 bit humidity and maybe 10 bit for temperature
-	short humidity = (short)_dht->readHumidity() * 10;
-	short temperature = (short)(_dht->readTemperature() * 10);
-	
+
+	int index = findSensor(pin);
+	if (index < 0)
+	{
+		index = findSensor(-1);
+		if (index < 0)
+		{
+			Firmata.sendEvent(EVENT_DHT_TOO_MANY_SENSORS, F("DHT: Max number of sensors exceeded"));
+			return;
+		}
+		_sensors[index].pin = pin;
+		_sensors[index].interval = 0;
+		_sensors[index].lastRead = millis();
+		Firmata.setPinMode(pin, PIN_MODE_DHT);
+		pinMode(pin, INPUT_PULLUP);
+	}
+	_sensors[index].type = dhtType;
+	_sensors[index].requested = true;
+	if (argc >= 3)
+	{
+		_sensors[index].interval = argv[1] | (argv[2] << 7);
+	}
+}
+
+void DhtFirmata::startAcquisition(int index)
+{
+	dht_sensor& sensor = _sensors[index];
+	_activeSensor = index;
+	sensor.requested = false;
+	sensor.lastRead = millis();
+	// Pull the line low to wake the sensor up
+	pinMode(sensor.pin, OUTPUT);
+	digitalWrite(sensor.pin, LOW);
+	_state = DHT_START_SIGNAL;
+	_stateStart = micros();
+}
+
+void DhtFirmata::receive()
+{
+	dht_sensor& sensor = _sensors[_activeSensor];
+	_edges = 0;
+	for (int i = 0; i < 5; i++)
+	{
+		_data[i] = 0;
+	}
+	int interrupt = digitalPinToInterrupt(sensor.pin);
+	_state = DHT_RECEIVING;
+	_stateStart = micros();
+	// Release the line, the sensor answers after 20-40us
+	pinMode(sensor.pin, INPUT_PULLUP);
+	if (interrupt >= 0)
+	{
+		PinInterrupts::attach(interrupt, edgeIsr, FALLING, this);
+		_interruptAttached = true;
+		return;
+	}
+
+	// No interrupt on this pin, sample it
+	int previous = HIGH;
+	while (_edges < DHT_EDGES && micros() - _stateStart < DHT_READ_TIMEOUT)
+	{
+		int level = digitalRead(sensor.pin);
+		if (previous == HIGH && level == LOW)
+		{
+			onFallingEdge();
+		}
+		previous = level;
+	}
+	finishAcquisition();
+}
+
+void DhtFirmata::finishAcquisition()
+{
+	dht_sensor& sensor = _sensors[_activeSensor];
+	if (_interruptAttached)
+	{
+		PinInterrupts::detach(digitalPinToInterrupt(sensor.pin), this);
+		_interruptAttached = false;
+	}
+	_state = DHT_IDLE;
+	_activeSensor = -1;
+
+	if (_edges < DHT_EDGES || (byte)(_data[0] + _data[1] + _data[2] + _data[3]) != _data[4])
+	{
+		Firmata.sendEvent(EVENT_DHT_READ_ERROR, F("DHT: Error reading sensor on pin "), sensor.pin);
+		return;
+	}
+
+	// Values are sent in tenths
+	short humidity;
+	short temperature;
+	if (sensor.type == 11)
+	{
+		humidity = _data[0] * 10 + _data[1];
+		temperature = (_data[2] * 10 + (_data[3] & 0x7F));
+		if (_data[3] & 0x80)
+		{
+			temperature = -temperature;
+		}
+	}
+	else
+	{
+		humidity = (_data[0] << 8) | _data[1];
+		temperature = ((_data[2] & 0x7F) << 8) | _data[3];
+		if (_data[2] & 0x80)
+		{
+			temperature = -temperature;
+		}
+	}
+
 	Firmata.startSysex();
 	Firmata.write(DHTSENSOR_DATA);
 	Firmata.write(DHTSENSOR_RESPONSE);
-	Firmata.write(pin);
+	Firmata.write((byte)sensor.pin);
 	Firmata.write(temperature & 0x7f);
 	Firmata.write((temperature >> 7) & 0x7f);
 	
@@ -142,22 +343,77 @@ void DhtFirmata::performDhtTransfer(byte command, byte argc, byte *argv)
 	Firmata.endSysex();
 }
 
-void DhtFirmata::disableDht()
+void DhtFirmata::disableDht(int index)
 {
-	delete _dht;
-	_dht = NULL;
-	_isDhtEnabled = false;
+	if (_activeSensor == index)
+	{
+		if (_interruptAttached)
+		{
+			PinInterrupts::detach(digitalPinToInterrupt(_sensors[index].pin), this);
+			_interruptAttached = false;
+		}
+		_state = DHT_IDLE;
+		_activeSensor = -1;
+	}
+	_sensors[index].pin = -1;
 }
 
 void DhtFirmata::reset()
 {
-  if (_isDhtEnabled) {
-	disableDht();
+  for (int i = 0; i < DHT_MAX_SENSORS; i++)
+  {
+	if (_sensors[i].pin >= 0)
+	{
+	  disableDht(i);
+	}
   }
 }
 
-void DhtFirmata::report()
+// the sensors with their intervals, each is measured once after the restore
+void DhtFirmata::writeConfiguration(Print& out)
 {
+  for (int i = 0; i < DHT_MAX_SENSORS; i++)
+  {
+	if (_sensors[i].pin >= 0)
+	{
+	  const byte config[] = { START_SYSEX, DHTSENSOR_DATA, _sensors[i].type, (byte)_sensors[i].pin,
+		(byte)(_sensors[i].interval & 0x7F), (byte)((_sensors[i].interval >> 7) & 0x7F), END_SYSEX };
+	  out.write(config, sizeof(config));
+	}
+  }
+}
+
+void DhtFirmata::report(bool elapsed)
+{
+	switch (_state)
+	{
+	case DHT_IDLE:
+	{
+		unsigned long now = millis();
+		for (int i = 0; i < DHT_MAX_SENSORS; i++)
+		{
+			dht_sensor& sensor = _sensors[i];
+			if (sensor.pin >= 0 && (sensor.requested || (sensor.interval != 0 && now - sensor.lastRead >= sensor.interval)))
+			{
+				startAcquisition(i);
+				break;
+			}
+		}
+		break;
+	}
+	case DHT_START_SIGNAL:
+		if (micros() - _stateStart >= (_sensors[_activeSensor].type == 11 ? DHT_START_SIGNAL_DHT11 : DHT_START_SIGNAL_DHT22))
+		{
+			receive();
+		}
+		break;
+	case DHT_RECEIVING:
+		if (_edges >= DHT_EDGES || micros() - _stateStart >= DHT_READ_TIMEOUT)
+		{
+			finishAcquisition();
+		}
+		break;
+	}
 }
 
 #endif 
@@ -18,9 +18,29 @@
 
 #include <ConfigurableFirmata.h>
 #include "DigitalInputFirmata.h"
+#include "utility/PinInterrupts.h"
 
 DigitalInputFirmata *DigitalInputFirmataInstance;
 
+volatile bool DigitalInputFirmata::pinsChanged = false;
+#ifdef ESP32
+volatile uint32_t DigitalInputFirmata::changedPins[TOTAL_PORTS];
+
+void IRAM_ATTR DigitalInputFirmata::pinChangeIsr(void* arg)
+{
+  byte pin = (byte)(uintptr_t)arg;
+  // The handler may run on either core, therefore use an atomic update
+  __atomic_fetch_or(&changedPins[pin / 8], (uint32_t)(1 << (pin & 7)), __ATOMIC_RELAXED);
+  pinsChanged = true;
+}
+#else
+void DigitalInputFirmata::pinChangeIsr()
+{
+  // The ISR only tells the main loop that something changed, it doesn't know which pin triggered it
+  pinsChanged = true;
+}
+#endif
+
 void reportDigitalInputCallback(byte port, int value)
 {
   DigitalInputFirmataInstance->reportDigital(port, value);
@@ -33,7 +53,9 @@ DigitalInputFirmata::DigitalInputFirmata()
     portConfigInputs[i] = 0;
     previousPINs[i] = 0;
     reportPINs[i] = 0;
+    interruptPins[i] = 0;
   }
+  useInterrupts = false;
   DigitalInputFirmataInstance = this;
   Firmata.attach(REPORT_DIGITAL, reportDigitalInputCallback);
 }
@@ -43,15 +65,32 @@ boolean DigitalInputFirmata::handleSysex(byte command, byte argc, byte* argv)
   return false;
 }
 
+void DigitalInputFirmata::writeConfiguration(Print& out)
+{
+  for (byte port = 0; port < TOTAL_PORTS && port < 16; port++) {
+    if (reportPINs[port]) {
+      out.write(REPORT_DIGITAL | port);
+      out.write((byte)1);
+    }
+  }
+}
+
 void DigitalInputFirmata::outputPort(byte portNumber, byte portValue, byte forceSend)
 {
   // pins not configured as INPUT are cleared to zeros
   portValue = portValue & portConfigInputs[portNumber];
   // only send if the value is different than previously sent
-  if (forceSend || previousPINs[portNumber] != portValue) {
+  if (forceSend) {
     Firmata.sendDigitalPort(portNumber, portValue);
     previousPINs[portNumber] = portValue;
   }
+  else if (previousPINs[portNumber] != portValue) {
+    // a change is telemetry, a newer one replaces it while it is queued
+    Firmata.beginMessage(FIRMATA_LANE_TELEMETRY, DIGITAL_MESSAGE << 8 | portNumber);
+    Firmata.sendDigitalPort(portNumber, portValue);
+    Firmata.endMessage();
+    previousPINs[portNumber] = portValue;
+  }
 }
 
 /* -----------------------------------------------------------------------------
@@ -59,6 +98,10 @@ void DigitalInputFirmata::outputPort(byte portNumber, byte portValue, byte force
  * to the Serial output queue using Serial.print() */
 void DigitalInputFirmata::report(bool elapsed)
 {
+    if (pinsChanged)
+    {
+        reportChangedPorts();
+    }
     if (!elapsed)
     {
         return;
@@ -95,6 +138,77 @@ void DigitalInputFirmata::report(bool elapsed)
 #endif
 }
 
+/* -----------------------------------------------------------------------------
+ * report the ports on which a pin change interrupt occurred since the last call */
+void DigitalInputFirmata::reportChangedPorts()
+{
+  pinsChanged = false;
+  for (byte i = 0; i < TOTAL_PORTS; i++)
+  {
+    if (!reportPINs[i] || !interruptPins[i])
+    {
+      continue;
+    }
+    byte portValue = readPort(i, portConfigInputs[i]) & portConfigInputs[i];
+#ifdef ESP32
+    byte edges = (byte)__atomic_exchange_n(&changedPins[i], 0, __ATOMIC_RELAXED);
+    // A pin that went back to its previous level since the last report saw a pulse that would otherwise be lost:
+    // send the state with that pin toggled first
+    byte intermediate = (previousPINs[i] ^ edges) & portConfigInputs[i];
+    if (intermediate != portValue)
+    {
+      outputPort(i, intermediate, false);
+    }
+#endif
+    outputPort(i, portValue, false);
+  }
+}
+
+void DigitalInputFirmata::setInterruptReporting(bool enable)
+{
+  useInterrupts = enable;
+  for (byte pin = 0; pin < TOTAL_PINS; pin++)
+  {
+    if (!IS_PIN_DIGITAL(pin) || !(portConfigInputs[pin / 8] & (1 << (pin & 7))))
+    {
+      continue;
+    }
+    if (enable)
+    {
+      attachPinInterrupt(pin);
+    }
+    else
+    {
+      detachPinInterrupt(pin);
+    }
+  }
+}
+
+void DigitalInputFirmata::attachPinInterrupt(byte pin)
+{
+  int interrupt = digitalPinToInterrupt(PIN_TO_DIGITAL(pin));
+  if (!useInterrupts || interrupt < 0 || ((interruptPins[pin / 8] & (1 << (pin & 7))) && PinInterrupts::isOwner(interrupt, this)))
+  {
+    return;
+  }
+#ifdef ESP32
+  PinInterrupts::attachArg(interrupt, pinChangeIsr, (void*)(uintptr_t)pin, CHANGE, this);
+#else
+  PinInterrupts::attach(interrupt, pinChangeIsr, CHANGE, this);
+#endif
+  interruptPins[pin / 8] |= (1 << (pin & 7));
+}
+
+void DigitalInputFirmata::detachPinInterrupt(byte pin)
+{
+  if (interruptPins[pin / 8] & (1 << (pin & 7)))
+  {
+    // a feature that took the interrupt over since (e.g. a frequency counter or a task trigger) keeps it
+    PinInterrupts::detach(digitalPinToInterrupt(PIN_TO_DIGITAL(pin)), this);
+    interruptPins[pin / 8] &= ~(1 << (pin & 7));
+  }
+}
+
 void DigitalInputFirmata::reportDigital(byte port, int value)
 {
   if (port < TOTAL_PORTS) {
@@ -123,8 +237,10 @@ boolean DigitalInputFirmata::handlePinMode(byte pin, int mode)
         pinMode(PIN_TO_DIGITAL(pin), INPUT_PULLUP);
         Firmata.setPinState(pin, 1);
       }
+      attachPinInterrupt(pin);
       return true;
     } else {
+      detachPinInterrupt(pin);
       portConfigInputs[pin / 8] &= ~(1 << (pin & 7));
       return true;
     }
@@ -144,6 +260,9 @@ void DigitalInputFirmata::handleCapability(byte pin)
 
 void DigitalInputFirmata::reset()
 {
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    detachPinInterrupt(pin);
+  }
   for (byte i = 0; i < TOTAL_PORTS; i++) {
     reportPINs[i] = false;      // by default, reporting off
     portConfigInputs[i] = 0;    // until activated
@@ -30,8 +30,16 @@ class DigitalInputFirmata: public FirmataFeature
     void report(bool elapsed);
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
+    // Only used to select this feature in REPORT_INTERVAL messages
+    boolean ownsSysexCommand(byte command) override { return command == REPORT_DIGITAL_PIN; }
     boolean handlePinMode(byte pin, int mode);
     void reset();
+    void writeConfiguration(Print& out) override;
+    /// <summary>
+    /// Use pin change interrupts to detect changes on input pins. Changed ports are then reported on the next loop
+    /// iteration, instead of waiting for the sampling interval. Off by default.
+    /// </summary>
+    void setInterruptReporting(bool enable);
 
   private:
     /* digital input ports */
@@ -41,6 +49,20 @@ class DigitalInputFirmata: public FirmataFeature
     /* pins configuration */
     byte portConfigInputs[TOTAL_PORTS]; // each bit: 1 = pin in INPUT, 0 = anything else
     void outputPort(byte portNumber, byte portValue, byte forceSend);
+
+    /* interrupt driven change detection */
+    void reportChangedPorts();
+    void attachPinInterrupt(byte pin);
+    void detachPinInterrupt(byte pin);
+    bool useInterrupts;
+    byte interruptPins[TOTAL_PORTS];    // each bit: 1 = this feature attached the interrupt of this pin
+#ifdef ESP32
+    static void IRAM_ATTR pinChangeIsr(void* arg);
+    static volatile uint32_t changedPins[TOTAL_PORTS]; // each bit: 1 = the pin saw an edge since the last report
+#else
+    static void pinChangeIsr();
+#endif
+    static volatile bool pinsChanged;
 };
 
 #endif
@@ -61,29 +61,19 @@ void DigitalOutputFirmata::reset()
 
 void DigitalOutputFirmata::digitalWritePort(byte port, int value)
 {
-  byte pin, lastPin, pinValue, mask = 1, pinWriteMask = 0;
-
   if (port < TOTAL_PORTS) {
-    // create a mask of the pins on this port that are writable.
-    lastPin = port * 8 + 8;
-    if (lastPin > TOTAL_PINS) lastPin = TOTAL_PINS;
-    for (pin = port * 8; pin < lastPin; pin++) {
-      // do not disturb non-digital pins (eg, Rx & Tx)
-      if (IS_PIN_DIGITAL(pin)) {
-        // do not touch pins in PWM, ANALOG, SERVO or other modes
-        if (Firmata.getPinMode(pin) == PIN_MODE_OUTPUT || Firmata.getPinMode(pin) == INPUT) {
-          pinValue = ((byte)value & mask) ? 1 : 0;
-          if (Firmata.getPinMode(pin) == PIN_MODE_OUTPUT) {
-            pinWriteMask |= mask;
-          } else if (Firmata.getPinMode(pin) == INPUT && pinValue == 1 && Firmata.getPinState(pin) != 1) {
-            pinMode(pin, INPUT_PULLUP);
-          }
-          Firmata.setPinState(pin, pinValue);
-        }
+    // only touch digital pins in OUTPUT or INPUT mode, not pins in PWM, ANALOG, SERVO or other modes
+    byte outputs = Firmata.getPortOutputMask(port);
+    byte inputs = Firmata.getPortInputMask(port);
+    // a 1 written to an input pin enables its pull-up
+    byte pullups = (byte)value & inputs & ~Firmata.getPortState(port);
+    for (byte pin = port * 8; pullups != 0; pin++, pullups >>= 1) {
+      if (pullups & 1) {
+        pinMode(pin, INPUT_PULLUP);
       }
-      mask = mask << 1;
     }
-    writePort(port, (byte)value, pinWriteMask);
+    Firmata.setPortState(port, (byte)value, outputs | inputs);
+    writePort(port, (byte)value, outputs);
   }
 }
 
@@ -51,13 +51,104 @@ void Encoder7BitClass::writeBinary(byte data)
   }
 }
 
+// 7 bytes -> 8 septets, LSB first
+static inline void encodeBlock(const byte *in, byte *out)
+{
+#ifdef ENCODER7BIT_32BIT
+  uint32_t lo = in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+  uint32_t hi = (lo >> 28) | ((uint32_t)in[4] << 4) | ((uint32_t)in[5] << 12) | ((uint32_t)in[6] << 20);
+  out[0] = lo & 0x7F;
+  out[1] = (lo >> 7) & 0x7F;
+  out[2] = (lo >> 14) & 0x7F;
+  out[3] = (lo >> 21) & 0x7F;
+  out[4] = hi & 0x7F;
+  out[5] = (hi >> 7) & 0x7F;
+  out[6] = (hi >> 14) & 0x7F;
+  out[7] = (hi >> 21) & 0x7F;
+#else
+  uint64_t v = 0;
+  for (byte i = 0; i < 7; i++) {
+    v |= (uint64_t)in[i] << (i * 8);
+  }
+  for (byte i = 0; i < 8; i++) {
+    out[i] = (v >> (i * 7)) & 0x7F;
+  }
+#endif
+}
+
+// 8 septets -> 7 bytes, all input is read before the output is written
+static inline void decodeBlock(const byte *in, byte *out)
+{
+#ifdef ENCODER7BIT_32BIT
+  uint32_t lo = in[0] | ((uint32_t)in[1] << 7) | ((uint32_t)in[2] << 14) | ((uint32_t)in[3] << 21);
+  uint32_t hi = in[4] | ((uint32_t)in[5] << 7) | ((uint32_t)in[6] << 14) | ((uint32_t)in[7] << 21);
+  out[0] = lo;
+  out[1] = lo >> 8;
+  out[2] = lo >> 16;
+  out[3] = (lo >> 24) | (hi << 4);
+  out[4] = hi >> 4;
+  out[5] = hi >> 12;
+  out[6] = hi >> 20;
+#else
+  uint64_t v = 0;
+  for (byte i = 0; i < 8; i++) {
+    v |= (uint64_t)in[i] << (i * 7);
+  }
+  for (byte i = 0; i < 7; i++) {
+    out[i] = v >> (i * 8);
+  }
+#endif
+}
+
+void Encoder7BitClass::writeBinary(const byte *data, int length)
+{
+  // continue a sequence that was started with single bytes until a block starts
+  while (length > 0 && shift != 0) {
+    writeBinary(*data++);
+    length--;
+  }
+  byte buffer[num7BitInbytes(ENCODER7BIT_CHUNK_SIZE)];
+  while (length >= 7) {
+    int chunk = length < ENCODER7BIT_CHUNK_SIZE ? length - length % 7 : ENCODER7BIT_CHUNK_SIZE;
+    byte *out = buffer;
+    for (int i = 0; i < chunk; i += 7, out += 8) {
+      encodeBlock(data + i, out);
+    }
+    Firmata.write(buffer, out - buffer);
+    data += chunk;
+    length -= chunk;
+  }
+  while (length > 0) {
+    writeBinary(*data++);
+    length--;
+  }
+}
+
+int Encoder7BitClass::encode(const byte *data, int length, byte *outData)
+{
+  int count = 0;
+  for (; length >= 7; length -= 7, data += 7, count += 8) {
+    encodeBlock(data, outData + count);
+  }
+  if (length > 0) {
+    byte last[7] = { 0 };
+    byte septets[8];
+    memcpy(last, data, length);
+    encodeBlock(last, septets);
+    memcpy(outData + count, septets, length + 1);
+    count += length + 1;
+  }
+  return count;
+}
+
 void Encoder7BitClass::readBinary(int outBytes, byte *inData, byte *outData)
 {
+  for (; outBytes >= 7; outBytes -= 7, inData += 8, outData += 7) {
+    decodeBlock(inData, outData);
+  }
+  // the remaining bytes i start at bit i of septet i
   for (int i = 0; i < outBytes; i++) {
-    int j = i << 3;
-    int pos = j / 7;
-    byte shift = j % 7;
-    outData[i] = (inData[pos] >> shift) | ((inData[pos + 1] << (7 - shift)) & 0xFF);
+    outData[i] = (inData[i] >> i) | ((inData[i + 1] << (7 - i)) & 0xFF);
   }
 }
 
@@ -20,6 +20,19 @@
 #endif
 
 #define num7BitOutbytes(a)(((a)*7)>>3)
+// number of 7 bit bytes needed for a bytes
+#define num7BitInbytes(a)(((a)*8+6)/7)
+
+// 7 bytes are packed into 8 septets at a time, in a 64 bit word or, where 64 bit shifts are slow, in two 32 bit words
+#if defined(__AVR__) && !defined(ENCODER7BIT_32BIT)
+#define ENCODER7BIT_32BIT
+#endif
+
+#ifdef LARGE_MEM_DEVICE
+#define ENCODER7BIT_CHUNK_SIZE 252 // bytes encoded per bulk write, a multiple of 7
+#else
+#define ENCODER7BIT_CHUNK_SIZE 28
+#endif
 
 class Encoder7BitClass
 {
@@ -28,7 +41,12 @@ class Encoder7BitClass
     void startBinaryWrite();
     void endBinaryWrite();
     void writeBinary(byte data);
+    // same as calling writeBinary() for every byte, but writes 7 byte blocks in bulk
+    void writeBinary(const byte *data, int length);
+    // decode outBytes bytes, inData and outData may be the same buffer
     static void readBinary(int outBytes, byte *inData, byte *outData);
+    // encode length bytes into num7BitInbytes(length) septets, the last one padded with zero bits
+    static int encode(const byte *data, int length, byte *outData);
 
   private:
     byte previous;
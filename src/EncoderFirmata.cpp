@@ -0,0 +1,380 @@
+/*
+  EncoderFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "EncoderFirmata.h"
+#include "utility/PinInterrupts.h"
+#ifdef FIRMATA_PCNT_UNITS
+// The PCNT counters are 16 bit signed, they are reset to 0 when reaching a limit
+#define ENCODER_PCNT_LIMIT 16384
+#endif
+
+static EncoderFirmata* EncoderFirmataInstance;
+
+// the step for a change from the previous to the current state of the pins, (A << 1 | B) each
+static const int8_t quadratureSteps[16] = { 0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0 };
+
+#ifndef FIRMATA_PCNT_UNITS
+template<int N> static void encoderIsr()
+{
+  EncoderFirmataInstance->update(N);
+}
+
+static const voidFuncPtr encoderIsrs[] = { encoderIsr<0>, encoderIsr<1>, encoderIsr<2>, encoderIsr<3>, encoderIsr<4>,
+  encoderIsr<5>, encoderIsr<6>, encoderIsr<7> };
+#endif
+
+EncoderFirmata::EncoderFirmata()
+{
+  EncoderFirmataInstance = this;
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    encoders[i].method = ENCODER_UNUSED;
+  }
+  autoReport = false;
+  reportMode = 0;
+  lastSample = millis();
+}
+
+#ifdef FIRMATA_PCNT_UNITS
+void IRAM_ATTR EncoderFirmata::pcntLimitIsr(void* arg)
+{
+  byte encoder = (uintptr_t)arg;
+  uint32_t status = 0;
+  pcnt_get_event_status(EncoderFirmataInstance->encoders[encoder].unit, &status);
+  if (status & PCNT_EVT_H_LIM) {
+    EncoderFirmataInstance->encoders[encoder].count += ENCODER_PCNT_LIMIT;
+  } else if (status & PCNT_EVT_L_LIM) {
+    EncoderFirmataInstance->encoders[encoder].count -= ENCODER_PCNT_LIMIT;
+  }
+}
+
+// a pin of an encoder that could not be attached goes back to its previous mode
+void EncoderFirmata::restorePin(byte pin, byte mode)
+{
+  Firmata.setPinMode(pin, mode);
+  if (mode == PIN_MODE_OUTPUT) {
+    pinMode(PIN_TO_DIGITAL(pin), OUTPUT);
+  } else if (mode == PIN_MODE_INPUT) {
+    pinMode(PIN_TO_DIGITAL(pin), INPUT);
+  } else if (mode == PIN_MODE_PULLUP) {
+    pinMode(PIN_TO_DIGITAL(pin), INPUT_PULLUP);
+  }
+}
+#endif
+
+void EncoderFirmata::handleCapability(byte pin)
+{
+  if (IS_PIN_DIGITAL(pin)) {
+    Firmata.write(PIN_MODE_ENCODER);
+    Firmata.write(28); // the position is reported with 28 bits
+  }
+}
+
+boolean EncoderFirmata::handlePinMode(byte pin, int mode)
+{
+  if (mode == PIN_MODE_ENCODER) {
+    // the pins are set up by ENCODER_ATTACH
+    return IS_PIN_DIGITAL(pin);
+  }
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    if (encoders[i].method != ENCODER_UNUSED && (encoders[i].pinA == pin || encoders[i].pinB == pin)) {
+      detach(i);
+    }
+  }
+  return false;
+}
+
+boolean EncoderFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != ENCODER_DATA || argc < 1) {
+    return false;
+  }
+  byte encoder = argc >= 2 ? argv[1] : 0;
+  switch (argv[0]) {
+    case ENCODER_ATTACH:
+      if (argc < 4 || encoder >= MAX_ENCODERS) {
+        Firmata.sendString(F("Invalid encoder"));
+      } else if (!attach(encoder, argv[2], argv[3])) {
+        Firmata.sendString(F("Encoder pins not available"));
+      }
+      return true;
+    case ENCODER_REPORT_POSITION:
+      if (encoder < MAX_ENCODERS && encoders[encoder].method != ENCODER_UNUSED) {
+        sendPositions(encoder);
+      }
+      return true;
+    case ENCODER_REPORT_POSITIONS:
+      sendPositions(MAX_ENCODERS);
+      return true;
+    case ENCODER_RESET_POSITION:
+      if (encoder < MAX_ENCODERS) {
+        setPosition(encoder, 0);
+      }
+      return true;
+    case ENCODER_REPORT_AUTO:
+      autoReport = argc >= 2 && argv[1] != 0;
+      return true;
+    case ENCODER_DETACH:
+      if (encoder < MAX_ENCODERS) {
+        detach(encoder);
+      }
+      return true;
+    case ENCODER_REPORT_MODE:
+      reportMode = argc >= 2 ? argv[1] : 0;
+      return true;
+  }
+  return false;
+}
+
+bool EncoderFirmata::attach(byte encoder, byte pinA, byte pinB)
+{
+  if (!IS_PIN_DIGITAL(pinA) || !IS_PIN_DIGITAL(pinB) || pinA == pinB ||
+      Firmata.getPinMode(pinA) == PIN_MODE_IGNORE || Firmata.getPinMode(pinB) == PIN_MODE_IGNORE) {
+    return false;
+  }
+  detach(encoder);
+  encoder_state* e = &encoders[encoder];
+#ifdef FIRMATA_PCNT_UNITS
+  pcnt_unit_t unit = PcntUnits::allocate();
+  if (unit == PCNT_UNIT_MAX) {
+    return false;
+  }
+  e->unit = unit;
+  byte modeA = Firmata.getPinMode(pinA);
+  byte modeB = Firmata.getPinMode(pinB);
+#endif
+  Firmata.setPinMode(pinA, PIN_MODE_ENCODER);
+  Firmata.setPinMode(pinB, PIN_MODE_ENCODER);
+  pinMode(PIN_TO_DIGITAL(pinA), INPUT_PULLUP);
+  pinMode(PIN_TO_DIGITAL(pinB), INPUT_PULLUP);
+  e->pinA = pinA;
+  e->pinB = pinB;
+  e->count = 0;
+  e->lastPosition = 0;
+  e->velocity = 0;
+  e->reportedPosition = 0;
+  e->lastAB = (digitalRead(PIN_TO_DIGITAL(pinA)) << 1) | digitalRead(PIN_TO_DIGITAL(pinB));
+#ifdef FIRMATA_PCNT_UNITS
+  // x4 decoding: each channel counts the edges of one pin, in the direction given by the other one
+  pcnt_config_t config = {};
+  config.pulse_gpio_num = PIN_TO_DIGITAL(pinA);
+  config.ctrl_gpio_num = PIN_TO_DIGITAL(pinB);
+  config.lctrl_mode = PCNT_MODE_REVERSE;
+  config.hctrl_mode = PCNT_MODE_KEEP;
+  config.pos_mode = PCNT_COUNT_DEC;
+  config.neg_mode = PCNT_COUNT_INC;
+  config.counter_h_lim = ENCODER_PCNT_LIMIT;
+  config.counter_l_lim = -ENCODER_PCNT_LIMIT;
+  config.unit = unit;
+  config.channel = PCNT_CHANNEL_0;
+  if (pcnt_unit_config(&config) != ESP_OK) {
+    PcntUnits::release(unit);
+    restorePin(pinA, modeA);
+    restorePin(pinB, modeB);
+    return false;
+  }
+  config.pulse_gpio_num = PIN_TO_DIGITAL(pinB);
+  config.ctrl_gpio_num = PIN_TO_DIGITAL(pinA);
+  config.pos_mode = PCNT_COUNT_INC;
+  config.neg_mode = PCNT_COUNT_DEC;
+  config.channel = PCNT_CHANNEL_1;
+  pcnt_unit_config(&config);
+  pcnt_set_filter_value(unit, 100); // ignore glitches shorter than 100 APB cycles (1.25 us)
+  pcnt_filter_enable(unit);
+  PcntUnits::installIsrService();
+  pcnt_counter_pause(unit);
+  pcnt_counter_clear(unit);
+  pcnt_event_enable(unit, PCNT_EVT_H_LIM);
+  pcnt_event_enable(unit, PCNT_EVT_L_LIM);
+  pcnt_isr_handler_add(unit, pcntLimitIsr, (void*)(uintptr_t)encoder);
+  pcnt_counter_resume(unit);
+  e->method = ENCODER_HARDWARE;
+#else
+  if (IS_PIN_INTERRUPT(pinA) && IS_PIN_INTERRUPT(pinB) && encoder < sizeof(encoderIsrs) / sizeof(encoderIsrs[0])) {
+    e->method = ENCODER_INTERRUPT;
+    PinInterrupts::attach(digitalPinToInterrupt(PIN_TO_DIGITAL(pinA)), encoderIsrs[encoder], CHANGE, this);
+    PinInterrupts::attach(digitalPinToInterrupt(PIN_TO_DIGITAL(pinB)), encoderIsrs[encoder], CHANGE, this);
+  } else {
+    e->method = ENCODER_POLLED;
+  }
+#endif
+  return true;
+}
+
+void EncoderFirmata::detach(byte encoder)
+{
+  encoder_state* e = &encoders[encoder];
+  if (e->method == ENCODER_UNUSED) {
+    return;
+  }
+#ifdef FIRMATA_PCNT_UNITS
+  pcnt_unit_t unit = e->unit;
+  pcnt_counter_pause(unit);
+  pcnt_isr_handler_remove(unit);
+  pcnt_set_pin(unit, PCNT_CHANNEL_0, PCNT_PIN_NOT_USED, PCNT_PIN_NOT_USED);
+  pcnt_set_pin(unit, PCNT_CHANNEL_1, PCNT_PIN_NOT_USED, PCNT_PIN_NOT_USED);
+  PcntUnits::release(unit);
+#else
+  if (e->method == ENCODER_INTERRUPT) {
+    PinInterrupts::detach(digitalPinToInterrupt(PIN_TO_DIGITAL(e->pinA)), this);
+    PinInterrupts::detach(digitalPinToInterrupt(PIN_TO_DIGITAL(e->pinB)), this);
+  }
+#endif
+  e->method = ENCODER_UNUSED;
+}
+
+void EncoderFirmata::update(byte encoder)
+{
+  encoder_state* e = &encoders[encoder];
+  byte ab = (digitalRead(PIN_TO_DIGITAL(e->pinA)) << 1) | digitalRead(PIN_TO_DIGITAL(e->pinB));
+  e->count += quadratureSteps[(e->lastAB << 2) | ab];
+  e->lastAB = ab;
+}
+
+int32_t EncoderFirmata::getPosition(byte encoder)
+{
+  encoder_state* e = &encoders[encoder];
+#ifdef FIRMATA_PCNT_UNITS
+  if (e->method == ENCODER_HARDWARE) {
+    // the overflow interrupt may come in between
+    int32_t overflows;
+    int16_t counter;
+    do {
+      overflows = e->count;
+      pcnt_get_counter_value(e->unit, &counter);
+    } while (overflows != e->count);
+    return overflows + counter;
+  }
+#endif
+  noInterrupts();
+  int32_t position = e->count;
+  interrupts();
+  return position;
+}
+
+void EncoderFirmata::setPosition(byte encoder, int32_t position)
+{
+  encoder_state* e = &encoders[encoder];
+  noInterrupts();
+#ifdef FIRMATA_PCNT_UNITS
+  if (e->method == ENCODER_HARDWARE) {
+    pcnt_counter_clear(e->unit);
+  }
+#endif
+  e->count = position;
+  interrupts();
+  e->lastPosition = position;
+  e->reportedPosition = position;
+  e->velocity = 0;
+}
+
+void EncoderFirmata::sample()
+{
+  unsigned long now = millis();
+  unsigned long elapsed = now - lastSample;
+  lastSample = now;
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    if (encoders[i].method != ENCODER_UNUSED) {
+      int32_t position = getPosition(i);
+      encoders[i].velocity = elapsed > 0 ? (int32_t)((int64_t)(position - encoders[i].lastPosition) * 1000 / (long)elapsed) : 0;
+      encoders[i].lastPosition = position;
+    }
+  }
+}
+
+void EncoderFirmata::sendPosition(byte encoder)
+{
+  encoder_state* e = &encoders[encoder];
+  int32_t position = getPosition(encoder);
+  uint32_t magnitude = position < 0 ? -position : position;
+  Firmata.write(encoder | (position < 0 ? ENCODER_NEGATIVE : 0));
+  Firmata.write((byte)(magnitude & 0x7F));
+  Firmata.write((byte)((magnitude >> 7) & 0x7F));
+  Firmata.write((byte)((magnitude >> 14) & 0x7F));
+  Firmata.write((byte)((magnitude >> 21) & 0x7F));
+  if (reportMode & ENCODER_REPORT_VELOCITY) {
+    uint32_t velocity = (uint32_t)e->velocity;
+    Firmata.write((byte)(velocity & 0x7F));
+    Firmata.write((byte)((velocity >> 7) & 0x7F));
+    Firmata.write((byte)((velocity >> 14) & 0x7F));
+    Firmata.write((byte)((velocity >> 21) & 0x7F));
+  }
+  e->reportedPosition = position;
+}
+
+void EncoderFirmata::sendPositions(byte encoder)
+{
+  Firmata.startSysex();
+  Firmata.write(ENCODER_DATA);
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    if ((encoder == MAX_ENCODERS || encoder == i) && encoders[i].method != ENCODER_UNUSED) {
+      sendPosition(i);
+    }
+  }
+  Firmata.endSysex();
+}
+
+void EncoderFirmata::report(bool elapsed)
+{
+  bool attached = false;
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    if (encoders[i].method == ENCODER_POLLED) {
+      update(i);
+    }
+    attached |= encoders[i].method != ENCODER_UNUSED;
+  }
+  if (!elapsed || !attached) {
+    return;
+  }
+  sample();
+  if (!autoReport) {
+    return;
+  }
+  if (reportMode & ENCODER_REPORT_ON_CHANGE) {
+    bool moved = false;
+    for (byte i = 0; i < MAX_ENCODERS; i++) {
+      moved |= encoders[i].method != ENCODER_UNUSED && encoders[i].lastPosition != encoders[i].reportedPosition;
+    }
+    if (!moved) {
+      return;
+    }
+  }
+  sendPositions(MAX_ENCODERS);
+}
+
+void EncoderFirmata::writeConfiguration(Print& out)
+{
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    if (encoders[i].method != ENCODER_UNUSED) {
+      out.write(START_SYSEX);
+      out.write(ENCODER_DATA);
+      out.write((byte)ENCODER_ATTACH);
+      out.write(i);
+      out.write(encoders[i].pinA);
+      out.write(encoders[i].pinB);
+      out.write(END_SYSEX);
+    }
+  }
+  if (reportMode != 0 || autoReport) {
+    const byte settings[] = { START_SYSEX, ENCODER_DATA, ENCODER_REPORT_MODE, reportMode, END_SYSEX,
+      START_SYSEX, ENCODER_DATA, ENCODER_REPORT_AUTO, (byte)autoReport, END_SYSEX };
+    out.write(settings, sizeof(settings));
+  }
+}
+
+void EncoderFirmata::reset()
+{
+  for (byte i = 0; i < MAX_ENCODERS; i++) {
+    detach(i);
+  }
+  autoReport = false;
+  reportMode = 0;
+}
@@ -0,0 +1,118 @@
+/*
+  EncoderFirmata.h - Firmata library
+
+  Quadrature encoders, counted on the board so that no step is lost, whatever the host does.
+  On the ESP32, each encoder uses a PCNT hardware counter, shared with Frequency (see
+  utility/PcntUnits.h). Elsewhere (and on ESP32 chips without PCNT), both pins of an encoder
+  need an interrupt. Encoders on
+  pins without one are polled once per loop, which is only good for slow, hand turned knobs.
+
+  The protocol is the one of the Firmata encoder feature, with ENCODER_REPORT_MODE added:
+
+  Host -> board:
+  START_SYSEX, ENCODER_DATA, ENCODER_ATTACH, encoder, pin A, pin B, END_SYSEX
+  START_SYSEX, ENCODER_DATA, ENCODER_REPORT_POSITION, encoder, END_SYSEX
+  START_SYSEX, ENCODER_DATA, ENCODER_REPORT_POSITIONS, END_SYSEX
+  START_SYSEX, ENCODER_DATA, ENCODER_RESET_POSITION, encoder, END_SYSEX
+  START_SYSEX, ENCODER_DATA, ENCODER_REPORT_AUTO, 0 / 1, END_SYSEX (all positions every sampling interval)
+  START_SYSEX, ENCODER_DATA, ENCODER_DETACH, encoder, END_SYSEX
+  START_SYSEX, ENCODER_DATA, ENCODER_REPORT_MODE, flags, END_SYSEX
+
+  Board -> host:
+  START_SYSEX, ENCODER_DATA, n x (encoder | 0x40 if the position is negative, |position| as 4 x 7 bit,
+  with ENCODER_REPORT_VELOCITY: velocity in counts/s as 4 x 7 bit, 28 bit two's complement), END_SYSEX
+
+  With ENCODER_REPORT_ON_CHANGE, the automatic report is skipped while no encoder moved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef EncoderFirmata_h
+#define EncoderFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+#include "utility/PcntUnits.h"
+
+// ENCODER_DATA subcommands
+#define ENCODER_ATTACH            0x00
+#define ENCODER_REPORT_POSITION   0x01
+#define ENCODER_REPORT_POSITIONS  0x02
+#define ENCODER_RESET_POSITION    0x03
+#define ENCODER_REPORT_AUTO       0x04
+#define ENCODER_DETACH            0x05
+#define ENCODER_REPORT_MODE       0x06
+
+// ENCODER_REPORT_MODE flags
+#define ENCODER_REPORT_VELOCITY   0x01
+#define ENCODER_REPORT_ON_CHANGE  0x02
+
+#define ENCODER_NEGATIVE          0x40
+
+#ifndef MAX_ENCODERS
+#ifdef FIRMATA_PCNT_UNITS
+#define MAX_ENCODERS              4
+#else
+#define MAX_ENCODERS              5
+#endif
+#endif
+
+// how an encoder is counted
+#define ENCODER_UNUSED            0
+#define ENCODER_HARDWARE          1
+#define ENCODER_INTERRUPT         2
+#define ENCODER_POLLED            3
+
+class EncoderFirmata: public FirmataFeature
+{
+  public:
+    EncoderFirmata();
+    void handleCapability(byte pin) override;
+    boolean handlePinMode(byte pin, int mode) override;
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    boolean ownsSysexCommand(byte command) override { return command == ENCODER_DATA; }
+    void reset() override;
+    void report(bool elapsed) override;
+    void writeConfiguration(Print& out) override;
+
+    bool attach(byte encoder, byte pinA, byte pinB);
+    void detach(byte encoder);
+    int32_t getPosition(byte encoder);
+    void setPosition(byte encoder, int32_t position);
+    // decodes a change of the pins, called from their interrupts
+    void update(byte encoder);
+
+  private:
+    struct encoder_state {
+      byte pinA;
+      byte pinB;
+      byte method;
+      volatile byte lastAB;
+      volatile int32_t count; // with ENCODER_HARDWARE, the overflows of the counter
+      int32_t lastPosition;   // at the last sampling interval
+      int32_t velocity;       // counts/s
+      int32_t reportedPosition;
+#ifdef FIRMATA_PCNT_UNITS
+      pcnt_unit_t unit;       // with ENCODER_HARDWARE
+#endif
+    };
+    encoder_state encoders[MAX_ENCODERS];
+    bool autoReport;
+    byte reportMode;
+    unsigned long lastSample;
+#ifdef FIRMATA_PCNT_UNITS
+    static void IRAM_ATTR pcntLimitIsr(void* arg);
+    void restorePin(byte pin, byte mode);
+#endif
+
+    void sample();
+    void sendPositions(byte encoder); // MAX_ENCODERS = all
+    void sendPosition(byte encoder);
+};
+
+#endif
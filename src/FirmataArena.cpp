@@ -0,0 +1,118 @@
+/*
+  FirmataArena.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "FirmataArena.h"
+
+FirmataArenaClass FirmataArena;
+
+#if FIRMATA_ARENA_SIZE > 0
+static size_t blockSize(byte* block)
+{
+  uint16_t size;
+  memcpy(&size, block - FIRMATA_ARENA_ALIGN, sizeof(size));
+  return size;
+}
+
+static void* nextFree(byte* block)
+{
+  void* next;
+  memcpy(&next, block, sizeof(next));
+  return next;
+}
+
+static void setNextFree(byte* block, void* next)
+{
+  memcpy(block, &next, sizeof(next));
+}
+#endif
+
+FirmataArenaClass::FirmataArenaClass()
+{
+  highWaterMark = 0;
+  heapFallbacks = 0;
+  reset();
+}
+
+void FirmataArenaClass::reset()
+{
+  top = 0;
+  used = 0;
+  freeList = nullptr;
+}
+
+bool FirmataArenaClass::inArena(void* block)
+{
+#if FIRMATA_ARENA_SIZE > 0
+  return (byte*)block >= memory && (byte*)block < memory + FIRMATA_ARENA_SIZE;
+#else
+  return false;
+#endif
+}
+
+void* FirmataArenaClass::allocate(size_t size)
+{
+#if FIRMATA_ARENA_SIZE > 0
+  size_t rounded = size == 0 ? FIRMATA_ARENA_ALIGN : (size + FIRMATA_ARENA_ALIGN - 1) / FIRMATA_ARENA_ALIGN * FIRMATA_ARENA_ALIGN;
+  byte* block = nullptr;
+  // a released block of the same size first, then fresh memory
+  byte* previous = nullptr;
+  for (byte* candidate = (byte*)freeList; candidate != nullptr; candidate = (byte*)nextFree(candidate)) {
+    if (blockSize(candidate) == rounded) {
+      if (previous == nullptr) {
+        freeList = nextFree(candidate);
+      } else {
+        setNextFree(previous, nextFree(candidate));
+      }
+      block = candidate;
+      break;
+    }
+    previous = candidate;
+  }
+  if (block == nullptr && top + FIRMATA_ARENA_ALIGN + rounded <= FIRMATA_ARENA_SIZE) {
+    block = memory + top + FIRMATA_ARENA_ALIGN;
+    uint16_t header = rounded;
+    memcpy(block - FIRMATA_ARENA_ALIGN, &header, sizeof(header));
+    top += FIRMATA_ARENA_ALIGN + rounded;
+  }
+  if (block != nullptr) {
+    used += FIRMATA_ARENA_ALIGN + rounded;
+    if (used > highWaterMark) {
+      highWaterMark = used;
+    }
+    return block;
+  }
+#endif
+  heapFallbacks++;
+  return malloc(size);
+}
+
+void FirmataArenaClass::release(void* block)
+{
+  if (block == nullptr) {
+    return;
+  }
+  if (!inArena(block)) {
+    free(block);
+    return;
+  }
+#if FIRMATA_ARENA_SIZE > 0
+  byte* b = (byte*)block;
+  size_t size = blockSize(b);
+  used -= FIRMATA_ARENA_ALIGN + size;
+  if (b + size == memory + top) {
+    top -= FIRMATA_ARENA_ALIGN + size; // the last block goes back to the fresh memory
+  } else {
+    setNextFree(b, freeList);
+    freeList = b;
+  }
+#endif
+}
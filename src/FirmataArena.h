@@ -0,0 +1,95 @@
+/*
+  FirmataArena.h - Firmata library
+
+  A fixed block of memory for the device drivers that the features create at run time
+  (steppers, OneWire buses, servos, software serial ports, ...), so that configuring and
+  resetting them over and over doesn't fragment the heap.
+
+  Blocks are cut off the arena from the front. A released block is kept on a free list and
+  handed out again for a request of the same size - which is what reconfiguring a device of
+  the same type asks for. After all features were reset, FirmataExt empties the whole arena.
+  Requests that don't fit anymore fall back to the heap and are counted, so that
+  FIRMATA_ARENA_SIZE can be adjusted (see FirmataStats STATS_MEMORY).
+
+  Usage, in place of new and delete:
+
+    stepper = FirmataArena.create<AccelStepper>(AccelStepper::DRIVER, stepPin, directionPin);
+    ...
+    FirmataArena.destroy(stepper);
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef FirmataArena_h
+#define FirmataArena_h
+
+#include <ConfigurableFirmata.h>
+#ifdef __AVR__
+#include <new.h>
+#else
+#include <new>
+#endif
+
+#ifndef FIRMATA_ARENA_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define FIRMATA_ARENA_SIZE      2048
+#else
+#define FIRMATA_ARENA_SIZE      0 // always use the heap, a static block costs too much of the 2 KB of an Uno
+#endif
+#endif
+
+// the alignment of all blocks, also the size of the header that holds the size of a block
+#define FIRMATA_ARENA_ALIGN     (sizeof(void*) < 4 ? 2 : 8)
+
+class FirmataArenaClass
+{
+  public:
+    FirmataArenaClass();
+    // a block of at least size bytes, from the heap if the arena is full, NULL if there is no memory at all
+    void* allocate(size_t size);
+    void release(void* block);
+    // forgets all blocks, once the features have destroyed their objects on SYSTEM_RESET
+    void reset();
+
+    template<typename T, typename... Args> T* create(Args... args)
+    {
+      void* block = allocate(sizeof(T));
+      return block != nullptr ? new (block) T(args...) : nullptr;
+    }
+
+    template<typename T> void destroy(T* object)
+    {
+      if (object != nullptr) {
+        object->~T();
+        release(object);
+      }
+    }
+
+    size_t getCapacity() { return FIRMATA_ARENA_SIZE; }
+    // bytes in use, including the headers
+    size_t getUsed() { return used; }
+    // the largest getUsed() since startup
+    size_t getHighWaterMark() { return highWaterMark; }
+    // allocations that did not fit and went to the heap
+    unsigned long getHeapFallbacks() { return heapFallbacks; }
+
+  private:
+#if FIRMATA_ARENA_SIZE > 0
+    alignas(8) byte memory[FIRMATA_ARENA_SIZE];
+#endif
+    size_t top; // the unused memory starts here
+    size_t used;
+    size_t highWaterMark;
+    unsigned long heapFallbacks;
+    void* freeList; // released blocks, linked through their first bytes
+    bool inArena(void* block);
+};
+
+extern FirmataArenaClass FirmataArena;
+
+#endif
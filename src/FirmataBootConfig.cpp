@@ -0,0 +1,238 @@
+/*
+  FirmataBootConfig.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "FirmataBootConfig.h"
+#include "FirmataExt.h"
+#ifdef BOOT_CONFIG_HAS_EEPROM
+#include <EEPROM.h>
+#endif
+
+// header: magic, flags, length (LSB, MSB), checksum of the messages
+#define BOOT_CONFIG_MAGIC       0xFC
+#define BOOT_CONFIG_HEADER_SIZE 5
+#define BOOT_CONFIG_CAPACITY    (BOOT_CONFIG_SIZE - BOOT_CONFIG_HEADER_SIZE)
+
+static byte readStorage(int offset)
+{
+#ifdef BOOT_CONFIG_HAS_EEPROM
+  return EEPROM.read(BOOT_CONFIG_EEPROM_OFFSET + offset);
+#else
+  return 0;
+#endif
+}
+
+static void writeStorage(int offset, byte value)
+{
+#if defined(ESP32) || defined(ESP8266)
+  EEPROM.write(BOOT_CONFIG_EEPROM_OFFSET + offset, value); // only changes the RAM copy until commit()
+#elif defined(BOOT_CONFIG_HAS_EEPROM)
+  EEPROM.update(BOOT_CONFIG_EEPROM_OFFSET + offset, value); // spares the cells that don't change
+#endif
+}
+
+static void commitStorage()
+{
+#if defined(ESP32) || defined(ESP8266)
+  EEPROM.commit();
+#endif
+}
+
+// collects the messages of writeConfiguration() behind the header, or only counts them
+class BootConfigWriter: public Print
+{
+  public:
+    BootConfigWriter(boolean store) : length(0), checksum(0), overflow(false), store(store) {}
+    size_t write(uint8_t c) override
+    {
+      if (length >= BOOT_CONFIG_CAPACITY) {
+        overflow = true;
+        return 0;
+      }
+      if (store) {
+        writeStorage(BOOT_CONFIG_HEADER_SIZE + length, c);
+      }
+      length++;
+      checksum += c;
+      return 1;
+    }
+    int length;
+    byte checksum;
+    boolean overflow;
+    boolean store;
+};
+
+// the messages that recreate the configuration of the pins and features
+static void writeBootMessages(Print& out)
+{
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    byte mode = Firmata.getPinMode(pin);
+    // only the modes that need no further configuration message, the features save the others
+    if (mode == PIN_MODE_INPUT || mode == PIN_MODE_OUTPUT || mode == PIN_MODE_PULLUP ||
+        mode == PIN_MODE_ANALOG || mode == PIN_MODE_PWM || mode == PIN_MODE_SERVO) {
+      out.write(SET_PIN_MODE);
+      out.write(pin);
+      out.write(mode);
+      if (mode == PIN_MODE_OUTPUT) {
+        out.write(SET_DIGITAL_PIN_VALUE);
+        out.write(pin);
+        out.write((byte)Firmata.getPinState(pin));
+      }
+    }
+  }
+  if (FirmataExtInstance != nullptr) {
+    FirmataExtInstance->writeConfiguration(out);
+  }
+}
+
+FirmataBootConfig::FirmataBootConfig()
+{
+  restorePending = true; // at boot
+  storageOpen = false;
+}
+
+void FirmataBootConfig::openStorage()
+{
+  if (!storageOpen) {
+#if defined(ESP32) || defined(ESP8266)
+    EEPROM.begin(BOOT_CONFIG_EEPROM_OFFSET + BOOT_CONFIG_SIZE);
+#endif
+    storageOpen = true;
+  }
+}
+
+boolean FirmataBootConfig::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != FIRMATA_BOOT_CONFIG || argc < 1) {
+    return false;
+  }
+  switch (argv[0]) {
+    case BOOT_CONFIG_SAVE:
+      sendStatus(save(argc > 1 ? argv[1] : 0));
+      return true;
+    case BOOT_CONFIG_CLEAR:
+      clear();
+      sendStatus(BOOT_CONFIG_OK);
+      return true;
+    case BOOT_CONFIG_QUERY:
+      sendStatus(BOOT_CONFIG_OK);
+      return true;
+    case BOOT_CONFIG_RESTORE:
+      restore();
+      sendStatus(BOOT_CONFIG_OK);
+      return true;
+  }
+  return false;
+}
+
+byte FirmataBootConfig::save(byte flags)
+{
+#ifndef BOOT_CONFIG_HAS_EEPROM
+  return BOOT_CONFIG_NO_STORAGE;
+#else
+  if (FirmataExtInstance != nullptr && !FirmataExtInstance->canWriteConfiguration()) {
+    Firmata.sendEvent(EVENT_BOOT_CONFIG_UNSUPPORTED, F("Boot configuration not supported by an active feature"));
+    return BOOT_CONFIG_UNSUPPORTED;
+  }
+  // measure first, a configuration that doesn't fit leaves the stored one alone
+  BootConfigWriter size(false);
+  writeBootMessages(size);
+  if (size.overflow) {
+    Firmata.sendEvent(EVENT_BOOT_CONFIG_TOO_LARGE, F("Boot configuration too large: "), size.length);
+    return BOOT_CONFIG_TOO_LARGE;
+  }
+  openStorage();
+  writeStorage(0, 0); // invalid until complete
+  BootConfigWriter out(true);
+  writeBootMessages(out);
+  writeStorage(1, flags);
+  writeStorage(2, out.length & 0xFF);
+  writeStorage(3, out.length >> 8);
+  writeStorage(4, out.checksum);
+  writeStorage(0, BOOT_CONFIG_MAGIC);
+  commitStorage();
+  return BOOT_CONFIG_OK;
+#endif
+}
+
+void FirmataBootConfig::clear()
+{
+  openStorage();
+  writeStorage(0, 0);
+  commitStorage();
+}
+
+int FirmataBootConfig::readHeader(byte* flags)
+{
+  openStorage();
+  *flags = 0;
+  if (readStorage(0) != BOOT_CONFIG_MAGIC) {
+    return 0;
+  }
+  int length = readStorage(2) | (readStorage(3) << 8);
+  if (length > BOOT_CONFIG_CAPACITY) {
+    return 0;
+  }
+  byte checksum = 0;
+  for (int i = 0; i < length; i++) {
+    checksum += readStorage(BOOT_CONFIG_HEADER_SIZE + i);
+  }
+  if (checksum != readStorage(4)) {
+    return 0;
+  }
+  *flags = readStorage(1);
+  return length;
+}
+
+boolean FirmataBootConfig::restore()
+{
+  byte flags;
+  int length = readHeader(&flags);
+  if (length == 0) {
+    return false;
+  }
+  for (int i = 0; i < length; i++) {
+    Firmata.parse(readStorage(BOOT_CONFIG_HEADER_SIZE + i));
+  }
+  // don't leave the parser waiting for the rest of a damaged message
+  Firmata.resetParser();
+  return true;
+}
+
+void FirmataBootConfig::reset()
+{
+  byte flags;
+  if (readHeader(&flags) > 0 && (flags & BOOT_CONFIG_ON_RESET)) {
+    restorePending = true;
+  }
+}
+
+void FirmataBootConfig::report(bool elapsed)
+{
+  // after the reset of all features, and not in the middle of a message from the host
+  if (restorePending && !Firmata.isParsingMessage()) {
+    restorePending = false;
+    restore();
+  }
+}
+
+void FirmataBootConfig::sendStatus(byte result)
+{
+  byte flags;
+  int length = readHeader(&flags);
+  Firmata.startSysex();
+  Firmata.write(FIRMATA_BOOT_CONFIG);
+  Firmata.write(BOOT_CONFIG_STATUS);
+  Firmata.write(result);
+  Firmata.write(flags);
+  Firmata.sendValueAsTwo7bitBytes(length);
+  Firmata.endSysex();
+}
@@ -0,0 +1,103 @@
+/*
+  FirmataBootConfig.h - Firmata library
+
+  Stores the current configuration in EEPROM (the NVS backed EEPROM emulation on ESP32 / ESP8266)
+  and restores it at boot, so that a board starts reporting without waiting for the host to set
+  up every pin again.
+
+  The configuration is saved as a sequence of Firmata messages that recreate it: the pin modes
+  and output values, followed by what every feature writes in writeConfiguration(). Restoring
+  means feeding these messages to the parser, on the first loop iteration after startup and,
+  if BOOT_CONFIG_ON_RESET was given, after every SYSTEM_RESET.
+
+  Usage:
+
+    FirmataBootConfig bootConfig;
+    ...
+    firmataExt.addFeature(bootConfig);
+
+  The features are found through FirmataExt, with FirmataExtT only the pin modes are saved.
+  While SPI or AccelStepper are in use, saving fails with BOOT_CONFIG_UNSUPPORTED: their devices
+  are not part of the saved configuration.
+
+  Host -> board:
+  START_SYSEX, FIRMATA_BOOT_CONFIG, BOOT_CONFIG_SAVE, flags, END_SYSEX
+  START_SYSEX, FIRMATA_BOOT_CONFIG, BOOT_CONFIG_CLEAR, END_SYSEX
+  START_SYSEX, FIRMATA_BOOT_CONFIG, BOOT_CONFIG_QUERY, END_SYSEX
+  START_SYSEX, FIRMATA_BOOT_CONFIG, BOOT_CONFIG_RESTORE, END_SYSEX
+
+  Board -> host, in reply to each of the above:
+  START_SYSEX, FIRMATA_BOOT_CONFIG, BOOT_CONFIG_STATUS, result, flags, stored length (2 x 7 bit,
+  0 = nothing stored), END_SYSEX
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef FirmataBootConfig_h
+#define FirmataBootConfig_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+
+// FIRMATA_BOOT_CONFIG subcommands
+#define BOOT_CONFIG_SAVE        0x00
+#define BOOT_CONFIG_CLEAR       0x01
+#define BOOT_CONFIG_QUERY       0x02
+#define BOOT_CONFIG_RESTORE     0x03
+#define BOOT_CONFIG_STATUS      0x04
+
+// BOOT_CONFIG_SAVE flags
+#define BOOT_CONFIG_ON_RESET    0x01 // restore after SYSTEM_RESET, too
+
+// BOOT_CONFIG_STATUS results
+#define BOOT_CONFIG_OK          0x00
+#define BOOT_CONFIG_TOO_LARGE   0x01 // the configuration did not fit, the stored one is kept
+#define BOOT_CONFIG_NO_STORAGE  0x02 // the board has no EEPROM
+#define BOOT_CONFIG_UNSUPPORTED 0x03 // an active feature can't save its configuration (SPI, AccelStepper), the stored one is kept
+
+#if defined(__AVR__) || defined(ESP32) || defined(ESP8266) || defined(FIRMATA_NATIVE)
+#define BOOT_CONFIG_HAS_EEPROM
+#endif
+
+#ifndef BOOT_CONFIG_EEPROM_OFFSET
+#define BOOT_CONFIG_EEPROM_OFFSET 0
+#endif
+#ifndef BOOT_CONFIG_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define BOOT_CONFIG_SIZE        1024 // bytes of EEPROM used, including the header
+#else
+#define BOOT_CONFIG_SIZE        256
+#endif
+#endif
+
+class FirmataBootConfig: public FirmataFeature
+{
+  public:
+    FirmataBootConfig();
+    void handleCapability(byte pin) override {}
+    boolean handlePinMode(byte pin, int mode) override { return false; }
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    boolean ownsSysexCommand(byte command) override { return command == FIRMATA_BOOT_CONFIG; }
+    void reset() override;
+    void report(bool elapsed) override;
+    // stores the current configuration, returns a BOOT_CONFIG_STATUS result
+    byte save(byte flags);
+    void clear();
+    // replays the stored configuration, false if there is none
+    boolean restore();
+
+  private:
+    boolean restorePending;
+    boolean storageOpen;
+    void openStorage();
+    // the length of the stored messages, 0 if there are none (or they are damaged)
+    int readHeader(byte* flags);
+    void sendStatus(byte result);
+};
+
+#endif
@@ -0,0 +1,356 @@
+/*
+  FirmataCapture.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "FirmataCapture.h"
+#include "Encoder7Bit.h"
+
+#define CAPTURE_MIN_INTERVAL 10 // us
+
+static FirmataCapture* captureInstance = NULL;
+
+#if defined(ESP32)
+static hw_timer_t* captureTimer = NULL;
+
+static void IRAM_ATTR onCaptureTimer()
+{
+  captureInstance->sampleFromTimer();
+}
+#elif defined(CAPTURE_USE_TIMER)
+ISR(TIMER2_COMPA_vect)
+{
+  if (captureInstance) {
+    captureInstance->sampleFromTimer();
+  }
+}
+#endif
+
+FirmataCapture::FirmataCapture()
+{
+  captureInstance = this;
+  state = CAPTURE_IDLE;
+  sourceCount = 0;
+  frameSize = 0;
+  capacity = 0;
+  captured = 0;
+  sentBytes = 0;
+#if defined(CAPTURE_USE_TIMER) && !defined(ESP32)
+  timerRunning = false;
+#endif
+}
+
+boolean FirmataCapture::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != FIRMATA_CAPTURE || argc < 1) {
+    return false;
+  }
+  switch (argv[0]) {
+    case CAPTURE_CONFIG:
+      if (configure(argc, argv)) {
+        sendStatus();
+      }
+      return true;
+    case CAPTURE_ARM:
+      if (sourceCount == 0) {
+        Firmata.sendString(F("Capture not configured"));
+        return true;
+      }
+      arm();
+      sendStatus();
+      return true;
+    case CAPTURE_TRIGGER:
+      if (sourceCount == 0) {
+        Firmata.sendString(F("Capture not configured"));
+        return true;
+      }
+      if (state != CAPTURE_ARMED && state != CAPTURE_TRIGGERED) {
+        arm();
+      }
+      softwareTrigger = true;
+      return true;
+    case CAPTURE_ABORT:
+      stop();
+      sendStatus();
+      return true;
+    case CAPTURE_QUERY:
+      sendStatus();
+      return true;
+  }
+  return false;
+}
+
+bool FirmataCapture::configure(byte argc, byte* argv)
+{
+#if !defined(CAPTURE_USE_TIMER) && !defined(FIRMATA_NATIVE)
+  Firmata.sendString(F("No capture timer on this board"));
+  return false;
+#endif
+  if (argc < 19 || argc - 18 > CAPTURE_MAX_SOURCES) {
+    Firmata.sendString(F("Invalid capture configuration"));
+    return false;
+  }
+  stop();
+  sourceCount = 0;
+  frameSize = 0;
+  byte analogSources = 0;
+  for (byte i = 18; i < argc; i++) {
+    byte source = argv[i];
+    if (source & CAPTURE_SOURCE_PORT) {
+      if ((source & 0x3F) >= TOTAL_PORTS) {
+        Firmata.sendString(F("Invalid capture source"));
+        return false;
+      }
+      frameSize += 1;
+    } else {
+#ifdef CAPTURE_ANALOG_IN_ISR
+      byte pin = 0;
+      while (pin < TOTAL_PINS && !(IS_PIN_ANALOG(pin) && PIN_TO_ANALOG(pin) == source)) {
+        pin++;
+      }
+      if (pin == TOTAL_PINS) {
+        Firmata.sendString(F("Invalid capture source"));
+        return false;
+      }
+      sourcePins[i - 18] = pin;
+      frameSize += 2;
+      analogSources++;
+#else
+      Firmata.sendString(F("Analog capture not supported"));
+      return false;
+#endif
+    }
+    sources[i - 18] = source;
+  }
+  interval = Firmata.decodePackedUInt32(argv + 1);
+  frames = Firmata.decodePackedUInt32(argv + 6);
+  preFrames = Firmata.decodePackedUInt32(argv + 11);
+  triggerPin = argv[16];
+  triggerEdge = argv[17];
+  capacity = CAPTURE_BUFFER_SIZE / frameSize;
+  // the interrupt must be done with all conversions before the next one
+  if (interval < CAPTURE_MIN_INTERVAL + (uint32_t)analogSources * CAPTURE_ANALOG_READ_TIME || frames == 0 || frames > capacity || preFrames >= frames ||
+      (triggerPin != CAPTURE_NO_TRIGGER_PIN && !IS_PIN_DIGITAL(triggerPin)) || triggerEdge > CAPTURE_EDGE_ANY) {
+    Firmata.sendString(F("Invalid capture configuration"));
+    return false;
+  }
+  sourceCount = argc - 18;
+  return true;
+}
+
+void FirmataCapture::arm()
+{
+  stop();
+  written = 0;
+  writeIndex = 0;
+  softwareTrigger = false;
+  if (triggerPin != CAPTURE_NO_TRIGGER_PIN) {
+    lastTriggerLevel = digitalRead(PIN_TO_DIGITAL(triggerPin));
+  }
+  captured = 0;
+  sentBytes = 0;
+  state = CAPTURE_ARMED;
+  if (!startTimer()) {
+    state = CAPTURE_IDLE;
+    Firmata.sendString(F("Capture interval not supported"));
+  }
+}
+
+void FirmataCapture::stop()
+{
+  stopTimer();
+  state = CAPTURE_IDLE;
+}
+
+void CAPTURE_ISR_ATTR FirmataCapture::sampleFromTimer()
+{
+  byte current = state;
+  if (current != CAPTURE_ARMED && current != CAPTURE_TRIGGERED) {
+    return;
+  }
+  uint32_t index = writeIndex;
+  byte* frame = buffer + index;
+  for (byte i = 0; i < sourceCount; i++) {
+    byte source = sources[i];
+    if (source & CAPTURE_SOURCE_PORT) {
+      *frame++ = readPort(source & 0x3F, 0xFF);
+    } else {
+#ifdef CAPTURE_ANALOG_IN_ISR
+      int value = analogRead(sourcePins[i]);
+      *frame++ = (byte)value;
+      *frame++ = (byte)(value >> 8);
+#endif
+    }
+  }
+  index += frameSize;
+  writeIndex = index + frameSize > capacity * frameSize ? 0 : index;
+  uint32_t frameNumber = written;
+  written = frameNumber + 1;
+
+  if (current == CAPTURE_ARMED) {
+    bool triggered = softwareTrigger;
+    if (triggerPin != CAPTURE_NO_TRIGGER_PIN) {
+      byte level = digitalRead(PIN_TO_DIGITAL(triggerPin));
+      byte last = lastTriggerLevel;
+      lastTriggerLevel = level;
+      triggered |= (triggerEdge == CAPTURE_EDGE_RISING && level && !last) ||
+                   (triggerEdge == CAPTURE_EDGE_FALLING && !level && last) ||
+                   (triggerEdge == CAPTURE_EDGE_ANY && level != last);
+    }
+    if (triggered) {
+      triggerFrame = frameNumber;
+      remaining = frames - preFrames - 1;
+      state = remaining == 0 ? CAPTURE_SENDING : CAPTURE_TRIGGERED;
+    }
+  } else if (--remaining == 0) {
+    state = CAPTURE_SENDING;
+  }
+}
+
+bool FirmataCapture::startTimer()
+{
+#if defined(ESP32)
+  if (captureTimer == NULL) {
+    captureTimer = timerBegin(CAPTURE_TIMER_NUM, 80, true); // 1 MHz
+    timerAttachInterrupt(captureTimer, &onCaptureTimer, true);
+  }
+  timerAlarmWrite(captureTimer, interval, true);
+  timerAlarmEnable(captureTimer);
+  return true;
+#elif defined(CAPTURE_USE_TIMER)
+  // the smallest prescaler of Timer2 that gets the interval into 8 bits
+  static const uint16_t prescalers[] = { 1, 8, 32, 64, 128, 256, 1024 };
+  for (byte i = 0; i < 7; i++) {
+    uint32_t ticks = (F_CPU / 1000000L) * interval / prescalers[i];
+    if (ticks <= 256) {
+      noInterrupts();
+      if (!timerRunning) {
+        savedTCCR2A = TCCR2A;
+        savedTCCR2B = TCCR2B;
+        savedOCR2A = OCR2A;
+        timerRunning = true;
+      }
+      TCCR2A = _BV(WGM21); // CTC mode
+      TCCR2B = i + 1;
+      TCNT2 = 0;
+      OCR2A = ticks - 1;
+      TIMSK2 |= _BV(OCIE2A);
+      interrupts();
+      return true;
+    }
+  }
+  return false;
+#else
+  return true;
+#endif
+}
+
+void FirmataCapture::stopTimer()
+{
+#if defined(ESP32)
+  if (captureTimer != NULL) {
+    timerAlarmDisable(captureTimer);
+  }
+#elif defined(CAPTURE_USE_TIMER)
+  if (!timerRunning) {
+    return;
+  }
+  noInterrupts();
+  TIMSK2 &= ~_BV(OCIE2A);
+  TCCR2A = savedTCCR2A;
+  TCCR2B = savedTCCR2B;
+  OCR2A = savedOCR2A;
+  timerRunning = false;
+  interrupts();
+#endif
+}
+
+void FirmataCapture::sendStatus()
+{
+  noInterrupts();
+  byte current = state;
+  uint32_t frameCount = written;
+  uint32_t trigger = triggerFrame;
+  interrupts();
+  if (current == CAPTURE_ARMED) {
+    frameCount = min(frameCount, frames);
+    trigger = 0;
+  } else if (current == CAPTURE_TRIGGERED) {
+    uint32_t pre = min(preFrames, trigger);
+    frameCount = pre + (frameCount - trigger);
+    trigger = pre;
+  } else if (current == CAPTURE_SENDING || current == CAPTURE_COMPLETE) {
+    uint32_t pre = min(preFrames, trigger);
+    frameCount = pre + (frames - preFrames);
+    trigger = pre;
+  } else {
+    frameCount = 0;
+    trigger = 0;
+  }
+  Firmata.startSysex();
+  Firmata.write(FIRMATA_CAPTURE);
+  Firmata.write(CAPTURE_STATUS);
+  Firmata.write(current);
+  Firmata.sendPackedUInt32(frameCount);
+  Firmata.sendPackedUInt32(trigger);
+  Firmata.sendPackedUInt32(capacity);
+  Firmata.endSysex();
+}
+
+void FirmataCapture::sendChunk()
+{
+  uint32_t total = captured * frameSize;
+  uint32_t length = min(total - sentBytes, (uint32_t)CAPTURE_CHUNK_SIZE);
+  uint32_t ringSize = capacity * frameSize;
+  // the capture ends with the last frame written
+  uint32_t start = (writeIndex + ringSize - total + sentBytes) % ringSize;
+  uint32_t first = min(length, ringSize - start);
+
+  Encoder7BitClass encoder;
+  Firmata.startSysex();
+  Firmata.write(FIRMATA_CAPTURE);
+  Firmata.write(CAPTURE_DATA);
+  Firmata.sendPackedUInt32(sentBytes);
+  encoder.startBinaryWrite();
+  encoder.writeBinary(buffer + start, first);
+  if (first < length) {
+    encoder.writeBinary(buffer, length - first);
+  }
+  encoder.endBinaryWrite();
+  Firmata.endSysex();
+  sentBytes += length;
+}
+
+void FirmataCapture::report(bool elapsed)
+{
+  if (state != CAPTURE_SENDING) {
+    return;
+  }
+  if (captured == 0) {
+    stopTimer();
+    uint32_t trigger = triggerFrame;
+    captured = min(preFrames, trigger) + (frames - preFrames);
+    sentBytes = 0;
+    sendStatus();
+  }
+  // one chunk per loop, so that the other features keep running while the capture is sent
+  sendChunk();
+  if (sentBytes == captured * frameSize) {
+    state = CAPTURE_COMPLETE;
+    sendStatus();
+  }
+}
+
+void FirmataCapture::reset()
+{
+  stop();
+  sourceCount = 0;
+  captured = 0;
+}
@@ -0,0 +1,177 @@
+/*
+  FirmataCapture.h - Firmata library
+
+  Burst capture: samples analog channels and digital ports from a timer interrupt into a ring
+  buffer, at rates no link could carry live, and sends the buffer afterwards. Used as a simple
+  on-board oscilloscope / logic analyzer.
+
+  Once armed, the interrupt samples continuously. When the trigger comes (CAPTURE_TRIGGER or
+  an edge on the trigger pin, checked at every sample), the frames before it are kept as
+  pre-trigger history and sampling goes on until the capture is complete. The timer is then
+  stopped and the frames are sent in CAPTURE_DATA chunks, followed by a CAPTURE_STATUS with
+  CAPTURE_COMPLETE.
+
+  A frame holds one sample of every source, in the configured order: 2 bytes (LSB first) per
+  analog channel and 1 byte per digital port.
+
+  Timers: on ESP32 hardware timer CAPTURE_TIMER_NUM, on AVR Timer2 if CAPTURE_USE_TIMER2 is
+  defined (it is also used by tone(), whose settings are restored when the capture stops).
+  analogRead() can't be called from an interrupt on ESP32, only digital ports are captured there.
+  On AVR every analog source takes a conversion of CAPTURE_ANALOG_READ_TIME in the interrupt,
+  intervals shorter than that for all analog sources are rejected (about 8 kHz for one channel).
+
+  Host -> board:
+  START_SYSEX, FIRMATA_CAPTURE, CAPTURE_CONFIG, interval in us (packed uint32), frames (packed uint32),
+  pre-trigger frames (packed uint32), trigger pin (127 = software trigger only), trigger edge,
+  n sources (CAPTURE_SOURCE_ANALOG | channel or CAPTURE_SOURCE_PORT | port), END_SYSEX
+  START_SYSEX, FIRMATA_CAPTURE, CAPTURE_ARM, END_SYSEX
+  START_SYSEX, FIRMATA_CAPTURE, CAPTURE_TRIGGER, END_SYSEX (arms first, if needed)
+  START_SYSEX, FIRMATA_CAPTURE, CAPTURE_ABORT, END_SYSEX
+  START_SYSEX, FIRMATA_CAPTURE, CAPTURE_QUERY, END_SYSEX
+
+  Board -> host:
+  START_SYSEX, FIRMATA_CAPTURE, CAPTURE_STATUS, state, frames captured (packed uint32),
+  index of the trigger frame (packed uint32), capacity in frames (packed uint32), END_SYSEX
+  START_SYSEX, FIRMATA_CAPTURE, CAPTURE_DATA, byte offset (packed uint32), data (Encoder7Bit), END_SYSEX
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef FirmataCapture_h
+#define FirmataCapture_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+
+// FIRMATA_CAPTURE subcommands
+#define CAPTURE_CONFIG          0x00
+#define CAPTURE_ARM             0x01
+#define CAPTURE_TRIGGER         0x02
+#define CAPTURE_ABORT           0x03
+#define CAPTURE_QUERY           0x04
+#define CAPTURE_STATUS          0x05
+#define CAPTURE_DATA            0x06
+
+// CAPTURE_STATUS states
+#define CAPTURE_IDLE            0x00
+#define CAPTURE_ARMED           0x01 // sampling, waiting for the trigger
+#define CAPTURE_TRIGGERED       0x02 // sampling the frames after the trigger
+#define CAPTURE_SENDING         0x03 // the capture is complete, CAPTURE_DATA follows
+#define CAPTURE_COMPLETE        0x04 // all data was sent
+
+// sources
+#define CAPTURE_SOURCE_ANALOG   0x00 // | channel
+#define CAPTURE_SOURCE_PORT     0x40 // | port
+
+// trigger edges
+#define CAPTURE_EDGE_RISING     0x00
+#define CAPTURE_EDGE_FALLING    0x01
+#define CAPTURE_EDGE_ANY        0x02
+
+#define CAPTURE_NO_TRIGGER_PIN  127
+#define CAPTURE_MAX_SOURCES     8
+
+#ifndef CAPTURE_BUFFER_SIZE
+#if defined(ESP32)
+#define CAPTURE_BUFFER_SIZE     65536
+#elif defined(LARGE_MEM_DEVICE)
+#define CAPTURE_BUFFER_SIZE     16384
+#else
+#define CAPTURE_BUFFER_SIZE     512
+#endif
+#endif
+
+#ifdef LARGE_MEM_DEVICE
+#define CAPTURE_CHUNK_SIZE      245 // bytes of data per CAPTURE_DATA message, a multiple of 7
+#else
+#define CAPTURE_CHUNK_SIZE      49
+#endif
+
+#if defined(ESP32)
+#define CAPTURE_USE_TIMER
+#define CAPTURE_TIMER_NUM       2 // AccelStepperFirmata uses timer 3
+#elif defined(ARDUINO_ARCH_AVR) && defined(CAPTURE_USE_TIMER2)
+#define CAPTURE_USE_TIMER
+#define CAPTURE_ANALOG_IN_ISR
+#elif defined(FIRMATA_NATIVE)
+// the tests call sampleFromTimer() themselves
+#define CAPTURE_ANALOG_IN_ISR
+#endif
+
+// us an analogRead() takes in the interrupt
+#ifndef CAPTURE_ANALOG_READ_TIME
+#if defined(ARDUINO_ARCH_AVR)
+#define CAPTURE_ANALOG_READ_TIME 115 // 13 ADC clocks at the default prescaler of 128, plus the call
+#elif defined(FIRMATA_NATIVE)
+#define CAPTURE_ANALOG_READ_TIME 5
+#else
+#define CAPTURE_ANALOG_READ_TIME 0
+#endif
+#endif
+
+#if defined(ESP32)
+#define CAPTURE_ISR_ATTR IRAM_ATTR
+#else
+#define CAPTURE_ISR_ATTR
+#endif
+
+class FirmataCapture: public FirmataFeature
+{
+  public:
+    FirmataCapture();
+    void handleCapability(byte pin) override {}
+    boolean handlePinMode(byte pin, int mode) override { return false; }
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    boolean ownsSysexCommand(byte command) override { return command == FIRMATA_CAPTURE; }
+    void reset() override;
+    void report(bool elapsed) override;
+    // takes one frame, called by the timer interrupt
+    void sampleFromTimer();
+
+  private:
+    byte buffer[CAPTURE_BUFFER_SIZE];
+    byte sources[CAPTURE_MAX_SOURCES];
+    byte sourcePins[CAPTURE_MAX_SOURCES]; // the pin to read for analog sources
+    byte sourceCount;
+    byte frameSize;
+    uint32_t capacity; // frames that fit into the buffer
+    uint32_t interval; // us
+    uint32_t frames;
+    uint32_t preFrames;
+    byte triggerPin;
+    byte triggerEdge;
+
+    // shared with the interrupt
+    volatile byte state;
+    volatile bool softwareTrigger;
+    volatile byte lastTriggerLevel;
+    volatile uint32_t written;   // frames sampled since arming
+    volatile uint32_t writeIndex; // byte offset of the next frame
+    volatile uint32_t triggerFrame; // the frame number of the trigger
+    volatile uint32_t remaining; // frames still to be sampled after the trigger
+
+    uint32_t captured; // frames in the capture
+    uint32_t sentBytes;
+#if defined(CAPTURE_USE_TIMER) && !defined(ESP32)
+    // the Timer2 settings of tone() and analogWrite(), restored when the capture stops
+    bool timerRunning;
+    byte savedTCCR2A;
+    byte savedTCCR2B;
+    byte savedOCR2A;
+#endif
+
+    bool configure(byte argc, byte* argv);
+    void arm();
+    void stop();
+    bool startTimer();
+    void stopTimer();
+    void sendStatus();
+    void sendChunk();
+};
+
+#endif
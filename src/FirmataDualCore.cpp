@@ -0,0 +1,154 @@
+/*
+  FirmataDualCore.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "FirmataDualCore.h"
+
+#if defined(ESP32) || defined(FIRMATA_NATIVE)
+
+#define RING_MASK (DUAL_CORE_RING_SIZE - 1)
+
+int FirmataSpscRing::peek() const
+{
+  if (available() == 0) {
+    return -1;
+  }
+  return buffer[tail.load(std::memory_order_relaxed) & RING_MASK];
+}
+
+size_t FirmataSpscRing::read(uint8_t* data, size_t length)
+{
+  size_t count = available();
+  if (length > count) {
+    length = count;
+  }
+  size_t start = tail.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < length; i++) {
+    data[i] = buffer[(start + i) & RING_MASK];
+  }
+  // release: the writer may reuse the space only after the data was copied
+  tail.store(start + length, std::memory_order_release);
+  return length;
+}
+
+size_t FirmataSpscRing::write(const uint8_t* data, size_t length)
+{
+  size_t room = space();
+  if (length > room) {
+    length = room;
+  }
+  size_t start = head.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < length; i++) {
+    buffer[(start + i) & RING_MASK] = data[i];
+  }
+  // release: the reader sees the new head only together with the data
+  head.store(start + length, std::memory_order_release);
+  return length;
+}
+
+#ifdef ESP32
+
+FirmataDualCore::FirmataDualCore()
+{
+  transport = nullptr;
+  firmataLoop = nullptr;
+  task = nullptr;
+  started = false;
+}
+
+void FirmataDualCore::begin(Stream& transport)
+{
+  this->transport = &transport;
+}
+
+bool FirmataDualCore::start(void (*firmataLoop)(), byte core)
+{
+  this->firmataLoop = firmataLoop;
+  started = true;
+  // the priority of the idle task, so that taskYIELD() lets it run and feed the watchdog
+  if (xTaskCreatePinnedToCore(taskMain, "Firmata", DUAL_CORE_STACK_SIZE, this, tskIDLE_PRIORITY, &task, core) != pdPASS) {
+    started = false;
+  }
+  return started;
+}
+
+void FirmataDualCore::taskMain(void* arg)
+{
+  FirmataDualCore* self = (FirmataDualCore*)arg;
+  for (;;) {
+    self->firmataLoop();
+    taskYIELD();
+  }
+}
+
+void FirmataDualCore::pump()
+{
+  if (transport == nullptr) {
+    return;
+  }
+  uint8_t chunk[DUAL_CORE_PUMP_CHUNK];
+  int received = transport->available();
+  while (received > 0 && input.space() > 0) {
+    size_t length = received;
+    length = min(min(length, input.space()), sizeof(chunk));
+    length = transport->readBytes(chunk, length);
+    if (length == 0) {
+      break;
+    }
+    input.write(chunk, length);
+    received -= length;
+  }
+  size_t length;
+  while ((length = output.read(chunk, sizeof(chunk))) > 0) {
+    transport->write(chunk, length);
+  }
+}
+
+int FirmataDualCore::available()
+{
+  return input.available();
+}
+
+int FirmataDualCore::read()
+{
+  uint8_t c;
+  return input.read(&c, 1) == 1 ? c : -1;
+}
+
+int FirmataDualCore::peek()
+{
+  return input.peek();
+}
+
+size_t FirmataDualCore::readBytes(char* buffer, size_t length)
+{
+  return input.read((uint8_t*)buffer, length);
+}
+
+size_t FirmataDualCore::write(uint8_t c)
+{
+  return write(&c, 1);
+}
+
+size_t FirmataDualCore::write(const uint8_t* buffer, size_t size)
+{
+  size_t written = output.write(buffer, size);
+  // until the task runs, setup() writes from the loop() side, where waiting would never end
+  while (written < size && started) {
+    vTaskDelay(1); // the host is slower than we are, wait for pump()
+    written += output.write(buffer + written, size - written);
+  }
+  return written;
+}
+
+#endif // ESP32
+
+#endif
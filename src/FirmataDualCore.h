@@ -0,0 +1,121 @@
+/*
+  FirmataDualCore.h - Firmata library
+
+  Runs Firmata in a FreeRTOS task on one core of an ESP32, while loop() on the other core only
+  moves data between the transport (the WiFi stream or the serial port) and the task. Parsing,
+  the features and their reports all stay in the task, so none of them needs locking; the two
+  sides only share a single-producer single-consumer ring buffer in each direction.
+
+  Usage:
+
+    FirmataDualCore dualCore;
+
+    void firmataLoop()
+    {
+      // what loop() did before, without serverStream.maintain()
+    }
+
+    void setup()
+    {
+      ...
+      dualCore.begin(serverStream);
+      Firmata.begin(dualCore);
+      ...
+      dualCore.start(firmataLoop);
+    }
+
+    void loop()
+    {
+      dualCore.pump();
+      serverStream.maintain();
+    }
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef FirmataDualCore_h
+#define FirmataDualCore_h
+
+#include <ConfigurableFirmata.h>
+
+// the ring buffer is also built natively, for the tests
+#if defined(ESP32) || defined(FIRMATA_NATIVE)
+#include <atomic>
+
+#ifndef DUAL_CORE_RING_SIZE
+#define DUAL_CORE_RING_SIZE     4096 // bytes buffered in each direction, a power of 2
+#endif
+
+// Lock-free ring buffer for exactly one writing and one reading task
+class FirmataSpscRing
+{
+  public:
+    FirmataSpscRing() : head(0), tail(0) {}
+    // reader side
+    size_t available() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed); }
+    int peek() const;
+    size_t read(uint8_t* data, size_t length);
+    // writer side
+    size_t space() const { return DUAL_CORE_RING_SIZE - (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire)); }
+    size_t write(const uint8_t* data, size_t length);
+
+  private:
+    uint8_t buffer[DUAL_CORE_RING_SIZE];
+    // free running positions, only head is written by the writer and only tail by the reader
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+};
+
+#ifdef ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#ifndef DUAL_CORE_FIRMATA_CORE
+#define DUAL_CORE_FIRMATA_CORE  0 // loop() runs on core 1
+#endif
+#ifndef DUAL_CORE_STACK_SIZE
+#define DUAL_CORE_STACK_SIZE    8192
+#endif
+#define DUAL_CORE_PUMP_CHUNK    128 // bytes copied at a time by pump()
+
+class FirmataDualCore: public Stream
+{
+  public:
+    FirmataDualCore();
+    // the stream to the host; Firmata itself is given this object instead
+    void begin(Stream& transport);
+    // starts the task that calls firmataLoop over and over, false if it could not be created.
+    // Call it at the end of setup(), from then on only the task may use Firmata.
+    bool start(void (*firmataLoop)(), byte core = DUAL_CORE_FIRMATA_CORE);
+    // to be called in loop(): passes the received data to the task and sends what it wrote
+    void pump();
+
+    // the Stream that Firmata uses, from within the task
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t readBytes(char* buffer, size_t length);
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t* buffer, size_t size) override;
+    void flush() override {}
+
+  private:
+    Stream* transport;
+    FirmataSpscRing input;  // transport -> task
+    FirmataSpscRing output; // task -> transport
+    void (*firmataLoop)();
+    TaskHandle_t task;
+    volatile bool started;
+    static void taskMain(void* arg);
+};
+
+#endif // ESP32
+
+#endif // ESP32 || FIRMATA_NATIVE
+
+#endif
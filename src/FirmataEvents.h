@@ -0,0 +1,87 @@
+/*
+  FirmataEvents.h - Numeric codes of the diagnostic messages
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+
+  Diagnostics sent with Firmata.sendEvent() have a 14 bit id: the sysex command of the module
+  in the upper 7 bits (0 for the core) and a running number in the lower 7 bits. By default they
+  are sent as STRING_DATA, but a host can switch to EVENT_REPORT messages, which carry only the id
+  and the arguments. The comment of each id is the text that goes with it, and serves as the
+  string table for the host. Ids must never be reused for a different meaning.
+
+  Host -> board:
+  START_SYSEX, EVENT_REPORT, EVENT_CONFIG, 1 = numeric / 0 = text
+  [, rate limiting window in ms (2 x 7 bit, 0 = off)], END_SYSEX
+
+  Board -> host:
+  START_SYSEX, EVENT_REPORT, EVENT_DATA, id (2 x 7 bit), repeat count (2 x 7 bit),
+  [argument (packed uint32)]*, END_SYSEX
+
+  An event is sent as soon as it occurs, with a repeat count of 0. Further occurrences within the
+  window are only counted and reported once the window is over, with the count and the arguments
+  of the last occurrence.
+*/
+
+#ifndef FirmataEvents_h
+#define FirmataEvents_h
+
+// EVENT_REPORT subcommands
+#define EVENT_CONFIG            0x00
+#define EVENT_DATA              0x01
+
+#define FIRMATA_EVENT_ID(command, number) ((uint16_t)(((command) << 7) | (number)))
+
+#define EVENT_INPUT_OVERFLOW             FIRMATA_EVENT_ID(0, 0x01) // "Discarding input message, out of buffer"
+#define EVENT_UNKNOWN_PIN_MODE           FIRMATA_EVENT_ID(0, 0x02) // "Unknown pin mode (pin, mode): " pin, mode
+#define EVENT_UNHANDLED_SYSEX            FIRMATA_EVENT_ID(0, 0x03) // "Unhandled sysex command: " command
+
+#define EVENT_I2C_TOO_MANY_BYTES_RECEIVED FIRMATA_EVENT_ID(I2C_REQUEST, 0x01) // "I2C: Too many bytes received from: " address
+#define EVENT_I2C_10BIT_ADDRESS          FIRMATA_EVENT_ID(I2C_REQUEST, 0x02) // "10-bit addressing not supported"
+#define EVENT_I2C_TOO_MANY_BYTES_TO_WRITE FIRMATA_EVENT_ID(I2C_REQUEST, 0x03) // "I2C: Too many bytes to write: " count
+#define EVENT_I2C_TOO_MANY_QUERIES       FIRMATA_EVENT_ID(I2C_REQUEST, 0x04) // "too many queries"
+#define EVENT_I2C_INVALID_BUS            FIRMATA_EVENT_ID(I2C_REQUEST, 0x05) // "I2C: Invalid bus: " bus
+
+#define EVENT_SPI_EMPTY_MESSAGE          FIRMATA_EVENT_ID(SPI_DATA, 0x01) // "Error in SPI_DATA command: empty message"
+#define EVENT_SPI_UNKNOWN_COMMAND        FIRMATA_EVENT_ID(SPI_DATA, 0x02) // "Unknown SPI command: " command
+#define EVENT_SPI_NOT_ENABLED            FIRMATA_EVENT_ID(SPI_DATA, 0x03) // "SPI not enabled."
+#define EVENT_SPI_MESSAGE_TOO_SHORT      FIRMATA_EVENT_ID(SPI_DATA, 0x04) // "Not enough data in SPI message"
+#define EVENT_SPI_CONFIG_TOO_SHORT       FIRMATA_EVENT_ID(SPI_DATA, 0x05) // "Not enough data in SPI_DEVICE_CONFIG message"
+#define EVENT_SPI_UNKNOWN_DEVICE         FIRMATA_EVENT_ID(SPI_DATA, 0x06) // "SPI: Unknown deviceId specified: " device id
+#define EVENT_SPI_READ_TOO_LONG          FIRMATA_EVENT_ID(SPI_DATA, 0x07) // "SPI_READ: Too many bytes requested"
+#define EVENT_SPI_BUFFER_TOO_SMALL       FIRMATA_EVENT_ID(SPI_DATA, 0x08) // "SPI_TRANSFER: Send buffer not large enough"
+#define EVENT_SPI_TOO_MANY_JOBS          FIRMATA_EVENT_ID(SPI_DATA, 0x09) // "SPI_READ_CONTINUOUSLY: Max number of jobs exceeded"
+#define EVENT_SPI_TOO_MANY_DEVICES       FIRMATA_EVENT_ID(SPI_DATA, 0x0A) // "SPI_DEVICE_CONFIG: Max number of devices exceeded"
+#define EVENT_SPI_WORD_SIZE              FIRMATA_EVENT_ID(SPI_DATA, 0x0B) // "SPI_DEVICE_CONFIG: Only 8 bit words supported"
+#define EVENT_SPI_CHANNEL                FIRMATA_EVENT_ID(SPI_DATA, 0x0C) // "SPI: Unsupported channel: " channel
+#define EVENT_SPI_PIN_ERROR              FIRMATA_EVENT_ID(SPI_DATA, 0x0D) // "Error enabling SPI mode"
+#define EVENT_SPI_DEVICE_CONFIGURED      FIRMATA_EVENT_ID(SPI_DATA, 0x0E) // "New SPI device (device id, index, CS pin, clock speed in Hz): " ..., CS pin 255 = none
+#define EVENT_SPI_BEGIN                  FIRMATA_EVENT_ID(SPI_DATA, 0x0F) // "SPI.begin()"
+#define EVENT_SPI_END                    FIRMATA_EVENT_ID(SPI_DATA, 0x10) // "SPI.end()"
+
+#define EVENT_DHT_MESSAGE_TOO_SHORT      FIRMATA_EVENT_ID(DHTSENSOR_DATA, 0x01) // "Error in DHT command: Not enough parameters"
+#define EVENT_DHT_SENSOR_TYPE            FIRMATA_EVENT_ID(DHTSENSOR_DATA, 0x02) // "DHT: Unsupported sensor type " type
+#define EVENT_DHT_INVALID_PIN            FIRMATA_EVENT_ID(DHTSENSOR_DATA, 0x03) // "DHT: Invalid pin " pin
+#define EVENT_DHT_TOO_MANY_SENSORS       FIRMATA_EVENT_ID(DHTSENSOR_DATA, 0x04) // "DHT: Max number of sensors exceeded"
+#define EVENT_DHT_READ_ERROR             FIRMATA_EVENT_ID(DHTSENSOR_DATA, 0x05) // "DHT: Error reading sensor on pin " pin
+
+#define EVENT_ACCELSTEPPER_OUT_OF_MEMORY FIRMATA_EVENT_ID(ACCELSTEPPER_DATA, 0x01) // "AccelStepper: Out of memory"
+
+#define EVENT_BOOT_CONFIG_TOO_LARGE      FIRMATA_EVENT_ID(FIRMATA_BOOT_CONFIG, 0x01) // "Boot configuration too large: " bytes written
+#define EVENT_BOOT_CONFIG_UNSUPPORTED    FIRMATA_EVENT_ID(FIRMATA_BOOT_CONFIG, 0x02) // "Boot configuration not supported by an active feature"
+
+#define EVENT_ONEWIRE_TOO_MANY_CONVERSIONS FIRMATA_EVENT_ID(ONEWIRE_DATA, 0x01) // "OneWire: Too many conversions in progress"
+#define EVENT_ONEWIRE_OUT_OF_MEMORY      FIRMATA_EVENT_ID(ONEWIRE_DATA, 0x02) // "OneWire: Out of memory"
+
+#define EVENT_SERVO_OUT_OF_MEMORY        FIRMATA_EVENT_ID(SERVO_CONFIG, 0x01) // "Servo: Out of memory"
+
+#define EVENT_MODBUS_INVALID_PORT        FIRMATA_EVENT_ID(MODBUS_DATA, 0x01) // "Modbus: Not a hardware serial port: " port
+#define EVENT_MODBUS_TOO_MANY_PORTS      FIRMATA_EVENT_ID(MODBUS_DATA, 0x02) // "Modbus: Max number of ports exceeded"
+#define EVENT_MODBUS_OUT_OF_MEMORY       FIRMATA_EVENT_ID(MODBUS_DATA, 0x03) // "Modbus: Out of memory"
+#define EVENT_MODBUS_NOT_CONFIGURED      FIRMATA_EVENT_ID(MODBUS_DATA, 0x04) // "Modbus: Port not configured: " port
+
+#endif
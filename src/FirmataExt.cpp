@@ -18,33 +18,56 @@
 
 #include <ConfigurableFirmata.h>
 #include "FirmataExt.h"
+#include "FirmataStats.h"
+#include "Encoder7Bit.h"
+#include "FirmataArena.h"
 
 FirmataExt *FirmataExtInstance;
+byte FirmataExt::envelopeErrors = 0;
+boolean FirmataExt::inEnvelope = false;
 
 void handleSetPinModeCallback(byte pin, int mode)
 {
   if (!FirmataExtInstance->handlePinMode(pin, mode) && mode != PIN_MODE_IGNORE) {
-    Firmata.sendString(F("Unknown pin mode")); 
+    FirmataExt::envelopeErrors++;
+    Firmata.sendEvent(EVENT_UNKNOWN_PIN_MODE, F("Unknown pin mode (pin, mode): "), pin, mode); 
   }
 }
 
 void handleSysexCallback(byte command, byte argc, byte* argv)
 {
   if (!FirmataExtInstance->handleSysex(command, argc, argv)) {
-    Firmata.sendString(F("Unhandled sysex command"));
+    FirmataExt::envelopeErrors++;
+    Firmata.sendEvent(EVENT_UNHANDLED_SYSEX, F("Unhandled sysex command: "), command);
   }
 }
 
+boolean handleSysexStreamCallback(byte command, byte phase, byte length, byte* data)
+{
+  return FirmataExtInstance->handleSysexStream(command, phase, length, data);
+}
+
 FirmataExt::FirmataExt()
 {
   FirmataExtInstance = this;
   Firmata.attach(SET_PIN_MODE, handleSetPinModeCallback);
   Firmata.attach((byte)START_SYSEX, handleSysexCallback);
+  Firmata.attachSysexStream(handleSysexStreamCallback);
     for (int i = 0; i < MAX_FEATURES; i++)
     {
         features[i] = nullptr;
+        reportInterval[i] = 0;
+        lastReport[i] = 0;
     }
   numFeatures = 0;
+  timestampedFeatures = 0;
+  lastTimestampSync = 0;
+  stats = nullptr;
+  invalidateCapabilities();
+  for (int i = 0; i < 128; i++)
+  {
+    sysexOwner[i] = NO_SYSEX_OWNER;
+  }
 }
 
 void FirmataExt::handleCapability(byte pin)
@@ -66,63 +89,275 @@ boolean FirmataExt::handleSysex(byte command, byte argc, byte* argv)
   switch (command) {
 
     case PIN_STATE_QUERY:
-      if (argc > 0) {
-        byte pin = argv[0];
-        if (pin < TOTAL_PINS) {
-          Firmata.write(START_SYSEX);
-          Firmata.write(PIN_STATE_RESPONSE);
-          Firmata.write(pin);
-          Firmata.write(Firmata.getPinMode(pin));
-          int pinState = Firmata.getPinState(pin);
-          Firmata.write((byte)pinState & 0x7F);
-          if (pinState & 0xFF80) Firmata.write((byte)(pinState >> 7) & 0x7F);
-          if (pinState & 0xC000) Firmata.write((byte)(pinState >> 14) & 0x7F);
-          Firmata.write(END_SYSEX);
-          return true;
-        }
+      if (handlePinStateQuery(argc, argv)) {
+        return true;
       }
       break;
+    case FIRMATA_ENVELOPE:
+      return handleEnvelope(argc, argv);
     case CAPABILITY_QUERY:
-      Firmata.write(START_SYSEX);
-      Firmata.write(CAPABILITY_RESPONSE);
-      for (byte pin = 0; pin < TOTAL_PINS; pin++) {
-        if (Firmata.getPinMode(pin) != PIN_MODE_IGNORE) {
-          for (byte i = 0; i < numFeatures; i++) {
-            features[i]->handleCapability(pin);
-          }
+      sendCapabilities();
+      return true;
+    case REPORT_INTERVAL:
+      // The feature is selected by one of the sysex commands it handles, the interval is a packed uint32 in microseconds
+      if (argc >= 6 && argv[0] < 128 && sysexOwner[argv[0]] != NO_SYSEX_OWNER) {
+        byte index = sysexOwner[argv[0]];
+        reportInterval[index] = Firmata.decodePackedUInt32(argv + 1);
+        lastReport[index] = micros();
+        return true;
+      }
+      break;
+    case TIMESTAMP_DATA:
+      // TIMESTAMP_CONFIG, feature selector (as for REPORT_INTERVAL), 1 = enable / 0 = disable
+      if (argc >= 3 && argv[0] == TIMESTAMP_CONFIG && argv[1] < 128 && sysexOwner[argv[1]] != NO_SYSEX_OWNER) {
+        uint32_t bit = 1UL << sysexOwner[argv[1]];
+        if (argv[2] == 1) {
+          timestampedFeatures |= bit;
+          sendTimestampSync();
+        } else {
+          timestampedFeatures &= ~bit;
         }
-        Firmata.write(127);
+        return true;
       }
-      Firmata.write(END_SYSEX);
-      return true;
+      break;
     default:
+    {
+      byte owner = command < 128 ? sysexOwner[command] : NO_SYSEX_OWNER;
+      if (owner != NO_SYSEX_OWNER && features[owner]->handleSysex(command, argc, argv)) {
+        return true;
+      }
+      // Not declared by anyone (or the owner declined, e.g. because it is disabled): ask the others
       for (byte i = 0; i < numFeatures; i++) {
-        if (features[i]->handleSysex(command, argc, argv)) {
-			return true;
+        if (i != owner && features[i]->handleSysex(command, argc, argv)) {
+          return true;
         }
       }
       break;
+    }
   }
   return false;
 }
 
+boolean FirmataExt::handleSysexStream(byte command, byte phase, byte length, byte* data)
+{
+  // streams only go to the feature that declared the command
+  FirmataFeature* owner = getSysexOwner(command);
+  return owner != NULL && owner->handleSysexStream(command, phase, length, data);
+}
+
+void FirmataExt::writeConfiguration(Print& out)
+{
+  for (byte i = 0; i < numFeatures; i++) {
+    features[i]->writeConfiguration(out);
+  }
+}
+
+boolean FirmataExt::canWriteConfiguration()
+{
+  for (byte i = 0; i < numFeatures; i++) {
+    if (!features[i]->canWriteConfiguration()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+boolean FirmataExt::handleEnvelope(byte argc, byte* argv)
+{
+  if (argc < 3 || argv[0] != ENVELOPE_EXECUTE) {
+    return false;
+  }
+  // the inner messages are parsed into the same input buffer, so copy everything out of it first
+  byte sequenceLsb = argv[1];
+  byte sequenceMsb = argv[2];
+  byte status = ENVELOPE_OK;
+  envelopeErrors = 0;
+  if (inEnvelope) {
+    status = ENVELOPE_NESTED;
+  } else {
+    byte messages[num7BitOutbytes(MAX_DATA_BYTES)];
+    byte length = num7BitOutbytes(argc - 3);
+    Encoder7BitClass::readBinary(length, argv + 3, messages);
+    inEnvelope = true;
+    // with the output queue, the events and telemetry of the inner messages would wait on their lanes
+    // while the acknowledgement overtakes them, so they are sent as replies (nested lanes are ignored)
+    Firmata.beginMessage(FIRMATA_LANE_CONTROL);
+    for (byte i = 0; i < length; i++) {
+      Firmata.parse(messages[i]);
+    }
+    Firmata.endMessage();
+    inEnvelope = false;
+    if (Firmata.isParsingMessage()) {
+      Firmata.resetParser();
+      status = ENVELOPE_INCOMPLETE;
+    }
+  }
+  // everything the inner messages wrote precedes the acknowledgement, only the repeats of a
+  // rate limited event are reported later (see FirmataClass::sendEvent())
+  Firmata.startSysex();
+  Firmata.write(FIRMATA_ENVELOPE);
+  Firmata.write(ENVELOPE_ACK);
+  Firmata.write(sequenceLsb);
+  Firmata.write(sequenceMsb);
+  Firmata.write(status);
+  Firmata.write(envelopeErrors > 127 ? 127 : envelopeErrors);
+  Firmata.endSysex();
+  return true;
+}
+
+boolean FirmataExt::handlePinStateQuery(byte argc, byte* argv)
+{
+  if (argc > 0) {
+    byte pin = argv[0];
+    if (pin < TOTAL_PINS) {
+      Firmata.write(START_SYSEX);
+      Firmata.write(PIN_STATE_RESPONSE);
+      Firmata.write(pin);
+      Firmata.write(Firmata.getPinMode(pin));
+      int pinState = Firmata.getPinState(pin);
+      Firmata.write((byte)pinState & 0x7F);
+      if (pinState & 0xFF80) Firmata.write((byte)(pinState >> 7) & 0x7F);
+      if (pinState & 0xC000) Firmata.write((byte)(pinState >> 14) & 0x7F);
+      Firmata.write(END_SYSEX);
+      return true;
+    }
+  }
+  return false;
+}
+
+void FirmataExt::writeCapabilities()
+{
+  Firmata.write(START_SYSEX);
+  Firmata.write(CAPABILITY_RESPONSE);
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    if (Firmata.getPinMode(pin) != PIN_MODE_IGNORE) {
+      for (byte i = 0; i < numFeatures; i++) {
+        features[i]->handleCapability(pin);
+      }
+    }
+    Firmata.write(127);
+  }
+  Firmata.write(END_SYSEX);
+}
+
+void FirmataExt::sendCapabilities()
+{
+#if FIRMATA_CAPABILITY_CACHE_SIZE > 0
+  byte ignored[sizeof(ignoredPins)] = { 0 };
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    if (Firmata.getPinMode(pin) == PIN_MODE_IGNORE) {
+      ignored[pin / 8] |= 1 << (pin % 8);
+    }
+  }
+  if (capabilityLength == 0 || memcmp(ignored, ignoredPins, sizeof(ignored)) != 0) {
+    memcpy(ignoredPins, ignored, sizeof(ignored));
+    Firmata.beginCapture(capabilityCache, sizeof(capabilityCache));
+    writeCapabilities();
+    capabilityLength = Firmata.endCapture();
+  }
+  if (capabilityLength != 0) {
+    Firmata.write(capabilityCache, capabilityLength);
+    return;
+  }
+#endif
+  // too large for the cache
+  writeCapabilities();
+}
+
+void FirmataExt::invalidateCapabilities()
+{
+#if FIRMATA_CAPABILITY_CACHE_SIZE > 0
+  capabilityLength = 0;
+#endif
+}
+
 void FirmataExt::addFeature(FirmataFeature &capability)
 {
+  invalidateCapabilities();
   if (numFeatures < MAX_FEATURES) {
+    for (byte command = 0; command < 128; command++) {
+      if (sysexOwner[command] == NO_SYSEX_OWNER && capability.ownsSysexCommand(command)) {
+        sysexOwner[command] = numFeatures;
+      }
+    }
     features[numFeatures++] = &capability;
   }
 }
 
+void FirmataExt::attachStats(FirmataStats &stats)
+{
+  addFeature(stats);
+  this->stats = &stats;
+}
+
+FirmataFeature* FirmataExt::getSysexOwner(byte command)
+{
+  if (command >= 128 || sysexOwner[command] == NO_SYSEX_OWNER) {
+    return NULL;
+  }
+  return features[sysexOwner[command]];
+}
+
 void FirmataExt::reset()
 {
   for (byte i = 0; i < numFeatures; i++) {
     features[i]->reset();
+    reportInterval[i] = 0;
   }
+  timestampedFeatures = 0;
+  // the features have destroyed their drivers, whatever is left was forgotten
+  FirmataArena.reset();
 }
 
 void FirmataExt::report(bool elapsed)
 {
+  unsigned long now = micros();
   for (byte i = 0; i < numFeatures; i++) {
-    features[i]->report(elapsed);
+    bool due = elapsed;
+    if (reportInterval[i] != 0) {
+      due = now - lastReport[i] >= reportInterval[i];
+      if (due) {
+        lastReport[i] += reportInterval[i];
+        // don't try to catch up if we're more than one interval behind
+        if (now - lastReport[i] >= reportInterval[i]) {
+          lastReport[i] = now;
+        }
+      }
+    }
+    unsigned long start = stats != nullptr ? micros() : 0;
+    if (due && (timestampedFeatures & (1UL << i))) {
+      unsigned long before = Firmata.getBytesWritten();
+      unsigned long sampleTime = micros();
+      features[i]->report(due);
+      if (Firmata.getBytesWritten() != before) {
+        Firmata.startSysex();
+        Firmata.write(TIMESTAMP_DATA);
+        Firmata.write(TIMESTAMP_SAMPLE);
+        Firmata.sendPackedUInt32(sampleTime);
+        Firmata.endSysex();
+      }
+    } else {
+      features[i]->report(due);
+    }
+    if (stats != nullptr) {
+      stats->reportTime(i, micros() - start);
+    }
+  }
+  if (timestampedFeatures != 0 && millis() - lastTimestampSync >= TIMESTAMP_SYNC_INTERVAL) {
+    sendTimestampSync();
   }
+  Firmata.flushEvents();
+  // send everything that was collected during this loop iteration
+  Firmata.flush();
+}
+
+void FirmataExt::sendTimestampSync()
+{
+  lastTimestampSync = millis();
+  Firmata.startSysex();
+  Firmata.write(TIMESTAMP_DATA);
+  Firmata.write(TIMESTAMP_SYNC);
+  Firmata.sendPackedUInt32(micros());
+  Firmata.sendPackedUInt32(lastTimestampSync);
+  Firmata.endSysex();
 }
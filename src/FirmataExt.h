@@ -22,10 +22,52 @@
 
 #define MAX_FEATURES TOTAL_PIN_MODES + 5
 
+// The CAPABILITY_RESPONSE is built once and sent from this buffer, 0 builds it for every query
+#ifndef FIRMATA_CAPABILITY_CACHE_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define FIRMATA_CAPABILITY_CACHE_SIZE 1536
+#else
+#define FIRMATA_CAPABILITY_CACHE_SIZE 0
+#endif
+#endif
+
+// marks a sysex command that no feature declared via ownsSysexCommand()
+#define NO_SYSEX_OWNER 0xFF
+
+/*
+  Report intervals per feature:
+  START_SYSEX, REPORT_INTERVAL, sysex command of the feature, interval in us (packed uint32), END_SYSEX
+  The feature is selected by one of the sysex commands it handles, an interval of 0 returns it to
+  the sampling interval of FirmataReporting. report() still calls every feature on every loop,
+  with elapsed = true when its interval has passed: most features also have work that doesn't wait
+  for an interval (serial ports, steppers, the I2C queues, tasks). With at most MAX_FEATURES due
+  times, they are checked one after the other instead of being kept in a timing wheel or heap.
+*/
+
+// TIMESTAMP_DATA subcommands
+#define TIMESTAMP_CONFIG        0x00 // host -> board: enable/disable timestamps for a feature
+#define TIMESTAMP_SAMPLE        0x01 // board -> host: micros() at which the reports since the previous frame were sampled
+#define TIMESTAMP_SYNC          0x02 // board -> host: current micros() and millis(), to unwrap micros() on the host
+
+#define TIMESTAMP_SYNC_INTERVAL 1000 // ms
+
+// FIRMATA_ENVELOPE subcommands
+#define ENVELOPE_EXECUTE        0x00 // host -> board: sequence id (2 x 7 bits), the inner messages (7 bit encoded)
+#define ENVELOPE_ACK            0x01 // board -> host: sequence id, status, number of inner messages nobody handled
+
+// ENVELOPE_ACK status
+#define ENVELOPE_OK             0x00
+#define ENVELOPE_INCOMPLETE     0x01 // the last inner message was cut off and discarded
+#define ENVELOPE_NESTED         0x02 // envelopes can't contain envelopes, nothing was executed
+
+class FirmataStats;
+
 void handleSetPinModeCallback(byte pin, int mode);
 
 void handleSysexCallback(byte command, byte argc, byte* argv);
 
+boolean handleSysexStreamCallback(byte command, byte phase, byte length, byte* data);
+
 class FirmataExt: public FirmataFeature
 {
   public:
@@ -33,12 +75,48 @@ class FirmataExt: public FirmataFeature
     void handleCapability(byte pin); //empty method
     boolean handlePinMode(byte pin, int mode);
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean handleSysexStream(byte command, byte phase, byte length, byte* data) override;
     void addFeature(FirmataFeature &capability);
+    // adds the statistics feature and times the report() of all features for it
+    void attachStats(FirmataStats &stats);
+    // the feature that declared to handle the sysex command, or NULL
+    FirmataFeature* getSysexOwner(byte command);
+    // for features whose capabilities change, the next CAPABILITY_QUERY builds the response again
+    void invalidateCapabilities();
     void reset();
     void report(bool elapsed) override;
+    void writeConfiguration(Print& out) override;
+    boolean canWriteConfiguration() override;
+    // answers a PIN_STATE_QUERY, shared with FirmataExtT
+    static boolean handlePinStateQuery(byte argc, byte* argv);
+    // executes the inner messages of a FIRMATA_ENVELOPE and acknowledges them, shared with FirmataExtT
+    static boolean handleEnvelope(byte argc, byte* argv);
+    // inner messages of the current envelope that no feature handled, counted by the callbacks
+    static byte envelopeErrors;
   private:
     FirmataFeature *features[MAX_FEATURES];
     byte numFeatures;
+    // index into features[] of the feature that handles each sysex command
+    byte sysexOwner[128];
+    // report interval of each feature in microseconds, 0 = use the global sampling interval
+    unsigned long reportInterval[MAX_FEATURES];
+    unsigned long lastReport[MAX_FEATURES];
+    // bit i set = send a TIMESTAMP_SAMPLE after the reports of features[i]
+    uint32_t timestampedFeatures;
+    unsigned long lastTimestampSync;
+    FirmataStats *stats;
+    static boolean inEnvelope;
+    void sendTimestampSync();
+    void writeCapabilities();
+    void sendCapabilities();
+#if FIRMATA_CAPABILITY_CACHE_SIZE > 0
+    byte capabilityCache[FIRMATA_CAPABILITY_CACHE_SIZE];
+    size_t capabilityLength; // 0 = not built
+    // the pins that were PIN_MODE_IGNORE when the response was built, they have no capabilities in it
+    byte ignoredPins[(TOTAL_PINS + 7) / 8];
+#endif
 };
 
+extern FirmataExt *FirmataExtInstance;
+
 #endif
@@ -0,0 +1,185 @@
+/*
+  FirmataExtT.h - Firmata library
+
+  A variant of FirmataExt with a feature set that is fixed at compile time. The features are
+  called directly instead of through their vtables, the calls can be inlined, and features that
+  don't override report() are not called at all from the main loop. No feature table is kept in
+  RAM.
+
+  Usage, instead of FirmataExt and addFeature():
+
+    DigitalInputFirmata digitalInput;
+    DigitalOutputFirmata digitalOutput;
+    FirmataReporting reporting;
+    FirmataExtT<DigitalInputFirmata, DigitalOutputFirmata, FirmataReporting> firmataExt(digitalInput, digitalOutput, reporting);
+
+  Sysex commands are offered to the features in the given order. Per-feature report intervals
+  and timestamps (REPORT_INTERVAL, TIMESTAMP_DATA) are only supported by FirmataExt.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef FirmataExtT_h
+#define FirmataExtT_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+#include "FirmataExt.h"
+#include "FirmataArena.h"
+
+template<typename T, typename U> struct FirmataIsSame { static const bool value = false; };
+template<typename T> struct FirmataIsSame<T, T> { static const bool value = true; };
+
+// true if the feature (or one of its base classes) overrides FirmataFeature::report()
+template<typename Feature> struct FirmataHasReport
+{
+  static const bool value = !FirmataIsSame<decltype(&Feature::report), void (FirmataFeature::*)(bool)>::value;
+};
+
+template<typename... Features> class FirmataFeatureList
+{
+  public:
+    void handleCapability(byte pin) {}
+    boolean handlePinMode(byte pin, int mode) { return false; }
+    boolean handleSysex(byte command, byte argc, byte* argv) { return false; }
+    boolean handleSysexStream(byte command, byte phase, byte length, byte* data) { return false; }
+    void reset() {}
+    void report(bool elapsed) {}
+};
+
+template<typename First, typename... Rest> class FirmataFeatureList<First, Rest...>
+{
+  public:
+    FirmataFeatureList(First& first, Rest&... rest) : feature(first), rest(rest...) {}
+
+    inline void handleCapability(byte pin)
+    {
+      feature.First::handleCapability(pin);
+      rest.handleCapability(pin);
+    }
+
+    inline boolean handlePinMode(byte pin, int mode)
+    {
+      // every feature sees the mode change, so that the previous owner of the pin can release it
+      boolean known = feature.First::handlePinMode(pin, mode);
+      return rest.handlePinMode(pin, mode) || known;
+    }
+
+    inline boolean handleSysex(byte command, byte argc, byte* argv)
+    {
+      return feature.First::handleSysex(command, argc, argv) || rest.handleSysex(command, argc, argv);
+    }
+
+    inline boolean handleSysexStream(byte command, byte phase, byte length, byte* data)
+    {
+      // without a table of owners, the first feature that accepts the command gets the stream
+      return (feature.First::ownsSysexCommand(command) && feature.First::handleSysexStream(command, phase, length, data)) ||
+        rest.handleSysexStream(command, phase, length, data);
+    }
+
+    inline void reset()
+    {
+      feature.First::reset();
+      rest.reset();
+    }
+
+    inline void report(bool elapsed)
+    {
+      if (FirmataHasReport<First>::value) {
+        feature.First::report(elapsed);
+      }
+      rest.report(elapsed);
+    }
+
+  private:
+    First& feature;
+    FirmataFeatureList<Rest...> rest;
+};
+
+template<typename... Features> class FirmataExtT
+{
+  public:
+    FirmataExtT(Features&... features) : features(features...)
+    {
+      instance = this;
+      Firmata.attach(SET_PIN_MODE, handleSetPinModeCallback);
+      Firmata.attach((byte)START_SYSEX, handleSysexCallback);
+      Firmata.attachSysexStream(handleSysexStreamCallback);
+    }
+
+    inline boolean handlePinMode(byte pin, int mode)
+    {
+      return features.handlePinMode(pin, mode);
+    }
+
+    boolean handleSysex(byte command, byte argc, byte* argv)
+    {
+      switch (command) {
+        case PIN_STATE_QUERY:
+          return FirmataExt::handlePinStateQuery(argc, argv);
+        case FIRMATA_ENVELOPE:
+          return FirmataExt::handleEnvelope(argc, argv);
+        case CAPABILITY_QUERY:
+          Firmata.write(START_SYSEX);
+          Firmata.write(CAPABILITY_RESPONSE);
+          for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+            if (Firmata.getPinMode(pin) != PIN_MODE_IGNORE) {
+              features.handleCapability(pin);
+            }
+            Firmata.write(127);
+          }
+          Firmata.write(END_SYSEX);
+          return true;
+        default:
+          return features.handleSysex(command, argc, argv);
+      }
+    }
+
+    inline void reset()
+    {
+      features.reset();
+      FirmataArena.reset();
+    }
+
+    inline void report(bool elapsed)
+    {
+      features.report(elapsed);
+      Firmata.flushEvents();
+      // send everything that was collected during this loop iteration
+      Firmata.flush();
+    }
+
+  private:
+    FirmataFeatureList<Features...> features;
+    static FirmataExtT* instance;
+
+    static void handleSetPinModeCallback(byte pin, int mode)
+    {
+      if (!instance->handlePinMode(pin, mode) && mode != PIN_MODE_IGNORE) {
+        FirmataExt::envelopeErrors++;
+        Firmata.sendEvent(EVENT_UNKNOWN_PIN_MODE, F("Unknown pin mode (pin, mode): "), pin, mode);
+      }
+    }
+
+    static void handleSysexCallback(byte command, byte argc, byte* argv)
+    {
+      if (!instance->handleSysex(command, argc, argv)) {
+        FirmataExt::envelopeErrors++;
+        Firmata.sendEvent(EVENT_UNHANDLED_SYSEX, F("Unhandled sysex command: "), command);
+      }
+    }
+
+    static boolean handleSysexStreamCallback(byte command, byte phase, byte length, byte* data)
+    {
+      return instance->features.handleSysexStream(command, phase, length, data);
+    }
+};
+
+template<typename... Features> FirmataExtT<Features...>* FirmataExtT<Features...>::instance = nullptr;
+
+#endif
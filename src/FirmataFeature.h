@@ -25,8 +25,55 @@ class FirmataFeature
     virtual void handleCapability(byte pin) = 0;
     virtual boolean handlePinMode(byte pin, int mode) = 0;
     virtual boolean handleSysex(byte command, byte argc, byte* argv) = 0;
+
+    /// <summary>
+    /// Declares the sysex commands this feature handles. FirmataExt queries this once when the feature is added
+    /// and dispatches the declared commands directly to this feature.
+    /// </summary>
+    /// <param name="command">A sysex command id (0-127)</param>
+    /// <returns>True if the command is handled by this feature. Features that return false for all commands
+    /// are still offered every command that no other feature handled.</returns>
+    virtual boolean ownsSysexCommand(byte command)
+    {
+      return false;
+    }
+
+    /// <summary>
+    /// Receives a sysex message longer than SYSEX_STREAM_CHUNK_SIZE data bytes while it arrives, instead of
+    /// through handleSysex(), so that it doesn't need to fit into the input buffer. Only called for the commands
+    /// reported by ownsSysexCommand(). Short messages of the command still go to handleSysex().
+    /// </summary>
+    /// <param name="command">The sysex command</param>
+    /// <param name="phase">SYSEX_STREAM_BEGIN first, then SYSEX_STREAM_DATA for every chunk and finally SYSEX_STREAM_END,
+    /// or SYSEX_STREAM_ABORT if the message was interrupted by a reset</param>
+    /// <param name="length">Number of data bytes, SYSEX_STREAM_CHUNK_SIZE (a multiple of 8) except for the last chunk.
+    /// SYSEX_STREAM_BEGIN already gets the first chunk to look at, it is delivered again with SYSEX_STREAM_DATA.</param>
+    /// <returns>For SYSEX_STREAM_BEGIN: true to receive the message, false to have it discarded if it overflows
+    /// the input buffer. Return true for all phases of an accepted stream.</returns>
+    virtual boolean handleSysexStream(byte command, byte phase, byte length, byte* data)
+    {
+      return false;
+    }
     virtual void reset() = 0;
 
+    /// <summary>
+    /// Writes the Firmata messages that recreate the current configuration of this feature, for FirmataBootConfig.
+    /// Pin modes that need no other message are already covered. The messages are replayed at boot, after reset().
+    /// </summary>
+    virtual void writeConfiguration(Print& out)
+    {
+      // Nothing to save by default
+    }
+
+    /// <summary>
+    /// False while this feature has a configuration that writeConfiguration() can't recreate. FirmataBootConfig
+    /// refuses to save then, rather than store a configuration that comes back incomplete.
+    /// </summary>
+    virtual boolean canWriteConfiguration()
+    {
+      return true;
+    }
+
     /// <summary>
     /// Regularly called by main thread
     /// </summary>
@@ -47,6 +47,15 @@ boolean FirmataReporting::handleSysex(byte command, byte argc, byte* argv)
   return false;
 }
 
+void FirmataReporting::writeConfiguration(Print& out)
+{
+  out.write(START_SYSEX);
+  out.write(SAMPLING_INTERVAL);
+  out.write(samplingInterval & 0x7F);
+  out.write((samplingInterval >> 7) & 0x7F);
+  out.write(END_SYSEX);
+}
+
 boolean FirmataReporting::elapsed()
 {
   currentMillis = millis();
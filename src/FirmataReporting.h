@@ -37,7 +37,9 @@ class FirmataReporting: public FirmataFeature
     void handleCapability(byte pin); //empty method
     boolean handlePinMode(byte pin, int mode); //empty method
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean ownsSysexCommand(byte command) override { return command == SAMPLING_INTERVAL; }
     void reset();
+    void writeConfiguration(Print& out) override;
 
     boolean elapsed();
   private:
@@ -15,9 +15,33 @@
 #include "Encoder7Bit.h"
 #include "FirmataScheduler.h"
 #include "FirmataExt.h"
+#include "I2CFirmata.h"
+#include "utility/PinInterrupts.h"
+
+#ifdef ESP32
+#define TRIGGER_ISR_ATTR IRAM_ATTR
+#else
+#define TRIGGER_ISR_ATTR
+#endif
 
 FirmataScheduler *FirmataSchedulerInstance;
 
+// set by the interrupts of digital triggers and by the I2C reads, handled in report()
+static volatile bool triggerFired[MAX_FIRMATA_TASK_TRIGGERS];
+
+template<int N> static void TRIGGER_ISR_ATTR triggerIsr()
+{
+  triggerFired[N] = true;
+}
+
+static const voidFuncPtr triggerIsrs[] = { triggerIsr<0>, triggerIsr<1>, triggerIsr<2>, triggerIsr<3>, triggerIsr<4>,
+  triggerIsr<5>, triggerIsr<6>, triggerIsr<7> };
+
+static void i2cTriggerListener(byte bus, byte address, int reg, const byte *data, byte count)
+{
+  FirmataSchedulerInstance->i2cRead(bus, address, reg, data, count);
+}
+
 void delayTaskCallback(long delay)
 {
   FirmataSchedulerInstance->delayTask(delay);
@@ -26,8 +50,24 @@ void delayTaskCallback(long delay)
 FirmataScheduler::FirmataScheduler()
 {
   FirmataSchedulerInstance = this;
-  tasks = NULL;
   running = NULL;
+  lastMicros = 0;
+  microsHigh = 0;
+  for (byte i = 0; i < MAX_FIRMATA_TASKS; i++) {
+    taskPool[i].id = NO_FIRMATA_TASK;
+  }
+#ifdef LARGE_MEM_DEVICE
+  for (byte i = 0; i < MAX_FIRMATA_TASK_ID; i++) {
+    taskSlot[i] = NO_FIRMATA_TASK;
+  }
+#endif
+  numTasks = 0;
+  taskDataUsed = 0;
+  taskOpsUsed = 0;
+  heapSize = 0;
+  for (byte i = 0; i < MAX_FIRMATA_TASK_TRIGGERS; i++) {
+    triggers[i].id = NO_FIRMATA_TASK;
+  }
   Firmata.attachDelayTask(delayTaskCallback);
 }
 
@@ -98,6 +138,13 @@ boolean FirmataScheduler::handleSysex(byte command, byte argc, byte* argv)
             }
             break;
           }
+        case TRIGGER_FIRMATA_TASK:
+          {
+            if (argc >= 3) {
+              setTrigger(argv[1], argc - 2, argv + 2);
+            }
+            break;
+          }
         case RESET_FIRMATA_TASKS:
           {
             reset();
@@ -117,38 +164,73 @@ void FirmataScheduler::createTask(byte id, int len)
   firmata_task *existing = findTask(id);
   if (existing) {
     reportTask(id, existing, true);
+    return;
   }
-  else {
-    firmata_task *newTask = (firmata_task*)malloc(sizeof(firmata_task) + len);
-    newTask->id = id;
-    newTask->time_ms = 0;
-    newTask->len = len;
-    newTask->nextTask = tasks;
-    newTask->pos = 0;
-    tasks = newTask;
+  if (id >= MAX_FIRMATA_TASK_ID || numTasks >= MAX_FIRMATA_TASKS || len < 0 || taskDataUsed + len > FIRMATA_TASK_DATA_SIZE) {
+    Firmata.sendString(F("Not enough memory for the task"));
+    reportTask(id, NULL, true);
+    return;
+  }
+  byte slot = 0;
+  while (taskPool[slot].id != NO_FIRMATA_TASK) {
+    slot++;
   }
+  firmata_task *newTask = &taskPool[slot];
+  newTask->id = id;
+  newTask->heapIndex = NO_FIRMATA_TASK;
+  newTask->time_us = 0;
+  newTask->len = len;
+  newTask->pos = 0;
+  newTask->offset = taskDataUsed;
+  newTask->firstOp = taskOpsUsed;
+  newTask->numOps = 0;
+  newTask->nextOp = 0;
+  taskDataUsed += len;
+#ifdef LARGE_MEM_DEVICE
+  taskSlot[id] = slot;
+#endif
+  numTasks++;
 };
 
 void FirmataScheduler::deleteTask(byte id)
 {
-  firmata_task *current = tasks;
-  firmata_task *previous = NULL;
-  while (current) {
-    if (current->id == id) {
-      if (previous) {
-        previous->nextTask = current->nextTask;
-      }
-      else {
-        tasks = current->nextTask;
-      }
-      free (current);
-      return;
+  firmata_task *task = findTask(id);
+  if (!task) {
+    return;
+  }
+  if (task->heapIndex != NO_FIRMATA_TASK) {
+    heapRemove(task->heapIndex);
+  }
+  for (byte i = 0; i < MAX_FIRMATA_TASK_TRIGGERS; i++) {
+    if (triggers[i].id == id) {
+      removeTrigger(i);
     }
-    else {
-      previous = current;
-      current = current->nextTask;
+  }
+  // keep the messages of the remaining tasks together, so a new task can use the space
+  int end = task->offset + task->len;
+  memmove(&taskData[task->offset], &taskData[end], taskDataUsed - end);
+  for (byte i = 0; i < MAX_FIRMATA_TASKS; i++) {
+    if (taskPool[i].id != NO_FIRMATA_TASK && taskPool[i].offset >= end) {
+      taskPool[i].offset -= task->len;
     }
   }
+  taskDataUsed -= task->len;
+  int endOp = task->firstOp + task->numOps;
+  memmove(&taskOps[task->firstOp], &taskOps[endOp], (taskOpsUsed - endOp) * sizeof(firmata_task_op));
+  for (byte i = 0; i < MAX_FIRMATA_TASKS; i++) {
+    if (taskPool[i].id != NO_FIRMATA_TASK && taskPool[i].firstOp >= endOp) {
+      taskPool[i].firstOp -= task->numOps;
+    }
+  }
+  taskOpsUsed -= task->numOps;
+  if (running == task) {
+    running = NULL;
+  }
+  task->id = NO_FIRMATA_TASK;
+#ifdef LARGE_MEM_DEVICE
+  taskSlot[id] = NO_FIRMATA_TASK;
+#endif
+  numTasks--;
 };
 
 void FirmataScheduler::addToTask(byte id, int additionalBytes, byte *message)
@@ -156,8 +238,10 @@ void FirmataScheduler::addToTask(byte id, int additionalBytes, byte *message)
   firmata_task *existing = findTask(id);
   if (existing) { //task exists and has not been fully loaded yet
     if (existing->pos + additionalBytes <= existing->len) {
-      for (int i = 0; i < additionalBytes; i++) {
-        existing->messages[existing->pos++] = message[i];
+      memcpy(&taskData[existing->offset + existing->pos], message, additionalBytes);
+      existing->pos += additionalBytes;
+      if (existing->pos == existing->len && existing->numOps == 0) {
+        compileTask(existing);
       }
     }
   }
@@ -170,8 +254,16 @@ void FirmataScheduler::schedule(byte id, long delay_ms)
 {
   firmata_task *existing = findTask(id);
   if (existing) {
+    if (existing->heapIndex != NO_FIRMATA_TASK) {
+      heapRemove(existing->heapIndex);
+    }
     existing->pos = 0;
-    existing->time_ms = millis() + delay_ms;
+    existing->nextOp = 0;
+    existing->time_us = now() + (int64_t)delay_ms * 1000;
+    // a running task is put back into the schedule when it returns
+    if (existing != running) {
+      heapInsert(findSlot(id));
+    }
   }
   else {
     reportTask(id, NULL, true);
@@ -181,10 +273,178 @@ void FirmataScheduler::schedule(byte id, long delay_ms)
 void FirmataScheduler::delayTask(long delay_ms)
 {
   if (running) {
-    long now = millis();
-    running->time_ms += delay_ms;
-    if (running->time_ms < now) { //if delay time allready passed by schedule to 'now'.
-      running->time_ms = now;
+    uint64_t now = this->now();
+    running->time_us += (int64_t)delay_ms * 1000;
+    if (running->time_us < now) { //if delay time allready passed by schedule to 'now'.
+      running->time_us = now;
+    }
+  }
+}
+
+void FirmataScheduler::setTrigger(byte id, byte argc, byte *argv)
+{
+  if (!findTask(id)) {
+    reportTask(id, NULL, true);
+    return;
+  }
+  firmata_task_trigger *trigger = findTrigger(id);
+  if (trigger) {
+    removeTrigger(trigger - triggers);
+  }
+  byte kind = argv[0] & ~TASK_TRIGGER_REPEAT;
+  if (kind == TASK_TRIGGER_NONE) {
+    return;
+  }
+  trigger = findTrigger(NO_FIRMATA_TASK);
+  if (!trigger) {
+    Firmata.sendString(F("Not enough memory for the trigger"));
+    return;
+  }
+  byte index = trigger - triggers;
+  trigger->kind = argv[0];
+  trigger->interrupt = false;
+  triggerFired[index] = false;
+  switch (kind) {
+    case TASK_TRIGGER_DIGITAL:
+      if (argc < 3 || !IS_PIN_DIGITAL(argv[1]) || argv[2] < TASK_TRIGGER_RISING || argv[2] > TASK_TRIGGER_CHANGE) {
+        Firmata.sendString(F("Invalid digital trigger"));
+        return;
+      }
+      trigger->pin = argv[1];
+      trigger->edge = argv[2];
+      trigger->state = digitalRead(PIN_TO_DIGITAL(trigger->pin));
+      if (IS_PIN_INTERRUPT(trigger->pin) && index < sizeof(triggerIsrs) / sizeof(triggerIsrs[0])) {
+        trigger->interrupt = true;
+        PinInterrupts::attach(digitalPinToInterrupt(PIN_TO_DIGITAL(trigger->pin)), triggerIsrs[index],
+          trigger->edge == TASK_TRIGGER_RISING ? RISING : trigger->edge == TASK_TRIGGER_FALLING ? FALLING : CHANGE, this);
+      }
+      break;
+    case TASK_TRIGGER_ANALOG: {
+      if (argc < 7 || argv[2] < TASK_TRIGGER_RISING || argv[2] > TASK_TRIGGER_FALLING) {
+        Firmata.sendString(F("Invalid analog trigger"));
+        return;
+      }
+      byte pin = 0;
+      while (pin < TOTAL_PINS && !(IS_PIN_ANALOG(pin) && PIN_TO_ANALOG(pin) == argv[1])) {
+        pin++;
+      }
+      if (pin == TOTAL_PINS) {
+        Firmata.sendString(F("Invalid analog trigger"));
+        return;
+      }
+      trigger->pin = pin;
+      trigger->edge = argv[2];
+      trigger->threshold = Firmata.decodePackedUInt14(argv + 3);
+      trigger->hysteresis = Firmata.decodePackedUInt14(argv + 5);
+      trigger->state = false; // armed once the input is on the other side of the threshold
+      break;
+    }
+    case TASK_TRIGGER_I2C: {
+      I2CFirmata *i2c = FirmataExtInstance != NULL ? static_cast<I2CFirmata*>(FirmataExtInstance->getSysexOwner(I2C_REQUEST)) : NULL;
+      byte bus = 0;
+      if (argc >= 3 && argv[1] == I2C_BUS_PREFIX) {
+        bus = argv[2];
+        argc -= 2;
+        argv += 2;
+      }
+      if (argc < 9 || i2c == NULL || bus >= I2C_MAX_BUSES) {
+        Firmata.sendString(F("Invalid I2C trigger"));
+        return;
+      }
+      trigger->hysteresis = bus;
+      trigger->pin = argv[1];
+      trigger->threshold = Firmata.decodePackedUInt14(argv + 2);
+      trigger->edge = argv[4];
+      trigger->mask = Firmata.decodePackedUInt14(argv + 5);
+      trigger->value = Firmata.decodePackedUInt14(argv + 7);
+      trigger->state = true;
+      i2c->setReadListener(i2cTriggerListener);
+      break;
+    }
+    default:
+      Firmata.sendString(F("Invalid trigger"));
+      return;
+  }
+  trigger->id = id;
+}
+
+void FirmataScheduler::removeTrigger(byte index)
+{
+  firmata_task_trigger *trigger = &triggers[index];
+  if (trigger->interrupt) {
+    PinInterrupts::detach(digitalPinToInterrupt(PIN_TO_DIGITAL(trigger->pin)), this);
+  }
+  trigger->id = NO_FIRMATA_TASK;
+}
+
+firmata_task_trigger *FirmataScheduler::findTrigger(byte id)
+{
+  for (byte i = 0; i < MAX_FIRMATA_TASK_TRIGGERS; i++) {
+    if (triggers[i].id == id) {
+      return &triggers[i];
+    }
+  }
+  return NULL;
+}
+
+void FirmataScheduler::i2cRead(byte bus, byte address, int reg, const byte *data, byte count)
+{
+  for (byte i = 0; i < MAX_FIRMATA_TASK_TRIGGERS; i++) {
+    firmata_task_trigger *trigger = &triggers[i];
+    if (trigger->id == NO_FIRMATA_TASK || (trigger->kind & ~TASK_TRIGGER_REPEAT) != TASK_TRIGGER_I2C ||
+        trigger->hysteresis != bus || trigger->pin != address || (trigger->threshold != TASK_TRIGGER_ANY_REGISTER && trigger->threshold != reg) ||
+        trigger->edge >= count) {
+      continue;
+    }
+    if ((data[trigger->edge] & trigger->mask) != trigger->value) {
+      trigger->state = true;
+    } else if (trigger->state) {
+      trigger->state = false;
+      triggerFired[i] = true;
+    }
+  }
+}
+
+/*
+ * Schedules the tasks of the triggers that fired without delay, so they run in the same report().
+ */
+void FirmataScheduler::checkTriggers()
+{
+  for (byte i = 0; i < MAX_FIRMATA_TASK_TRIGGERS; i++) {
+    firmata_task_trigger *trigger = &triggers[i];
+    if (trigger->id == NO_FIRMATA_TASK) {
+      continue;
+    }
+    bool fire = false;
+    if (trigger->interrupt || (trigger->kind & ~TASK_TRIGGER_REPEAT) == TASK_TRIGGER_I2C) {
+      noInterrupts();
+      fire = triggerFired[i];
+      triggerFired[i] = false;
+      interrupts();
+    } else if ((trigger->kind & ~TASK_TRIGGER_REPEAT) == TASK_TRIGGER_DIGITAL) {
+      byte level = digitalRead(PIN_TO_DIGITAL(trigger->pin));
+      if (level != trigger->state) {
+        fire = trigger->edge == TASK_TRIGGER_CHANGE || (trigger->edge == TASK_TRIGGER_RISING) == (level == HIGH);
+        trigger->state = level;
+      }
+    } else {
+      int value = analogRead(trigger->pin);
+      bool beyond = trigger->edge == TASK_TRIGGER_RISING ? value >= trigger->threshold : value <= trigger->threshold;
+      bool back = trigger->edge == TASK_TRIGGER_RISING ? value < trigger->threshold - trigger->hysteresis
+        : value > trigger->threshold + trigger->hysteresis;
+      if (trigger->state && beyond) {
+        fire = true;
+        trigger->state = false;
+      } else if (back) {
+        trigger->state = true;
+      }
+    }
+    if (fire) {
+      byte id = trigger->id;
+      if (!(trigger->kind & TASK_TRIGGER_REPEAT)) {
+        removeTrigger(i);
+      }
+      schedule(id, 0);
     }
   }
 }
@@ -194,10 +454,10 @@ void FirmataScheduler::queryAllTasks()
   Firmata.write(START_SYSEX);
   Firmata.write(SCHEDULER_DATA);
   Firmata.write(QUERY_ALL_TASKS_REPLY);
-  firmata_task *task = tasks;
-  while (task) {
-    Firmata.write(task->id);
-    task = task->nextTask;
+  for (byte id = 0; id < MAX_FIRMATA_TASK_ID; id++) {
+    if (findSlot(id) != NO_FIRMATA_TASK) {
+      Firmata.write(id);
+    }
   }
   Firmata.write(END_SYSEX);
 };
@@ -221,10 +481,17 @@ void FirmataScheduler::reportTask(byte id, firmata_task* task, boolean error)
     }
     Firmata.write(id);
     if (task) {
+        // time_ms (4 bytes), len (2 bytes), pos (2 bytes) and the messages, LSB first
+        uint32_t time_ms = task->time_us / 1000;
         encoder.startBinaryWrite();
-        for (unsigned int i = 3; i < firmata_task_len(task); i++) {
-            encoder.writeBinary(((byte*)task)[i]); //don't write first 3 bytes (firmata_task*, byte); makes use of AVR byteorder (LSB first)
+        for (byte i = 0; i < 4; i++) {
+            encoder.writeBinary((time_ms >> (i * 8)) & 0xFF);
         }
+        encoder.writeBinary(task->len & 0xFF);
+        encoder.writeBinary((task->len >> 8) & 0xFF);
+        encoder.writeBinary(task->pos & 0xFF);
+        encoder.writeBinary((task->pos >> 8) & 0xFF);
+        encoder.writeBinary(taskData + task->offset, task->len);
         encoder.endBinaryWrite();
     }
     Firmata.write(END_SYSEX);
@@ -232,57 +499,102 @@ void FirmataScheduler::reportTask(byte id, firmata_task* task, boolean error)
 
 void FirmataScheduler::report(bool elapsed)
 {
-  if (tasks) {
-    long now = millis();
-    firmata_task *current = tasks;
-    firmata_task *previous = NULL;
-    while (current) {
-      if (current->time_ms > 0 && current->time_ms < now) { // TODO handle overflow
-        if (execute(current)) {
-          previous = current;
-          current = current->nextTask;
-        }
-        else {
-          if (previous) {
-            previous->nextTask = current->nextTask;
-            free(current);
-            current = previous->nextTask;
-          }
-          else {
-            tasks = current->nextTask;
-            free(current);
-            current = tasks;
-          }
-        }
-      }
-      else {
-        current = current->nextTask;
+  checkTriggers();
+  uint64_t now = this->now();
+  // every task scheduled so far runs at most once, even if it reschedules itself without delay
+  byte budget = heapSize;
+  while (heapSize > 0 && budget > 0 && taskPool[heap[0]].time_us <= now) {
+    byte slot = heap[0];
+    firmata_task *task = &taskPool[slot];
+    byte id = task->id;
+    budget--;
+    heapRemove(0);
+    boolean rescheduled = execute(task);
+    if (findSlot(id) != slot) {
+      continue; // the task deleted itself
+    }
+    if (!rescheduled) {
+      if (!findTrigger(id)) {
+        deleteTask(id); // a task with a trigger stays loaded for the next event
       }
     }
+    else if (task->heapIndex == NO_FIRMATA_TASK) {
+      heapInsert(slot);
+    }
   }
 };
 
+// the tasks and their triggers are not saved in the boot configuration
+boolean FirmataScheduler::canWriteConfiguration()
+{
+  return numTasks == 0;
+}
+
 void FirmataScheduler::reset()
 {
-  while (tasks) {
-    firmata_task *nextTask = tasks->nextTask;
-    free(tasks);
-    tasks = nextTask;
+  for (byte i = 0; i < MAX_FIRMATA_TASK_TRIGGERS; i++) {
+    if (triggers[i].id != NO_FIRMATA_TASK) {
+      removeTrigger(i);
+    }
   }
+  for (byte i = 0; i < MAX_FIRMATA_TASKS; i++) {
+    if (taskPool[i].id != NO_FIRMATA_TASK) {
+#ifdef LARGE_MEM_DEVICE
+      taskSlot[taskPool[i].id] = NO_FIRMATA_TASK;
+#endif
+      taskPool[i].id = NO_FIRMATA_TASK;
+    }
+  }
+  numTasks = 0;
+  taskDataUsed = 0;
+  taskOpsUsed = 0;
+  heapSize = 0;
+  running = NULL;
 };
 
 //private
+uint64_t FirmataScheduler::now()
+{
+  // extend micros() to 64 bits, so the due times never wrap around
+  unsigned long us = micros();
+  if (us < lastMicros) {
+    microsHigh++;
+  }
+  lastMicros = us;
+  return ((uint64_t)microsHigh << 32) | us;
+}
+
 boolean FirmataScheduler::execute(firmata_task *task)
 {
-  long start = task->time_ms;
-  int pos = task->pos;
-  int len = task->len;
-  byte *messages = task->messages;
+  uint64_t start = task->time_us;
   running = task;
-  while (pos < len) {
-    Firmata.parse(messages[pos++]);
-    if (start != task->time_ms) { // return true if task got rescheduled during run.
-      task->pos = ( pos == len ? 0 : pos ); // last message executed? -> start over next time
+  if (task->numOps > 0) {
+    int index = task->nextOp;
+    while (index < task->numOps) {
+      // taskOps may move while the operation runs, if it deletes another task
+      int end = taskOps[task->firstOp + index].end;
+      runOp(task, &taskOps[task->firstOp + index++]);
+      if (running != task) { // the task deleted itself
+        return false;
+      }
+      if (start != task->time_us) { // return true if task got rescheduled during run.
+        task->nextOp = ( index == task->numOps ? 0 : index ); // last message executed? -> start over next time
+        task->pos = ( end == task->len ? 0 : end );
+        running = NULL;
+        return true;
+      }
+    }
+    running = NULL;
+    return false;
+  }
+  int pos = task->pos;
+  while (pos < task->len) {
+    Firmata.parse(taskData[task->offset + pos++]);
+    if (running != task) { // the task deleted itself
+      return false;
+    }
+    if (start != task->time_us) { // return true if task got rescheduled during run.
+      task->pos = ( pos == task->len ? 0 : pos ); // last message executed? -> start over next time
       running = NULL;
       return true;
     }
@@ -291,15 +603,224 @@ boolean FirmataScheduler::execute(firmata_task *task)
   return false;
 }
 
-firmata_task *FirmataScheduler::findTask(byte id)
+/*
+ * Splits the messages of a completely loaded task into operations that call the feature or callback
+ * handling them directly, so running the task doesn't go through the parser and the sysex dispatch
+ * again each time. If the operations don't fit, the task is parsed when it runs instead.
+ */
+void FirmataScheduler::compileTask(firmata_task *task)
 {
-  firmata_task *currentTask = tasks;
-  while (currentTask) {
-    if (id == currentTask->id) {
-      return currentTask;
+  if (FirmataExtInstance == NULL) {
+    return;
+  }
+  byte *data = &taskData[task->offset];
+  int len = task->len;
+  int first = taskOpsUsed;
+  int count = 0;
+  int pos = 0;
+  while (pos < len) {
+    if (first + count >= MAX_FIRMATA_TASK_OPS) {
+      return;
+    }
+    firmata_task_op *op = &taskOps[first + count];
+    byte inputData = data[pos];
+    byte command = inputData < 0xF0 ? (inputData & 0xF0) : inputData;
+    int end = pos + 1;
+    op->type = TASK_OP_RAW;
+    op->offset = pos;
+    switch (command) {
+      case START_SYSEX:
+        while (end < len && data[end] != END_SYSEX) {
+          end++;
+        }
+        if (end < len) {
+          end++;
+          int argc = end - pos - 3;
+          FirmataFeature *feature = FirmataExtInstance->getSysexOwner(data[pos + 1]);
+          if (argc >= 0 && argc <= MAX_FIRMATA_TASK_OP_ARGS && feature) {
+            op->type = TASK_OP_SYSEX;
+            op->command = data[pos + 1];
+            op->channel = argc;
+            op->offset = pos + 2;
+            op->feature = feature;
+          }
+        }
+        break;
+      case ANALOG_MESSAGE:
+      case DIGITAL_MESSAGE:
+      case SET_PIN_MODE:
+      case SET_DIGITAL_PIN_VALUE:
+        if (pos + 2 < len && data[pos + 1] < 128 && data[pos + 2] < 128) {
+          end = pos + 3;
+          op->command = command;
+          if (command == ANALOG_MESSAGE) {
+            op->feature = FirmataExtInstance->getSysexOwner(EXTENDED_ANALOG);
+            if (op->feature) {
+              op->type = TASK_OP_ANALOG;
+              op->channel = inputData & 0x0F;
+            }
+          } else if (command == DIGITAL_MESSAGE) {
+            op->type = TASK_OP_CALLBACK;
+            op->callback = Firmata.getCallback(command);
+            op->channel = inputData & 0x0F;
+            op->value = data[pos + 1] | (data[pos + 2] << 7);
+          } else {
+            op->type = command == SET_PIN_MODE ? TASK_OP_PIN_MODE : TASK_OP_CALLBACK;
+            op->callback = Firmata.getCallback(command);
+            op->channel = data[pos + 1];
+            op->value = data[pos + 2];
+          }
+        }
+        break;
+      case REPORT_ANALOG:
+      case REPORT_DIGITAL:
+        if (pos + 1 < len && data[pos + 1] < 128) {
+          end = pos + 2;
+          op->type = TASK_OP_CALLBACK;
+          op->command = command;
+          op->callback = Firmata.getCallback(command);
+          op->channel = inputData & 0x0F;
+          op->value = data[pos + 1];
+        }
+        break;
+    }
+    op->end = end;
+    if (op->type == TASK_OP_RAW && count > 0 && taskOps[first + count - 1].type == TASK_OP_RAW) {
+      taskOps[first + count - 1].end = end; // append to the previous raw bytes
     } else {
-      currentTask = currentTask->nextTask;
+      count++;
     }
-  };
-  return NULL;
+    pos = end;
+  }
+  task->firstOp = first;
+  task->numOps = count;
+  task->nextOp = 0;
+  taskOpsUsed += count;
+}
+
+void FirmataScheduler::runOp(firmata_task *task, firmata_task_op *op)
+{
+  switch (op->type) {
+    case TASK_OP_SYSEX:
+      {
+        byte command = op->command;
+        byte argc = op->channel;
+        int offset = op->offset;
+        // the features decode their arguments in place, so they get a copy
+        memcpy(opArgs, &taskData[task->offset + offset], argc);
+        if (!op->feature->handleSysex(command, argc, opArgs) && running == task) {
+          memcpy(opArgs, &taskData[task->offset + offset], argc);
+          handleSysexCallback(command, argc, opArgs);
+        }
+      }
+      break;
+    case TASK_OP_ANALOG:
+      {
+        byte args[3] = { op->channel, taskData[task->offset + op->offset + 1], taskData[task->offset + op->offset + 2] };
+        memcpy(opArgs, args, 3);
+        if (!op->feature->handleSysex(EXTENDED_ANALOG, 3, opArgs) && running == task) {
+          // e.g. a servo pin, which the owner leaves to the other features
+          memcpy(opArgs, args, 3);
+          handleSysexCallback(EXTENDED_ANALOG, 3, opArgs);
+        }
+      }
+      break;
+    case TASK_OP_CALLBACK:
+      if (op->callback) {
+        (*op->callback)(op->channel, op->value);
+      }
+      break;
+    case TASK_OP_PIN_MODE:
+      Firmata.setPinMode(op->channel, op->value);
+      break;
+    default:
+      for (int i = op->offset, end = op->end; i < end && running == task; i++) {
+        Firmata.parse(taskData[task->offset + i]);
+      }
+      break;
+  }
+}
+
+firmata_task *FirmataScheduler::findTask(byte id)
+{
+  byte slot = findSlot(id);
+  return slot != NO_FIRMATA_TASK ? &taskPool[slot] : NULL;
+}
+
+byte FirmataScheduler::findSlot(byte id)
+{
+  if (id >= MAX_FIRMATA_TASK_ID) {
+    return NO_FIRMATA_TASK;
+  }
+#ifdef LARGE_MEM_DEVICE
+  return taskSlot[id];
+#else
+  for (byte i = 0; i < MAX_FIRMATA_TASKS; i++) {
+    if (taskPool[i].id == id) {
+      return i;
+    }
+  }
+  return NO_FIRMATA_TASK;
+#endif
+}
+
+void FirmataScheduler::heapInsert(byte slot)
+{
+  heap[heapSize] = slot;
+  taskPool[slot].heapIndex = heapSize;
+  siftUp(heapSize++);
+}
+
+void FirmataScheduler::heapRemove(byte index)
+{
+  taskPool[heap[index]].heapIndex = NO_FIRMATA_TASK;
+  heapSize--;
+  if (index == heapSize) {
+    return;
+  }
+  heap[index] = heap[heapSize];
+  taskPool[heap[index]].heapIndex = index;
+  siftUp(index);
+  siftDown(index);
+}
+
+void FirmataScheduler::heapSwap(byte a, byte b)
+{
+  byte slot = heap[a];
+  heap[a] = heap[b];
+  heap[b] = slot;
+  taskPool[heap[a]].heapIndex = a;
+  taskPool[heap[b]].heapIndex = b;
+}
+
+void FirmataScheduler::siftUp(byte index)
+{
+  while (index > 0) {
+    byte parent = (index - 1) / 2;
+    if (taskPool[heap[parent]].time_us <= taskPool[heap[index]].time_us) {
+      return;
+    }
+    heapSwap(parent, index);
+    index = parent;
+  }
+}
+
+void FirmataScheduler::siftDown(byte index)
+{
+  while (true) {
+    byte smallest = index;
+    byte left = 2 * index + 1;
+    byte right = left + 1;
+    if (left < heapSize && taskPool[heap[left]].time_us < taskPool[heap[smallest]].time_us) {
+      smallest = left;
+    }
+    if (right < heapSize && taskPool[heap[right]].time_us < taskPool[heap[smallest]].time_us) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      return;
+    }
+    heapSwap(index, smallest);
+    index = smallest;
+  }
 }
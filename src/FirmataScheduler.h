@@ -29,20 +29,123 @@
 #define ERROR_TASK_REPLY        8
 #define QUERY_ALL_TASKS_REPLY   9
 #define QUERY_TASK_REPLY        10
+#define TRIGGER_FIRMATA_TASK    11
 #define EXTENDED_SCHEDULER_COMMAND 0x7F /* Command for extended schedulers - ignored by FirmataScheduler*/
 
-#define firmata_task_len(a)(sizeof(firmata_task)+(a)->len)
+// All tables are static, on AVR they are kept small: about 350 bytes with the defaults below
+#ifndef MAX_FIRMATA_TASKS
+#ifdef LARGE_MEM_DEVICE
+#define MAX_FIRMATA_TASKS 64
+#else
+#define MAX_FIRMATA_TASKS 4
+#endif
+#endif
+#ifndef FIRMATA_TASK_DATA_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define FIRMATA_TASK_DATA_SIZE 4096 // bytes of messages of all tasks together
+#else
+#define FIRMATA_TASK_DATA_SIZE 128
+#endif
+#endif
+#ifndef MAX_FIRMATA_TASK_OPS
+#ifdef LARGE_MEM_DEVICE
+#define MAX_FIRMATA_TASK_OPS 256 // operations of all tasks together
+#else
+#define MAX_FIRMATA_TASK_OPS 8
+#endif
+#endif
+#ifndef MAX_FIRMATA_TASK_OP_ARGS
+#ifdef LARGE_MEM_DEVICE
+#define MAX_FIRMATA_TASK_OP_ARGS 128
+#else
+#define MAX_FIRMATA_TASK_OP_ARGS 16
+#endif
+#endif
+#ifndef MAX_FIRMATA_TASK_TRIGGERS
+#ifdef LARGE_MEM_DEVICE
+#define MAX_FIRMATA_TASK_TRIGGERS 8
+#else
+#define MAX_FIRMATA_TASK_TRIGGERS 2
+#endif
+#endif
+#define MAX_FIRMATA_TASK_ID 128 // only 7bits used
+#define NO_FIRMATA_TASK 0xFF
 
 void delayTaskCallback(long delay);
 
+// Kinds of the operations a task is compiled to when it has been loaded completely
+#define TASK_OP_RAW      0 // bytes fed through Firmata.parse(), for anything not listed below
+#define TASK_OP_SYSEX    1 // sysex message, passed to the feature that owns the command
+#define TASK_OP_ANALOG   2 // ANALOG_MESSAGE, passed as EXTENDED_ANALOG to the feature that owns it
+#define TASK_OP_CALLBACK 3 // DIGITAL_MESSAGE, SET_DIGITAL_PIN_VALUE, REPORT_ANALOG and REPORT_DIGITAL
+#define TASK_OP_PIN_MODE 4 // SET_PIN_MODE
+
+/*
+ * Triggers run a task as soon as an event happens, instead of at a time:
+ * START_SYSEX, SCHEDULER_DATA, TRIGGER_FIRMATA_TASK, id, TASK_TRIGGER_NONE, END_SYSEX
+ * START_SYSEX, SCHEDULER_DATA, TRIGGER_FIRMATA_TASK, id, TASK_TRIGGER_DIGITAL, pin, edge, END_SYSEX
+ * START_SYSEX, SCHEDULER_DATA, TRIGGER_FIRMATA_TASK, id, TASK_TRIGGER_ANALOG, channel, edge,
+ *   threshold (2 x 7 bit), hysteresis (2 x 7 bit), END_SYSEX
+ * START_SYSEX, SCHEDULER_DATA, TRIGGER_FIRMATA_TASK, id, TASK_TRIGGER_I2C, address, register (2 x 7 bit),
+ *   byte index, mask (2 x 7 bit), value (2 x 7 bit), END_SYSEX
+ *   (the address of a trigger on another bus than 0 is preceded by I2C_BUS_PREFIX, bus, as in I2C_REQUEST)
+ * Digital edges on interrupt pins are caught by the interrupt, the task runs in the next report().
+ * Other pins and analog thresholds are checked every loop. A threshold fires when the input crosses it
+ * in the direction of the edge and is armed again once it went back by the hysteresis. An I2C trigger
+ * fires when (data[byte index] & mask) == value starts to match in the replies of the I2C reads, the
+ * host sets them up as continuous reads (register 0x3FFF matches any register).
+ * The trigger is removed when it fires, unless the kind has TASK_TRIGGER_REPEAT. A task with a trigger
+ * stays loaded after it ran.
+ */
+#define TASK_TRIGGER_NONE       0
+#define TASK_TRIGGER_DIGITAL    1
+#define TASK_TRIGGER_ANALOG     2
+#define TASK_TRIGGER_I2C        3
+#define TASK_TRIGGER_REPEAT     0x40
+#define TASK_TRIGGER_RISING     1 // low to high, or rising above the threshold
+#define TASK_TRIGGER_FALLING    2
+#define TASK_TRIGGER_CHANGE     3 // digital only
+#define TASK_TRIGGER_ANY_REGISTER 0x3FFF
+
+struct firmata_task_trigger
+{
+  byte id; // of the task, NO_FIRMATA_TASK if unused
+  byte kind;
+  byte pin; // digital or analog pin, I2C address
+  byte edge; // I2C: byte index
+  int threshold; // I2C: register
+  int hysteresis; // I2C: bus
+  byte mask;
+  byte value;
+  byte state; // last level of a polled pin, or whether the trigger is armed
+  bool interrupt;
+};
+
+struct firmata_task_op
+{
+  byte type;
+  byte command;
+  byte channel; // channel or pin of a message, argc of a sysex message
+  int offset; // of the message (arguments for sysex) in the task messages
+  int end; // position in the task messages after this message
+  int value;
+  union {
+    FirmataFeature *feature;
+    callbackFunction callback;
+  };
+};
+
 struct firmata_task
 {
-  firmata_task *nextTask;
-  byte id; //only 7bits used -> supports 127 tasks
-  long time_ms;
+  byte id;
+  byte heapIndex; // position in the schedule, NO_FIRMATA_TASK if the task isn't scheduled
   int len;
   int pos;
-  byte messages[];
+  int offset; // of the messages in taskData
+  int firstOp; // in taskOps
+  int numOps; // 0 if not compiled, the messages are parsed then
+  int nextOp;
+  uint64_t time_us; // due time, 0 if not scheduled
 };
 
 class FirmataScheduler: public FirmataFeature
@@ -52,8 +155,10 @@ class FirmataScheduler: public FirmataFeature
     void handleCapability(byte pin); //empty method
     boolean handlePinMode(byte pin, int mode); //empty method
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean ownsSysexCommand(byte command) override { return command == SCHEDULER_DATA; }
     void report(bool elapsed);
     void reset();
+    boolean canWriteConfiguration() override;
     void createTask(byte id, int len);
     void deleteTask(byte id);
     void addToTask(byte id, int len, byte *message);
@@ -61,14 +166,45 @@ class FirmataScheduler: public FirmataFeature
     void delayTask(long time_ms);
     void queryAllTasks();
     void queryTask(byte id);
+    void setTrigger(byte id, byte argc, byte *argv);
+    // data of an I2C read, from I2CFirmata
+    void i2cRead(byte bus, byte address, int reg, const byte *data, byte count);
 
   private:
-    firmata_task *tasks;
+    firmata_task taskPool[MAX_FIRMATA_TASKS];
+#ifdef LARGE_MEM_DEVICE
+    byte taskSlot[MAX_FIRMATA_TASK_ID]; // task id -> index in taskPool, the small pool is searched instead
+#endif
+    byte numTasks;
+    byte taskData[FIRMATA_TASK_DATA_SIZE];
+    int taskDataUsed;
+    firmata_task_op taskOps[MAX_FIRMATA_TASK_OPS];
+    int taskOpsUsed;
+    byte opArgs[MAX_FIRMATA_TASK_OP_ARGS];
+    // indices in taskPool of the scheduled tasks, as a min-heap on time_us
+    byte heap[MAX_FIRMATA_TASKS];
+    byte heapSize;
     firmata_task *running;
+    unsigned long lastMicros;
+    unsigned long microsHigh;
+    firmata_task_trigger triggers[MAX_FIRMATA_TASK_TRIGGERS];
 
+    uint64_t now();
     boolean execute(firmata_task *task);
+    void compileTask(firmata_task *task);
+    void runOp(firmata_task *task, firmata_task_op *op);
     firmata_task *findTask(byte id);
+    // index in taskPool, NO_FIRMATA_TASK if there is no task with the id
+    byte findSlot(byte id);
     void reportTask(byte id, firmata_task *task, boolean error);
+    void removeTrigger(byte index);
+    firmata_task_trigger *findTrigger(byte id);
+    void checkTriggers();
+    void heapInsert(byte slot);
+    void heapRemove(byte index);
+    void heapSwap(byte a, byte b);
+    void siftUp(byte index);
+    void siftDown(byte index);
 };
 
 #endif
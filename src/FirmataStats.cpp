@@ -0,0 +1,159 @@
+/*
+  FirmataStats.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "FirmataStats.h"
+#include "FirmataArena.h"
+
+#if defined(__AVR__)
+extern int __heap_start;
+extern void* __brkval;
+#elif defined(__arm__) && !defined(ESP32) && !defined(ESP8266)
+extern "C" char* sbrk(int incr);
+#endif
+
+FirmataStats::FirmataStats()
+{
+  autoInterval = 0;
+  lastAuto = 0;
+  numFeatures = 0;
+  restart();
+}
+
+boolean FirmataStats::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != FIRMATA_STATS || argc < 1) {
+    return false;
+  }
+  switch (argv[0]) {
+    case STATS_QUERY:
+      sendStats();
+      return true;
+    case STATS_RESET:
+      restart();
+      return true;
+    case STATS_MEMORY:
+      sendMemory();
+      return true;
+    case STATS_AUTO:
+      if (argc >= 6) {
+        autoInterval = Firmata.decodePackedUInt32(argv + 1);
+        lastAuto = millis();
+        return true;
+      }
+      break;
+  }
+  return false;
+}
+
+void FirmataStats::reset()
+{
+  autoInterval = 0;
+  restart();
+}
+
+void FirmataStats::report(bool elapsed)
+{
+  // called once per loop iteration, so the time since the last call is the loop period
+  unsigned long now = micros();
+  if (loopStarted) {
+    unsigned long period = now - lastLoop;
+    loopTotal += period;
+    if (period < loopMin) {
+      loopMin = period;
+    }
+    if (period > loopMax) {
+      loopMax = period;
+    }
+    loopCount++;
+  }
+  loopStarted = true;
+  lastLoop = now;
+  reportCount++;
+
+  if (autoInterval != 0 && millis() - lastAuto >= autoInterval) {
+    lastAuto += autoInterval;
+    if (millis() - lastAuto >= autoInterval) {
+      lastAuto = millis();
+    }
+    sendStats();
+  }
+}
+
+void FirmataStats::restart()
+{
+  loopStarted = false;
+  loopCount = 0;
+  reportCount = 0;
+  loopMin = 0xFFFFFFFF;
+  loopMax = 0;
+  loopTotal = 0;
+  for (byte i = 0; i < STATS_MAX_FEATURES; i++) {
+    featureTotal[i] = 0;
+    featureMax[i] = 0;
+  }
+}
+
+void FirmataStats::sendStats()
+{
+  Firmata.startSysex();
+  Firmata.write(FIRMATA_STATS);
+  Firmata.write(STATS_REPLY);
+  Firmata.sendPackedUInt32(millis());
+  Firmata.sendPackedUInt32(loopCount);
+  Firmata.sendPackedUInt32(loopCount != 0 ? loopMin : 0);
+  Firmata.sendPackedUInt32(loopCount != 0 ? loopTotal / loopCount : 0);
+  Firmata.sendPackedUInt32(loopMax);
+  Firmata.sendPackedUInt32(Firmata.getBytesRead());
+  Firmata.sendPackedUInt32(Firmata.getBytesWritten());
+  Firmata.sendPackedUInt32(Firmata.getSysexMessagesParsed());
+  Firmata.sendPackedUInt32(Firmata.getMessagesDiscarded());
+  Firmata.sendPackedUInt32(freeMemory());
+  Firmata.write(numFeatures);
+  for (byte i = 0; i < numFeatures; i++) {
+    Firmata.sendPackedUInt32(reportCount != 0 ? featureTotal[i] / reportCount : 0);
+    Firmata.sendPackedUInt32(featureMax[i]);
+  }
+  Firmata.endSysex();
+
+  // keep measuring the loop period across the reply
+  boolean started = loopStarted;
+  restart();
+  loopStarted = started;
+}
+
+void FirmataStats::sendMemory()
+{
+  Firmata.startSysex();
+  Firmata.write(FIRMATA_STATS);
+  Firmata.write(STATS_MEMORY_REPLY);
+  Firmata.sendPackedUInt32(FirmataArena.getCapacity());
+  Firmata.sendPackedUInt32(FirmataArena.getUsed());
+  Firmata.sendPackedUInt32(FirmataArena.getHighWaterMark());
+  Firmata.sendPackedUInt32(FirmataArena.getHeapFallbacks());
+  Firmata.sendPackedUInt32(freeMemory());
+  Firmata.endSysex();
+}
+
+uint32_t FirmataStats::freeMemory()
+{
+#if defined(ESP32) || defined(ESP8266)
+  return ESP.getFreeHeap();
+#elif defined(__AVR__)
+  char top;
+  return (uint32_t)(&top - (__brkval == 0 ? (char*)&__heap_start : (char*)__brkval));
+#elif defined(__arm__)
+  char top;
+  return (uint32_t)(&top - sbrk(0));
+#else
+  return 0;
+#endif
+}
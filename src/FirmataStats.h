@@ -0,0 +1,111 @@
+/*
+  FirmataStats.h - Firmata library
+
+  Run-time statistics of the firmware: the period of the main loop, the time the report() of
+  every feature takes, the number of bytes received and sent, the number of sysex messages
+  parsed and discarded, and the free memory.
+
+  Usage:
+
+    FirmataStats stats;
+    ...
+    firmataExt.attachStats(stats); // instead of addFeature(stats)
+
+  Host -> board:
+  START_SYSEX, FIRMATA_STATS, STATS_QUERY, END_SYSEX
+  START_SYSEX, FIRMATA_STATS, STATS_RESET, END_SYSEX
+  START_SYSEX, FIRMATA_STATS, STATS_AUTO, interval in ms (packed uint32, 0 = off), END_SYSEX
+  START_SYSEX, FIRMATA_STATS, STATS_MEMORY, END_SYSEX
+
+  Board -> host, all values as packed uint32:
+  START_SYSEX, FIRMATA_STATS, STATS_REPLY, millis(), loop count, loop period min, avg and max in us,
+  bytes received, bytes sent, sysex messages parsed, messages discarded, free memory (0 = unknown),
+  number of features n, n x (avg and max report() time in us), END_SYSEX
+
+  Board -> host, in reply to STATS_MEMORY, all values as packed uint32 (see FirmataArena.h):
+  START_SYSEX, FIRMATA_STATS, STATS_MEMORY_REPLY, arena size, bytes used, high-water mark,
+  allocations that went to the heap, free memory, END_SYSEX
+
+  The loop and report times cover the interval since the previous reply (or STATS_RESET), the
+  counters are totals since startup. Features are listed in the order they were added.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef FirmataStats_h
+#define FirmataStats_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+#include "FirmataExt.h"
+
+// FIRMATA_STATS subcommands
+#define STATS_QUERY             0x00
+#define STATS_RESET             0x01
+#define STATS_AUTO              0x02
+#define STATS_REPLY             0x03
+#define STATS_MEMORY            0x04
+#define STATS_MEMORY_REPLY      0x05
+
+#ifdef LARGE_MEM_DEVICE
+#define STATS_MAX_FEATURES      (MAX_FEATURES)
+#else
+#define STATS_MAX_FEATURES      8 // report() of later features is not timed
+#endif
+
+class FirmataStats: public FirmataFeature
+{
+  public:
+    FirmataStats();
+    void handleCapability(byte pin) override {}
+    boolean handlePinMode(byte pin, int mode) override { return false; }
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    boolean ownsSysexCommand(byte command) override { return command == FIRMATA_STATS; }
+    void reset() override;
+    void report(bool elapsed) override;
+
+    // called by FirmataExt::report() with the time the report() of features[index] took
+    void reportTime(byte index, unsigned long duration)
+    {
+      if (index < STATS_MAX_FEATURES)
+      {
+        featureTotal[index] += duration;
+        if (duration > featureMax[index])
+        {
+          featureMax[index] = duration;
+        }
+        if (index >= numFeatures)
+        {
+          numFeatures = index + 1;
+        }
+      }
+    }
+
+    // free heap (or free RAM between heap and stack) in bytes, 0 if unknown
+    static uint32_t freeMemory();
+
+  private:
+    boolean loopStarted;
+    unsigned long lastLoop;
+    unsigned long loopCount; // measured loop periods
+    unsigned long reportCount; // calls of report(), i.e. of FirmataExt::report()
+    unsigned long loopMin;
+    unsigned long loopMax;
+    unsigned long loopTotal;
+    unsigned long featureTotal[STATS_MAX_FEATURES];
+    unsigned long featureMax[STATS_MAX_FEATURES];
+    byte numFeatures;
+    unsigned long autoInterval; // ms, 0 = only on request
+    unsigned long lastAuto;
+
+    void restart();
+    void sendStats();
+    void sendMemory();
+};
+
+#endif
@@ -18,24 +18,204 @@
 
 #include <ConfigurableFirmata.h>
 #include "Frequency.h"
+#include "utility/PinInterrupts.h"
+#ifdef FIRMATA_PCNT_UNITS
+// The PCNT counters are 16 bit signed, they are reset to 0 when reaching this value
+#define PCNT_HIGH_LIMIT 30000
+#endif
 
 Frequency *FrequencyFirmataInstance;
 
-volatile int32_t Frequency::_ticks = 0;
+volatile uint32_t Frequency::_ticks[MAX_FREQUENCY_CHANNELS];
+#ifdef FIRMATA_PCNT_UNITS
+volatile uint32_t Frequency::_overflows[MAX_FREQUENCY_CHANNELS];
+#endif
 
 Frequency::Frequency()
 {
   FrequencyFirmataInstance = this;
-  _activePin = -1;
-  _reportDelay = 0;
-  _ticks = 0;
-  _lastReport = millis();
+  for (byte i = 0; i < MAX_FREQUENCY_CHANNELS; i++)
+  {
+    _channels[i].pin = -1;
+    _channels[i].mode = INTERRUPT_MODE_DISABLE;
+    _channels[i].reportDelay = 0;
+    _channels[i].lastReport = millis();
+    _ticks[i] = 0;
+  }
+}
+
+#ifdef FIRMATA_PCNT_UNITS
+void IRAM_ATTR Frequency::PcntOverflowIsr(void* arg)
+{
+	_overflows[(uintptr_t)arg]++;
 }
+#endif
 
-void Frequency::FrequencyIsr()
+#ifdef ESP32
+void IRAM_ATTR Frequency::FrequencyIsr(void* arg)
+{
+	_ticks[(uintptr_t)arg]++;
+}
+#else
+template<int N> void Frequency::FrequencyIsr()
 {
 	// The ISR can't be interrupted by the main routine, therefore this is thread safe
-	_ticks++;
+	_ticks[N]++;
+}
+#endif
+
+int Frequency::findChannel(int pin)
+{
+	for (byte i = 0; i < MAX_FREQUENCY_CHANNELS; i++)
+	{
+		if (_channels[i].pin == pin)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+bool Frequency::startChannel(byte channel, byte pin, byte mode)
+{
+	// Must use "auto" here, because the value uses an enum type on newer boards.
+	auto internalMode = LOW;
+	switch (mode)
+	{
+		case INTERRUPT_MODE_LOW:
+		internalMode = LOW;
+		break;
+		case INTERRUPT_MODE_HIGH:
+		internalMode = HIGH;
+		break;
+		case INTERRUPT_MODE_FALLING:
+		internalMode = FALLING;
+		break;
+		case INTERRUPT_MODE_RISING:
+		internalMode = RISING;
+		break;
+		case INTERRUPT_MODE_CHANGE:
+		internalMode = CHANGE;
+		break;
+		default:
+		return false;
+	}
+
+	_ticks[channel] = 0;
+	pinMode(pin, INPUT);
+#ifdef FIRMATA_PCNT_UNITS
+	if (mode == INTERRUPT_MODE_RISING || mode == INTERRUPT_MODE_FALLING || mode == INTERRUPT_MODE_CHANGE)
+	{
+		// Edges are counted by the hardware, we only get an interrupt every PCNT_HIGH_LIMIT pulses
+		pcnt_unit_t unit = PcntUnits::allocate();
+		if (unit == PCNT_UNIT_MAX)
+		{
+			return false;
+		}
+		pcnt_config_t config = {};
+		config.pulse_gpio_num = pin;
+		config.ctrl_gpio_num = PCNT_PIN_NOT_USED;
+		config.lctrl_mode = PCNT_MODE_KEEP;
+		config.hctrl_mode = PCNT_MODE_KEEP;
+		config.pos_mode = mode == INTERRUPT_MODE_FALLING ? PCNT_COUNT_DIS : PCNT_COUNT_INC;
+		config.neg_mode = mode == INTERRUPT_MODE_RISING ? PCNT_COUNT_DIS : PCNT_COUNT_INC;
+		config.counter_h_lim = PCNT_HIGH_LIMIT;
+		config.counter_l_lim = 0;
+		config.unit = unit;
+		config.channel = PCNT_CHANNEL_0;
+		if (pcnt_unit_config(&config) != ESP_OK)
+		{
+			PcntUnits::release(unit);
+			return false;
+		}
+		PcntUnits::installIsrService();
+		_channels[channel].unit = unit;
+		_overflows[channel] = 0;
+		pcnt_counter_pause(unit);
+		pcnt_counter_clear(unit);
+		pcnt_event_enable(unit, PCNT_EVT_H_LIM);
+		pcnt_isr_handler_add(unit, PcntOverflowIsr, (void*)(uintptr_t)channel);
+		pcnt_counter_resume(unit);
+	}
+	else
+#endif
+	{
+#ifdef ESP32
+		// Level triggered modes are not supported by the pulse counter
+		PinInterrupts::attachArg(digitalPinToInterrupt(pin), FrequencyIsr, (void*)(uintptr_t)channel, internalMode, this);
+#else
+		static const voidFuncPtr isrs[MAX_FREQUENCY_CHANNELS] = { FrequencyIsr<0>, FrequencyIsr<1>, FrequencyIsr<2>, FrequencyIsr<3> };
+		PinInterrupts::attach(digitalPinToInterrupt(pin), isrs[channel], internalMode, this);
+#endif
+	}
+	_channels[channel].pin = pin;
+	_channels[channel].mode = mode;
+	return true;
+}
+
+void Frequency::stopChannel(byte channel)
+{
+	int pin = _channels[channel].pin;
+	if (pin < 0)
+	{
+		return;
+	}
+#ifdef FIRMATA_PCNT_UNITS
+	if (_channels[channel].mode != INTERRUPT_MODE_LOW && _channels[channel].mode != INTERRUPT_MODE_HIGH)
+	{
+		pcnt_unit_t unit = _channels[channel].unit;
+		pcnt_counter_pause(unit);
+		pcnt_event_disable(unit, PCNT_EVT_H_LIM);
+		pcnt_isr_handler_remove(unit);
+		pcnt_set_pin(unit, PCNT_CHANNEL_0, PCNT_PIN_NOT_USED, PCNT_PIN_NOT_USED);
+		PcntUnits::release(unit);
+	}
+	else
+#endif
+	{
+		// This cannot be -1 here
+		PinInterrupts::detach(digitalPinToInterrupt(pin), this);
+	}
+	_channels[channel].pin = -1;
+	_channels[channel].mode = INTERRUPT_MODE_DISABLE;
+	// the next pin on the channel starts with the default interval
+	_channels[channel].reportDelay = 0;
+	_channels[channel].lastReport = millis();
+}
+
+uint32_t Frequency::readTicks(byte channel)
+{
+#ifdef FIRMATA_PCNT_UNITS
+	if (_channels[channel].mode != INTERRUPT_MODE_LOW && _channels[channel].mode != INTERRUPT_MODE_HIGH)
+	{
+		pcnt_unit_t unit = _channels[channel].unit;
+		uint32_t overflows;
+		int16_t count;
+		// Retry if the counter wrapped while we were reading it
+		do
+		{
+			overflows = _overflows[channel];
+			pcnt_get_counter_value(unit, &count);
+		} while (overflows != _overflows[channel]);
+		return overflows * PCNT_HIGH_LIMIT + (uint16_t)count;
+	}
+#endif
+	// Clear the interrupt flag, so that we can read out the counter
+	noInterrupts();
+	uint32_t ticks = _ticks[channel];
+	interrupts();
+	return ticks;
+}
+
+bool Frequency::getTicks(byte pin, uint32_t& ticks)
+{
+	int channel = findChannel(pin);
+	if (channel < 0)
+	{
+		return false;
+	}
+	ticks = readTicks(channel);
+	return true;
 }
 
 boolean Frequency::handleSysex(byte command, byte argc, byte* argv)
@@ -50,12 +230,12 @@ boolean Frequency::handleSysex(byte command, byte argc, byte* argv)
 	  byte pin = argv[1];
 	  if (frequencyCommand == FREQUENCY_SUBCOMMAND_CLEAR)
 	  {
-		  if (_activePin == pin || (_activePin >= 0 && pin == 0x7F))
+		  for (byte i = 0; i < MAX_FREQUENCY_CHANNELS; i++)
 		  {
-		  	// This cannot be -1 here
-			  uint8_t interrupt = (uint8_t)digitalPinToInterrupt(_activePin);
-			  detachInterrupt(interrupt);
-			  _activePin = -1;
+			  if (_channels[i].pin >= 0 && (_channels[i].pin == pin || pin == 0x7F))
+			  {
+				  stopChannel(i);
+			  }
 		  }
 	  }
   }
@@ -74,51 +254,30 @@ boolean Frequency::handleSysex(byte command, byte argc, byte* argv)
 			  Firmata.sendString(F("Invalid pin number for frequency command"));
 			  return true;
 		  }
-		  
-		  if (ms > 0)
-		  {
-			  _lastReport = millis();
-			  _reportDelay = ms;
-		  }
-		  if (_activePin == -1)
+
+		  int channel = findChannel(pin);
+		  if (channel < 0)
 		  {
 			  // not yet enabled on this pin
-			  // Must use "auto" here, because the value uses an enum type on newer boards.
-			  auto internalMode = LOW;
-			  switch (mode)
+			  channel = findChannel(-1);
+			  if (channel < 0)
 			  {
-				  case INTERRUPT_MODE_LOW:
-				  internalMode = LOW;
-				  break;
-				  case INTERRUPT_MODE_HIGH:
-				  internalMode = HIGH;
-				  break;
-				  case INTERRUPT_MODE_FALLING:
-				  internalMode = FALLING;
-				  break;
-				  case INTERRUPT_MODE_RISING:
-				  internalMode = RISING;
-				  break;
-				  case INTERRUPT_MODE_CHANGE:
-				  internalMode = CHANGE;
-				  break;
+				  Firmata.sendString(F("No free frequency channel"));
+				  return true;
 			  }
-			  if (internalMode >= 0)
+			  if (!startChannel(channel, pin, mode))
 			  {
-				  attachInterrupt(digitalPinToInterrupt(pin), FrequencyIsr, internalMode);
-				  _activePin = pin;
+				  return true;
 			  }
-			  
-			  pinMode(pin, INPUT);
 			  Firmata.setPinMode(pin, PIN_MODE_FREQUENCY);
 			  // Firmata.sendStringf(F("Frequency mode enabled with delay %ld on pin %ld"), (int32_t)_reportDelay, (int32_t)pin);
 		  }
-		  else if (_activePin != pin)
+		  if (ms > 0)
 		  {
-			  Firmata.sendString(F("Cannot change pin number while active"));
-			  return true;
+			  _channels[channel].lastReport = millis();
+			  _channels[channel].reportDelay = ms;
 		  }
-		  reportValue(pin);
+		  reportValue(channel);
 	  }
   }
   return true;
@@ -126,28 +285,46 @@ boolean Frequency::handleSysex(byte command, byte argc, byte* argv)
 
 void Frequency::report(bool elapsed)
 {
-	int mi = millis();
-	if (mi < _lastReport || mi > (_lastReport + _reportDelay))
+	uint32_t mi = millis();
+	byte due[MAX_FREQUENCY_CHANNELS];
+	byte numDue = 0;
+	for (byte i = 0; i < MAX_FREQUENCY_CHANNELS; i++)
+	{
+		if (_channels[i].pin >= 0 && mi - _channels[i].lastReport > _channels[i].reportDelay)
+		{
+			due[numDue++] = i;
+			_channels[i].lastReport = mi;
+		}
+	}
+
+	if (numDue == 1)
+	{
+		reportValue(due[0]);
+	}
+	else if (numDue > 1)
 	{
-		if (_activePin >= 0)
+		// pin and ticks of all channels that are due, with one timestamp
+		Firmata.startSysex();
+		Firmata.write(FREQUENCY_COMMAND);
+		Firmata.write(FREQUENCY_SUBCOMMAND_REPORT_MULTIPLE);
+		Firmata.sendPackedUInt32(mi);
+		for (byte i = 0; i < numDue; i++)
 		{
-			reportValue(_activePin);
+			Firmata.write((byte)_channels[due[i]].pin);
+			Firmata.sendPackedUInt32(readTicks(due[i]));
 		}
-		_lastReport = mi;
+		Firmata.endSysex();
 	}
 }
 
-void Frequency::reportValue(int pin)
+void Frequency::reportValue(byte channel)
 {
 	int32_t currentTime = millis();
-	// Clear the interrupt flag, so that we can read out the counter
-	noInterrupts();
-	int32_t ticks = _ticks;
-	interrupts();
+	uint32_t ticks = readTicks(channel);
 	Firmata.startSysex();
 	Firmata.write(FREQUENCY_COMMAND);
 	Firmata.write(FREQUENCY_SUBCOMMAND_REPORT);
-	Firmata.write(pin);
+	Firmata.write((byte)_channels[channel].pin);
 	Firmata.sendPackedUInt32(currentTime);
 	Firmata.sendPackedUInt32(ticks);
 	Firmata.endSysex();
@@ -160,10 +337,11 @@ boolean Frequency::handlePinMode(byte pin, int mode)
   {
     if (mode == PIN_MODE_FREQUENCY) {
       return true;
-    } else if (pin == _activePin)
+    }
+    int channel = findChannel(pin);
+    if (channel >= 0)
 	{
-      detachInterrupt(interruptPin);
-	  _activePin = -1;
+      stopChannel(channel);
     }
   }
   return false;
@@ -178,11 +356,25 @@ void Frequency::handleCapability(byte pin)
   }
 }
 
+// a query per measured pin, it also sets the pin mode
+void Frequency::writeConfiguration(Print& out)
+{
+	for (byte i = 0; i < MAX_FREQUENCY_CHANNELS; i++)
+	{
+		if (_channels[i].pin < 0)
+		{
+			continue;
+		}
+		const byte query[] = { START_SYSEX, FREQUENCY_COMMAND, FREQUENCY_SUBCOMMAND_QUERY, (byte)_channels[i].pin, _channels[i].mode,
+			(byte)(_channels[i].reportDelay & 0x7F), (byte)((_channels[i].reportDelay >> 7) & 0x7F), END_SYSEX };
+		out.write(query, sizeof(query));
+	}
+}
+
 void Frequency::reset()
 {
-	if (_activePin >= 0)
+	for (byte i = 0; i < MAX_FREQUENCY_CHANNELS; i++)
 	{
-		detachInterrupt(digitalPinToInterrupt(_activePin));
-		_activePin = -1;
+		stopChannel(i);
 	}
 }
@@ -19,6 +19,7 @@
 
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
+#include "utility/PcntUnits.h"
 
 #define INTERRUPT_MODE_DISABLE 0
 #define INTERRUPT_MODE_LOW 1
@@ -30,9 +31,19 @@
 #define FREQUENCY_SUBCOMMAND_CLEAR 0
 #define FREQUENCY_SUBCOMMAND_QUERY 1
 #define FREQUENCY_SUBCOMMAND_REPORT 2
+#define FREQUENCY_SUBCOMMAND_REPORT_MULTIPLE 3
 
-// This class tries to accurately measure the number of ticks per time on a specific pin.
-// All pins that have interrupt capability can be used, but only one at a time. 
+#ifdef FIRMATA_PCNT_UNITS
+// The edge modes take a PCNT unit each, shared with EncoderFirmata
+#define MAX_FREQUENCY_CHANNELS FIRMATA_PCNT_UNITS
+#else
+#define MAX_FREQUENCY_CHANNELS 4
+#endif
+
+// This class tries to accurately measure the number of ticks per time on specific pins.
+// All pins that have interrupt capability can be used, up to MAX_FREQUENCY_CHANNELS at a time.
+// On the ESP32, edges are counted by the PCNT hardware pulse counters, on other boards (and ESP32 chips without
+// PCNT) with an interrupt per edge.
 class Frequency: public FirmataFeature
 {
   public:
@@ -40,15 +51,41 @@ class Frequency: public FirmataFeature
     void report(bool elapsed);
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean ownsSysexCommand(byte command) override { return command == FREQUENCY_COMMAND; }
     boolean handlePinMode(byte pin, int mode);
     void reset();
+    void writeConfiguration(Print& out) override;
+    // the ticks counted on the pin so far, false if the pin isn't measured
+    bool getTicks(byte pin, uint32_t& ticks);
   private:
-    static void FrequencyIsr();
-    void reportValue(int pin);
-    int _activePin;
-	int32_t _reportDelay;
-	int32_t _lastReport;
-	static volatile int32_t _ticks;
+    struct FrequencyChannel
+    {
+      int pin; // -1 if unused
+      byte mode;
+      uint32_t reportDelay;
+      uint32_t lastReport;
+#ifdef FIRMATA_PCNT_UNITS
+      pcnt_unit_t unit; // of the edge modes
+#endif
+    };
+
+    int findChannel(int pin);
+    bool startChannel(byte channel, byte pin, byte mode);
+    void stopChannel(byte channel);
+    uint32_t readTicks(byte channel);
+    void reportValue(byte channel);
+    FrequencyChannel _channels[MAX_FREQUENCY_CHANNELS];
+#ifdef FIRMATA_PCNT_UNITS
+    static void IRAM_ATTR PcntOverflowIsr(void* arg);
+    // Number of times the 16 bit PCNT counter wrapped
+    static volatile uint32_t _overflows[MAX_FREQUENCY_CHANNELS];
+#endif
+#ifdef ESP32
+    static void IRAM_ATTR FrequencyIsr(void* arg);
+#else
+    template<int N> static void FrequencyIsr();
+#endif
+    static volatile uint32_t _ticks[MAX_FREQUENCY_CHANNELS];
 };
 
 #endif
@@ -10,71 +10,199 @@
 
 I2CFirmata::I2CFirmata()
 {
-    isI2CEnabled = false;
-    queryIndex = -1;
-    i2cReadDelayTime = 0;  // default delay time between i2c read request and Wire.requestFrom()
-    memset(i2cRxData, 0, 32);
+    readListener = NULL;
+    numQueries = 0;
+    memset(i2cRxData, 0, sizeof(i2cRxData));
+    for (byte i = 0; i < I2C_MAX_BUSES; i++) {
+      i2c_bus* b = &buses[i];
+      b->wire = NULL;
+      b->enabled = false;
+      b->sdaPin = I2C_DEFAULT_PIN;
+      b->sclPin = I2C_DEFAULT_PIN;
+      b->clock = 0;
+      b->readDelayTime = 0;
+      clearQueue(i);
+    }
+    buses[0].wire = &Wire;
+#if I2C_MAX_BUSES > 1
+    buses[1].wire = &Wire1;
+#endif
+}
+
+void I2CFirmata::setBus(byte bus, TwoWire* wire)
+{
+  if (bus >= I2C_MAX_BUSES) {
+    return;
+  }
+  if (buses[bus].enabled) {
+    disableI2CPins(bus);
+  }
+  buses[bus].wire = wire;
+}
+
+void I2CFirmata::clearQueue(byte bus)
+{
+  i2c_bus* b = &buses[bus];
+  b->queueStart = 0;
+  b->queueLength = 0;
+  b->pollIndex = 0;
+  b->readPending = false;
+  b->readyTime = micros();
+}
+
+/* Starts the next pending transaction of a bus: queued requests first, then the continuous reads.
+ * The waits between register write and read, and after writes, don't block the main loop. */
+void I2CFirmata::processNextTransaction(byte bus)
+{
+  i2c_bus* b = &buses[bus];
+  if ((long)(micros() - b->readyTime) < 0) {
+    return;
+  }
+
+  if (b->readPending) {
+    b->readPending = false;
+    readAndReportData(bus, b->activeRead.addr, b->activeRead.reg, b->activeRead.bytes, b->activeRead.sequenceNo);
+    return;
+  }
+
+  if (b->queueLength > 0) {
+    i2c_transaction* t = &b->queue[b->queueStart];
+    b->queueStart = (b->queueStart + 1) % I2C_QUEUE_SIZE;
+    b->queueLength--;
+    if (t->mode == I2C_WRITE) {
+      b->wire->beginTransmission(t->addr);
+      b->wire->write(t->data, t->bytes);
+      b->wire->endTransmission();
+      b->readyTime = micros() + I2C_WRITE_SETTLE_TIME;
+    }
+    else {
+      b->activeQuery = I2C_MAX_QUERIES;
+      startRead(bus, t->addr, t->reg, t->bytes, t->stopTX, t->sequenceNo);
+    }
+    return;
+  }
+
+  // round robin over the continuous reads of the bus that are due
+  for (byte i = 0; i < numQueries; i++) {
+    byte index = (b->pollIndex + i) % numQueries;
+    i2c_device_info* q = &query[index];
+    if (q->pending && q->bus == bus) {
+      q->pending = false;
+      b->pollIndex = index + 1;
+      b->activeQuery = index;
+      startRead(bus, q->addr, q->reg, q->bytes, q->stopTX, 0);
+      return;
+    }
+  }
 }
 
-void I2CFirmata::readAndReportData(byte address, int theRegister, byte numBytes, byte stopTX, byte seqenceNo) {
+/* The order of the continuous queries doesn't matter, so the last one fills the gap */
+void I2CFirmata::removeQuery(byte index)
+{
+  numQueries--;
+  if (index != numQueries) {
+    query[index] = query[numQueries];
+  }
+}
+
+void I2CFirmata::startRead(byte bus, byte address, int theRegister, byte numBytes, byte stopTX, byte seqenceNo)
+{
+  i2c_bus* b = &buses[bus];
   // allow I2C requests that don't require a register read
   // for example, some devices using an interrupt pin to signify new data available
   // do not always require the register read so upon interrupt you call Wire.requestFrom()
   if (theRegister != I2C_REGISTER_NOT_SPECIFIED) {
-    Wire.beginTransmission(address);
-    Wire.write((byte)theRegister);
-    Wire.endTransmission(stopTX); // default = true
+    b->wire->beginTransmission(address);
+    b->wire->write((byte)theRegister);
+    b->wire->endTransmission(stopTX); // default = true
     // do not set a value of 0
-    if (i2cReadDelayTime > 0) {
-      // delay is necessary for some devices such as WiiNunchuck
-      delayMicroseconds(i2cReadDelayTime);
+    if (b->readDelayTime > 0) {
+      // delay is necessary for some devices such as WiiNunchuck. Read the data on a later loop iteration.
+      b->activeRead.addr = address;
+      b->activeRead.reg = theRegister;
+      b->activeRead.bytes = numBytes;
+      b->activeRead.sequenceNo = seqenceNo;
+      b->readPending = true;
+      b->readyTime = micros() + b->readDelayTime;
+      return;
     }
   }
-  else {
+  readAndReportData(bus, address, theRegister, numBytes, seqenceNo);
+}
+
+void I2CFirmata::readAndReportData(byte bus, byte address, int theRegister, byte numBytes, byte seqenceNo) {
+  TwoWire* wire = buses[bus].wire;
+  int requestedRegister = theRegister;
+  if (theRegister == I2C_REGISTER_NOT_SPECIFIED) {
     theRegister = 0;  // fill the register with a dummy value
   }
+  if (numBytes > I2C_MAX_READ_BYTES) {
+    numBytes = I2C_MAX_READ_BYTES;
+  }
 
-  Wire.requestFrom(address, numBytes);  // all bytes are returned in requestFrom
+  wire->requestFrom(address, numBytes);  // all bytes are returned in requestFrom
 
   // check to be sure correct number of bytes were returned by slave
-  if (numBytes < Wire.available()) {
-    Firmata.sendString(F("I2C: Too many bytes received"));
+  if (numBytes < wire->available()) {
+    Firmata.sendEvent(EVENT_I2C_TOO_MANY_BYTES_RECEIVED, F("I2C: Too many bytes received from: "), address);
   }
-  else if (numBytes > Wire.available()) {
+  else if (numBytes > wire->available()) {
     // Firmata.sendString(F("I2C: Too few bytes received"));
-    numBytes = Wire.available();
+    numBytes = wire->available();
   }
 
   i2cRxData[0] = (byte)theRegister;
 
-  for (int i = 0; i < numBytes && Wire.available(); i++) {
-    i2cRxData[1 + i] = Wire.read();
+  for (int i = 0; i < numBytes && wire->available(); i++) {
+    i2cRxData[1 + i] = wire->read();
+  }
+  if (readListener) {
+    readListener(bus, address, requestedRegister, i2cRxData + 1, numBytes);
   }
 
-  // send slave address, register and received bytes
+  // send slave address, register and received bytes, the data of a continuous read is telemetry
+  byte activeQuery = buses[bus].activeQuery;
+  if (activeQuery < I2C_MAX_QUERIES) {
+    Firmata.beginMessage(FIRMATA_LANE_TELEMETRY, I2C_REPLY << 8 | activeQuery);
+  }
   Firmata.startSysex();
   Firmata.write(I2C_REPLY);
+  if (bus != 0) {
+    Firmata.write(I2C_BUS_PREFIX);
+    Firmata.write(bus);
+  }
   Firmata.write(address); // Slave address, LSB (always < 128 in 7 bit mode)
   Firmata.write(seqenceNo); // Slave address, MSB. This is abused here, but a client that doesn't use the sequencing will always send 0 and be happy
   for (int i = 0; i < numBytes + 1; i++) {
       Firmata.sendValueAsTwo7bitBytes(i2cRxData[i]);
   }
   Firmata.endSysex();
+  if (activeQuery < I2C_MAX_QUERIES) {
+    Firmata.endMessage();
+  }
+}
+
+bool I2CFirmata::usesPin(byte bus, byte pin)
+{
+  i2c_bus* b = &buses[bus];
+  if (b->sdaPin == I2C_DEFAULT_PIN) {
+    // the default pins of other buses than Wire are not known
+    return bus == 0 && IS_PIN_I2C(pin);
+  }
+  return pin == b->sdaPin || pin == b->sclPin;
 }
 
 boolean I2CFirmata::handlePinMode(byte pin, int mode)
 {
-  if (IS_PIN_I2C(pin)) {
-    if (mode == PIN_MODE_I2C) {
-      // the user must call I2C_CONFIG to enable I2C for a device
-      return true;
-    }
-    else if (isI2CEnabled) {
-      // disable i2c so pins can be used for other functions
-      // the following if statements should reconfigure the pins properly
-      if (Firmata.getPinMode(pin) == PIN_MODE_I2C) {
-        disableI2CPins();
-      }
+  if (mode == PIN_MODE_I2C) {
+    // the user must call I2C_CONFIG to enable I2C for a device
+    return IS_PIN_I2C(pin);
+  }
+  for (byte i = 0; i < I2C_MAX_BUSES; i++) {
+    // disable i2c so pins can be used for other functions
+    // the following if statements should reconfigure the pins properly
+    if (buses[i].enabled && usesPin(i, pin) && Firmata.getPinMode(pin) == PIN_MODE_I2C) {
+      disableI2CPins(i);
     }
   }
   return false;
@@ -92,19 +220,25 @@ boolean I2CFirmata::handleSysex(byte command, byte argc, byte* argv)
 {
   switch (command) {
   case I2C_REQUEST:
-    if (isI2CEnabled) {
-      handleI2CRequest(argc, argv);
-      return true;
-    }
-    break;
+    return handleI2CRequest(argc, argv);
   case I2C_CONFIG:
     return handleI2CConfig(argc, argv);
   }
   return false;
 }
 
-void I2CFirmata::handleI2CRequest(byte argc, byte* argv)
+boolean I2CFirmata::handleI2CRequest(byte argc, byte* argv)
 {
+  byte bus = 0;
+  if (argc >= 2 && argv[0] == I2C_BUS_PREFIX) {
+    bus = argv[1];
+    argc -= 2;
+    argv += 2;
+  }
+  if (bus >= I2C_MAX_BUSES || !buses[bus].enabled || argc < 2) {
+    return false;
+  }
+  i2c_bus* b = &buses[bus];
   byte mode;
   byte stopTX;
   byte slaveAddress;
@@ -112,8 +246,8 @@ void I2CFirmata::handleI2CRequest(byte argc, byte* argv)
   int slaveRegister;
   mode = argv[1] & I2C_READ_WRITE_MODE_MASK;
   if (argv[1] & I2C_10BIT_ADDRESS_MODE_MASK) {
-    Firmata.sendString(F("10-bit addressing not supported"));
-    return;
+    Firmata.sendEvent(EVENT_I2C_10BIT_ADDRESS, F("10-bit addressing not supported"));
+    return true;
   }
   else {
     slaveAddress = argv[0];
@@ -130,152 +264,271 @@ void I2CFirmata::handleI2CRequest(byte argc, byte* argv)
     stopTX = I2C_STOP_TX; // default
   }
 
+  i2c_transaction* t;
   switch (mode) {
   case I2C_WRITE:
-    Wire.beginTransmission(slaveAddress);
-    for (byte i = 2; i < argc; i += 2) {
-      data = argv[i] + (argv[i + 1] << 7);
-      Wire.write(data);
-    }
-    Wire.endTransmission();
-    delayMicroseconds(70);
-    break;
   case I2C_READ:
-    if (argc == 6) {
+    if (mode == I2C_WRITE && (argc - 2) / 2 > I2C_MAX_WRITE_BYTES) {
+      Firmata.sendEvent(EVENT_I2C_TOO_MANY_BYTES_TO_WRITE, F("I2C: Too many bytes to write: "), (argc - 2) / 2);
+      break;
+    }
+    // If the queue is full, wait until the oldest request is done
+    while (b->queueLength == I2C_QUEUE_SIZE) {
+      processNextTransaction(bus);
+    }
+    t = &b->queue[(b->queueStart + b->queueLength) % I2C_QUEUE_SIZE];
+    b->queueLength++;
+    t->mode = mode;
+    t->addr = slaveAddress;
+    t->stopTX = stopTX;
+    t->sequenceNo = sequenceNo;
+    if (mode == I2C_WRITE) {
+      t->bytes = 0;
+      for (byte i = 2; i + 1 < argc; i += 2) {
+        t->data[t->bytes++] = argv[i] + (argv[i + 1] << 7);
+      }
+    }
+    else if (argc == 6) {
       // a slave register is specified
-      slaveRegister = argv[2] + (argv[3] << 7);
-      data = argv[4] + (argv[5] << 7);  // bytes to read
+      t->reg = argv[2] + (argv[3] << 7);
+      t->bytes = argv[4] + (argv[5] << 7);  // bytes to read
     }
     else {
       // a slave register is NOT specified
-      slaveRegister = I2C_REGISTER_NOT_SPECIFIED;
-      data = argv[2] + (argv[3] << 7);  // bytes to read
+      t->reg = I2C_REGISTER_NOT_SPECIFIED;
+      t->bytes = argv[2] + (argv[3] << 7);  // bytes to read
     }
-    readAndReportData(slaveAddress, (int)slaveRegister, data, stopTX, sequenceNo);
     break;
   case I2C_READ_CONTINUOUSLY:
-    if ((queryIndex + 1) >= I2C_MAX_QUERIES) {
-      // too many queries, just ignore
-      Firmata.sendString(F("too many queries"));
-      break;
-    }
-    if (argc == 6) {
+  {
+    unsigned int period = 0;
+    if (argc >= 6) {
       // a slave register is specified
       slaveRegister = argv[2] + (argv[3] << 7);
       data = argv[4] + (argv[5] << 7);  // bytes to read
+      if (argc >= 8) {
+        // and a poll period in ms
+        period = argv[6] + (argv[7] << 7);
+      }
     }
     else {
       // a slave register is NOT specified
       slaveRegister = (int)I2C_REGISTER_NOT_SPECIFIED;
       data = argv[2] + (argv[3] << 7);  // bytes to read
     }
-    queryIndex++;
-    query[queryIndex].addr = slaveAddress;
-    query[queryIndex].reg = slaveRegister;
-    query[queryIndex].bytes = data;
-    query[queryIndex].stopTX = stopTX;
+    // A device may be queried for several registers, but only once per register
+    byte index = 0;
+    while (index < numQueries && (query[index].bus != bus || query[index].addr != slaveAddress || query[index].reg != slaveRegister)) {
+      index++;
+    }
+    if (index == I2C_MAX_QUERIES) {
+      // too many queries, just ignore
+      Firmata.sendEvent(EVENT_I2C_TOO_MANY_QUERIES, F("too many queries"));
+      break;
+    }
+    if (index == numQueries) {
+      numQueries++;
+    }
+    query[index].bus = bus;
+    query[index].addr = slaveAddress;
+    query[index].reg = slaveRegister;
+    query[index].bytes = data;
+    query[index].stopTX = stopTX;
+    query[index].pending = false;
+    query[index].period = period;
+    query[index].lastRead = millis();
     break;
+  }
   case I2C_STOP_READING:
-    byte queryIndexToSkip;
-    // if read continuous mode is enabled for only 1 i2c device, disable
-    // read continuous reporting for that device
-    if (queryIndex <= 0) {
-      queryIndex = -1;
+    // stop reading the given register or, if none is given, all registers of the device
+    if (argc >= 4) {
+      slaveRegister = argv[2] + (argv[3] << 7);
     }
     else {
-      queryIndexToSkip = 0;
-      // if read continuous mode is enabled for multiple devices,
-      // determine which device to stop reading and remove it's data from
-      // the array, shifiting other array data to fill the space
-      for (byte i = 0; i < queryIndex + 1; i++) {
-        if (query[i].addr == slaveAddress) {
-          queryIndexToSkip = i;
-          break;
-        }
-      }
-
-      for (byte i = queryIndexToSkip; i < queryIndex + 1; i++) {
-        if (i < I2C_MAX_QUERIES) {
-          query[i].addr = query[i + 1].addr;
-          query[i].reg = query[i + 1].reg;
-          query[i].bytes = query[i + 1].bytes;
-          query[i].stopTX = query[i + 1].stopTX;
-        }
+      slaveRegister = (int)I2C_REGISTER_NOT_SPECIFIED;
+    }
+    for (byte i = numQueries; i > 0; i--) {
+      if (query[i - 1].bus == bus && query[i - 1].addr == slaveAddress && (argc < 4 || query[i - 1].reg == slaveRegister)) {
+        removeQuery(i - 1);
       }
-      queryIndex--;
     }
     break;
   default:
     break;
   }
+  return true;
 }
 
 boolean I2CFirmata::handleI2CConfig(byte argc, byte* argv)
 {
   unsigned int delayTime = (argv[0] + (argv[1] << 7));
+  byte bus = argc >= 3 ? argv[2] : 0;
+  if (bus >= I2C_MAX_BUSES || buses[bus].wire == NULL) {
+    Firmata.sendEvent(EVENT_I2C_INVALID_BUS, F("I2C: Invalid bus: "), bus);
+    return true;
+  }
+  i2c_bus* b = &buses[bus];
 
   if (delayTime > 0) {
-    i2cReadDelayTime = delayTime;
+    b->readDelayTime = delayTime;
+  }
+  if (argc >= 7 && (argv[5] != b->sdaPin || argv[6] != b->sclPin)) {
+    // the controller moves to other pins
+    if (b->enabled) {
+      disableI2CPins(bus);
+    }
+    b->sdaPin = argv[5];
+    b->sclPin = argv[6];
+  }
+  if (argc >= 5) {
+    b->clock = (uint32_t)(argv[3] + (argv[4] << 7)) * 1000;
+    if (b->enabled && b->clock != 0) {
+      b->wire->setClock(b->clock);
+    }
   }
 
-  if (!isI2CEnabled) {
-    enableI2CPins();
+  if (!b->enabled) {
+    enableI2CPins(bus);
   }
-  return isI2CEnabled;
+  return b->enabled;
 }
 
-boolean I2CFirmata::enableI2CPins()
+boolean I2CFirmata::enableI2CPins(byte bus)
 {
-  byte i;
-  // is there a faster way to do this? would probaby require importing
-  // Arduino.h to get SCL and SDA pins
-  for (i = 0; i < TOTAL_PINS; i++) {
-    if (IS_PIN_I2C(i)) {
-      if (Firmata.getPinMode(i) == PIN_MODE_IGNORE) {
-        return false;
+  i2c_bus* b = &buses[bus];
+  if (b->sdaPin != I2C_DEFAULT_PIN) {
+    if (!IS_PIN_DIGITAL(b->sdaPin) || !IS_PIN_DIGITAL(b->sclPin) ||
+        Firmata.getPinMode(b->sdaPin) == PIN_MODE_IGNORE || Firmata.getPinMode(b->sclPin) == PIN_MODE_IGNORE) {
+      return false;
+    }
+    Firmata.setPinMode(b->sdaPin, PIN_MODE_I2C);
+    Firmata.setPinMode(b->sclPin, PIN_MODE_I2C);
+  }
+  else if (bus == 0) {
+    byte i;
+    // is there a faster way to do this? would probaby require importing
+    // Arduino.h to get SCL and SDA pins
+    for (i = 0; i < TOTAL_PINS; i++) {
+      if (IS_PIN_I2C(i)) {
+        if (Firmata.getPinMode(i) == PIN_MODE_IGNORE) {
+          return false;
+        }
+        // mark pins as i2c so they are ignore in non i2c data requests
+        Firmata.setPinMode(i, PIN_MODE_I2C);
+        pinMode(i, PIN_MODE_I2C);
       }
-      // mark pins as i2c so they are ignore in non i2c data requests
-      Firmata.setPinMode(i, PIN_MODE_I2C);
-      pinMode(i, PIN_MODE_I2C);
     }
   }
 
-  isI2CEnabled = true;
+  b->enabled = true;
 
-  Wire.end();
+  b->wire->end();
+#ifdef ESP32
+  if (b->sdaPin != I2C_DEFAULT_PIN) {
+    b->wire->begin(PIN_TO_DIGITAL(b->sdaPin), PIN_TO_DIGITAL(b->sclPin));
+  }
+  else
+#endif
 #ifdef ARDUINO_M5STACK_Core2
+  if (bus == 0) {
     // For the M5Stack, we explicitly choose the pins, because we want to use the internal I2C bus by default
     // It has the on-board devices attached: touchscreen, RTC, power controller and IMU (Core2 only)
-  Wire.begin(21, 22);
-#else
-  Wire.begin();
+    Wire.begin(21, 22);
+  }
+  else
 #endif
+  {
+    b->wire->begin();
+  }
+  if (b->clock != 0) {
+    b->wire->setClock(b->clock);
+  }
   return true;
 }
 
 /* disable the i2c pins so they can be used for other functions */
-void I2CFirmata::disableI2CPins()
+void I2CFirmata::disableI2CPins(byte bus)
 {
-  isI2CEnabled = false;
-  // disable read continuous mode for all devices
-  queryIndex = -1;
+  buses[bus].enabled = false;
+  // disable read continuous mode for all devices of the bus
+  for (byte i = numQueries; i > 0; i--) {
+    if (query[i - 1].bus == bus) {
+      removeQuery(i - 1);
+    }
+  }
+  clearQueue(bus);
   // uncomment the following if or when the end() method is added to Wire library
   // Wire.end();
 }
 
+void I2CFirmata::writeConfiguration(Print& out)
+{
+  for (byte i = 0; i < I2C_MAX_BUSES; i++) {
+    i2c_bus* b = &buses[i];
+    if (!b->enabled) {
+      continue;
+    }
+    unsigned int kHz = b->clock / 1000;
+    const byte config[] = { START_SYSEX, I2C_CONFIG, (byte)(b->readDelayTime & 0x7F), (byte)((b->readDelayTime >> 7) & 0x7F), i,
+      (byte)(kHz & 0x7F), (byte)((kHz >> 7) & 0x7F), b->sdaPin, b->sclPin, END_SYSEX };
+    out.write(config, sizeof(config));
+  }
+  // the continuous reads, the requests of the queues are gone by the time the configuration is restored
+  for (byte i = 0; i < numQueries; i++) {
+    i2c_device_info* q = &query[i];
+    out.write(START_SYSEX);
+    out.write(I2C_REQUEST);
+    if (q->bus != 0) {
+      out.write(I2C_BUS_PREFIX);
+      out.write(q->bus);
+    }
+    out.write(q->addr);
+    out.write(I2C_READ_CONTINUOUSLY | (q->stopTX == I2C_RESTART_TX ? I2C_END_TX_MASK : 0));
+    if (q->reg != I2C_REGISTER_NOT_SPECIFIED) {
+      out.write(q->reg & 0x7F);
+      out.write((q->reg >> 7) & 0x7F);
+    }
+    out.write(q->bytes & 0x7F);
+    out.write(q->bytes >> 7);
+    if (q->reg != I2C_REGISTER_NOT_SPECIFIED && q->period != 0) {
+      out.write(q->period & 0x7F);
+      out.write((q->period >> 7) & 0x7F);
+    }
+    out.write(END_SYSEX);
+  }
+}
+
 void I2CFirmata::reset()
 {
-  if (isI2CEnabled) {
-    disableI2CPins();
+  for (byte i = 0; i < I2C_MAX_BUSES; i++) {
+    if (buses[i].enabled) {
+      disableI2CPins(i);
+    }
+    buses[i].sdaPin = I2C_DEFAULT_PIN;
+    buses[i].sclPin = I2C_DEFAULT_PIN;
+    buses[i].clock = 0;
   }
 }
 
 void I2CFirmata::report(bool elapsed)
 {
-  // report i2c data for all device with read continuous mode enabled
-  if (queryIndex > -1) {
-    for (byte i = 0; i < queryIndex + 1; i++) {
-      readAndReportData(query[i].addr, query[i].reg, query[i].bytes, query[i].stopTX, 0);
+  // mark the devices with read continuous mode enabled that are due. If a device is still pending
+  // from the previous round, it is read only once.
+  unsigned long now = millis();
+  for (byte i = 0; i < numQueries; i++) {
+    i2c_device_info* q = &query[i];
+    if (q->period == 0) {
+      q->pending |= elapsed;
+    }
+    else if (now - q->lastRead >= q->period) {
+      q->pending = true;
+      q->lastRead = now;
+    }
+  }
+  // one transaction per bus, the buses don't wait for each other
+  for (byte i = 0; i < I2C_MAX_BUSES; i++) {
+    if (buses[i].enabled) {
+      processNextTransaction(i);
     }
   }
 }
@@ -17,6 +17,23 @@
   include Wire.h for every arduino sketch that includes ConfigurableFirmata.
 
   Last updated by Jeff Hoefs: January 23rd, 2015
+
+  Boards with a second I2C controller have more than one bus (I2C_MAX_BUSES), each with its
+  own request queue. The buses take turns with one transaction per loop, so a bus with many
+  requests doesn't hold up the others. The transactions themselves are still synchronous: a
+  slow device blocks the loop for the duration of its transfer. Bus 0 is Wire,
+  bus 1 is Wire1, setBus() takes any other TwoWire. Requests to and replies from another bus
+  than 0 start with I2C_BUS_PREFIX and the bus, the rest is unchanged:
+  START_SYSEX, I2C_REQUEST, I2C_BUS_PREFIX, bus, address, mode, ..., END_SYSEX
+  START_SYSEX, I2C_REPLY, I2C_BUS_PREFIX, bus, address, sequence, register, data..., END_SYSEX
+
+  I2C_CONFIG configures a bus with optional arguments after the delay:
+  START_SYSEX, I2C_CONFIG, delay (2 x 7 bit), bus, clock in kHz (2 x 7 bit, 0 = the default), SDA pin, SCL pin, END_SYSEX
+  The pins are 127 for the default pins. Only the ESP32 routes a controller to any other pins.
+
+  Continuous reads without a period of their own are polled at the sampling interval, as in
+  StandardFirmata, or at the REPORT_INTERVAL of I2C_REQUEST (see FirmataExt.h). The queued
+  requests and the polls that are due are processed on every loop, one transaction per bus.
 */
 
 #ifndef I2CFirmata_h
@@ -36,17 +53,79 @@
 #define I2C_10BIT_ADDRESS_MASK      B00000111
 #define I2C_STOP_TX                 1
 #define I2C_RESTART_TX              0
-#define I2C_MAX_QUERIES             8
 #define I2C_REGISTER_NOT_SPECIFIED  -1
+#define I2C_BUS_PREFIX              0x7F // a reserved address, followed by the bus
+#define I2C_DEFAULT_PIN             127
+#ifndef I2C_MAX_BUSES
+#if (defined(ESP32) && !defined(CONFIG_IDF_TARGET_ESP32C3) && !defined(CONFIG_IDF_TARGET_ESP32C6)) || \
+    defined(ARDUINO_ARCH_RP2040) || (defined(WIRE_INTERFACES_COUNT) && WIRE_INTERFACES_COUNT > 1)
+#define I2C_MAX_BUSES               2
+#else
+#define I2C_MAX_BUSES               1
+#endif
+#endif
+#ifdef LARGE_MEM_DEVICE
+#define I2C_QUEUE_SIZE              16
+#ifndef I2C_MAX_QUERIES
+#define I2C_MAX_QUERIES             32
+#endif
+#define I2C_MAX_READ_BYTES          128 // the Wire buffer size of the ESP32
+#else
+#define I2C_QUEUE_SIZE              4
+#ifndef I2C_MAX_QUERIES
+#define I2C_MAX_QUERIES             8
+#endif
+#define I2C_MAX_READ_BYTES          32
+#endif
+#define I2C_MAX_WRITE_BYTES         32 // the size of the Wire buffer on most boards
+#define I2C_WRITE_SETTLE_TIME       70 // microseconds to wait after a write before the next transaction
+
+class TwoWire;
 
 /* i2c data */
 struct i2c_device_info {
+  byte bus;
   byte addr;
   int reg;
   byte bytes;
   byte stopTX;
+  bool pending;             // due for being read
+  unsigned int period;      // poll period in ms, 0 = at the sampling interval
+  unsigned long lastRead;   // millis() of the last poll, if period != 0
+};
+
+/* a pending read or write request */
+struct i2c_transaction {
+  byte mode; // I2C_WRITE or I2C_READ
+  byte addr;
+  int reg;
+  byte bytes; // number of bytes to read or write
+  byte stopTX;
+  byte sequenceNo;
+  byte data[I2C_MAX_WRITE_BYTES];
 };
 
+/* a bus and its request queue */
+struct i2c_bus {
+  TwoWire* wire;
+  boolean enabled;
+  byte sdaPin;              // I2C_DEFAULT_PIN or the pin the controller is routed to
+  byte sclPin;
+  uint32_t clock;           // Hz, 0 = the default of Wire
+  unsigned int readDelayTime; // delay time between i2c read request and Wire.requestFrom()
+  i2c_transaction queue[I2C_QUEUE_SIZE]; // processed one bus transaction per loop iteration
+  byte queueStart;
+  byte queueLength;
+  byte pollIndex;           // the continuous query to look at first for the next read
+  bool readPending;         // register of activeRead was written, waiting for readDelayTime
+  i2c_transaction activeRead;
+  byte activeQuery;         // the continuous query of activeRead, I2C_MAX_QUERIES for a request
+  unsigned long readyTime;  // micros() at which the next transaction may start
+};
+
+// called with the data of every read, before it is sent to the host
+typedef void (*i2c_read_listener)(byte bus, byte address, int reg, const byte* data, byte count);
+
 class I2CFirmata: public FirmataFeature
 {
   public:
@@ -54,23 +133,33 @@ class I2CFirmata: public FirmataFeature
     boolean handlePinMode(byte pin, int mode);
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean ownsSysexCommand(byte command) override { return command == I2C_REQUEST || command == I2C_CONFIG; }
     void reset();
     void report(bool elapsed) override;
+    void writeConfiguration(Print& out) override;
+    void setReadListener(i2c_read_listener listener) { readListener = listener; }
+    // a TwoWire for a bus, e.g. a third controller. The host enables it with I2C_CONFIG.
+    void setBus(byte bus, TwoWire* wire);
 
   private:
+    i2c_read_listener readListener;
     /* for i2c read continuous more */
     i2c_device_info query[I2C_MAX_QUERIES];
 
-    byte i2cRxData[32];
-    boolean isI2CEnabled;
-    signed char queryIndex;
-    unsigned int i2cReadDelayTime;  // default delay time between i2c read request and Wire.requestFrom()
+    byte i2cRxData[I2C_MAX_READ_BYTES + 1];
+    byte numQueries;
+    i2c_bus buses[I2C_MAX_BUSES];
 
-    void readAndReportData(byte address, int theRegister, byte numBytes, byte stopTX, byte seqenceNo);
-    void handleI2CRequest(byte argc, byte *argv);
+    void processNextTransaction(byte bus);
+    void startRead(byte bus, byte address, int theRegister, byte numBytes, byte stopTX, byte seqenceNo);
+    void readAndReportData(byte bus, byte address, int theRegister, byte numBytes, byte seqenceNo);
+    void clearQueue(byte bus);
+    void removeQuery(byte index);
+    boolean handleI2CRequest(byte argc, byte *argv);
     boolean handleI2CConfig(byte argc, byte *argv);
-    boolean enableI2CPins();
-    void disableI2CPins();
+    boolean enableI2CPins(byte bus);
+    void disableI2CPins(byte bus);
+    bool usesPin(byte bus, byte pin);
 };
 
 
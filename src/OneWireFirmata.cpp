@@ -16,6 +16,7 @@
 #include <ConfigurableFirmata.h>
 #include "OneWireFirmata.h"
 #include "Encoder7Bit.h"
+#include "FirmataArena.h"
 
 OneWireFirmata::OneWireFirmata()
 {
@@ -23,6 +24,112 @@ OneWireFirmata::OneWireFirmata()
     pinOneWire[i].device = NULL;
     pinOneWire[i].power = false;
   }
+  clearRomCache(0xFF);
+  for (int i = 0; i < ONEWIRE_MAX_CONVERSIONS; i++) {
+    conversions[i].pin = 0xFF;
+  }
+}
+
+/* Forgets the cached ROM codes of the given bus, or of all busses if pin is 0xFF */
+void OneWireFirmata::clearRomCache(byte pin)
+{
+  for (int i = 0; i < ONEWIRE_MAX_CACHED_DEVICES; i++) {
+    if (pin == 0xFF || romCache[i].pin == pin) {
+      romCache[i].pin = 0xFF;
+    }
+  }
+  // the scratchpads of a conversion are read again for the devices cached from now on
+  for (int i = 0; i < ONEWIRE_MAX_CONVERSIONS; i++) {
+    if (pin == 0xFF || conversions[i].pin == pin) {
+      conversions[i].next = 0;
+    }
+  }
+}
+
+void OneWireFirmata::cacheRom(byte pin, byte* addr)
+{
+  for (int i = 0; i < ONEWIRE_MAX_CACHED_DEVICES; i++) {
+    if (romCache[i].pin == 0xFF) {
+      romCache[i].pin = pin;
+      memcpy(romCache[i].addr, addr, 8);
+      return;
+    }
+  }
+  // cache full: the device can still be addressed by the host, it's just not included in ONEWIRE_CONVERT_ALL_REPLY
+}
+
+/* Starts a temperature conversion on all devices of the bus. The result is read from report() once it's done. */
+void OneWireFirmata::startConversion(byte pin, unsigned int duration)
+{
+  int slot = -1;
+  for (int i = 0; i < ONEWIRE_MAX_CONVERSIONS; i++) {
+    if (conversions[i].pin == pin || (slot < 0 && conversions[i].pin == 0xFF)) {
+      slot = i;
+    }
+  }
+  if (slot < 0) {
+    Firmata.sendEvent(EVENT_ONEWIRE_TOO_MANY_CONVERSIONS, F("OneWire: Too many conversions in progress"));
+    return;
+  }
+
+  ow_device_info *info = &pinOneWire[pin];
+  bool known = false;
+  for (int i = 0; i < ONEWIRE_MAX_CACHED_DEVICES && !known; i++) {
+    known = romCache[i].pin == pin;
+  }
+  if (!known) {
+    // nobody searched this bus yet
+    byte addr[8];
+    info->device->reset_search();
+    while (info->device->search(addr)) {
+      cacheRom(pin, addr);
+    }
+  }
+
+  info->device->reset();
+  info->device->skip();
+  // with parasite power, the line must stay high during the conversion
+  info->device->write(ONEWIRE_CMD_CONVERT_T, info->power);
+  conversions[slot].pin = pin;
+  conversions[slot].start = millis();
+  conversions[slot].duration = duration;
+  conversions[slot].next = 0;
+}
+
+/* The first cache entry of the bus from start on, ONEWIRE_MAX_CACHED_DEVICES if there is none */
+int OneWireFirmata::nextCachedRom(byte pin, int start)
+{
+  while (start < ONEWIRE_MAX_CACHED_DEVICES && romCache[start].pin != pin) {
+    start++;
+  }
+  return start;
+}
+
+/* Reads the scratchpad of a cached device into its cache entry, about 10 ms at standard speed */
+void OneWireFirmata::readScratchpad(byte pin, ow_rom_entry* entry)
+{
+  OneWire *device = pinOneWire[pin].device;
+  device->reset();
+  device->select(entry->addr);
+  device->write(ONEWIRE_CMD_READ_SCRATCHPAD);
+  device->read_bytes(entry->scratchpad, ONEWIRE_SCRATCHPAD_SIZE);
+}
+
+/* Sends the ROM code and scratchpad of each cached device of the bus in a single ONEWIRE_CONVERT_ALL_REPLY */
+void OneWireFirmata::sendScratchpads(byte pin)
+{
+  Encoder7BitClass encoder;
+  Firmata.write(START_SYSEX);
+  Firmata.write(ONEWIRE_DATA);
+  Firmata.write(ONEWIRE_CONVERT_ALL_REPLY);
+  Firmata.write(pin);
+  encoder.startBinaryWrite();
+  for (int i = nextCachedRom(pin, 0); i < ONEWIRE_MAX_CACHED_DEVICES; i = nextCachedRom(pin, i + 1)) {
+    encoder.writeBinary(romCache[i].addr, 8);
+    encoder.writeBinary(romCache[i].scratchpad, ONEWIRE_SCRATCHPAD_SIZE);
+  }
+  encoder.endBinaryWrite();
+  Firmata.write(END_SYSEX);
 }
 
 boolean OneWireFirmata::handlePinMode(byte pin, int mode)
@@ -42,13 +149,25 @@ void OneWireFirmata::handleCapability(byte pin)
   }
 }
 
-void OneWireFirmata::oneWireConfig(byte pin, boolean power)
+void OneWireFirmata::oneWireConfig(byte pin, boolean power, boolean overdrive)
 {
   ow_device_info *info = &pinOneWire[pin];
   if (info->device == NULL) {
-    info->device = new OneWire(pin);
+    info->device = FirmataArena.create<OneWire>(pin);
+    if (info->device == NULL) {
+      Firmata.sendEvent(EVENT_ONEWIRE_OUT_OF_MEMORY, F("OneWire: Out of memory"));
+      return;
+    }
   }
   info->power = power;
+  if (overdrive != info->device->get_overdrive()) {
+    // the next standard speed reset brings all devices back to standard speed
+    info->device->set_overdrive(false);
+    if (overdrive) {
+      info->device->reset();
+      info->device->overdrive_skip();
+    }
+  }
 }
 
 boolean OneWireFirmata::handleSysex(byte command, byte argc, byte* argv)
@@ -73,9 +192,13 @@ boolean OneWireFirmata::handleSysex(byte command, byte argc, byte* argv)
               Firmata.write(pin);
               encoder.startBinaryWrite();
               byte addrArray[8];
+              if (!isAlarmSearch) {
+                clearRomCache(pin);
+              }
               while (isAlarmSearch ? device->search(addrArray, false) : device->search(addrArray)) {
-                for (int i = 0; i < 8; i++) {
-                  encoder.writeBinary(addrArray[i]);
+                encoder.writeBinary(addrArray, 8);
+                if (!isAlarmSearch) {
+                  cacheRom(pin, addrArray);
                 }
               }
               encoder.endBinaryWrite();
@@ -84,14 +207,25 @@ boolean OneWireFirmata::handleSysex(byte command, byte argc, byte* argv)
             }
           case ONEWIRE_CONFIG_REQUEST:
             {
-              if (argc == 3 && Firmata.getPinMode(pin) != PIN_MODE_IGNORE) {
+              // optional: overdrive flag
+              if ((argc == 3 || argc == 4) && Firmata.getPinMode(pin) != PIN_MODE_IGNORE) {
                 Firmata.setPinMode(pin, PIN_MODE_ONEWIRE);
-                oneWireConfig(pin, argv[2]); // this calls oneWireConfig again, this time setting the correct config (which doesn't cause harm though)
+                oneWireConfig(pin, argv[2], argc == 4 && argv[3]); // this calls oneWireConfig again, this time setting the correct config (which doesn't cause harm though)
               } else {
                 return false;
               }
               break;
             }
+          case ONEWIRE_CONVERT_ALL_REQUEST:
+            {
+              // optional: conversion time in ms (2 x 7 bit)
+              unsigned int duration = ONEWIRE_DEFAULT_CONVERSION_TIME;
+              if (argc >= 4) {
+                duration = argv[2] | (argv[3] << 7);
+              }
+              startConversion(pin, duration);
+              break;
+            }
           default:
             {
               if (subcommand & ONEWIRE_RESET_REQUEST_BIT) {
@@ -131,9 +265,7 @@ boolean OneWireFirmata::handleSysex(byte command, byte argc, byte* argv)
                 }
 
                 if (subcommand & ONEWIRE_WRITE_REQUEST_BIT) {
-                  for (int i = 0; i < numBytes; i++) {
-                    info->device->write(argv[i], info->power);
-                  }
+                  info->device->write_bytes(argv, numBytes, info->power);
                 }
 
                 if (numReadBytes > 0) {
@@ -160,13 +292,59 @@ boolean OneWireFirmata::handleSysex(byte command, byte argc, byte* argv)
   return false;
 }
 
+// the busses with their power and speed, the host searches the devices again
+void OneWireFirmata::writeConfiguration(Print& out)
+{
+  for (int pin = 0; pin < TOTAL_PINS; pin++) {
+    ow_device_info *info = &pinOneWire[pin];
+    if (info->device == NULL || Firmata.getPinMode(pin) != PIN_MODE_ONEWIRE) {
+      continue;
+    }
+    const byte config[] = { START_SYSEX, ONEWIRE_DATA, ONEWIRE_CONFIG_REQUEST, (byte)pin, (byte)(info->power ? 1 : 0),
+      (byte)(info->device->get_overdrive() ? 1 : 0), END_SYSEX };
+    out.write(config, sizeof(config));
+  }
+}
+
 void OneWireFirmata::reset()
 {
   for (int i = 0; i < TOTAL_PINS; i++) {
     if (pinOneWire[i].device) {
-      free(pinOneWire[i].device);
+      FirmataArena.destroy(pinOneWire[i].device);
       pinOneWire[i].device = NULL;
     }
     pinOneWire[i].power = false;
   }
+  clearRomCache(0xFF);
+  for (int i = 0; i < ONEWIRE_MAX_CONVERSIONS; i++) {
+    conversions[i].pin = 0xFF;
+  }
+}
+
+// Once a conversion is done, the scratchpads of the bus are read one device per call, so that the
+// loop is never blocked for more than one read. The reply is sent after the last device.
+void OneWireFirmata::report(bool elapsed)
+{
+  unsigned long now = millis();
+  for (int i = 0; i < ONEWIRE_MAX_CONVERSIONS; i++) {
+    ow_conversion *conversion = &conversions[i];
+    byte pin = conversion->pin;
+    if (pin == 0xFF || now - conversion->start < conversion->duration) {
+      continue;
+    }
+    if (!pinOneWire[pin].device) {
+      conversion->pin = 0xFF;
+      continue;
+    }
+    conversion->next = nextCachedRom(pin, conversion->next);
+    if (conversion->next < ONEWIRE_MAX_CACHED_DEVICES) {
+      readScratchpad(pin, &romCache[conversion->next]);
+      conversion->next = nextCachedRom(pin, conversion->next + 1);
+    }
+    if (conversion->next >= ONEWIRE_MAX_CACHED_DEVICES) {
+      conversion->pin = 0xFF;
+      sendScratchpads(pin);
+    }
+    return;
+  }
 }
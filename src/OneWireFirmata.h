@@ -26,6 +26,8 @@
 #define ONEWIRE_READ_REPLY 0x43
 #define ONEWIRE_SEARCH_ALARMS_REQUEST 0x44
 #define ONEWIRE_SEARCH_ALARMS_REPLY 0x45
+#define ONEWIRE_CONVERT_ALL_REQUEST 0x46
+#define ONEWIRE_CONVERT_ALL_REPLY 0x47
 
 #define ONEWIRE_RESET_REQUEST_BIT 0x01
 #define ONEWIRE_SKIP_REQUEST_BIT 0x02
@@ -40,12 +42,39 @@
 //default value for power:
 #define ONEWIRE_POWER 1
 
+#ifdef LARGE_MEM_DEVICE
+#define ONEWIRE_MAX_CACHED_DEVICES 64 // ROM codes remembered from searches, for all busses together
+#define ONEWIRE_MAX_CONVERSIONS 4 // busses with a pending ONEWIRE_CONVERT_ALL_REQUEST
+#else
+#define ONEWIRE_MAX_CACHED_DEVICES 8
+#define ONEWIRE_MAX_CONVERSIONS 1
+#endif
+#define ONEWIRE_DEFAULT_CONVERSION_TIME 750 // ms, for a DS18B20 at 12 bit resolution
+#define ONEWIRE_CMD_CONVERT_T 0x44
+#define ONEWIRE_CMD_READ_SCRATCHPAD 0xBE
+#define ONEWIRE_SCRATCHPAD_SIZE 9
+
 struct ow_device_info
 {
   OneWire* device;
   boolean power;
 };
 
+struct ow_rom_entry
+{
+  byte pin; // 0xFF if unused
+  byte addr[8];
+  byte scratchpad[ONEWIRE_SCRATCHPAD_SIZE]; // read after a conversion
+};
+
+struct ow_conversion
+{
+  byte pin; // 0xFF if unused
+  unsigned long start;
+  unsigned int duration;
+  int next; // the cache entry to read next once the conversion is done, one per report()
+};
+
 class OneWireFirmata: public FirmataFeature
 {
   public:
@@ -53,11 +82,22 @@ class OneWireFirmata: public FirmataFeature
     boolean handlePinMode(byte pin, int mode);
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean ownsSysexCommand(byte command) override { return command == ONEWIRE_DATA; }
     void reset();
+    void report(bool elapsed) override;
+    void writeConfiguration(Print& out) override;
 
   private:
     ow_device_info pinOneWire[TOTAL_PINS];
-    void oneWireConfig(byte pin, boolean power);
+    ow_rom_entry romCache[ONEWIRE_MAX_CACHED_DEVICES];
+    ow_conversion conversions[ONEWIRE_MAX_CONVERSIONS];
+    void oneWireConfig(byte pin, boolean power, boolean overdrive = false);
+    void clearRomCache(byte pin);
+    void cacheRom(byte pin, byte* addr);
+    void startConversion(byte pin, unsigned int duration);
+    int nextCachedRom(byte pin, int start);
+    void readScratchpad(byte pin, ow_rom_entry* entry);
+    void sendScratchpads(byte pin);
 };
 
 #endif
@@ -13,6 +13,7 @@
 */
 
 #include "SerialFirmata.h"
+#include "FirmataArena.h"
 
 SerialFirmata::SerialFirmata()
 {
@@ -24,6 +25,14 @@ SerialFirmata::SerialFirmata()
 #endif
 
   serialIndex = -1;
+  openHardwarePorts = 0;
+  for (byte i = 0; i < SERIAL_READ_ARR_LEN; i++) {
+    policy[i].frame = NULL;
+  }
+  streamPort = NULL;
+  for (byte i = 0; i < MODBUS_MAX_PORTS; i++) {
+    modbus[i] = NULL;
+  }
   reset();
 }
 
@@ -46,6 +55,9 @@ void SerialFirmata::handleCapability(byte pin)
 
 boolean SerialFirmata::handleSysex(byte command, byte argc, byte *argv)
 {
+  if (command == MODBUS_DATA) {
+    return handleModbus(argc, argv);
+  }
   if (command == SERIAL_MESSAGE) {
 
     Stream *serialPort;
@@ -57,32 +69,17 @@ boolean SerialFirmata::handleSysex(byte command, byte argc, byte *argv)
       case SERIAL_CONFIG:
         {
           long baud = (long)argv[1] | ((long)argv[2] << 7) | ((long)argv[3] << 14);
-          serial_pins pins;
-          lastAvailableBytes[portId] = 0;
-          lastReceive[portId] = 0;
-// this ifdef will be removed once a command to enable RX buffering has been added to the protocol
+          endModbus(portId);
 #if defined(FIRMATA_SERIAL_PORT_RX_BUFFERING)
-          // 8N1 = 10 bits per char, max. 50 bits -> 50000 = 50bits * 1000ms/s
-          // char delay value (ms) to detect the end of a message, defaults to 50 bits * 1000 / baud rate
-          // a value of 0 will disable RX buffering, resulting in single byte transfers to the host with
-          // baud rates below approximately 56k (varies with CPU speed)
-          maxCharDelay[portId] = 50000 / baud;
+          // 8N1 = 10 bits per char, max. 50 bits -> 50000000 = 50bits * 1000000us/s
+          // char delay value (us) to detect the end of a message, defaults to 50 bits * 1000000 / baud rate
+          // The default policy if none is set with SERIAL_READ_POLICY.
+          setRelayPolicy(portId, 48, 0, baud > 0 ? 50000000UL / baud : 0, SERIAL_NO_DELIMITER);
 #else
-          maxCharDelay[portId] = 0;
+          setRelayPolicy(portId, 0, 0, 0, SERIAL_NO_DELIMITER);
 #endif
           if (portId < 8) {
-            serialPort = getPortFromId(portId);
-            if (serialPort != NULL) {
-              pins = getSerialPinNumbers(portId);
-              if (pins.rx != 0 && pins.tx != 0) {
-                Firmata.setPinMode(pins.rx, PIN_MODE_SERIAL);
-                Firmata.setPinMode(pins.tx, PIN_MODE_SERIAL);
-                // Fixes an issue where some serial devices would not work properly with Arduino Due
-                // because all Arduino pins are set to OUTPUT by default in StandardFirmata.
-                pinMode(pins.rx, INPUT);
-              }
-              ((HardwareSerial*)serialPort)->begin(baud);
-            }
+            beginHardwarePort(portId, baud);
           } else {
 #if defined(SoftwareSerial_h)
             byte swTxPin, swRxPin;
@@ -97,22 +94,22 @@ boolean SerialFirmata::handleSysex(byte command, byte argc, byte *argv)
             switch (portId) {
               case SW_SERIAL0:
                 if (swSerial0 == NULL) {
-                  swSerial0 = new SoftwareSerial(swRxPin, swTxPin);
+                  swSerial0 = FirmataArena.create<SoftwareSerial>(swRxPin, swTxPin);
                 }
                 break;
               case SW_SERIAL1:
                 if (swSerial1 == NULL) {
-                  swSerial1 = new SoftwareSerial(swRxPin, swTxPin);
+                  swSerial1 = FirmataArena.create<SoftwareSerial>(swRxPin, swTxPin);
                 }
                 break;
               case SW_SERIAL2:
                 if (swSerial2 == NULL) {
-                  swSerial2 = new SoftwareSerial(swRxPin, swTxPin);
+                  swSerial2 = FirmataArena.create<SoftwareSerial>(swRxPin, swTxPin);
                 }
                 break;
               case SW_SERIAL3:
                 if (swSerial3 == NULL) {
-                  swSerial3 = new SoftwareSerial(swRxPin, swTxPin);
+                  swSerial3 = FirmataArena.create<SoftwareSerial>(swRxPin, swTxPin);
                 }
                 break;
             }
@@ -128,6 +125,7 @@ boolean SerialFirmata::handleSysex(byte command, byte argc, byte *argv)
         }
       case SERIAL_WRITE:
         {
+          // long writes are streamed, see handleSysexStream()
           byte data;
           serialPort = getPortFromId(portId);
           if (serialPort == NULL) {
@@ -140,7 +138,7 @@ boolean SerialFirmata::handleSysex(byte command, byte argc, byte *argv)
           break; // SERIAL_WRITE
         }
       case SERIAL_READ:
-        if (argv[1] == SERIAL_READ_CONTINUOUSLY) {
+        if (argv[1] == SERIAL_READ_CONTINUOUSLY || argv[1] == SERIAL_READ_CONTINUOUSLY_PACKED) {
           if (serialIndex + 1 >= MAX_SERIAL_PORTS) {
             break;
           }
@@ -152,8 +150,17 @@ boolean SerialFirmata::handleSysex(byte command, byte argc, byte *argv)
             // read all available bytes per iteration of loop()
             serialBytesToRead[portId] = 0;
           }
+          packedReply[portId] = argv[1] == SERIAL_READ_CONTINUOUSLY_PACKED;
           serialIndex++;
           reportSerial[serialIndex] = portId;
+        } else if (argv[1] == SERIAL_READ_POLICY) {
+          // minimum batch (2 x 7 bits), max. latency and gap (packed uint32, us), delimiter (2 x 7 bits, optional)
+          if (argc < 14) {
+            break;
+          }
+          int delimiter = argc >= 16 ? (argv[14] | (argv[15] << 7)) : SERIAL_NO_DELIMITER;
+          setRelayPolicy(portId, argv[2] | (argv[3] << 7), Firmata.decodePackedUInt32(argv + 4),
+                         Firmata.decodePackedUInt32(argv + 9), delimiter > 0xFF ? SERIAL_NO_DELIMITER : delimiter);
         } else if (argv[1] == SERIAL_STOP_READING) {
           byte serialIndexToSkip = 0;
           if (serialIndex <= 0) {
@@ -176,17 +183,16 @@ boolean SerialFirmata::handleSysex(byte command, byte argc, byte *argv)
         }
         break; // SERIAL_READ
       case SERIAL_CLOSE:
+        endModbus(portId);
         serialPort = getPortFromId(portId);
         if (serialPort != NULL) {
           if (portId < 8) {
             ((HardwareSerial*)serialPort)->end();
+            openHardwarePorts &= ~(1 << portId);
           } else {
 #if defined(SoftwareSerial_h)
             ((SoftwareSerial*)serialPort)->end();
-            if (serialPort != NULL) {
-              free(serialPort);
-              serialPort = NULL;
-            }
+            destroySoftwareSerial(portId);
 #endif
           }
         }
@@ -217,31 +223,121 @@ boolean SerialFirmata::handleSysex(byte command, byte argc, byte *argv)
 void SerialFirmata::report(bool elapsed)
 {
   checkSerial();
+  for (byte i = 0; i < MODBUS_MAX_PORTS; i++) {
+    if (modbus[i] != NULL) {
+      runModbus(modbus[i], elapsed);
+    }
+  }
+}
+
+boolean SerialFirmata::handleSysexStream(byte command, byte phase, byte length, byte* data)
+{
+  switch (phase) {
+    case SYSEX_STREAM_BEGIN:
+      if ((data[0] & SERIAL_MODE_MASK) != SERIAL_WRITE || (data[0] & SERIAL_PORT_ID_MASK) >= SERIAL_READ_ARR_LEN) {
+        return false;
+      }
+      streamPort = getPortFromId(data[0] & SERIAL_PORT_ID_MASK);
+      streamSkip = 1;
+      streamLowByte = -1;
+      return streamPort != NULL;
+    case SYSEX_STREAM_DATA:
+      for (byte i = streamSkip; i < length; i++) {
+        if (streamLowByte < 0) {
+          streamLowByte = data[i];
+        } else {
+          streamPort->write((byte)(streamLowByte + (data[i] << 7)));
+          streamLowByte = -1;
+        }
+      }
+      streamSkip = 0;
+      return true;
+    default:
+      streamPort = NULL;
+      return true;
+  }
 }
 
 void SerialFirmata::reset()
 {
+  for (byte i = 0; i < MODBUS_MAX_PORTS; i++) {
+    if (modbus[i] != NULL) {
+      endModbus(modbus[i]->portId);
+    }
+  }
 #if defined(SoftwareSerial_h)
-  Stream *serialPort;
   // free memory allocated for SoftwareSerial ports
   for (byte i = SW_SERIAL0; i < SW_SERIAL3 + 1; i++) {
-    serialPort = getPortFromId(i);
-    if (serialPort != NULL) {
-      free(serialPort);
-      serialPort = NULL;
-    }
+    destroySoftwareSerial(i);
   }
 #endif
 
   serialIndex = -1;
+  openHardwarePorts = 0;
   for (byte i = 0; i < SERIAL_READ_ARR_LEN; i++) {
     serialBytesToRead[i] = 0;
-    lastReceive[i] = 0;
-    maxCharDelay[i] = 0;
-    lastAvailableBytes[i] = 0;
+    setRelayPolicy(i, 0, 0, 0, SERIAL_NO_DELIMITER);
+    packedReply[i] = false;
   }
 }
 
+// the open ports and continuous reads are not saved in the boot configuration
+boolean SerialFirmata::canWriteConfiguration()
+{
+  if (serialIndex >= 0 || openHardwarePorts != 0) {
+    return false;
+  }
+#if defined(SoftwareSerial_h)
+  if (swSerial0 != NULL || swSerial1 != NULL || swSerial2 != NULL || swSerial3 != NULL) {
+    return false;
+  }
+#endif
+  return true;
+}
+
+#if defined(SoftwareSerial_h)
+void SerialFirmata::destroySoftwareSerial(byte portId)
+{
+  Stream **port;
+  switch (portId) {
+    case SW_SERIAL0: port = &swSerial0; break;
+    case SW_SERIAL1: port = &swSerial1; break;
+    case SW_SERIAL2: port = &swSerial2; break;
+    case SW_SERIAL3: port = &swSerial3; break;
+    default: return;
+  }
+  if (streamPort == *port) {
+    streamPort = NULL;
+  }
+  FirmataArena.destroy((SoftwareSerial*)*port);
+  *port = NULL;
+}
+#endif
+
+// open a hardware port, NULL if the board doesn't have it
+Stream* SerialFirmata::beginHardwarePort(byte portId, long baud)
+{
+  Stream *serialPort = getPortFromId(portId);
+  if (serialPort == NULL) {
+    return NULL;
+  }
+  serial_pins pins = getSerialPinNumbers(portId);
+  if (pins.rx != 0 && pins.tx != 0) {
+    Firmata.setPinMode(pins.rx, PIN_MODE_SERIAL);
+    Firmata.setPinMode(pins.tx, PIN_MODE_SERIAL);
+    // Fixes an issue where some serial devices would not work properly with Arduino Due
+    // because all Arduino pins are set to OUTPUT by default in StandardFirmata.
+    pinMode(pins.rx, INPUT);
+  }
+#ifdef SERIAL_HW_RX_BUFFER_SIZE
+  // must be set before begin()
+  ((HardwareSerial*)serialPort)->setRxBufferSize(SERIAL_HW_RX_BUFFER_SIZE);
+#endif
+  ((HardwareSerial*)serialPort)->begin(baud);
+  openHardwarePorts |= 1 << portId;
+  return serialPort;
+}
+
 // get a pointer to the serial port associated with the specified port id
 Stream* SerialFirmata::getPortFromId(byte portId)
 {
@@ -289,25 +385,37 @@ Stream* SerialFirmata::getPortFromId(byte portId)
   return NULL;
 }
 
+void SerialFirmata::setRelayPolicy(byte portId, int minBatch, unsigned long maxLatency, unsigned long gap, int delimiter)
+{
+  serial_relay_policy *p = &policy[portId];
+  p->minBatch = minBatch;
+  p->maxLatency = maxLatency;
+  p->gap = gap;
+  p->delimiter = delimiter;
+  p->lastAvailable = 0;
+  p->frameLength = 0;
+  if (delimiter != SERIAL_NO_DELIMITER) {
+    if (p->frame == NULL) {
+      p->frame = (byte*)FirmataArena.allocate(SERIAL_RX_CHUNK_SIZE);
+    }
+  } else if (p->frame != NULL) {
+    FirmataArena.release(p->frame);
+    p->frame = NULL;
+  }
+}
+
 // Check serial ports that have READ_CONTINUOUS mode set and relay any data
 // for each port to the device attached to that port.
 void SerialFirmata::checkSerial()
 {
-  byte portId, serialData;
-  int bytesToRead = 0;
-  int numBytesToRead = 0;
-  Stream* serialPort;
-
   if (serialIndex > -1) {
-
-    unsigned long currentMillis = millis();
+    unsigned long now = micros();
 
     // loop through all reporting (READ_CONTINUOUS) serial ports
     for (byte i = 0; i < serialIndex + 1; i++) {
-      portId = reportSerial[i];
-      bytesToRead = serialBytesToRead[portId];
-      serialPort = getPortFromId(portId);
-      if (serialPort == NULL) {
+      byte portId = reportSerial[i];
+      Stream *serialPort = getPortFromId(portId);
+      if (serialPort == NULL || getModbus(portId) != NULL) {
         continue;
       }
 #if defined(SoftwareSerial_h)
@@ -316,49 +424,516 @@ void SerialFirmata::checkSerial()
         continue;
       }
 #endif
-      int availableBytes = serialPort->available();
-      if (availableBytes > 0) {
-        bool read = true;
-
-        // check if reading should be delayed to collect some bytes before
-        // forwarding (for baud rates significantly below 57600 baud)
-        if (maxCharDelay[portId]) {
-          // inter character delay exceeded or more than 48 bytes available or more bytes available than required
-          read = (lastAvailableBytes[portId] > 0 && (currentMillis - lastReceive[portId]) >= maxCharDelay[portId])
-                 || (bytesToRead == 0 && availableBytes >= 48) || (bytesToRead > 0 && availableBytes >= bytesToRead);
-          if (availableBytes > lastAvailableBytes[portId]) {
-            lastReceive[portId] = currentMillis;
-            lastAvailableBytes[portId] = availableBytes;
-          }
-        }
+      relayPort(portId, serialPort, now);
+    }
+  }
+}
 
-        if (read) {
-          Firmata.write(START_SYSEX);
-          Firmata.write(SERIAL_MESSAGE);
-          Firmata.write(SERIAL_REPLY | portId);
+void SerialFirmata::relayPort(byte portId, Stream *serialPort, unsigned long now)
+{
+  serial_relay_policy *p = &policy[portId];
+  int bytesToRead = serialBytesToRead[portId];
+  // available() is only called once per port and loop, everything else works on this count
+  int availableBytes = serialPort->available();
+  if (p->frame != NULL && availableBytes > 0) {
+    // collect the received bytes, so they can be scanned for the delimiter
+    int space = SERIAL_RX_CHUNK_SIZE - p->frameLength;
+    int n = serialPort->readBytes(p->frame + p->frameLength, min(availableBytes, space));
+    p->frameLength += n;
+    availableBytes = 0;
+  }
+  int pending = p->frame != NULL ? p->frameLength : availableBytes;
+  if (pending == 0) {
+    p->lastAvailable = 0;
+    return;
+  }
+  if (pending > p->lastAvailable) {
+    if (p->lastAvailable == 0) {
+      p->firstByteTime = now;
+    }
+    p->lastByteTime = now;
+  }
+  p->lastAvailable = pending;
 
-          if (bytesToRead == 0 || (serialPort->available() <= bytesToRead)) {
-            numBytesToRead = serialPort->available();
-          } else {
-            numBytesToRead = bytesToRead;
-          }
+  int numBytesToRead = pending;
+  bool flush = p->minBatch == 0 && p->maxLatency == 0 && p->gap == 0 && p->frame == NULL;
+  flush = flush || (p->minBatch > 0 && pending >= p->minBatch)
+          || (bytesToRead > 0 && pending >= bytesToRead)
+          || (p->maxLatency > 0 && now - p->firstByteTime >= p->maxLatency)
+          || (p->gap > 0 && now - p->lastByteTime >= p->gap);
+  if (p->frame != NULL) {
+    // forward up to and including the first delimiter, or everything if the buffer is full
+    for (int j = 0; j < p->frameLength; j++) {
+      if (p->frame[j] == p->delimiter) {
+        numBytesToRead = j + 1;
+        flush = true;
+        break;
+      }
+    }
+    flush = flush || p->frameLength == SERIAL_RX_CHUNK_SIZE;
+  }
+  if (!flush) {
+    return;
+  }
+  if (bytesToRead > 0 && numBytesToRead > bytesToRead) {
+    numBytesToRead = bytesToRead;
+  }
 
-          if (lastAvailableBytes[portId] - numBytesToRead >= 0) {
-            lastAvailableBytes[portId] -= numBytesToRead;
-          } else {
-            lastAvailableBytes[portId] = 0;
-          }
+  bool packed = packedReply[portId];
+  Encoder7BitClass encoder;
+  Firmata.write(START_SYSEX);
+  Firmata.write(SERIAL_MESSAGE);
+  Firmata.write((packed ? SERIAL_REPLY_PACKED : SERIAL_REPLY) | portId);
+  if (packed) {
+    encoder.startBinaryWrite();
+  }
+  if (p->frame != NULL) {
+    sendReplyData(p->frame, numBytesToRead, packed, encoder);
+    p->frameLength -= numBytesToRead;
+    memmove(p->frame, p->frame + numBytesToRead, p->frameLength);
+  } else {
+    // relay serial data to the serial device
+    int remaining = numBytesToRead;
+    while (remaining > 0) {
+      // read into the upper half of rxBuffer, sendReplyData() expands it in place
+      byte *received = rxBuffer + SERIAL_RX_CHUNK_SIZE;
+      int chunk = serialPort->readBytes(received, min(remaining, SERIAL_RX_CHUNK_SIZE));
+      if (chunk <= 0) {
+        break;
+      }
+      sendReplyData(received, chunk, packed, encoder);
+      remaining -= chunk;
+    }
+  }
+  if (packed) {
+    encoder.endBinaryWrite();
+  }
+  Firmata.write(END_SYSEX);
+
+  p->lastAvailable = pending - numBytesToRead;
+  p->firstByteTime = now;
+}
 
-          // relay serial data to the serial device
-          while (numBytesToRead > 0) {
-            serialData = serialPort->read();
-            Firmata.write(serialData & 0x7F);
-            Firmata.write((serialData >> 7) & 0x7F);
-            numBytesToRead--;
+// Writes data of a SERIAL_REPLY, either packed or as two 7 bit bytes per byte. data may point into
+// the upper half of rxBuffer, the expansion to 7 bit pairs never overwrites bytes not read yet.
+void SerialFirmata::sendReplyData(const byte *data, int length, bool packed, Encoder7BitClass &encoder)
+{
+  if (packed) {
+    encoder.writeBinary(data, length);
+    return;
+  }
+  while (length > 0) {
+    int chunk = min(length, SERIAL_RX_CHUNK_SIZE);
+    for (int i = 0; i < chunk; i++) {
+      byte serialData = data[i];
+      rxBuffer[2 * i] = serialData & 0x7F;
+      rxBuffer[2 * i + 1] = (serialData >> 7) & 0x7F;
+    }
+    Firmata.write(rxBuffer, 2 * chunk);
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+modbus_master* SerialFirmata::getModbus(byte portId)
+{
+  for (byte i = 0; i < MODBUS_MAX_PORTS; i++) {
+    if (modbus[i] != NULL && modbus[i]->portId == portId) {
+      return modbus[i];
+    }
+  }
+  return NULL;
+}
+
+void SerialFirmata::endModbus(byte portId)
+{
+  for (byte i = 0; i < MODBUS_MAX_PORTS; i++) {
+    if (modbus[i] != NULL && modbus[i]->portId == portId) {
+      FirmataArena.destroy(modbus[i]);
+      modbus[i] = NULL;
+    }
+  }
+}
+
+boolean SerialFirmata::handleModbus(byte argc, byte *argv)
+{
+  if (argc < 2) {
+    return false;
+  }
+  byte portId = argv[1];
+  if (argv[0] == MODBUS_CONFIG) {
+    if (argc < 6) {
+      return false;
+    }
+    long baud = (long)argv[2] | ((long)argv[3] << 7) | ((long)argv[4] << 14);
+    configureModbus(portId, baud, argv[5], argc >= 8 ? argv[6] | (argv[7] << 7) : 0);
+    return true;
+  }
+
+  modbus_master *m = getModbus(portId);
+  if (m == NULL) {
+    Firmata.sendEvent(EVENT_MODBUS_NOT_CONFIGURED, F("Modbus: Port not configured: "), portId);
+    return true;
+  }
+  switch (argv[0]) {
+    case MODBUS_REQUEST:
+      {
+        // request id, slave, function, data
+        if (argc < 5) {
+          return false;
+        }
+        int length = 1 + (argc - 5) / 2;
+        if (length > MODBUS_MAX_REQUEST) {
+          sendModbusError(m, MODBUS_SOURCE_REQUEST, argv[2], MODBUS_ERROR_TOO_LONG, 0);
+          break;
+        }
+        if (m->queueLength == MODBUS_QUEUE_SIZE) {
+          sendModbusError(m, MODBUS_SOURCE_REQUEST, argv[2], MODBUS_ERROR_BUSY, 0);
+          break;
+        }
+        modbus_request *r = &m->queue[(m->queueStart + m->queueLength) % MODBUS_QUEUE_SIZE];
+        m->queueLength++;
+        r->requestId = argv[2];
+        r->slave = argv[3];
+        r->length = (byte)length;
+        r->pdu[0] = argv[4];
+        for (int i = 1; i < length; i++) {
+          r->pdu[i] = argv[3 + 2 * i] | (argv[4 + 2 * i] << 7);
+        }
+        break;
+      }
+    case MODBUS_POLL:
+      {
+        // entry, slave, function, address (3 x 7 bit), count, period (2 x 7 bit)
+        if (argc < 11 || argv[2] >= MODBUS_MAX_POLLS || argv[3] == 0 || argv[4] < 1 || argv[4] > 4) {
+          return false;
+        }
+        byte count = argv[8];
+        // the response has a byte count, the data and the CRC
+        int responseLength = argv[4] <= 2 ? (count + 7) / 8 : 2 * count;
+        if (count == 0 || count > MODBUS_MAX_POLL_VALUES || 5 + responseLength > MODBUS_MAX_FRAME) {
+          sendModbusError(m, MODBUS_SOURCE_POLL, argv[2], MODBUS_ERROR_TOO_LONG, 0);
+          break;
+        }
+        modbus_poll *p = &m->polls[argv[2]];
+        if (m->waiting && m->active == argv[2]) {
+          // the response would be decoded as the new poll
+          m->active = MODBUS_MAX_POLLS;
+        }
+        p->slave = argv[3];
+        p->function = argv[4];
+        p->address = argv[5] | (argv[6] << 7) | (argv[7] << 14);
+        p->count = count;
+        p->period = argv[9] | (argv[10] << 7);
+        p->error = 0;
+        p->valid = false;
+        p->pending = true;
+        p->lastRun = millis();
+        break;
+      }
+    case MODBUS_POLL_REMOVE:
+      if (argc < 3) {
+        return false;
+      }
+      for (byte i = 0; i < MODBUS_MAX_POLLS; i++) {
+        if (argv[2] == 0x7F || argv[2] == i) {
+          m->polls[i].slave = 0;
+          if (m->waiting && m->active == i) {
+            m->active = MODBUS_MAX_POLLS;
           }
-          Firmata.write(END_SYSEX);
         }
       }
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+void SerialFirmata::configureModbus(byte portId, long baud, byte dePin, unsigned int timeout)
+{
+  endModbus(portId);
+  if (portId >= 8 || getPortFromId(portId) == NULL || baud <= 0) {
+    Firmata.sendEvent(EVENT_MODBUS_INVALID_PORT, F("Modbus: Not a hardware serial port: "), portId);
+    return;
+  }
+  int slot = -1;
+  for (byte i = 0; i < MODBUS_MAX_PORTS; i++) {
+    if (modbus[i] == NULL) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0) {
+    Firmata.sendEvent(EVENT_MODBUS_TOO_MANY_PORTS, F("Modbus: Max number of ports exceeded"));
+    return;
+  }
+  // value initialized, so the queue is empty and all polls are unused
+  modbus_master *m = FirmataArena.create<modbus_master>();
+  if (m == NULL) {
+    Firmata.sendEvent(EVENT_MODBUS_OUT_OF_MEMORY, F("Modbus: Out of memory"));
+    return;
+  }
+  modbus[slot] = m;
+  m->portId = portId;
+  m->port = beginHardwarePort(portId, baud);
+  m->dePin = dePin;
+  // 3.5 characters of 11 bits, but at least 1.75 ms as the specification recommends above 19200 baud
+  m->silence = baud > 19200 ? 1750 : 38500000UL / baud;
+  m->timeout = timeout > 0 ? timeout : MODBUS_DEFAULT_TIMEOUT;
+  m->lastByteTime = micros();
+  if (dePin != MODBUS_NO_PIN && IS_PIN_DIGITAL(dePin)) {
+    Firmata.setPinMode(dePin, PIN_MODE_OUTPUT);
+    pinMode(PIN_TO_DIGITAL(dePin), OUTPUT);
+    digitalWrite(PIN_TO_DIGITAL(dePin), LOW);
+  } else {
+    m->dePin = MODBUS_NO_PIN;
+  }
+}
+
+// Runs the transactions of a port without blocking: a frame is sent once the bus was silent for
+// 3.5 characters, the response is collected over the following loops.
+void SerialFirmata::runModbus(modbus_master *m, bool elapsed)
+{
+  unsigned long nowMs = millis();
+  for (byte i = 0; i < MODBUS_MAX_POLLS; i++) {
+    modbus_poll *p = &m->polls[i];
+    if (p->slave == 0) {
+      continue;
+    }
+    if (p->period == 0) {
+      p->pending |= elapsed;
+    } else if (nowMs - p->lastRun >= p->period) {
+      p->pending = true;
+      p->lastRun = nowMs;
+    }
+  }
+
+  unsigned long now = micros();
+  if (m->waiting) {
+    if (receiveModbusFrame(m, now)) {
+      completeModbusTransaction(m, 0);
+    } else if (m->rxLength == 0 && now - m->sentTime >= m->timeout * 1000UL) {
+      completeModbusTransaction(m, MODBUS_ERROR_TIMEOUT);
+    }
+    return;
+  }
+  if (now - m->lastByteTime < (m->broadcast ? MODBUS_TURNAROUND_DELAY * 1000UL : m->silence)) {
+    return;
+  }
+
+  if (m->queueLength > 0) {
+    modbus_request *r = &m->queue[m->queueStart];
+    sendModbusFrame(m, r->slave, r->pdu, r->length);
+    m->active = -1;
+    if (r->slave == 0) {
+      // a broadcast has no response
+      completeModbusTransaction(m, 0);
+    }
+    return;
+  }
+  for (byte i = 0; i < MODBUS_MAX_POLLS; i++) {
+    byte index = (m->pollIndex + i) % MODBUS_MAX_POLLS;
+    modbus_poll *p = &m->polls[index];
+    if (p->slave != 0 && p->pending) {
+      p->pending = false;
+      m->pollIndex = index + 1;
+      byte pdu[5] = { p->function, (byte)(p->address >> 8), (byte)p->address, 0, p->count };
+      sendModbusFrame(m, p->slave, pdu, 5);
+      m->active = index;
+      return;
+    }
+  }
+}
+
+void SerialFirmata::sendModbusFrame(modbus_master *m, byte slave, const byte *pdu, byte length)
+{
+  m->frame[0] = slave;
+  memcpy(m->frame + 1, pdu, length);
+  uint16_t crc = modbusCrc(m->frame, length + 1);
+  m->frame[length + 1] = (byte)crc;
+  m->frame[length + 2] = (byte)(crc >> 8);
+
+  if (m->dePin != MODBUS_NO_PIN) {
+    digitalWrite(PIN_TO_DIGITAL(m->dePin), HIGH);
+  }
+  m->port->write(m->frame, length + 3);
+  // the transceiver must drive the bus until the last bit is out
+  m->port->flush();
+  if (m->dePin != MODBUS_NO_PIN) {
+    digitalWrite(PIN_TO_DIGITAL(m->dePin), LOW);
+  }
+  // the echo of the frame, if the receiver isn't disabled while sending
+  while (m->port->available() > 0) {
+    m->port->read();
+  }
+  m->sentTime = micros();
+  m->lastByteTime = m->sentTime;
+  m->rxLength = 0;
+  m->waiting = slave != 0;
+  m->broadcast = slave == 0;
+}
+
+// Collects the response, true once it is complete: when it has the length its header announces,
+// or when the bus is silent after it.
+bool SerialFirmata::receiveModbusFrame(modbus_master *m, unsigned long now)
+{
+  int available = m->port->available();
+  if (available > 0) {
+    int space = MODBUS_MAX_FRAME - m->rxLength;
+    m->rxLength += m->port->readBytes(m->frame + m->rxLength, min(available, space));
+    m->lastByteTime = now;
+  }
+  if (m->rxLength < 3) {
+    return m->rxLength > 0 && now - m->lastByteTime >= m->silence;
+  }
+  int expected = 0;
+  byte function = m->frame[1];
+  if (function & 0x80) {
+    expected = 5;
+  } else if (function >= 1 && function <= 4) {
+    expected = 5 + m->frame[2];
+  } else if (function == 5 || function == 6 || function == 15 || function == 16) {
+    expected = 8;
+  }
+  if (expected > MODBUS_MAX_FRAME) {
+    // the response doesn't fit into the buffer, it is dropped and reported as a frame error
+    m->rxLength = 0;
+    return true;
+  }
+  return (expected > 0 && m->rxLength >= expected) || m->rxLength == MODBUS_MAX_FRAME
+         || now - m->lastByteTime >= m->silence;
+}
+
+void SerialFirmata::completeModbusTransaction(modbus_master *m, byte error)
+{
+  m->waiting = false;
+  if (m->active >= MODBUS_MAX_POLLS) {
+    // the poll was changed or removed while it was read
+    return;
+  }
+  byte slave = m->active < 0 ? m->queue[m->queueStart].slave : m->polls[m->active].slave;
+  int length = m->rxLength;
+  if (error == 0 && slave != 0) {
+    if (length < 5 || modbusCrc(m->frame, length - 2) != (m->frame[length - 2] | (m->frame[length - 1] << 8))
+        || m->frame[0] != slave) {
+      error = MODBUS_ERROR_FRAME;
+    }
+  }
+
+  if (m->active < 0) {
+    modbus_request *r = &m->queue[m->queueStart];
+    m->queueStart = (m->queueStart + 1) % MODBUS_QUEUE_SIZE;
+    m->queueLength--;
+    if (error != 0) {
+      sendModbusError(m, MODBUS_SOURCE_REQUEST, r->requestId, error, 0);
+      return;
+    }
+    Firmata.startSysex();
+    Firmata.write(MODBUS_DATA);
+    Firmata.write(MODBUS_REPLY);
+    Firmata.write(m->portId);
+    Firmata.write(r->requestId);
+    Firmata.write(r->slave);
+    if (slave == 0) {
+      Firmata.sendValueAsTwo7bitBytes(r->pdu[0]);
+    } else {
+      // the response PDU, without slave and CRC
+      for (int i = 1; i < length - 2; i++) {
+        Firmata.sendValueAsTwo7bitBytes(m->frame[i]);
+      }
+    }
+    Firmata.endSysex();
+    return;
+  }
+
+  modbus_poll *p = &m->polls[m->active];
+  byte exceptionCode = 0;
+  if (error == 0 && (m->frame[1] & 0x7F) != p->function) {
+    error = MODBUS_ERROR_FRAME;
+  } else if (error == 0 && (m->frame[1] & 0x80)) {
+    error = MODBUS_ERROR_EXCEPTION;
+    exceptionCode = m->frame[2];
+  }
+  if (error != 0) {
+    if (p->error != error) {
+      p->error = error;
+      sendModbusError(m, MODBUS_SOURCE_POLL, m->active, error, exceptionCode);
+    }
+    p->valid = false;
+    return;
+  }
+  p->error = 0;
+  reportModbusValues(m, m->active);
+}
+
+// Decodes the response of a poll and reports the values that changed since the last read
+void SerialFirmata::reportModbusValues(modbus_master *m, byte entry)
+{
+  modbus_poll *p = &m->polls[entry];
+  byte byteCount = m->frame[2];
+  const byte *data = m->frame + 3;
+  bool started = false;
+  for (byte i = 0; i < p->count; i++) {
+    uint16_t value;
+    if (p->function <= 2) {
+      if (i / 8 >= byteCount) {
+        break;
+      }
+      value = (data[i / 8] >> (i % 8)) & 1;
+    } else {
+      if (2 * i + 1 >= byteCount) {
+        break;
+      }
+      value = (data[2 * i] << 8) | data[2 * i + 1];
+    }
+    if (p->valid && p->values[i] == value) {
+      continue;
+    }
+    p->values[i] = value;
+    if (!started) {
+      Firmata.startSysex();
+      Firmata.write(MODBUS_DATA);
+      Firmata.write(MODBUS_VALUES);
+      Firmata.write(m->portId);
+      Firmata.write(entry);
+      started = true;
+    }
+    Firmata.write(i);
+    Firmata.write(value & 0x7F);
+    Firmata.write((value >> 7) & 0x7F);
+    Firmata.write(value >> 14);
+  }
+  if (started) {
+    Firmata.endSysex();
+  }
+  p->valid = true;
+}
+
+void SerialFirmata::sendModbusError(modbus_master *m, byte source, byte id, byte error, byte exceptionCode)
+{
+  Firmata.startSysex();
+  Firmata.write(MODBUS_DATA);
+  Firmata.write(MODBUS_ERROR);
+  Firmata.write(m->portId);
+  Firmata.write(source);
+  Firmata.write(id);
+  Firmata.write(error);
+  if (error == MODBUS_ERROR_EXCEPTION) {
+    Firmata.write(exceptionCode & 0x7F);
+  }
+  Firmata.endSysex();
+}
+
+// CRC-16 of Modbus RTU (polynomial 0xA001, reflected, start value 0xFFFF), sent low byte first
+uint16_t SerialFirmata::modbusCrc(const byte *data, int length)
+{
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (byte bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
     }
   }
+  return crc;
 }
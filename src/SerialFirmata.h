@@ -10,6 +10,29 @@
   See file LICENSE.txt for further informations on licensing terms.
 
   Last updated December 23rd, 2016
+
+  Modbus RTU master: a hardware port can be switched to Modbus, the board then does the framing,
+  the CRC, the timing and the direction pin of the RS-485 transceiver. Requests are queued and
+  sent one after the other, their replies are forwarded as they are. Polls read registers or coils
+  periodically and only report the values that changed. SERIAL_CONFIG or SERIAL_CLOSE on the port
+  end the Modbus mode.
+
+  Host -> board:
+  START_SYSEX, MODBUS_DATA, MODBUS_CONFIG, port, baud (3 x 7 bit), DE/RE pin (127 = none),
+  [response timeout in ms (2 x 7 bit), 0 = MODBUS_DEFAULT_TIMEOUT], END_SYSEX
+  START_SYSEX, MODBUS_DATA, MODBUS_REQUEST, port, request id, slave, function, data (2 x 7 bit per byte), END_SYSEX
+  START_SYSEX, MODBUS_DATA, MODBUS_POLL, port, entry, slave, function (1-4), address (3 x 7 bit), count,
+  period in ms (2 x 7 bit, 0 = at the sampling interval), END_SYSEX
+  START_SYSEX, MODBUS_DATA, MODBUS_POLL_REMOVE, port, entry (127 = all), END_SYSEX
+
+  Board -> host:
+  START_SYSEX, MODBUS_DATA, MODBUS_REPLY, port, request id, slave, response PDU (2 x 7 bit per byte), END_SYSEX
+  START_SYSEX, MODBUS_DATA, MODBUS_VALUES, port, entry, n x (index, value (3 x 7 bit)), END_SYSEX
+  START_SYSEX, MODBUS_DATA, MODBUS_ERROR, port, source, request id or entry, error, [exception code], END_SYSEX
+  The reply of a request is its response PDU (function and data), also if it is an exception. A
+  broadcast (slave 0) is confirmed once it is sent, by a reply with only the function, the next frame
+  follows after MODBUS_TURNAROUND_DELAY. Errors of a poll are only reported when they
+  change; after an error, the next successful read reports all values again.
 */
 
 #ifndef SerialFirmata_h
@@ -17,6 +40,7 @@
 
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
+#include "Encoder7Bit.h"
 // SoftwareSerial is currently only supported for AVR-based boards and the Arduino 101.
 // Limited to Arduino 1.6.6 or higher because Arduino builder cannot find SoftwareSerial
 // prior to this release.
@@ -46,6 +70,18 @@
 #define MAX_SERIAL_PORTS            8
 #define SERIAL_READ_ARR_LEN         12
 
+// bytes read from a port with one readBytes() call
+#ifdef LARGE_MEM_DEVICE
+#define SERIAL_RX_CHUNK_SIZE        256
+#else
+#define SERIAL_RX_CHUNK_SIZE        32
+#endif
+
+#ifdef ESP32
+// receive buffer of the UART driver, so a port can be read at its line rate between two loops
+#define SERIAL_HW_RX_BUFFER_SIZE    4096
+#endif
+
 // map configuration query response resolution value to serial pin type
 #define RES_RX1                     0x02
 #define RES_TX1                     0x03
@@ -62,12 +98,116 @@
 #define SERIAL_CLOSE                0x50
 #define SERIAL_FLUSH                0x60
 #define SERIAL_LISTEN               0x70
+#define SERIAL_REPLY_PACKED         0x00 // board -> host only: like SERIAL_REPLY, but the data is Encoder7Bit packed
 
 // Serial read modes
 #define SERIAL_READ_CONTINUOUSLY    0x00
 #define SERIAL_STOP_READING         0x01
+#define SERIAL_READ_CONTINUOUSLY_PACKED 0x02 // as SERIAL_READ_CONTINUOUSLY, replies with SERIAL_REPLY_PACKED
+#define SERIAL_READ_POLICY          0x03 // when to forward the received data, see serial_relay_policy
+
+#define SERIAL_NO_DELIMITER         -1
 #define SERIAL_MODE_MASK            0xF0
 
+/*
+ * Received data is forwarded in a SERIAL_REPLY as soon as one of the set conditions is met. Without
+ * any condition, whatever is available is forwarded on each loop.
+ */
+struct serial_relay_policy {
+  int minBatch; // forward once this many bytes are available, 0 = not used
+  unsigned long maxLatency; // us the oldest byte may wait, 0 = not used
+  unsigned long gap; // us without a new byte that end a message (e.g. 3.5 chars for Modbus RTU), 0 = not used
+  int delimiter; // byte that ends a message (e.g. '\n'), or SERIAL_NO_DELIMITER
+  // state
+  unsigned long firstByteTime; // when the oldest byte not forwarded yet was seen
+  unsigned long lastByteTime;
+  int lastAvailable;
+  byte *frame; // received bytes scanned for the delimiter, SERIAL_RX_CHUNK_SIZE
+  int frameLength;
+};
+
+// MODBUS_DATA subcommands
+#define MODBUS_CONFIG               0x00
+#define MODBUS_REQUEST              0x01
+#define MODBUS_POLL                 0x02
+#define MODBUS_POLL_REMOVE          0x03
+#define MODBUS_REPLY                0x04
+#define MODBUS_VALUES               0x05
+#define MODBUS_ERROR                0x06
+
+// MODBUS_ERROR codes
+#define MODBUS_ERROR_TIMEOUT        0x01 // no response within the timeout
+#define MODBUS_ERROR_FRAME          0x02 // bad CRC, or the response doesn't match the request
+#define MODBUS_ERROR_EXCEPTION      0x03 // exception response to a poll, followed by the exception code
+#define MODBUS_ERROR_BUSY           0x04 // the request queue is full
+#define MODBUS_ERROR_TOO_LONG       0x05 // the request or the poll doesn't fit into a frame
+
+// MODBUS_ERROR sources
+#define MODBUS_SOURCE_REQUEST       0x00
+#define MODBUS_SOURCE_POLL          0x01
+
+#define MODBUS_NO_PIN               127
+#define MODBUS_DEFAULT_TIMEOUT      100 // ms
+#ifndef MODBUS_TURNAROUND_DELAY
+#define MODBUS_TURNAROUND_DELAY     100 // ms after a broadcast before the next frame, for the slaves to process it
+#endif
+#ifdef LARGE_MEM_DEVICE
+#define MODBUS_MAX_PORTS            2
+#define MODBUS_MAX_FRAME            256 // the maximum of Modbus RTU
+#define MODBUS_MAX_REQUEST          64 // bytes of a queued request PDU
+#define MODBUS_QUEUE_SIZE           4
+#define MODBUS_MAX_POLLS            16
+#define MODBUS_MAX_POLL_VALUES      16
+#else
+#define MODBUS_MAX_PORTS            1
+#define MODBUS_MAX_FRAME            40
+#define MODBUS_MAX_REQUEST          24
+#define MODBUS_QUEUE_SIZE           2
+#define MODBUS_MAX_POLLS            4
+#define MODBUS_MAX_POLL_VALUES      8
+#endif
+
+struct modbus_request {
+  byte requestId;
+  byte slave;
+  byte length; // of the PDU
+  byte pdu[MODBUS_MAX_REQUEST]; // function code and data
+};
+
+struct modbus_poll {
+  byte slave; // 0 = unused
+  byte function;
+  uint16_t address;
+  byte count;
+  byte error; // last reported error, 0 = none
+  bool valid; // values holds the last read
+  bool pending; // due, waiting for the bus
+  unsigned int period; // ms, 0 = at the sampling interval
+  unsigned long lastRun;
+  uint16_t values[MODBUS_MAX_POLL_VALUES];
+};
+
+// Modbus state of a port, created on MODBUS_CONFIG
+struct modbus_master {
+  byte portId;
+  Stream *port;
+  byte dePin; // MODBUS_NO_PIN = none
+  unsigned long silence; // us between frames, 3.5 characters
+  unsigned int timeout; // ms
+  bool waiting; // for the response to the active transaction
+  bool broadcast; // the last frame sent was a broadcast, the next one waits for MODBUS_TURNAROUND_DELAY
+  int active; // poll of the active transaction, -1 for the request at the head of the queue
+  unsigned long sentTime; // micros
+  unsigned long lastByteTime; // micros of the last byte sent or received
+  uint16_t rxLength;
+  byte frame[MODBUS_MAX_FRAME]; // the frame sent, then the response
+  modbus_request queue[MODBUS_QUEUE_SIZE];
+  byte queueStart;
+  byte queueLength;
+  byte pollIndex; // the poll to look at first for the next transaction
+  modbus_poll polls[MODBUS_MAX_POLLS];
+};
+
 struct serial_pins {
   uint8_t rx;
   uint8_t tx;
@@ -139,27 +279,58 @@ class SerialFirmata: public FirmataFeature
     boolean handlePinMode(byte pin, int mode);
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean handleSysexStream(byte command, byte phase, byte length, byte* data) override;
+    boolean ownsSysexCommand(byte command) override { return command == SERIAL_MESSAGE || command == MODBUS_DATA; }
     void report(bool elapsed) override;
     void reset();
+    boolean canWriteConfiguration() override;
     void checkSerial();
+    void setRelayPolicy(byte portId, int minBatch, unsigned long maxLatency, unsigned long gap, int delimiter);
 
   private:
     byte reportSerial[MAX_SERIAL_PORTS];
     int serialBytesToRead[SERIAL_READ_ARR_LEN];
     signed char serialIndex;
+    byte openHardwarePorts; // bit per hardware port id, set by beginHardwarePort()
 
-    unsigned long lastReceive[SERIAL_READ_ARR_LEN];
-    unsigned char maxCharDelay[SERIAL_READ_ARR_LEN];
-    int lastAvailableBytes[SERIAL_READ_ARR_LEN];
+    serial_relay_policy policy[SERIAL_READ_ARR_LEN];
+    bool packedReply[SERIAL_READ_ARR_LEN];
+    // data read from a port; in unpacked mode, the received bytes are expanded in place
+    // to two 7 bit bytes each, so it is twice the chunk size
+    byte rxBuffer[2 * SERIAL_RX_CHUNK_SIZE];
+
+    // SERIAL_WRITE messages that don't fit into the input buffer are written while they arrive
+    Stream *streamPort;
+    byte streamSkip; // header bytes of the message still to be skipped
+    int streamLowByte; // first half of a byte split between two chunks, or -1
 
 #if defined(SoftwareSerial_h)
     Stream *swSerial0;
     Stream *swSerial1;
     Stream *swSerial2;
     Stream *swSerial3;
+    // ends the lifetime of the port object and forgets it, so it can be opened again
+    void destroySoftwareSerial(byte portId);
 #endif
 
+    modbus_master *modbus[MODBUS_MAX_PORTS];
+
     Stream* getPortFromId(byte portId);
+    Stream* beginHardwarePort(byte portId, long baud);
+    void relayPort(byte portId, Stream *serialPort, unsigned long now);
+    void sendReplyData(const byte *data, int length, bool packed, Encoder7BitClass &encoder);
+
+    modbus_master* getModbus(byte portId);
+    void endModbus(byte portId);
+    boolean handleModbus(byte argc, byte *argv);
+    void configureModbus(byte portId, long baud, byte dePin, unsigned int timeout);
+    void runModbus(modbus_master *m, bool elapsed);
+    void sendModbusFrame(modbus_master *m, byte slave, const byte *pdu, byte length);
+    bool receiveModbusFrame(modbus_master *m, unsigned long now);
+    void completeModbusTransaction(modbus_master *m, byte error);
+    void reportModbusValues(modbus_master *m, byte entry);
+    void sendModbusError(modbus_master *m, byte source, byte id, byte error, byte exceptionCode);
+    static uint16_t modbusCrc(const byte *data, int length);
 
 };
 
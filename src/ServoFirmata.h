@@ -25,9 +25,17 @@
 #include <Servo.h>
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
+#include "FirmataArena.h"
 
 void servoAnalogWrite(byte pin, int value);
 
+struct servo_channel
+{
+  Servo servo;
+  int minPulse; // -1 for the defaults of Servo
+  int maxPulse;
+};
+
 class ServoFirmata: public FirmataFeature
 {
   public:
@@ -36,9 +44,11 @@ class ServoFirmata: public FirmataFeature
     boolean handlePinMode(byte pin, int mode);
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean ownsSysexCommand(byte command) override { return command == SERVO_CONFIG; }
     void reset();
+    void writeConfiguration(Print& out) override;
   private:
-    Servo *servos[MAX_SERVOS];
+    servo_channel *servos[MAX_SERVOS];
     void attach(byte pin, int minPulse, int maxPulse);
     void detach(byte pin);
 };
@@ -65,9 +75,9 @@ ServoFirmata::ServoFirmata()
 boolean ServoFirmata::analogWrite(byte pin, int value)
 {
   if (IS_PIN_SERVO(pin)) {
-    Servo *servo = servos[PIN_TO_SERVO(pin)];
+    servo_channel *servo = servos[PIN_TO_SERVO(pin)];
     if (servo) {
-      servo->write(value);
+      servo->servo.write(value);
       return true;
     }
   }
@@ -110,35 +120,71 @@ boolean ServoFirmata::handleSysex(byte command, byte argc, byte* argv)
       }
     }
   }
+  // the value of a pin in servo mode, in degrees or as pulse width in microseconds
+  if (command == EXTENDED_ANALOG && argc > 1 && Firmata.getPinMode(argv[0]) == PIN_MODE_SERVO) {
+    int value = argv[1];
+    if (argc > 2) value |= (argv[2] << 7);
+    if (argc > 3) value |= (argv[3] << 14);
+    return analogWrite(argv[0], value);
+  }
   return false;
 }
 
 void ServoFirmata::attach(byte pin, int minPulse, int maxPulse)
 {
-  Servo *servo = servos[PIN_TO_SERVO(pin)];
+  servo_channel *servo = servos[PIN_TO_SERVO(pin)];
   if (!servo) {
-    servo = new Servo();
+    servo = FirmataArena.create<servo_channel>();
+    if (!servo) {
+      Firmata.sendEvent(EVENT_SERVO_OUT_OF_MEMORY, F("Servo: Out of memory"));
+      return;
+    }
     servos[PIN_TO_SERVO(pin)] = servo;
   }
-  if (servo->attached())
-    servo->detach();
+  if (servo->servo.attached())
+    servo->servo.detach();
+  servo->minPulse = minPulse;
+  servo->maxPulse = maxPulse;
   if (minPulse >= 0 || maxPulse >= 0)
-    servo->attach(PIN_TO_DIGITAL(pin), minPulse, maxPulse);
+    servo->servo.attach(PIN_TO_DIGITAL(pin), minPulse, maxPulse);
   else
-    servo->attach(PIN_TO_DIGITAL(pin));
+    servo->servo.attach(PIN_TO_DIGITAL(pin));
 }
 
 void ServoFirmata::detach(byte pin)
 {
-  Servo *servo = servos[PIN_TO_SERVO(pin)];
+  servo_channel *servo = servos[PIN_TO_SERVO(pin)];
   if (servo) {
-    if (servo->attached())
-      servo->detach();
-    free(servo);
+    if (servo->servo.attached())
+      servo->servo.detach();
+    FirmataArena.destroy(servo);
     servos[PIN_TO_SERVO(pin)] = NULL;
   }
 }
 
+// SET_PIN_MODE is saved by FirmataBootConfig, the pulse range and the position follow it
+void ServoFirmata::writeConfiguration(Print& out)
+{
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    if (!IS_PIN_SERVO(pin) || Firmata.getPinMode(pin) != PIN_MODE_SERVO) {
+      continue;
+    }
+    servo_channel *servo = servos[PIN_TO_SERVO(pin)];
+    if (!servo || !servo->servo.attached()) {
+      continue;
+    }
+    if (servo->minPulse >= 0 || servo->maxPulse >= 0) {
+      const byte config[] = { START_SYSEX, SERVO_CONFIG, pin, (byte)(servo->minPulse & 0x7F), (byte)((servo->minPulse >> 7) & 0x7F),
+        (byte)(servo->maxPulse & 0x7F), (byte)((servo->maxPulse >> 7) & 0x7F), END_SYSEX };
+      out.write(config, sizeof(config));
+    }
+    // as a pulse width, which write() tells apart from an angle
+    int pulse = servo->servo.readMicroseconds();
+    const byte position[] = { START_SYSEX, EXTENDED_ANALOG, pin, (byte)(pulse & 0x7F), (byte)((pulse >> 7) & 0x7F), END_SYSEX };
+    out.write(position, sizeof(position));
+  }
+}
+
 void ServoFirmata::reset()
 {
   for (byte pin = 0; pin < TOTAL_PINS; pin++) {
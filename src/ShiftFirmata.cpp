@@ -0,0 +1,307 @@
+/*
+  ShiftFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "ShiftFirmata.h"
+#include "Encoder7Bit.h"
+
+#define SHIFT_DEFAULT_SPEED 1000 // kHz
+
+ShiftFirmata::ShiftFirmata()
+{
+  for (byte i = 0; i < MAX_SHIFT_REGISTERS; i++) {
+    registers[i].dataPin = 127;
+  }
+}
+
+void ShiftFirmata::handleCapability(byte pin)
+{
+  if (IS_PIN_DIGITAL(pin)) {
+    Firmata.write(PIN_MODE_SHIFT);
+    Firmata.write(8);
+  }
+}
+
+boolean ShiftFirmata::handlePinMode(byte pin, int mode)
+{
+  if (mode == PIN_MODE_SHIFT) {
+    // the pins are set up by SHIFT_CONFIG
+    return IS_PIN_DIGITAL(pin);
+  }
+  for (byte i = 0; i < MAX_SHIFT_REGISTERS; i++) {
+    shift_register* r = &registers[i];
+    if (r->dataPin != 127 && (r->dataPin == pin || r->clockPin == pin || r->latchPin == pin)) {
+      release(i);
+    }
+  }
+  return false;
+}
+
+boolean ShiftFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != SHIFT_DATA || argc < 2) {
+    return false;
+  }
+  byte reg = argv[1];
+  if (reg >= MAX_SHIFT_REGISTERS) {
+    Firmata.sendString(F("Invalid shift register"));
+    return true;
+  }
+  if (argv[0] != SHIFT_CONFIG && registers[reg].dataPin == 127) {
+    Firmata.sendString(F("Shift register not configured"));
+    return true;
+  }
+  switch (argv[0]) {
+    case SHIFT_CONFIG:
+      if (argc < 8 || !configure(reg, argv[2], argv[3], argv[4], argv[5], Firmata.decodePackedUInt14(argv + 6))) {
+        Firmata.sendString(F("Invalid shift register pins"));
+      }
+      return true;
+    case SHIFT_WRITE: {
+      int length = num7BitOutbytes(argc - 2);
+      Encoder7BitClass::readBinary(length, argv + 2, argv + 2); // decode in place
+      write(reg, argv + 2, length);
+      return true;
+    }
+    case SHIFT_READ:
+      if (argc >= 3) {
+        byte data[SHIFT_MAX_READ_BYTES];
+        byte length = min(argv[2], (byte)SHIFT_MAX_READ_BYTES);
+        read(reg, data, length);
+        sendReply(reg, data, length);
+      }
+      return true;
+    case SHIFT_REPORT:
+      if (argc >= 3) {
+        registers[reg].reportBytes = min(argv[2], (byte)SHIFT_MAX_READ_BYTES);
+        registers[reg].reported = false;
+      }
+      return true;
+  }
+  return false;
+}
+
+bool ShiftFirmata::configure(byte reg, byte dataPin, byte clockPin, byte latchPin, byte flags, uint16_t speed)
+{
+  if (!IS_PIN_DIGITAL(dataPin) || !IS_PIN_DIGITAL(clockPin) || (latchPin != SHIFT_NO_LATCH && !IS_PIN_DIGITAL(latchPin)) ||
+      Firmata.getPinMode(dataPin) == PIN_MODE_IGNORE || Firmata.getPinMode(clockPin) == PIN_MODE_IGNORE ||
+      (latchPin != SHIFT_NO_LATCH && Firmata.getPinMode(latchPin) == PIN_MODE_IGNORE)) {
+    return false;
+  }
+  release(reg);
+  shift_register* r = &registers[reg];
+  Firmata.setPinMode(dataPin, PIN_MODE_SHIFT);
+  Firmata.setPinMode(clockPin, PIN_MODE_SHIFT);
+  pinMode(PIN_TO_DIGITAL(dataPin), (flags & SHIFT_INPUT) ? INPUT : OUTPUT);
+  pinMode(PIN_TO_DIGITAL(clockPin), OUTPUT);
+  digitalWrite(PIN_TO_DIGITAL(clockPin), LOW);
+  if (latchPin != SHIFT_NO_LATCH) {
+    Firmata.setPinMode(latchPin, PIN_MODE_SHIFT);
+    pinMode(PIN_TO_DIGITAL(latchPin), OUTPUT);
+    // idle high: outputs latch on the rising edge, inputs load while it is low
+    digitalWrite(PIN_TO_DIGITAL(latchPin), (flags & SHIFT_INPUT) ? HIGH : LOW);
+  }
+  r->dataPin = dataPin;
+  r->clockPin = clockPin;
+  r->latchPin = latchPin;
+  r->flags = flags;
+  r->speed = speed != 0 ? speed : SHIFT_DEFAULT_SPEED;
+  r->reportBytes = 0;
+  r->reported = false;
+#ifdef SHIFT_USE_SPI
+  r->useSpi = clockPin == PIN_SPI_SCK && dataPin == ((flags & SHIFT_INPUT) ? PIN_SPI_MISO : PIN_SPI_MOSI);
+  if (r->useSpi) {
+    SPI.begin();
+  }
+#else
+  r->useSpi = false;
+#endif
+  return true;
+}
+
+void ShiftFirmata::release(byte reg)
+{
+  // the pins keep their mode, the host sets them to whatever it uses them for next
+  registers[reg].dataPin = 127;
+}
+
+void ShiftFirmata::shiftOutBytes(shift_register* r, const byte* data, int length)
+{
+  bool msbFirst = r->flags & SHIFT_MSB_FIRST;
+#ifdef SHIFT_USE_SPI
+  if (r->useSpi) {
+    SPI.beginTransaction(SPISettings((uint32_t)r->speed * 1000, msbFirst ? MSBFIRST : LSBFIRST, SPI_MODE0));
+    for (int i = 0; i < length; i++) {
+      SPI.transfer(data[i]);
+    }
+    SPI.endTransaction();
+    return;
+  }
+#endif
+#ifdef __AVR__
+  volatile uint8_t* dataOut = portOutputRegister(digitalPinToPort(PIN_TO_DIGITAL(r->dataPin)));
+  uint8_t dataMask = digitalPinToBitMask(PIN_TO_DIGITAL(r->dataPin));
+  volatile uint8_t* clockOut = portOutputRegister(digitalPinToPort(PIN_TO_DIGITAL(r->clockPin)));
+  uint8_t clockMask = digitalPinToBitMask(PIN_TO_DIGITAL(r->clockPin));
+#endif
+  for (int i = 0; i < length; i++) {
+    byte value = data[i];
+#ifdef __AVR__
+    // the ports are shared with other pins, which an interrupt may change
+    noInterrupts();
+#endif
+    for (byte bit = 0; bit < 8; bit++) {
+      bool high = msbFirst ? (value & (0x80 >> bit)) : (value & (1 << bit));
+#ifdef __AVR__
+      if (high) {
+        *dataOut |= dataMask;
+      } else {
+        *dataOut &= ~dataMask;
+      }
+      *clockOut |= clockMask;
+      *clockOut &= ~clockMask;
+#else
+      digitalWrite(PIN_TO_DIGITAL(r->dataPin), high ? HIGH : LOW);
+      digitalWrite(PIN_TO_DIGITAL(r->clockPin), HIGH);
+      digitalWrite(PIN_TO_DIGITAL(r->clockPin), LOW);
+#endif
+    }
+#ifdef __AVR__
+    interrupts();
+#endif
+  }
+}
+
+void ShiftFirmata::shiftInBytes(shift_register* r, byte* data, int length)
+{
+  bool msbFirst = r->flags & SHIFT_MSB_FIRST;
+#ifdef SHIFT_USE_SPI
+  if (r->useSpi) {
+    SPI.beginTransaction(SPISettings((uint32_t)r->speed * 1000, msbFirst ? MSBFIRST : LSBFIRST, SPI_MODE0));
+    for (int i = 0; i < length; i++) {
+      data[i] = SPI.transfer(0);
+    }
+    SPI.endTransaction();
+    return;
+  }
+#endif
+#ifdef __AVR__
+  volatile uint8_t* dataIn = portInputRegister(digitalPinToPort(PIN_TO_DIGITAL(r->dataPin)));
+  uint8_t dataMask = digitalPinToBitMask(PIN_TO_DIGITAL(r->dataPin));
+  volatile uint8_t* clockOut = portOutputRegister(digitalPinToPort(PIN_TO_DIGITAL(r->clockPin)));
+  uint8_t clockMask = digitalPinToBitMask(PIN_TO_DIGITAL(r->clockPin));
+#endif
+  for (int i = 0; i < length; i++) {
+    byte value = 0;
+#ifdef __AVR__
+    noInterrupts();
+#endif
+    for (byte bit = 0; bit < 8; bit++) {
+      // read before the rising edge, the first bit is there right after the load
+#ifdef __AVR__
+      bool high = *dataIn & dataMask;
+      *clockOut |= clockMask;
+      *clockOut &= ~clockMask;
+#else
+      bool high = digitalRead(PIN_TO_DIGITAL(r->dataPin)) == HIGH;
+      digitalWrite(PIN_TO_DIGITAL(r->clockPin), HIGH);
+      digitalWrite(PIN_TO_DIGITAL(r->clockPin), LOW);
+#endif
+      if (high) {
+        value |= msbFirst ? (0x80 >> bit) : (1 << bit);
+      }
+    }
+#ifdef __AVR__
+    interrupts();
+#endif
+    data[i] = value;
+  }
+}
+
+void ShiftFirmata::write(byte reg, const byte* data, int length)
+{
+  shift_register* r = &registers[reg];
+  if (r->flags & SHIFT_INPUT) {
+    return;
+  }
+  shiftOutBytes(r, data, length);
+  if (r->latchPin != SHIFT_NO_LATCH) {
+    digitalWrite(PIN_TO_DIGITAL(r->latchPin), HIGH);
+    digitalWrite(PIN_TO_DIGITAL(r->latchPin), LOW);
+  }
+}
+
+void ShiftFirmata::read(byte reg, byte* data, int length)
+{
+  shift_register* r = &registers[reg];
+  if (r->latchPin != SHIFT_NO_LATCH && (r->flags & SHIFT_INPUT)) {
+    digitalWrite(PIN_TO_DIGITAL(r->latchPin), LOW);
+    digitalWrite(PIN_TO_DIGITAL(r->latchPin), HIGH);
+  }
+  shiftInBytes(r, data, length);
+}
+
+void ShiftFirmata::sendReply(byte reg, const byte* data, int length)
+{
+  Encoder7BitClass encoder;
+  Firmata.startSysex();
+  Firmata.write(SHIFT_DATA);
+  Firmata.write(SHIFT_REPLY);
+  Firmata.write(reg);
+  encoder.startBinaryWrite();
+  encoder.writeBinary(data, length);
+  encoder.endBinaryWrite();
+  Firmata.endSysex();
+}
+
+void ShiftFirmata::report(bool elapsed)
+{
+  if (!elapsed) {
+    return;
+  }
+  for (byte i = 0; i < MAX_SHIFT_REGISTERS; i++) {
+    shift_register* r = &registers[i];
+    if (r->dataPin == 127 || r->reportBytes == 0) {
+      continue;
+    }
+    byte data[SHIFT_MAX_READ_BYTES];
+    read(i, data, r->reportBytes);
+    if (!r->reported || memcmp(data, r->last, r->reportBytes) != 0) {
+      memcpy(r->last, data, r->reportBytes);
+      r->reported = true;
+      sendReply(i, data, r->reportBytes);
+    }
+  }
+}
+
+void ShiftFirmata::writeConfiguration(Print& out)
+{
+  for (byte i = 0; i < MAX_SHIFT_REGISTERS; i++) {
+    shift_register* r = &registers[i];
+    if (r->dataPin == 127) {
+      continue;
+    }
+    const byte config[] = { START_SYSEX, SHIFT_DATA, SHIFT_CONFIG, i, r->dataPin, r->clockPin, r->latchPin, r->flags,
+      (byte)(r->speed & 0x7F), (byte)(r->speed >> 7), END_SYSEX };
+    out.write(config, sizeof(config));
+    if (r->reportBytes != 0) {
+      const byte report[] = { START_SYSEX, SHIFT_DATA, SHIFT_REPORT, i, r->reportBytes, END_SYSEX };
+      out.write(report, sizeof(report));
+    }
+  }
+}
+
+void ShiftFirmata::reset()
+{
+  for (byte i = 0; i < MAX_SHIFT_REGISTERS; i++) {
+    release(i);
+  }
+}
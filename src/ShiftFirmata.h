@@ -0,0 +1,101 @@
+/*
+  ShiftFirmata.h - Firmata library
+
+  Shift registers and chains of them: 74HC595 style outputs and 74HC165 style inputs. When the
+  data and clock pins are the MOSI (MISO for inputs) and SCK pins, the bits are shifted by the
+  SPI hardware, otherwise they are bit-banged (through the port registers on AVR).
+
+  A register is clocked like SPI mode 0: the data is valid at the rising edge of the clock. An
+  output chain is latched with a rising edge of the latch pin after the data was shifted, an
+  input chain loads its inputs while the latch pin is pulsed low before the data is shifted in.
+
+  Host -> board:
+  START_SYSEX, SHIFT_DATA, SHIFT_CONFIG, register, data pin, clock pin, latch pin (127 = none), flags,
+  SPI clock in kHz (2 x 7 bit, 0 = default), END_SYSEX
+  START_SYSEX, SHIFT_DATA, SHIFT_WRITE, register, data (Encoder7Bit, first byte first), END_SYSEX
+  START_SYSEX, SHIFT_DATA, SHIFT_READ, register, number of bytes, END_SYSEX
+  START_SYSEX, SHIFT_DATA, SHIFT_REPORT, register, number of bytes (0 = stop), END_SYSEX
+
+  SHIFT_REPORT reads the register every sampling interval and reports it when it changed.
+
+  Board -> host:
+  START_SYSEX, SHIFT_DATA, SHIFT_REPLY, register, data (Encoder7Bit), END_SYSEX
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef ShiftFirmata_h
+#define ShiftFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+
+#if defined(PIN_SPI_MOSI) && !defined(FIRMATA_NATIVE)
+#include <SPI.h>
+#define SHIFT_USE_SPI
+#endif
+
+// SHIFT_DATA subcommands
+#define SHIFT_CONFIG            0x00
+#define SHIFT_WRITE             0x01
+#define SHIFT_READ              0x02
+#define SHIFT_REPORT            0x03
+#define SHIFT_REPLY             0x04
+
+// SHIFT_CONFIG flags
+#define SHIFT_MSB_FIRST         0x01
+#define SHIFT_INPUT             0x02 // the data pin is an input
+
+#define SHIFT_NO_LATCH          127
+
+#ifndef MAX_SHIFT_REGISTERS
+#define MAX_SHIFT_REGISTERS     4
+#endif
+#ifdef LARGE_MEM_DEVICE
+#define SHIFT_MAX_READ_BYTES    32 // bytes read at a time, for the length of a chain
+#else
+#define SHIFT_MAX_READ_BYTES    8
+#endif
+
+class ShiftFirmata: public FirmataFeature
+{
+  public:
+    ShiftFirmata();
+    void handleCapability(byte pin) override;
+    boolean handlePinMode(byte pin, int mode) override;
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    boolean ownsSysexCommand(byte command) override { return command == SHIFT_DATA; }
+    void reset() override;
+    void report(bool elapsed) override;
+    void writeConfiguration(Print& out) override;
+
+    void write(byte reg, const byte* data, int length);
+    void read(byte reg, byte* data, int length);
+
+  private:
+    struct shift_register {
+      byte dataPin; // 127 = not configured
+      byte clockPin;
+      byte latchPin;
+      byte flags;
+      uint16_t speed; // kHz
+      bool useSpi;
+      byte reportBytes;
+      bool reported;
+      byte last[SHIFT_MAX_READ_BYTES];
+    };
+    shift_register registers[MAX_SHIFT_REGISTERS];
+
+    bool configure(byte reg, byte dataPin, byte clockPin, byte latchPin, byte flags, uint16_t speed);
+    void release(byte reg);
+    void shiftOutBytes(shift_register* r, const byte* data, int length);
+    void shiftInBytes(shift_register* r, byte* data, int length);
+    void sendReply(byte reg, const byte* data, int length);
+};
+
+#endif
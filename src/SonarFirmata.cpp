@@ -0,0 +1,255 @@
+/*
+  SonarFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "SonarFirmata.h"
+#include "utility/PinInterrupts.h"
+
+#define SONAR_IDLE              0
+#define SONAR_WAIT_ECHO         1
+#define SONAR_ECHO              2
+#define SONAR_DONE              3
+
+#define SONAR_DEFAULT_DISTANCE  400 // cm
+#define SONAR_US_PER_CM         58 // there and back
+#define SONAR_ECHO_DELAY        2000 // us from the trigger to the start of the echo, at most
+
+static SonarFirmata* SonarFirmataInstance;
+
+static void SONAR_ISR_ATTR sonarEchoIsr()
+{
+  SonarFirmataInstance->echoChanged();
+}
+
+SonarFirmata::SonarFirmata()
+{
+  SonarFirmataInstance = this;
+  for (byte i = 0; i < MAX_SONARS; i++) {
+    sensors[i].triggerPin = 127;
+  }
+  current = MAX_SONARS - 1; // the round robin starts with sensor 0
+  phase = SONAR_IDLE;
+  pingStart = micros() - SONAR_PING_INTERVAL;
+}
+
+void SonarFirmata::handleCapability(byte pin)
+{
+  if (IS_PIN_DIGITAL(pin)) {
+    Firmata.write(PIN_MODE_SONAR);
+    Firmata.write(1);
+  }
+}
+
+boolean SonarFirmata::handlePinMode(byte pin, int mode)
+{
+  if (mode == PIN_MODE_SONAR) {
+    // the pins are set up by SONAR_CONFIG
+    return IS_PIN_DIGITAL(pin);
+  }
+  for (byte i = 0; i < MAX_SONARS; i++) {
+    if (sensors[i].triggerPin != 127 && (sensors[i].triggerPin == pin || sensors[i].echoPin == pin)) {
+      remove(i);
+    }
+  }
+  return false;
+}
+
+boolean SonarFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != SONAR_DATA || argc < 2) {
+    return false;
+  }
+  byte sensor = argv[1];
+  if (sensor >= MAX_SONARS) {
+    Firmata.sendString(F("Invalid sonar sensor"));
+    return true;
+  }
+  switch (argv[0]) {
+    case SONAR_CONFIG:
+      if (argc < 6 || !configure(sensor, argv[2], argv[3], Firmata.decodePackedUInt14(argv + 4))) {
+        Firmata.sendString(F("Invalid sonar pins"));
+      }
+      return true;
+    case SONAR_REMOVE:
+      remove(sensor);
+      return true;
+  }
+  return false;
+}
+
+bool SonarFirmata::configure(byte sensor, byte triggerPin, byte echoPin, uint16_t maxDistance)
+{
+  if (!IS_PIN_DIGITAL(triggerPin) || !IS_PIN_DIGITAL(echoPin) ||
+      Firmata.getPinMode(triggerPin) == PIN_MODE_IGNORE || Firmata.getPinMode(echoPin) == PIN_MODE_IGNORE) {
+    return false;
+  }
+  remove(sensor);
+  sonar_sensor* s = &sensors[sensor];
+  Firmata.setPinMode(triggerPin, PIN_MODE_SONAR);
+  Firmata.setPinMode(echoPin, PIN_MODE_SONAR);
+  if (triggerPin != echoPin) {
+    pinMode(PIN_TO_DIGITAL(triggerPin), OUTPUT);
+    digitalWrite(PIN_TO_DIGITAL(triggerPin), LOW);
+  }
+  pinMode(PIN_TO_DIGITAL(echoPin), INPUT);
+  s->triggerPin = triggerPin;
+  s->echoPin = echoPin;
+  s->maxDistance = maxDistance != 0 ? maxDistance : SONAR_DEFAULT_DISTANCE;
+  s->distance = 0;
+  if (IS_PIN_INTERRUPT(echoPin)) {
+    PinInterrupts::attach(digitalPinToInterrupt(PIN_TO_DIGITAL(echoPin)), sonarEchoIsr, CHANGE, this);
+  }
+  return true;
+}
+
+void SonarFirmata::remove(byte sensor)
+{
+  sonar_sensor* s = &sensors[sensor];
+  if (s->triggerPin == 127) {
+    return;
+  }
+  if (sensor == current) {
+    phase = SONAR_IDLE;
+  }
+  if (IS_PIN_INTERRUPT(s->echoPin)) {
+    PinInterrupts::detach(digitalPinToInterrupt(PIN_TO_DIGITAL(s->echoPin)), this);
+  }
+  s->triggerPin = 127;
+}
+
+void SonarFirmata::ping(byte sensor)
+{
+  sonar_sensor* s = &sensors[sensor];
+  byte pin = PIN_TO_DIGITAL(s->triggerPin);
+  if (s->triggerPin == s->echoPin) {
+    pinMode(pin, OUTPUT);
+  }
+  // the interrupt ignores the edges of the trigger pulse while the phase is idle
+  digitalWrite(pin, HIGH);
+  delayMicroseconds(10);
+  digitalWrite(pin, LOW);
+  if (s->triggerPin == s->echoPin) {
+    pinMode(pin, INPUT);
+  }
+  current = sensor;
+  pingStart = micros();
+  phase = SONAR_WAIT_ECHO;
+}
+
+void SONAR_ISR_ATTR SonarFirmata::echoChanged()
+{
+  byte state = phase;
+  if (state != SONAR_WAIT_ECHO && state != SONAR_ECHO) {
+    return;
+  }
+  bool high = digitalRead(PIN_TO_DIGITAL(sensors[current].echoPin)) == HIGH;
+  if (state == SONAR_WAIT_ECHO && high) {
+    echoStart = micros();
+    phase = SONAR_ECHO;
+  } else if (state == SONAR_ECHO && !high) {
+    echoEnd = micros();
+    phase = SONAR_DONE;
+  }
+}
+
+void SonarFirmata::finishPing()
+{
+  sonar_sensor* s = &sensors[current];
+  unsigned long maxEcho = (unsigned long)s->maxDistance * SONAR_US_PER_CM;
+  unsigned long echo = 0;
+  if (phase == SONAR_DONE) {
+    noInterrupts();
+    echo = echoEnd - echoStart;
+    interrupts();
+  }
+  // the speed of sound is 343 m/s, half of it for the way there
+  s->distance = echo != 0 && echo <= maxEcho ? (uint16_t)(echo * 343 / 2000) : 0;
+  phase = SONAR_IDLE;
+}
+
+void SonarFirmata::report(bool elapsed)
+{
+  if (phase != SONAR_IDLE) {
+    sonar_sensor* s = &sensors[current];
+    if (!IS_PIN_INTERRUPT(s->echoPin)) {
+      echoChanged();
+    }
+    if (phase == SONAR_DONE ||
+        micros() - pingStart > (unsigned long)s->maxDistance * SONAR_US_PER_CM + SONAR_ECHO_DELAY) {
+      finishPing();
+    }
+  }
+  if (phase == SONAR_IDLE && micros() - pingStart >= SONAR_PING_INTERVAL) {
+    // round robin, the next sensor after the last one
+    for (byte i = 1; i <= MAX_SONARS; i++) {
+      byte sensor = (current + i) % MAX_SONARS;
+      if (sensors[sensor].triggerPin != 127) {
+        ping(sensor);
+        break;
+      }
+    }
+  }
+  if (elapsed) {
+    sendDistances();
+  }
+}
+
+void SonarFirmata::sendDistances()
+{
+  bool started = false;
+  for (byte i = 0; i < MAX_SONARS; i++) {
+    if (sensors[i].triggerPin == 127) {
+      continue;
+    }
+    if (!started) {
+      Firmata.beginMessage(FIRMATA_LANE_TELEMETRY, SONAR_DATA << 8 | i);
+      Firmata.startSysex();
+      Firmata.write(SONAR_DATA);
+      Firmata.write(SONAR_REPLY);
+      started = true;
+    }
+    Firmata.write(i);
+    Firmata.write(sensors[i].distance & 0x7F);
+    Firmata.write((sensors[i].distance >> 7) & 0x7F);
+#if FIRMATA_OUTPUT_QUEUE_SIZE > 0
+    // with the output queue, every sensor is a telemetry source of its own
+    Firmata.endSysex();
+    Firmata.endMessage();
+    started = false;
+#endif
+  }
+  if (started) {
+    Firmata.endSysex();
+    Firmata.endMessage();
+  }
+}
+
+void SonarFirmata::writeConfiguration(Print& out)
+{
+  for (byte i = 0; i < MAX_SONARS; i++) {
+    sonar_sensor* s = &sensors[i];
+    if (s->triggerPin == 127) {
+      continue;
+    }
+    const byte config[] = { START_SYSEX, SONAR_DATA, SONAR_CONFIG, i, s->triggerPin, s->echoPin,
+      (byte)(s->maxDistance & 0x7F), (byte)((s->maxDistance >> 7) & 0x7F), END_SYSEX };
+    out.write(config, sizeof(config));
+  }
+}
+
+void SonarFirmata::reset()
+{
+  for (byte i = 0; i < MAX_SONARS; i++) {
+    remove(i);
+  }
+  current = MAX_SONARS - 1;
+  phase = SONAR_IDLE;
+}
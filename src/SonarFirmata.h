@@ -0,0 +1,88 @@
+/*
+  SonarFirmata.h - Firmata library
+
+  HC-SR04 style ultrasonic distance sensors. The sensors are pinged one after the other, each
+  ping SONAR_PING_INTERVAL after the previous one, so that the echo of one sensor is gone before
+  the next one listens. The echo width is taken with a pin change interrupt. Echo pins without an
+  interrupt are polled once per loop, which makes the distance only as exact as the loop time.
+  Trigger and echo may be the same pin, for sensors with a single signal line.
+
+  Host -> board:
+  START_SYSEX, SONAR_DATA, SONAR_CONFIG, sensor, trigger pin, echo pin, max distance in cm (2 x 7 bit), END_SYSEX
+  START_SYSEX, SONAR_DATA, SONAR_REMOVE, sensor, END_SYSEX
+
+  Board -> host, every sampling interval:
+  START_SYSEX, SONAR_DATA, SONAR_REPLY, n x (sensor, distance in mm (2 x 7 bit), 0 = no echo), END_SYSEX
+  With the output queue (LARGE_MEM_DEVICE), every sensor comes in a message of its own.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef SonarFirmata_h
+#define SonarFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+
+// SONAR_DATA subcommands
+#define SONAR_CONFIG            0x00
+#define SONAR_REMOVE            0x01
+#define SONAR_REPLY             0x02
+
+#ifndef MAX_SONARS
+#define MAX_SONARS              6
+#endif
+#ifndef SONAR_PING_INTERVAL
+#define SONAR_PING_INTERVAL     30000 // us, the HC-SR04 gives up on an echo after about 25 ms
+#endif
+
+#ifdef ESP32
+#define SONAR_ISR_ATTR IRAM_ATTR
+#else
+#define SONAR_ISR_ATTR
+#endif
+
+class SonarFirmata: public FirmataFeature
+{
+  public:
+    SonarFirmata();
+    void handleCapability(byte pin) override;
+    boolean handlePinMode(byte pin, int mode) override;
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    boolean ownsSysexCommand(byte command) override { return command == SONAR_DATA; }
+    void reset() override;
+    void report(bool elapsed) override;
+    void writeConfiguration(Print& out) override;
+
+    // distance in mm of the last ping, 0 if there was no echo
+    uint16_t getDistance(byte sensor) { return sensors[sensor].distance; }
+    // called by the interrupt of the echo pins
+    void echoChanged();
+
+  private:
+    struct sonar_sensor {
+      byte triggerPin; // 127 = unused
+      byte echoPin;
+      uint16_t maxDistance; // cm
+      uint16_t distance; // mm
+    };
+    sonar_sensor sensors[MAX_SONARS];
+    byte current; // the sensor of the current or last ping
+    volatile byte phase;
+    volatile unsigned long echoStart;
+    volatile unsigned long echoEnd;
+    unsigned long pingStart;
+
+    bool configure(byte sensor, byte triggerPin, byte echoPin, uint16_t maxDistance);
+    void remove(byte sensor);
+    void ping(byte sensor);
+    void finishPing();
+    void sendDistances();
+};
+
+#endif
@@ -8,6 +8,12 @@
 
   See file LICENSE.txt for further informations on licensing terms.
 
+  The channel bits of a deviceIdChannel select the SPI host of the device. Each channel has its
+  own SPIClass, so a chunked transfer that holds one bus doesn't stop the continuous reads on
+  another. Channel 0 is the global SPI, channel 1 is HSPI on the ESP32, setChannel() installs
+  any other SPIClass. SPI_BEGIN takes the pins of the host as optional arguments:
+  START_SYSEX, SPI_DATA, SPI_BEGIN, channel [, SCK pin, MISO pin, MOSI pin], END_SYSEX
+  The pins are 127 for the default pins. Only the ESP32 routes a host to any other pins.
 */
 
 #ifndef SpiFirmata_h
@@ -28,19 +34,37 @@
 #define SPI_REPLY               0x05
 #define SPI_END                 0x06
 #define SPI_WRITE_ACK           0x07
+#define SPI_READ_CONTINUOUSLY   0x08 // Repeat a transfer at a given interval and report the results
+#define SPI_STOP_READING        0x09 // Stop a continuous transfer
 
 #define SPI_SEND_NO_REPLY 0
 #define SPI_SEND_NORMAL_REPLY 1
 #define SPI_SEND_EMPTY_REPLY 2
 
 #define SPI_MAX_DEVICES 8
-#define MAX_SPI_BUF_SIZE 32
+#define SPI_DEFAULT_PIN 127
+#if defined(ESP32) && defined(HSPI)
+#define SPI_SECOND_HOST HSPI // the host of channel 1
+#endif
+#ifndef SPI_MAX_CHANNELS
+#ifdef SPI_SECOND_HOST
+#define SPI_MAX_CHANNELS 2
+#else
+#define SPI_MAX_CHANNELS 1
+#endif
+#endif
+#define MAX_SPI_BUF_SIZE 32 // max size of the transfer of a continuous job
+#ifdef LARGE_MEM_DEVICE
+#define SPI_MAX_JOBS 8
+#else
+#define SPI_MAX_JOBS 2
+#endif
 
 /* Spi data */
 struct spi_device_config {
   byte deviceIdChannel;
   byte csPinOptions;
-  byte csPin;
+  int csPin; // -1 if CS is not handled by us
   boolean packedData;
   SPISettings spi_settings;
   boolean used;
@@ -56,6 +80,27 @@ public:
 	}
 };
 
+/* An SPI host and the device that holds it */
+struct spi_channel {
+  SPIClass* spi; // NULL if the channel isn't available
+  boolean enabled;
+  byte sckPin; // SPI_DEFAULT_PIN or the pin the host is routed to
+  byte misoPin;
+  byte mosiPin;
+  // Index of the device whose CS is held active by a chunked transfer (and that owns the bus), -1 if none
+  int activeTransferIndex;
+};
+
+/* A transfer that is repeated periodically */
+struct spi_job {
+  int configIndex; // -1 if unused
+  byte requestId;
+  unsigned int period; // in ms, 0 = at the sampling interval
+  unsigned long lastRun;
+  byte length;
+  byte data[MAX_SPI_BUF_SIZE];
+};
+
 class SpiFirmata: public FirmataFeature
 {
   public:
@@ -63,45 +108,105 @@ class SpiFirmata: public FirmataFeature
     boolean handlePinMode(byte pin, int mode);
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
+    boolean ownsSysexCommand(byte command) override { return command == SPI_DATA; }
     void reset();
-    void report();
+    void report(bool elapsed) override;
+    boolean canWriteConfiguration() override;
+    // an SPIClass for a channel, e.g. a third host. The host enables it with SPI_BEGIN.
+    void setChannel(byte channel, SPIClass* spi);
 
   private:
     void handleSpiRequest(byte command, byte argc, byte *argv);
 	boolean handleSpiBegin(byte argc, byte *argv);
     boolean handleSpiConfig(byte argc, byte *argv);
-    boolean enableSpiPins();
+    boolean enableSpiPins(byte channel);
 	void handleSpiTransfer(byte argc, byte *argv, boolean dummySend, int sendReply);
-    void disableSpiPins();
+    void disableSpiPins(byte channel);
+	bool usesPin(byte channel, byte pin);
 	int getConfigIndexForDevice(byte deviceIdChannel);
+	spi_channel& channelOf(int index) { return channels[config[index].deviceIdChannel & 0x3]; }
+	void endActiveTransfer(spi_channel& channel);
+	int decodeTransferData(int index, byte argc, byte *argv, byte *data, int maxLength);
+	void sendSpiReply(int index, byte requestId, byte *data, int length);
+	void handleSpiReadContinuously(byte argc, byte *argv);
+	void handleSpiStopReading(byte argc, byte *argv);
+	void runJob(spi_job& job);
+	void clearJobs();
+
+	spi_job jobs[SPI_MAX_JOBS];
 	
     spi_device_config config[SPI_MAX_DEVICES];
-	bool isSpiEnabled;
+	spi_channel channels[SPI_MAX_CHANNELS];
+#if defined(SPI_SECOND_HOST) && SPI_MAX_CHANNELS > 1
+	SPIClass secondHost;
+#endif
 };
 
 
 SpiFirmata::SpiFirmata()
+#if defined(SPI_SECOND_HOST) && SPI_MAX_CHANNELS > 1
+  : secondHost(SPI_SECOND_HOST)
+#endif
 {
-  isSpiEnabled = false;
+  for (int i = 0; i < SPI_MAX_CHANNELS; i++) {
+    channels[i].spi = NULL;
+    channels[i].enabled = false;
+    channels[i].sckPin = SPI_DEFAULT_PIN;
+    channels[i].misoPin = SPI_DEFAULT_PIN;
+    channels[i].mosiPin = SPI_DEFAULT_PIN;
+    channels[i].activeTransferIndex = -1;
+  }
+  channels[0].spi = &SPI;
+#if defined(SPI_SECOND_HOST) && SPI_MAX_CHANNELS > 1
+  channels[1].spi = &secondHost;
+#endif
   for (int i = 0; i < SPI_MAX_DEVICES; i++) {
     config[i].deviceIdChannel = -1;
 	config[i].csPin = -1;
     config[i].used = false;
 	config[i].packedData = false;
   }
+  clearJobs();
+}
+
+void SpiFirmata::setChannel(byte channel, SPIClass* spi)
+{
+  if (channel >= SPI_MAX_CHANNELS) {
+    return;
+  }
+  if (channels[channel].enabled) {
+    disableSpiPins(channel);
+  }
+  channels[channel].spi = spi;
+}
+
+void SpiFirmata::clearJobs()
+{
+  for (int i = 0; i < SPI_MAX_JOBS; i++) {
+    jobs[i].configIndex = -1;
+  }
+}
+
+bool SpiFirmata::usesPin(byte channel, byte pin)
+{
+  spi_channel& ch = channels[channel];
+  if (ch.sckPin == SPI_DEFAULT_PIN) {
+    // the default pins of other channels than SPI are not known
+    return channel == 0 && IS_PIN_SPI(pin);
+  }
+  return pin == ch.sckPin || pin == ch.misoPin || pin == ch.mosiPin;
 }
 
 boolean SpiFirmata::handlePinMode(byte pin, int mode)
 {
-  if (IS_PIN_SPI(pin)) {
-    if (mode == PIN_MODE_SPI) {
-      return true;
-    } else if (isSpiEnabled) {
-      // disable Spi so pins can be used for other functions
-      // the following if statements should reconfigure the pins properly
-      if (Firmata.getPinMode(pin) == PIN_MODE_SPI) {
-        disableSpiPins();
-      }
+  if (mode == PIN_MODE_SPI) {
+    return IS_PIN_SPI(pin);
+  }
+  for (byte i = 0; i < SPI_MAX_CHANNELS; i++) {
+    // disable Spi so pins can be used for other functions
+    // the following if statements should reconfigure the pins properly
+    if (channels[i].enabled && usesPin(i, pin) && Firmata.getPinMode(pin) == PIN_MODE_SPI) {
+      disableSpiPins(i);
     }
   }
   return false;
@@ -121,7 +226,7 @@ boolean SpiFirmata::handleSysex(byte command, byte argc, byte *argv)
     case SPI_DATA:
 		  if (argc < 1)
 		  {
-			  Firmata.sendString(F("Error in SPI_DATA command: empty message"));
+			  Firmata.sendEvent(EVENT_SPI_EMPTY_MESSAGE, F("Error in SPI_DATA command: empty message"));
 			  return false;
 		  }
         handleSpiRequest(argv[0], argc - 1, argv + 1);
@@ -140,7 +245,12 @@ void SpiFirmata::handleSpiRequest(byte command, byte argc, byte *argv)
 	    handleSpiConfig(argc, argv);
 		break;
 	  case SPI_END:
-	    disableSpiPins();
+	    // without a channel, all channels are ended
+	    for (byte i = 0; i < SPI_MAX_CHANNELS; i++) {
+	      if (channels[i].enabled && (argc == 0 || argv[0] == i)) {
+	        disableSpiPins(i);
+	      }
+	    }
 		break;
 	  case SPI_READ:
 	    handleSpiTransfer(argc, argv, true, SPI_SEND_NORMAL_REPLY);
@@ -154,55 +264,55 @@ void SpiFirmata::handleSpiRequest(byte command, byte argc, byte *argv)
 	  case SPI_TRANSFER:
 	    handleSpiTransfer(argc, argv, false, SPI_SEND_NORMAL_REPLY);
 		break;
+	  case SPI_READ_CONTINUOUSLY:
+		  handleSpiReadContinuously(argc, argv);
+		  break;
+	  case SPI_STOP_READING:
+		  handleSpiStopReading(argc, argv);
+		  break;
 	  default:
-	    Firmata.sendString(F("Unknown SPI command: "), command);
+	    Firmata.sendEvent(EVENT_SPI_UNKNOWN_COMMAND, F("Unknown SPI command: "), command);
 		break;
   }
 }
 
 void SpiFirmata::handleSpiTransfer(byte argc, byte *argv, boolean dummySend, int sendReply)
 {
-	if (!isSpiEnabled)
-	{
-		Firmata.sendString(F("SPI not enabled."));
-		return;
-	}
 	byte data[MAX_DATA_BYTES];
 	// Make sure we have enough data. No data bytes is only allowed in read-only mode
 	if (dummySend ? argc < 4 : argc < 6) {
-		Firmata.sendString(F("Not enough data in SPI message"));
+		Firmata.sendEvent(EVENT_SPI_MESSAGE_TOO_SHORT, F("Not enough data in SPI message"));
 		return;
 	}
 	
 	int index = getConfigIndexForDevice(argv[0]);
 	if (index < 0) {
-		Firmata.sendString(F("SPI_TRANSFER: Unknown deviceId specified: "), argv[0]);
+		Firmata.sendEvent(EVENT_SPI_UNKNOWN_DEVICE, F("SPI: Unknown deviceId specified: "), argv[0]);
+		return;
+	}
+	spi_channel& channel = channelOf(index);
+	if (!channel.enabled)
+	{
+		Firmata.sendEvent(EVENT_SPI_NOT_ENABLED, F("SPI not enabled."));
 		return;
 	}
 	
 	int bytesToSend = 0;
 	// In read-only mode set buffer to 0, otherwise fill buffer from request
 	if (dummySend) {
+		if (argv[3] > MAX_DATA_BYTES)
+		{
+			Firmata.sendEvent(EVENT_SPI_READ_TOO_LONG, F("SPI_READ: Too many bytes requested"));
+			return;
+		}
 		memset(data, 0, argv[3]);
 		bytesToSend = argv[3];
 	} else 
 	{
-		if (config[index].packedData)
-		{
-			bytesToSend = num7BitOutbytes(argc - 4);
-			if (bytesToSend > MAX_DATA_BYTES)
-			{
-				Firmata.sendString(F("SPI_TRANSFER: Send buffer not large enough"));
-				return;
-			}
-			Encoder7BitClass::readBinary(bytesToSend, argv + 4, data);
-		}
-		else
+		bytesToSend = decodeTransferData(index, argc - 4, argv + 4, data, MAX_DATA_BYTES);
+		if (bytesToSend < 0)
 		{
-			for (byte i = 4; i < argc; i += 2) 
-			{
-				data[bytesToSend++] = argv[i] + (argv[i + 1] << 7);
-			}
+			return;
 		}
 	}
 
@@ -220,51 +330,176 @@ void SpiFirmata::handleSpiTransfer(byte argc, byte *argv, boolean dummySend, int
 		Firmata.write(reply, 7);
 	}
 
-	if (config[index].csPin != -1)
+	// A transfer that doesn't deselect the device is continued by the following messages for the same device. CS and the
+	// bus stay with the device until a message deselects it, so large transfers can be split into several chunks.
+	if (channel.activeTransferIndex != index)
 	{
-		digitalWrite(config[index].csPin, LOW);
+		endActiveTransfer(channel);
+		channel.spi->beginTransaction(config[index].spi_settings);
+		if (config[index].csPin != -1)
+		{
+			digitalWrite(config[index].csPin, LOW);
+		}
+		channel.activeTransferIndex = index;
 	}
 
-	SPI.beginTransaction(config[index].spi_settings);
-	SPI.transfer(data, bytesToSend);
-	SPI.endTransaction();
+	channel.spi->transfer(data, bytesToSend);
 	if (argv[2] != 0)
 	{
 		// Default is deselect, so only skip this if the value is 0
-		digitalWrite(config[index].csPin, HIGH);
+		endActiveTransfer(channel);
 	}
 	if (sendReply == SPI_SEND_NORMAL_REPLY) {
-	  Firmata.startSysex();
-	  Firmata.write(SPI_DATA);
-	  Firmata.write(SPI_REPLY);
-	  Firmata.write(argv[0]);
-	  Firmata.write(argv[1]);
-	  Firmata.write((byte)bytesToSend); // the bytes received is always equal to the bytes sent for SPI
-		if (config[index].packedData)
+	  sendSpiReply(index, argv[1], data, bytesToSend);
+	}
+}
+
+/// <summary>
+/// Decodes the data bytes of a transfer request, either packed or as 2 x 7 bit per byte, depending on the device configuration
+/// </summary>
+/// <returns>The number of bytes decoded, -1 if they don't fit into the buffer</returns>
+int SpiFirmata::decodeTransferData(int index, byte argc, byte *argv, byte *data, int maxLength)
+{
+	int length = 0;
+	if (config[index].packedData)
+	{
+		length = num7BitOutbytes(argc);
+		if (length > maxLength)
 		{
-			Encoder7BitClass encoder;
-			encoder.startBinaryWrite();
-			for (int i = 0; i < bytesToSend; i++) 
-			{
-				encoder.writeBinary(data[i]);
-			}
-			encoder.endBinaryWrite();
+			Firmata.sendEvent(EVENT_SPI_BUFFER_TOO_SMALL, F("SPI_TRANSFER: Send buffer not large enough"));
+			return -1;
+		}
+		Encoder7BitClass::readBinary(length, argv, data);
+	}
+	else
+	{
+		if (argc / 2 > maxLength)
+		{
+			Firmata.sendEvent(EVENT_SPI_BUFFER_TOO_SMALL, F("SPI_TRANSFER: Send buffer not large enough"));
+			return -1;
 		}
-		else
+		for (byte i = 0; i + 1 < argc; i += 2)
 		{
-			for (int i = 0; i < bytesToSend; i++)
-			{
-				Firmata.sendValueAsTwo7bitBytes(data[i]);
-			}
+			data[length++] = argv[i] + (argv[i + 1] << 7);
 		}
-	  Firmata.endSysex();
 	}
+	return length;
+}
+
+void SpiFirmata::sendSpiReply(int index, byte requestId, byte *data, int length)
+{
+	Firmata.startSysex();
+	Firmata.write(SPI_DATA);
+	Firmata.write(SPI_REPLY);
+	Firmata.write(config[index].deviceIdChannel);
+	Firmata.write(requestId);
+	Firmata.write((byte)length); // the bytes received is always equal to the bytes sent for SPI
+	if (config[index].packedData)
+	{
+		Encoder7BitClass encoder;
+		encoder.startBinaryWrite();
+		encoder.writeBinary(data, length);
+		encoder.endBinaryWrite();
+	}
+	else
+	{
+		for (int i = 0; i < length; i++)
+		{
+			Firmata.sendValueAsTwo7bitBytes(data[i]);
+		}
+	}
+	Firmata.endSysex();
+}
+
+/// <summary>
+/// Stores a transfer that is repeated every period ms (or at the sampling interval, if 0). Each run sends an SPI_REPLY.
+/// Format: deviceId, requestId, period (2 x 7 bit), data (as for SPI_TRANSFER).
+/// A job with the same deviceId and requestId replaces the existing one.
+/// </summary>
+void SpiFirmata::handleSpiReadContinuously(byte argc, byte *argv)
+{
+	if (argc < 6) {
+		Firmata.sendEvent(EVENT_SPI_MESSAGE_TOO_SHORT, F("Not enough data in SPI message"));
+		return;
+	}
+	int index = getConfigIndexForDevice(argv[0]);
+	if (index < 0) {
+		Firmata.sendEvent(EVENT_SPI_UNKNOWN_DEVICE, F("SPI: Unknown deviceId specified: "), argv[0]);
+		return;
+	}
+	if (!channelOf(index).enabled)
+	{
+		Firmata.sendEvent(EVENT_SPI_NOT_ENABLED, F("SPI not enabled."));
+		return;
+	}
+	spi_job* job = nullptr;
+	for (int i = 0; i < SPI_MAX_JOBS; i++) {
+		if (jobs[i].configIndex == index && jobs[i].requestId == argv[1]) {
+			job = &jobs[i];
+			break;
+		}
+		if (job == nullptr && jobs[i].configIndex == -1) {
+			job = &jobs[i];
+		}
+	}
+	if (job == nullptr) {
+		Firmata.sendEvent(EVENT_SPI_TOO_MANY_JOBS, F("SPI_READ_CONTINUOUSLY: Max number of jobs exceeded"));
+		return;
+	}
+	int length = decodeTransferData(index, argc - 4, argv + 4, job->data, MAX_SPI_BUF_SIZE);
+	if (length < 0)
+	{
+		job->configIndex = -1;
+		return;
+	}
+	job->configIndex = index;
+	job->requestId = argv[1];
+	job->period = argv[2] + (argv[3] << 7);
+	job->lastRun = millis();
+	job->length = (byte)length;
+}
+
+/// <summary>
+/// Stops the job with the given deviceId and requestId, or all jobs of the device if the requestId is 0x7F
+/// </summary>
+void SpiFirmata::handleSpiStopReading(byte argc, byte *argv)
+{
+	if (argc < 2) {
+		Firmata.sendEvent(EVENT_SPI_MESSAGE_TOO_SHORT, F("Not enough data in SPI message"));
+		return;
+	}
+	int index = getConfigIndexForDevice(argv[0]);
+	for (int i = 0; i < SPI_MAX_JOBS; i++) {
+		if (index >= 0 && jobs[i].configIndex == index && (argv[1] == 0x7F || jobs[i].requestId == argv[1])) {
+			jobs[i].configIndex = -1;
+		}
+	}
+}
+
+void SpiFirmata::runJob(spi_job& job)
+{
+	spi_device_config& cfg = config[job.configIndex];
+	SPIClass* spi = channelOf(job.configIndex).spi;
+	byte data[MAX_SPI_BUF_SIZE];
+	memcpy(data, job.data, job.length);
+	spi->beginTransaction(cfg.spi_settings);
+	if (cfg.csPin != -1)
+	{
+		digitalWrite(cfg.csPin, LOW);
+	}
+	spi->transfer(data, job.length);
+	if (cfg.csPin != -1)
+	{
+		digitalWrite(cfg.csPin, HIGH);
+	}
+	spi->endTransaction();
+	sendSpiReply(job.configIndex, job.requestId, data, job.length);
 }
 
 boolean SpiFirmata::handleSpiConfig(byte argc, byte* argv)
 {
 	if (argc < 10) {
-		Firmata.sendString(F("Not enough data in SPI_DEVICE_CONFIG message"));
+		Firmata.sendEvent(EVENT_SPI_CONFIG_TOO_SHORT, F("Not enough data in SPI_DEVICE_CONFIG message"));
 		return false;
 	}
 
@@ -285,21 +520,22 @@ boolean SpiFirmata::handleSpiConfig(byte argc, byte* argv)
 	}
 	if (index == -1)
 	{
-		Firmata.sendString(F("SPI_DEVICE_CONFIG: Max number of devices exceeded"));
+		Firmata.sendEvent(EVENT_SPI_TOO_MANY_DEVICES, F("SPI_DEVICE_CONFIG: Max number of devices exceeded"));
 		return false;
 	}
 
 	// Check word size. Must be 0 (default) or 8.
 	if (argv[7] != 0 && argv[7] != 8)
 	{
-		Firmata.sendString(F("SPI_DEVICE_CONFIG: Only 8 bit words supported"));
+		Firmata.sendEvent(EVENT_SPI_WORD_SIZE, F("SPI_DEVICE_CONFIG: Only 8 bit words supported"));
 		return false;
 	}
 
 	byte deviceIdChannel = argv[0];
-	if ((deviceIdChannel & 0x3) != 0)
+	byte channel = deviceIdChannel & 0x3;
+	if (channel >= SPI_MAX_CHANNELS || channels[channel].spi == NULL)
 	{
-		Firmata.sendString(F("SPI_DEVICE_CONFIG: Only channel 0 supported: "), deviceIdChannel);
+		Firmata.sendEvent(EVENT_SPI_CHANNEL, F("SPI: Unsupported channel: "), channel);
 		return false;
 	}
 
@@ -327,10 +563,25 @@ boolean SpiFirmata::handleSpiConfig(byte argc, byte* argv)
 		pinMode(cfg.csPin, OUTPUT);
 	}
 
-	Firmata.sendStringf(F("New SPI device %d allocated with index %d and CS %d, clock speed %d Hz"), deviceIdChannel, index, config[index].csPin, speed);
+	uint32_t info[4] = { deviceIdChannel, (uint32_t)index, (byte)cfg.csPin, speed }; // a CS pin of 255 means none
+	Firmata.sendEvent(EVENT_SPI_DEVICE_CONFIGURED, F("New SPI device (device id, index, CS pin, clock speed in Hz): "), 4, info);
 	return true;
 }
 
+void SpiFirmata::endActiveTransfer(spi_channel& channel)
+{
+	if (channel.activeTransferIndex < 0)
+	{
+		return;
+	}
+	if (config[channel.activeTransferIndex].csPin != -1)
+	{
+		digitalWrite(config[channel.activeTransferIndex].csPin, HIGH);
+	}
+	channel.spi->endTransaction();
+	channel.activeTransferIndex = -1;
+}
+
 int SpiFirmata::getConfigIndexForDevice(byte deviceIdChannel)
 {
   for (int i = 0; i < SPI_MAX_DEVICES; i++) {
@@ -343,27 +594,66 @@ int SpiFirmata::getConfigIndexForDevice(byte deviceIdChannel)
 
 boolean SpiFirmata::handleSpiBegin(byte argc, byte *argv)
 {
-  if (!isSpiEnabled) {
-	  // Only channel 0 supported
-    if (argc != 1 || *argv != 0) {
-		Firmata.sendString(F("SPI_BEGIN: Only channel 0 supported"));
-		return false;
-	}
+  byte channel = argc > 0 ? argv[0] : 0;
+  if (argc < 1 || channel >= SPI_MAX_CHANNELS || channels[channel].spi == NULL) {
+    Firmata.sendEvent(EVENT_SPI_CHANNEL, F("SPI: Unsupported channel: "), channel);
+    return false;
+  }
+  spi_channel& ch = channels[channel];
+  if (argc >= 4 && (argv[1] != ch.sckPin || argv[2] != ch.misoPin || argv[3] != ch.mosiPin)) {
+    // the host moves to other pins
+    if (ch.enabled) {
+      disableSpiPins(channel);
+    }
+    ch.sckPin = argv[1];
+    ch.misoPin = argv[2];
+    ch.mosiPin = argv[3];
+  }
 
-  	if (!enableSpiPins())
+  if (!ch.enabled) {
+  	if (!enableSpiPins(channel))
   	{
-		Firmata.sendString(F("Error enabling SPI mode"));
+		Firmata.sendEvent(EVENT_SPI_PIN_ERROR, F("Error enabling SPI mode"));
 		return false;
   	}
 
-	SPI.begin();
-	Firmata.sendString(F("SPI.begin()"));
+#ifdef ESP32
+	if (ch.sckPin != SPI_DEFAULT_PIN) {
+	  ch.spi->begin(PIN_TO_DIGITAL(ch.sckPin), PIN_TO_DIGITAL(ch.misoPin), PIN_TO_DIGITAL(ch.mosiPin));
+	}
+	else
+#endif
+	{
+	  ch.spi->begin();
+	}
+	Firmata.sendEvent(EVENT_SPI_BEGIN, F("SPI.begin()"));
   }
-  return isSpiEnabled;
+  return ch.enabled;
 }
 
-boolean SpiFirmata::enableSpiPins()
+boolean SpiFirmata::enableSpiPins(byte channel)
 {
+  spi_channel& ch = channels[channel];
+  if (ch.sckPin != SPI_DEFAULT_PIN) {
+    byte pins[3] = { ch.sckPin, ch.misoPin, ch.mosiPin };
+    for (byte i = 0; i < 3; i++) {
+      if (!IS_PIN_DIGITAL(pins[i]) || Firmata.getPinMode(pins[i]) == PIN_MODE_IGNORE) {
+        return false;
+      }
+    }
+    // the pins are configured by begin()
+    for (byte i = 0; i < 3; i++) {
+      Firmata.setPinMode(pins[i], PIN_MODE_SPI);
+    }
+    ch.enabled = true;
+    return true;
+  }
+  if (channel != 0) {
+    // the default pins of other hosts are not known, they are not marked
+    ch.enabled = true;
+    return true;
+  }
+
   if (Firmata.getPinMode(PIN_SPI_MISO) == PIN_MODE_IGNORE) {
         return false;
   }
@@ -385,27 +675,67 @@ boolean SpiFirmata::enableSpiPins()
   Firmata.setPinMode(PIN_SPI_SCK, PIN_MODE_SPI);
   pinMode(PIN_SPI_SCK, OUTPUT);
   
-  isSpiEnabled = true;
+  ch.enabled = true;
   return true;
 }
 
-/* disable the Spi pins so they can be used for other functions */
-void SpiFirmata::disableSpiPins()
+/* disable the Spi pins of a channel so they can be used for other functions */
+void SpiFirmata::disableSpiPins(byte channel)
+{
+  spi_channel& ch = channels[channel];
+  endActiveTransfer(ch);
+  // stop the continuous reads of the devices on the channel
+  for (int i = 0; i < SPI_MAX_JOBS; i++) {
+    if (jobs[i].configIndex >= 0 && &channelOf(jobs[i].configIndex) == &ch) {
+      jobs[i].configIndex = -1;
+    }
+  }
+  ch.enabled = false;
+  ch.spi->end();
+  Firmata.sendEvent(EVENT_SPI_END, F("SPI.end()"));
+}
+
+// the devices and jobs are not saved in the boot configuration
+boolean SpiFirmata::canWriteConfiguration()
 {
-  isSpiEnabled = false;
-  SPI.end();
-  Firmata.sendString(F("SPI.end()"));
+  for (int i = 0; i < SPI_MAX_CHANNELS; i++) {
+    if (channels[i].enabled) {
+      return false;
+    }
+  }
+  return true;
 }
 
 void SpiFirmata::reset()
 {
-  if (isSpiEnabled) {
-    disableSpiPins();
+  for (byte i = 0; i < SPI_MAX_CHANNELS; i++) {
+    if (channels[i].enabled) {
+      disableSpiPins(i);
+    }
+    channels[i].sckPin = SPI_DEFAULT_PIN;
+    channels[i].misoPin = SPI_DEFAULT_PIN;
+    channels[i].mosiPin = SPI_DEFAULT_PIN;
   }
 }
 
-void SpiFirmata::report()
+void SpiFirmata::report(bool elapsed)
 {
+  unsigned long now = millis();
+  for (int i = 0; i < SPI_MAX_JOBS; i++) {
+    spi_job& job = jobs[i];
+    if (job.configIndex < 0) {
+      continue;
+    }
+    // Don't interrupt a chunked transfer that holds the bus. The other buses go on.
+    spi_channel& channel = channelOf(job.configIndex);
+    if (!channel.enabled || channel.activeTransferIndex >= 0) {
+      continue;
+    }
+    if (job.period == 0 ? elapsed : now - job.lastRun >= job.period) {
+      job.lastRun = now;
+      runJob(job);
+    }
+  }
 }
 
 #endif /* SpiFirmata_h */
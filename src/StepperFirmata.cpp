@@ -18,6 +18,7 @@
 #include <ConfigurableFirmata.h>
 #include "StepperFirmata.h"
 #include "utility/FirmataStepper.h"
+#include "FirmataArena.h"
 
 boolean StepperFirmata::handlePinMode(byte pin, int mode)
 {
@@ -75,8 +76,10 @@ boolean StepperFirmata::handleSysex(byte command, byte argc, byte *argv)
         if (!stepper[deviceNum]) {
           numSteppers++;
         }
+        FirmataArena.destroy(stepper[deviceNum]);
+        stepper[deviceNum] = NULL;
         if (interfaceType == FirmataStepper::DRIVER || interfaceType == FirmataStepper::TWO_WIRE) {
-          stepper[deviceNum] = new FirmataStepper(interface, stepsPerRev, directionPin, stepPin);
+          stepper[deviceNum] = FirmataArena.create<FirmataStepper>(interface, stepsPerRev, directionPin, stepPin);
         } else if (interfaceType == FirmataStepper::FOUR_WIRE) {
           motorPin3 = argv[7];
           motorPin4 = argv[8];
@@ -84,7 +87,7 @@ boolean StepperFirmata::handleSysex(byte command, byte argc, byte *argv)
             return false;
           Firmata.setPinMode(motorPin3, PIN_MODE_STEPPER);
           Firmata.setPinMode(motorPin4, PIN_MODE_STEPPER);
-          stepper[deviceNum] = new FirmataStepper(interface, stepsPerRev, directionPin, stepPin, motorPin3, motorPin4);
+          stepper[deviceNum] = FirmataArena.create<FirmataStepper>(interface, stepsPerRev, directionPin, stepPin, motorPin3, motorPin4);
         }
       }
       else if (stepCommand == STEPPER_STEP) {
@@ -121,7 +124,7 @@ void StepperFirmata::reset()
 {
   for (byte i = 0; i < MAX_STEPPERS; i++) {
     if (stepper[i]) {
-      free(stepper[i]);
+      FirmataArena.destroy(stepper[i]);
       stepper[i] = 0;
     }
   }
@@ -30,6 +30,7 @@ class StepperFirmata: public FirmataFeature
     boolean handlePinMode(byte pin, int mode);
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte *argv);
+    boolean ownsSysexCommand(byte command) override { return command == STEPPER_DATA; }
     void update();
     void reset();
   private:
@@ -0,0 +1,209 @@
+/*
+  UdpStream.h
+  An Arduino-Stream that sends its output as UDP datagrams. It wraps any
+  instance of UDP, e.g. a WiFiUDP or an EthernetUDP, so it can be used
+  with both the WiFi and the Ethernet libraries.
+
+  Every flush of the stream sends the complete Firmata messages collected
+  so far as one datagram, a message that is still being written is kept
+  for the next one. So a lost datagram never leaves the host with half a
+  message. Only a single message larger than a datagram is split.
+  Each datagram starts with a 14 bit sequence number (two 7 bit bytes,
+  LSB first) so the host can detect lost datagrams, followed by plain
+  Firmata messages. Incoming datagrams carry plain Firmata messages
+  without a header.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+ */
+
+#ifndef UDPSTREAM_H
+#define UDPSTREAM_H
+
+#include <inttypes.h>
+#include <Stream.h>
+#include <Udp.h>
+
+// Maximum size of an outgoing datagram, including the header. Larger output is split
+// into several datagrams.
+#ifndef UDP_STREAM_PACKET_SIZE
+#define UDP_STREAM_PACKET_SIZE 512
+#endif
+
+#define UDP_STREAM_HEADER_SIZE 2
+
+class UdpStream : public Stream
+{
+  public:
+    /**
+     * Create a UDP stream. If no remote address is given, output is sent to the sender of
+     * the last datagram received.
+     */
+    UdpStream(UDP &udp, uint16_t localPort, IPAddress remoteIp = IPAddress(), uint16_t remotePort = 0)
+      : udp(udp),
+        localPort(localPort),
+        remoteIp(remoteIp),
+        remotePort(remotePort)
+    {
+    }
+
+    /**
+     * Start listening on the local port. Call this after the network is up.
+     */
+    inline bool begin()
+    {
+      started = udp.begin(localPort) != 0;
+      return started;
+    }
+
+    inline int available()
+    {
+      if (!started)
+        return 0;
+      int bytes = udp.available();
+      if (bytes > 0)
+        return bytes;
+      // current datagram consumed, look for the next one
+      if (udp.parsePacket() <= 0)
+        return 0;
+      if (!fixedRemote) {
+        remoteIp = udp.remoteIP();
+        remotePort = udp.remotePort();
+        hasRemote = true;
+      }
+      return udp.available();
+    }
+
+    inline int read()
+    {
+      return available() > 0 ? udp.read() : -1;
+    }
+
+    inline int peek()
+    {
+      return available() > 0 ? udp.peek() : -1;
+    }
+
+    /**
+     * Send the buffered complete messages as one datagram.
+     */
+    inline void flush()
+    {
+      send(messageEnd);
+    }
+
+    inline size_t write(uint8_t c)
+    {
+      if (txLength == UDP_STREAM_PACKET_SIZE) {
+        // a message that fills a whole datagram by itself has to be split
+        send(messageEnd > UDP_STREAM_HEADER_SIZE ? messageEnd : txLength);
+      }
+      buffer[txLength++] = c;
+      trackMessage(c);
+      return 1;
+    }
+
+    inline size_t write(const uint8_t *buf, size_t size)
+    {
+      for (size_t i = 0; i < size; i++) {
+        write(buf[i]);
+      }
+      return size;
+    }
+
+    /**
+     * @return sequence number of the next datagram
+     */
+    inline uint16_t getSequence()
+    {
+      return sequence & 0x3FFF;
+    }
+
+  private:
+    /**
+     * Send the first length bytes of the buffer, the rest moves to the next datagram.
+     */
+    void send(size_t length)
+    {
+      if (length == UDP_STREAM_HEADER_SIZE)
+        return;
+      if (started && hasRemote) {
+        buffer[0] = sequence & 0x7F;
+        buffer[1] = (sequence >> 7) & 0x7F;
+        sequence++;
+        udp.beginPacket(remoteIp, remotePort);
+        udp.write(buffer, length);
+        udp.endPacket();
+      }
+      memmove(buffer + UDP_STREAM_HEADER_SIZE, buffer + length, txLength - length);
+      txLength -= length - UDP_STREAM_HEADER_SIZE;
+      messageEnd = UDP_STREAM_HEADER_SIZE;
+    }
+
+    /**
+     * Follow the message framing of the output, messageEnd is set after every complete message.
+     */
+    void trackMessage(uint8_t c)
+    {
+      if (c == 0xF0) { // START_SYSEX
+        inSysex = true;
+        return;
+      }
+      if (c == 0xF7) { // END_SYSEX
+        inSysex = false;
+        messageEnd = txLength;
+        return;
+      }
+      if (c & 0x80) {
+        inSysex = false;
+        dataPending = messageDataLength(c);
+      } else if (inSysex || dataPending == 0) {
+        return;
+      } else {
+        dataPending--;
+      }
+      if (dataPending == 0)
+        messageEnd = txLength;
+    }
+
+    static uint8_t messageDataLength(uint8_t command)
+    {
+      if (command < 0xC0 || (command >= 0xE0 && command < 0xF0))
+        return 2; // digital and analog messages, MIDI note and control messages
+      if (command < 0xE0)
+        return 1; // report analog and digital
+      switch (command) {
+        case 0xF2:
+        case 0xF4: // SET_PIN_MODE
+        case 0xF5: // SET_DIGITAL_PIN_VALUE
+        case 0xF9: // REPORT_VERSION
+          return 2;
+        case 0xF1:
+        case 0xF3:
+          return 1;
+        default:
+          return 0;
+      }
+    }
+
+    UDP &udp;
+    uint16_t localPort;
+    IPAddress remoteIp;
+    uint16_t remotePort;
+    const bool fixedRemote = remotePort != 0;
+    bool hasRemote = fixedRemote;
+    bool started = false;
+    uint16_t sequence = 0;
+    size_t txLength = UDP_STREAM_HEADER_SIZE;
+    // end of the last complete message in the buffer
+    size_t messageEnd = UDP_STREAM_HEADER_SIZE;
+    bool inSysex = false;
+    uint8_t dataPending = 0;
+    uint8_t buffer[UDP_STREAM_PACKET_SIZE];
+};
+
+#endif /* UDPSTREAM_H */
@@ -38,7 +38,7 @@ void AccelStepper::move(long relative)
 // Implements steps according to the current step interval
 // You must call this at least once per step
 // returns true if a step occurred
-boolean AccelStepper::runSpeed()
+boolean ACCELSTEPPER_ISR_ATTR AccelStepper::runSpeed()
 {
     // Dont do anything unless we actually have a step interval
     if (!_stepInterval)
@@ -69,7 +69,7 @@ boolean AccelStepper::runSpeed()
     }
 }
 
-long AccelStepper::distanceToGo()
+long ACCELSTEPPER_ISR_ATTR AccelStepper::distanceToGo()
 {
     return _targetPos - _currentPos;
 }
@@ -94,6 +94,74 @@ void AccelStepper::setCurrentPosition(long position)
     _speed = 0.0;
 }
 
+#if ACCELSTEPPER_FIXED_POINT
+long AccelStepper::stepsToStop()
+{
+    // While accelerating from standstill, equation 16 gives n steps to stop again, so
+    // there is no need to compute it from the speed. At maxSpeed, n keeps counting up.
+    if (_n < 0)
+	return -_n;
+    return min(_n, _maxStopSteps);
+}
+
+void AccelStepper::computeNewSpeed()
+{
+    long distanceTo = distanceToGo(); // +ve is clockwise from curent location
+
+    long stepsToStop = this->stepsToStop();
+
+    if (distanceTo == 0 && stepsToStop <= 1)
+    {
+	// We are at the target and its time to stop
+	_stepInterval = 0;
+	_speed = 0.0;
+	_n = 0;
+	return;
+    }
+
+    if (distanceTo > 0)
+    {
+	if (_n > 0)
+	{
+	    if ((stepsToStop >= distanceTo) || _direction == DIRECTION_CCW)
+		_n = -stepsToStop; // Start deceleration
+	}
+	else if (_n < 0)
+	{
+	    if ((stepsToStop < distanceTo) && _direction == DIRECTION_CW)
+		_n = -_n; // Start accceleration
+	}
+    }
+    else if (distanceTo < 0)
+    {
+	if (_n > 0)
+	{
+	    if ((stepsToStop >= -distanceTo) || _direction == DIRECTION_CW)
+		_n = -stepsToStop; // Start deceleration
+	}
+	else if (_n < 0)
+	{
+	    if ((stepsToStop < -distanceTo) && _direction == DIRECTION_CCW)
+		_n = -_n; // Start accceleration
+	}
+    }
+
+    if (_n == 0)
+    {
+	// First step from stopped
+	_cn = _c0;
+	_direction = (distanceTo > 0) ? DIRECTION_CW : DIRECTION_CCW;
+    }
+    else
+    {
+	// Equation 13. With the Q8 interval, the rounding of the division is far below 1us
+	_cn = _cn - (_cn / (4 * _n + 1)) * 2;
+	_cn = max(_cn, _cmin);
+    }
+    _n++;
+    _stepInterval = _cn >> ACCELSTEPPER_FIXED_SHIFT;
+}
+#else
 void AccelStepper::computeNewSpeed()
 {
     long distanceTo = distanceToGo(); // +ve is clockwise from curent location
@@ -180,11 +248,17 @@ void AccelStepper::computeNewSpeed()
 // You must call this at least once per step, preferably in your main loop
 // If the motor is in the desired position, the cost is very small
 // returns true if the motor is still running to the target position.
+#endif
+
 boolean AccelStepper::run()
 {
     if (runSpeed())
 	computeNewSpeed();
+#if ACCELSTEPPER_FIXED_POINT
+    return _stepInterval != 0 || distanceToGo() != 0;
+#else
     return _speed != 0.0 || distanceToGo() != 0;
+#endif
 }
 
 AccelStepper::AccelStepper(uint8_t interface, uint8_t pin1, uint8_t pin2, uint8_t pin3, uint8_t pin4, bool enable)
@@ -209,7 +283,11 @@ AccelStepper::AccelStepper(uint8_t interface, uint8_t pin1, uint8_t pin2, uint8_
     _n = 0;
     _c0 = 0.0;
     _cn = 0.0;
+#if ACCELSTEPPER_FIXED_POINT
+    _cmin = 1L << ACCELSTEPPER_FIXED_SHIFT;
+#else
     _cmin = 1.0;
+#endif
     _direction = DIRECTION_CCW;
 
     int i;
@@ -245,7 +323,11 @@ AccelStepper::AccelStepper(void (*forward)(), void (*backward)())
     _n = 0;
     _c0 = 0.0;
     _cn = 0.0;
+#if ACCELSTEPPER_FIXED_POINT
+    _cmin = 1L << ACCELSTEPPER_FIXED_SHIFT;
+#else
     _cmin = 1.0;
+#endif
     _direction = DIRECTION_CCW;
 
     int i;
@@ -262,6 +344,16 @@ void AccelStepper::setMaxSpeed(float speed)
     if (_maxSpeed != speed)
     {
 	_maxSpeed = speed;
+#if ACCELSTEPPER_FIXED_POINT
+	_cmin = (1000000.0 * (1 << ACCELSTEPPER_FIXED_SHIFT)) / speed;
+	long n = stepsToStop();
+	_maxStopSteps = (long)((speed * speed) / (2.0 * _acceleration)); // Equation 16
+	if (_n > 0)
+	{
+	    _n = n;
+	    computeNewSpeed();
+	}
+#else
 	_cmin = 1000000.0 / speed;
 	// Recompute _n from current speed and adjust speed if accelerating or cruising
 	if (_n > 0)
@@ -269,6 +361,7 @@ void AccelStepper::setMaxSpeed(float speed)
 	    _n = (long)((_speed * _speed) / (2.0 * _acceleration)); // Equation 16
 	    computeNewSpeed();
 	}
+#endif
     }
 }
 
@@ -288,7 +381,12 @@ void AccelStepper::setAcceleration(float acceleration)
 	// Recompute _n per Equation 17
 	_n = _n * (_acceleration / acceleration);
 	// New c0 per Equation 7, with correction per Equation 15
+#if ACCELSTEPPER_FIXED_POINT
+	_c0 = 0.676 * sqrt(2.0 / acceleration) * (1000000.0 * (1 << ACCELSTEPPER_FIXED_SHIFT)); // Equation 15
+	_maxStopSteps = (long)((_maxSpeed * _maxSpeed) / (2.0 * acceleration)); // Equation 16
+#else
 	_c0 = 0.676 * sqrt(2.0 / acceleration) * 1000000.0; // Equation 15
+#endif
 	_acceleration = acceleration;
 	computeNewSpeed();
     }
@@ -296,7 +394,7 @@ void AccelStepper::setAcceleration(float acceleration)
 
 void AccelStepper::setSpeed(float speed)
 {
-    if (speed == _speed)
+    if (speed == this->speed())
         return;
     speed = constrain(speed, -_maxSpeed, _maxSpeed);
     if (speed == 0.0)
@@ -311,11 +409,19 @@ void AccelStepper::setSpeed(float speed)
 
 float AccelStepper::speed()
 {
+#if ACCELSTEPPER_FIXED_POINT
+    // Not updated on every step, so derive it from the current interval
+    if (_stepInterval == 0)
+	return 0.0;
+    float speed = 1000000.0 / _stepInterval;
+    return (_direction == DIRECTION_CW) ? speed : -speed;
+#else
     return _speed;
+#endif
 }
 
 // Subclasses can override
-void AccelStepper::step(long step)
+void ACCELSTEPPER_ISR_ATTR AccelStepper::step(long step)
 {
     switch (_interface)
     {
@@ -353,7 +459,7 @@ void AccelStepper::step(long step)
 // bit 0 of the mask corresponds to _pin[0]
 // bit 1 of the mask corresponds to _pin[1]
 // ....
-void AccelStepper::setOutputPins(uint8_t mask)
+void ACCELSTEPPER_ISR_ATTR AccelStepper::setOutputPins(uint8_t mask)
 {
     uint8_t numpins = 2;
     if (_interface == FULL4WIRE || _interface == HALF4WIRE)
@@ -366,10 +472,10 @@ void AccelStepper::setOutputPins(uint8_t mask)
 }
 
 // 0 pin step function (ie for functional usage)
-void AccelStepper::step0(long step)
+void ACCELSTEPPER_ISR_ATTR AccelStepper::step0(long step)
 {
     (void)(step); // Unused
-    if (_speed > 0)
+    if (_direction == DIRECTION_CW)
 	_forward();
     else
 	_backward();
@@ -378,7 +484,7 @@ void AccelStepper::step0(long step)
 // 1 pin step function (ie for stepper drivers)
 // This is passed the current step number (0 to 7)
 // Subclasses can override
-void AccelStepper::step1(long step)
+void ACCELSTEPPER_ISR_ATTR AccelStepper::step1(long step)
 {
     (void)(step); // Unused
 
@@ -395,7 +501,7 @@ void AccelStepper::step1(long step)
 // 2 pin step function
 // This is passed the current step number (0 to 7)
 // Subclasses can override
-void AccelStepper::step2(long step)
+void ACCELSTEPPER_ISR_ATTR AccelStepper::step2(long step)
 {
     switch (step & 0x3)
     {
@@ -419,7 +525,7 @@ void AccelStepper::step2(long step)
 // 3 pin step function
 // This is passed the current step number (0 to 7)
 // Subclasses can override
-void AccelStepper::step3(long step)
+void ACCELSTEPPER_ISR_ATTR AccelStepper::step3(long step)
 {
     switch (step % 3)
     {
@@ -441,7 +547,7 @@ void AccelStepper::step3(long step)
 // 4 pin step function for half stepper
 // This is passed the current step number (0 to 7)
 // Subclasses can override
-void AccelStepper::step4(long step)
+void ACCELSTEPPER_ISR_ATTR AccelStepper::step4(long step)
 {
     switch (step & 0x3)
     {
@@ -466,7 +572,7 @@ void AccelStepper::step4(long step)
 // 3 pin half step function
 // This is passed the current step number (0 to 7)
 // Subclasses can override
-void AccelStepper::step6(long step)
+void ACCELSTEPPER_ISR_ATTR AccelStepper::step6(long step)
 {
     switch (step % 6)
     {
@@ -500,7 +606,7 @@ void AccelStepper::step6(long step)
 // 4 pin half step function
 // This is passed the current step number (0 to 7)
 // Subclasses can override
-void AccelStepper::step8(long step)
+void ACCELSTEPPER_ISR_ATTR AccelStepper::step8(long step)
 {
     switch (step & 0x7)
     {
@@ -635,10 +741,15 @@ void AccelStepper::runToNewPosition(long position)
 
 void AccelStepper::stop()
 {
-    if (_speed != 0.0)
+    float speed = this->speed();
+    if (speed != 0.0)
     {    
-	long stepsToStop = (long)((_speed * _speed) / (2.0 * _acceleration)) + 1; // Equation 16 (+integer rounding)
-	if (_speed > 0)
+#if ACCELSTEPPER_FIXED_POINT
+	long stepsToStop = this->stepsToStop() + 1;
+#else
+	long stepsToStop = (long)((speed * speed) / (2.0 * _acceleration)) + 1; // Equation 16 (+integer rounding)
+#endif
+	if (speed > 0)
 	    move(stepsToStop);
 	else
 	    move(-stepsToStop);
@@ -647,5 +758,5 @@ void AccelStepper::stop()
 
 bool AccelStepper::isRunning()
 {
-    return !(_speed == 0.0 && _targetPos == _currentPos);
+    return !(speed() == 0.0 && _targetPos == _currentPos);
 }
@@ -259,6 +259,23 @@
 // These defs cause trouble on some versions of Arduino
 #undef round
 
+// Set this to 1 to compute the acceleration profile with integer math instead of floats. It
+// uses the same recurrence (equation 13), with the step interval in Q8 fixed point, and
+// tracks the steps needed to stop instead of computing them from the speed on every step.
+// This makes computeNewSpeed() several times cheaper on boards without an FPU, like AVR.
+// speed() is then derived from the current step interval.
+#ifndef ACCELSTEPPER_FIXED_POINT
+#define ACCELSTEPPER_FIXED_POINT 0
+#endif
+#define ACCELSTEPPER_FIXED_SHIFT 8
+
+// Functions that may be called from a timer interrupt (runSpeed() and the step functions)
+#ifdef ESP32
+#define ACCELSTEPPER_ISR_ATTR IRAM_ATTR
+#else
+#define ACCELSTEPPER_ISR_ATTR
+#endif
+
 /////////////////////////////////////////////////////////////////////
 /// \class AccelStepper AccelStepper.h <AccelStepper.h>
 /// \brief Support for stepper motors with acceleration etc.
@@ -390,6 +407,12 @@ public:
     /// \return true if the motor was stepped.
     boolean runSpeed();
 
+    /// Computes the speed for the next step, as run() does after each step.
+    /// Use this together with runSpeed() when the steps are done from a timer
+    /// interrupt, but the (floating point) speed profile has to be computed
+    /// outside of it. Call it once for each step runSpeed() has made.
+    void    updateSpeed() { computeNewSpeed(); }
+
     /// Sets the maximum permitted speed. The run() function will accelerate
     /// up to the speed set by this function.
     /// Caution: the maximum speed achievable depends on your processor and clock speed.
@@ -660,6 +683,22 @@ private:
     /// The step counter for speed calculations
     long _n;
 
+#if ACCELSTEPPER_FIXED_POINT
+    /// Initial step size in microseconds, Q8 fixed point
+    long _c0;
+
+    /// Last step size in microseconds, Q8 fixed point
+    long _cn;
+
+    /// Min step size in microseconds based on maxSpeed, Q8 fixed point
+    long _cmin; // at max speed
+
+    /// Steps needed to stop from maxSpeed
+    long _maxStopSteps;
+
+    /// Steps needed to stop from the current speed
+    long stepsToStop();
+#else
     /// Initial step size in microseconds
     float _c0;
 
@@ -668,6 +707,7 @@ private:
 
     /// Min step size in microseconds based on maxSpeed
     float _cmin; // at max speed
+#endif
 
 };
 
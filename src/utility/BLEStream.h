@@ -11,6 +11,7 @@
 #define _BLE_STREAM_H_
 
 #include <Arduino.h>
+#include "Boards.h"
 #if defined(_VARIANT_ARDUINO_101_X_)
 #include <CurieBLE.h>
 #define _MAX_ATTR_DATA_LEN_ BLE_MAX_ATTR_DATA_LEN
@@ -21,6 +22,20 @@
 
 #define BLESTREAM_TXBUFFER_FLUSH_INTERVAL 80
 #define BLESTREAM_MIN_FLUSH_INTERVAL 8 // minimum interval for flushing the TX buffer
+#ifndef BLESTREAM_RX_BUFFER_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define BLESTREAM_RX_BUFFER_SIZE 512 // must be a power of two
+#else
+#define BLESTREAM_RX_BUFFER_SIZE 128
+#endif
+#endif
+#ifndef BLESTREAM_TX_BUFFER_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define BLESTREAM_TX_BUFFER_SIZE 256 // output queued for notification, must be a power of two
+#else
+#define BLESTREAM_TX_BUFFER_SIZE 32 // at least one notification
+#endif
+#endif
 
 // #define BLE_SERIAL_DEBUG
 
@@ -39,6 +54,7 @@ class BLEStream : public BLEPeripheral, public Stream
     virtual int read(void);
     virtual void flush(void);
     virtual size_t write(uint8_t byte);
+    virtual size_t write(const uint8_t* buffer, size_t size);
     using Print::write;
     virtual operator bool();
 
@@ -48,12 +64,13 @@ class BLEStream : public BLEPeripheral, public Stream
     int _flushInterval;
     static BLEStream* _instance;
 
+    // both rings use free running indices, masked on access
     size_t _rxHead;
     size_t _rxTail;
-    size_t _rxCount() const;
-    unsigned char _rxBuffer[256];
-    size_t _txCount;
-    unsigned char _txBuffer[_MAX_ATTR_DATA_LEN_];
+    unsigned char _rxBuffer[BLESTREAM_RX_BUFFER_SIZE];
+    size_t _txHead;
+    size_t _txTail;
+    unsigned char _txBuffer[BLESTREAM_TX_BUFFER_SIZE];
 
     BLEService _uartService = BLEService("6E400001-B5A3-F393-E0A9-E50E24DCCA9E");
     BLEDescriptor _uartNameDescriptor = BLEDescriptor("2901", "UART");
@@ -62,6 +79,9 @@ class BLEStream : public BLEPeripheral, public Stream
     BLECharacteristic _txCharacteristic = BLECharacteristic("6E400003-B5A3-F393-E0A9-E50E24DCCA9E", BLENotify, _MAX_ATTR_DATA_LEN_);
     BLEDescriptor _txNameDescriptor = BLEDescriptor("2901", "TX - Transfer Data (Notify)");
 
+    size_t _txCount() const { return this->_txHead - this->_txTail; }
+    bool _notify(bool partial);
+    void _waitForTxSpace();
     void _received(const unsigned char* data, size_t size);
     static void _received(BLECentral& /*central*/, BLECharacteristic& rxCharacteristic);
 };
@@ -73,6 +93,10 @@ class BLEStream : public BLEPeripheral, public Stream
  * not needed.
  */
 
+static_assert((BLESTREAM_RX_BUFFER_SIZE & (BLESTREAM_RX_BUFFER_SIZE - 1)) == 0, "BLESTREAM_RX_BUFFER_SIZE must be a power of two");
+static_assert((BLESTREAM_TX_BUFFER_SIZE & (BLESTREAM_TX_BUFFER_SIZE - 1)) == 0, "BLESTREAM_TX_BUFFER_SIZE must be a power of two");
+static_assert(BLESTREAM_TX_BUFFER_SIZE >= _MAX_ATTR_DATA_LEN_, "BLESTREAM_TX_BUFFER_SIZE must hold a notification");
+
 BLEStream* BLEStream::_instance = NULL;
 
 BLEStream::BLEStream(unsigned char req, unsigned char rdy, unsigned char rst) :
@@ -82,7 +106,7 @@ BLEStream::BLEStream(unsigned char req, unsigned char rdy, unsigned char rst) :
   BLEPeripheral(req, rdy, rst)
 #endif
 {
-  this->_txCount = 0;
+  this->_txHead = this->_txTail = 0;
   this->_rxHead = this->_rxTail = 0;
   this->_flushed = 0;
   this->_flushInterval = BLESTREAM_TXBUFFER_FLUSH_INTERVAL;
@@ -110,8 +134,9 @@ bool BLEStream::poll()
 {
   // BLEPeripheral::poll is called each time connected() is called
   this->_connected = BLEPeripheral::connected();
-  if (millis() > this->_flushed + this->_flushInterval) {
-    flush();
+  // full packets go out as soon as possible, the rest after the flush interval
+  if (this->_txCount() > 0) {
+    _notify(millis() > this->_flushed + this->_flushInterval);
   }
   return this->_connected;
 }
@@ -132,7 +157,7 @@ int BLEStream::available(void)
   // actually necessary. Seems to run fine without them, but only minimal testing so far.
   BLEPeripheral::poll();
 #endif
-  int retval = (this->_rxHead - this->_rxTail + sizeof(this->_rxBuffer)) % sizeof(this->_rxBuffer);
+  int retval = this->_rxHead - this->_rxTail;
 #ifdef BLE_SERIAL_DEBUG
   if (retval > 0) {
     Serial.print(F("BLEStream::available() = "));
@@ -148,7 +173,7 @@ int BLEStream::peek(void)
   BLEPeripheral::poll();
 #endif
   if (this->_rxTail == this->_rxHead) return -1;
-  uint8_t byte = this->_rxBuffer[this->_rxTail];
+  uint8_t byte = this->_rxBuffer[this->_rxTail & (BLESTREAM_RX_BUFFER_SIZE - 1)];
 #ifdef BLE_SERIAL_DEBUG
   Serial.print(F("BLEStream::peek() = 0x"));
   Serial.println(byte, HEX);
@@ -162,8 +187,8 @@ int BLEStream::read(void)
   BLEPeripheral::poll();
 #endif
   if (this->_rxTail == this->_rxHead) return -1;
-  this->_rxTail = (this->_rxTail + 1) % sizeof(this->_rxBuffer);
-  uint8_t byte = this->_rxBuffer[this->_rxTail];
+  uint8_t byte = this->_rxBuffer[this->_rxTail & (BLESTREAM_RX_BUFFER_SIZE - 1)];
+  this->_rxTail++;
 #ifdef BLE_SERIAL_DEBUG
   Serial.print(F("BLEStream::read() = 0x"));
   Serial.println(byte, HEX);
@@ -171,37 +196,86 @@ int BLEStream::read(void)
   return byte;
 }
 
+/*
+ * Send the queued output without waiting. Whatever cannot be sent yet because the
+ * notification queue of the BLE stack is full stays queued and is sent from poll().
+ */
 void BLEStream::flush(void)
 {
-  if (this->_txCount == 0) return;
-#ifndef _VARIANT_ARDUINO_101_X_
-  // ensure there are available packets before sending
-  while(!this->_txCharacteristic.canNotify()) {
-    BLEPeripheral::poll();
-  }
-#endif
-  this->_txCharacteristic.setValue(this->_txBuffer, this->_txCount);
-  this->_flushed = millis();
-  this->_txCount = 0;
+  if (this->_txCount() == 0) return;
+  _notify(true);
 #ifdef BLE_SERIAL_DEBUG
   Serial.println(F("BLEStream::flush()"));
 #endif
 }
 
 size_t BLEStream::write(uint8_t byte)
+{
+  return write(&byte, 1);
+}
+
+size_t BLEStream::write(const uint8_t* buffer, size_t size)
 {
 #ifndef _VARIANT_ARDUINO_101_X_
   BLEPeripheral::poll();
 #endif
   if (this->_txCharacteristic.subscribed() == false) return 0;
-  this->_txBuffer[this->_txCount++] = byte;
-  if (this->_txCount == sizeof(this->_txBuffer)) flush();
+  size_t written = 0;
+  while (written < size) {
+    if (this->_txCount() == BLESTREAM_TX_BUFFER_SIZE) _waitForTxSpace();
+    size_t offset = this->_txHead & (BLESTREAM_TX_BUFFER_SIZE - 1);
+    size_t length = min(size - written, min(BLESTREAM_TX_BUFFER_SIZE - this->_txCount(), BLESTREAM_TX_BUFFER_SIZE - offset));
+    memcpy(this->_txBuffer + offset, buffer + written, length);
+    this->_txHead += length;
+    written += length;
+  }
+  // send complete packets right away
+  if (this->_txCount() >= _MAX_ATTR_DATA_LEN_) _notify(false);
 #ifdef BLE_SERIAL_DEBUG
-  Serial.print(F("BLEStream::write( 0x"));
-  Serial.print(byte, HEX);
-  Serial.println(F(") = 1"));
+  Serial.print(F("BLEStream::write("));
+  Serial.print(size);
+  Serial.println(F(")"));
 #endif
-  return 1;
+  return size;
+}
+
+/*
+ * Send queued output as notifications of up to _MAX_ATTR_DATA_LEN_ bytes, as long as the
+ * BLE stack accepts them.
+ * @param partial Also send a final packet that is not full.
+ * @return true if everything that was to be sent is out.
+ */
+bool BLEStream::_notify(bool partial)
+{
+  unsigned char packet[_MAX_ATTR_DATA_LEN_];
+  while (this->_txCount() > 0) {
+    size_t length = min(this->_txCount(), (size_t)_MAX_ATTR_DATA_LEN_);
+    if (!partial && length < _MAX_ATTR_DATA_LEN_) break;
+#ifndef _VARIANT_ARDUINO_101_X_
+    if (!this->_txCharacteristic.canNotify()) return false;
+#endif
+    size_t offset = this->_txTail & (BLESTREAM_TX_BUFFER_SIZE - 1);
+    size_t first = min(length, BLESTREAM_TX_BUFFER_SIZE - offset);
+    memcpy(packet, this->_txBuffer + offset, first);
+    memcpy(packet + first, this->_txBuffer, length - first);
+    this->_txCharacteristic.setValue(packet, length);
+    this->_txTail += length;
+  }
+  if (partial) this->_flushed = millis();
+  return true;
+}
+
+/*
+ * The output queue is full. Wait until the BLE stack accepts at least one more packet.
+ */
+void BLEStream::_waitForTxSpace()
+{
+  while (this->_txCount() == BLESTREAM_TX_BUFFER_SIZE) {
+    _notify(false);
+#ifndef _VARIANT_ARDUINO_101_X_
+    BLEPeripheral::poll();
+#endif
+  }
 }
 
 BLEStream::operator bool()
@@ -223,10 +297,13 @@ void BLEStream::setFlushInterval(int interval)
 
 void BLEStream::_received(const unsigned char* data, size_t size)
 {
-  for (size_t i = 0; i < size; i++) {
-    this->_rxHead = (this->_rxHead + 1) % sizeof(this->_rxBuffer);
-    this->_rxBuffer[this->_rxHead] = data[i];
-  }
+  // data that does not fit is dropped
+  size_t length = min(size, BLESTREAM_RX_BUFFER_SIZE - (this->_rxHead - this->_rxTail));
+  size_t offset = this->_rxHead & (BLESTREAM_RX_BUFFER_SIZE - 1);
+  size_t first = min(length, BLESTREAM_RX_BUFFER_SIZE - offset);
+  memcpy(this->_rxBuffer + offset, data, first);
+  memcpy(this->_rxBuffer, data + first, length - first);
+  this->_rxHead += length;
 #ifdef BLE_SERIAL_DEBUG
   Serial.print(F("BLEStream::received("));
   for (int i = 0; i < size; i++) Serial.print(data[i], HEX);
@@ -798,6 +798,22 @@ static inline void attachInterrupt(pin_size_t interruptNumber, voidFuncPtr callb
 #define PIN_TO_SERVO(p)         (p)
 
 
+// Native build on the development machine (extras/native), the pins only exist in the Arduino shim
+#elif defined(FIRMATA_NATIVE)
+#define TOTAL_ANALOG_PINS       8
+#define TOTAL_PINS              32 // 24 digital + 8 analog
+#define VERSION_BLINK_PIN       13
+#define IS_PIN_DIGITAL(p)       ((p) >= 2 && (p) < TOTAL_PINS)
+#define IS_PIN_ANALOG(p)        ((p) >= 24 && (p) < TOTAL_PINS)
+#define IS_PIN_PWM(p)           IS_PIN_DIGITAL(p)
+#define IS_PIN_SERVO(p)         ((p) >= 2 && (p) < 14)
+#define IS_PIN_I2C(p)           ((p) == 18 || (p) == 19)
+#define PIN_TO_DIGITAL(p)       (p)
+#define PIN_TO_ANALOG(p)        ((p) - 24)
+#define PIN_TO_PWM(p)           PIN_TO_DIGITAL(p)
+#define PIN_TO_SERVO(p)         ((p) - 2)
+
+
 // anything else
 #else
 #error "Please edit Boards.h with a hardware abstraction for this board"
@@ -822,6 +838,36 @@ static inline void attachInterrupt(pin_size_t interruptNumber, voidFuncPtr callb
 
 #define MODE_INPUT 0 /* Because the name INPUT causes conflicts compiling on Windows */
 
+/*==============================================================================
+ * Fast GPIO backends: readPort() and writePort() access the port registers
+ * directly instead of calling digitalRead()/digitalWrite() for every pin.
+ * Define FIRMATA_NO_FAST_GPIO to use the Arduino functions instead.
+ *============================================================================*/
+
+#if !defined(FIRMATA_NO_FAST_GPIO) && !defined(ARDUINO_PINOUT_OPTIMIZE)
+#if defined(ESP32) && defined(CONFIG_IDF_TARGET_ESP32)
+// Firmata pin n is GPIO n, GPIO 0-31 are in GPIO.in/out, GPIO 32-39 in GPIO.in1/out1
+#include "soc/gpio_struct.h"
+#define FIRMATA_GPIO_ESP32 1
+#elif defined(ARDUINO_ARCH_SAMD)
+#define FIRMATA_GPIO_SAMD 1
+#endif
+#endif
+
+/*==============================================================================
+ * digitalPortMask() - The pins of a port that are digital pins, computed from
+ * IS_PIN_DIGITAL() on every call (the port is not known at compile time)
+ *============================================================================*/
+
+static inline unsigned char digitalPortMask(byte) __attribute__((always_inline, unused));
+static inline unsigned char digitalPortMask(byte port)
+{
+  return (IS_PIN_DIGITAL(port * 8 + 0) ? 0x01 : 0) | (IS_PIN_DIGITAL(port * 8 + 1) ? 0x02 : 0) |
+         (IS_PIN_DIGITAL(port * 8 + 2) ? 0x04 : 0) | (IS_PIN_DIGITAL(port * 8 + 3) ? 0x08 : 0) |
+         (IS_PIN_DIGITAL(port * 8 + 4) ? 0x10 : 0) | (IS_PIN_DIGITAL(port * 8 + 5) ? 0x20 : 0) |
+         (IS_PIN_DIGITAL(port * 8 + 6) ? 0x40 : 0) | (IS_PIN_DIGITAL(port * 8 + 7) ? 0x80 : 0);
+}
+
 /*==============================================================================
  * readPort() - Read an 8 bit port
  *============================================================================*/
@@ -834,6 +880,21 @@ static inline unsigned char readPort(byte port, byte bitmask)
   if (port == 1) return ((PINB & 0x3F) | ((PINC & 0x03) << 6)) & bitmask;
   if (port == 2) return ((PINC & 0x3C) >> 2) & bitmask;
   return 0;
+#elif defined(FIRMATA_GPIO_ESP32)
+  bitmask &= digitalPortMask(port);
+  if (port < 4) return (GPIO.in >> (port * 8)) & bitmask;
+  if (port == 4) return GPIO.in1.data & bitmask;
+  return 0;
+#elif defined(FIRMATA_GPIO_SAMD)
+  unsigned char out = 0, pin = port * 8;
+  bitmask &= digitalPortMask(port);
+  for (byte i = 0; bitmask != 0; i++, bitmask >>= 1) {
+    if (bitmask & 1) {
+      const PinDescription& desc = g_APinDescription[PIN_TO_DIGITAL(pin + i)];
+      if (PORT->Group[desc.ulPort].IN.reg & (1ul << desc.ulPin)) out |= (1 << i);
+    }
+  }
+  return out;
 #else
   unsigned char out = 0, pin = port * 8;
   if (IS_PIN_DIGITAL(pin + 0) && (bitmask & 0x01) && digitalRead(PIN_TO_DIGITAL(pin + 0))) out |= 0x01;
@@ -881,6 +942,30 @@ static inline unsigned char writePort(byte port, byte value, byte bitmask)
     sei();
   }
   return 1;
+#elif defined(FIRMATA_GPIO_ESP32)
+  // the set and clear registers change only the given bits, so no locking is needed
+  bitmask &= digitalPortMask(port);
+  uint32_t set = value & bitmask;
+  uint32_t clear = ~value & bitmask;
+  if (port < 4) {
+    if (set) GPIO.out_w1ts = set << (port * 8);
+    if (clear) GPIO.out_w1tc = clear << (port * 8);
+  } else if (port == 4) {
+    if (set) GPIO.out1_w1ts.val = set;
+    if (clear) GPIO.out1_w1tc.val = clear;
+  }
+  return 1;
+#elif defined(FIRMATA_GPIO_SAMD)
+  byte pin = port * 8;
+  bitmask &= digitalPortMask(port);
+  for (byte i = 0; bitmask != 0; i++, bitmask >>= 1) {
+    if (bitmask & 1) {
+      const PinDescription& desc = g_APinDescription[PIN_TO_DIGITAL(pin + i)];
+      if (value & (1 << i)) PORT->Group[desc.ulPort].OUTSET.reg = (1ul << desc.ulPin);
+      else PORT->Group[desc.ulPort].OUTCLR.reg = (1ul << desc.ulPin);
+    }
+  }
+  return 1;
 #else
   byte pin = port * 8;
   if ((bitmask & 0x01)) digitalWrite(PIN_TO_DIGITAL(pin + 0), (value & 0x01));
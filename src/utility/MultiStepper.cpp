@@ -49,7 +49,7 @@ void MultiStepper::moveTo(long absolute[])
 }
 
 // Returns true if any motor is still running to the target position.
-boolean MultiStepper::run()
+boolean ACCELSTEPPER_ISR_ATTR MultiStepper::run()
 {
     uint8_t i;
     boolean ret = false;
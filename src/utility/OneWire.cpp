@@ -127,6 +127,7 @@ OneWire::OneWire(uint8_t pin)
 	pinMode(pin, INPUT);
 	bitmask = PIN_TO_BITMASK(pin);
 	baseReg = PIN_TO_BASEREG(pin);
+	overdrive = false;
 #if ONEWIRE_SEARCH
 	reset_search();
 #endif
@@ -159,13 +160,25 @@ uint8_t OneWire::reset(void)
 	DIRECT_WRITE_LOW(reg, mask);
 	DIRECT_MODE_OUTPUT(reg, mask);	// drive output low
 	interrupts();
-	delayMicroseconds(480);
-	noInterrupts();
-	DIRECT_MODE_INPUT(reg, mask);	// allow it to float
-	delayMicroseconds(70);
-	r = !DIRECT_READ(reg, mask);
-	interrupts();
-	delayMicroseconds(410);
+	if (overdrive) {
+		// A standard speed reset would drop the devices back to standard speed,
+		// so this one has to stay within 70..80us
+		noInterrupts();
+		delayMicroseconds(70);
+		DIRECT_MODE_INPUT(reg, mask);	// allow it to float
+		delayMicroseconds(9);
+		r = !DIRECT_READ(reg, mask);
+		interrupts();
+		delayMicroseconds(40);
+	} else {
+		delayMicroseconds(480);
+		noInterrupts();
+		DIRECT_MODE_INPUT(reg, mask);	// allow it to float
+		delayMicroseconds(70);
+		r = !DIRECT_READ(reg, mask);
+		interrupts();
+		delayMicroseconds(410);
+	}
 	reg = reg; // Avoid Warning on unused variable when compiling in compatibility mode
 	return r;
 }
@@ -179,7 +192,23 @@ void OneWire::write_bit(uint8_t v)
 	IO_REG_TYPE mask=bitmask;
 	volatile IO_REG_TYPE *reg IO_REG_ASM = baseReg;
 
-	if (v & 1) {
+	if (overdrive) {
+		// At overdrive speed the whole slot is only 10us long and must not be stretched
+		noInterrupts();
+		DIRECT_WRITE_LOW(reg, mask);
+		DIRECT_MODE_OUTPUT(reg, mask);	// drive output low
+		if (v & 1) {
+			delayMicroseconds(1);
+			DIRECT_WRITE_HIGH(reg, mask);	// drive output high
+			interrupts();
+			delayMicroseconds(8);
+		} else {
+			delayMicroseconds(8);
+			DIRECT_WRITE_HIGH(reg, mask);	// drive output high
+			interrupts();
+			delayMicroseconds(3);
+		}
+	} else if (v & 1) {
 		noInterrupts();
 		DIRECT_WRITE_LOW(reg, mask);
 		DIRECT_MODE_OUTPUT(reg, mask);	// drive output low
@@ -188,6 +217,10 @@ void OneWire::write_bit(uint8_t v)
 		interrupts();
 		delayMicroseconds(55);
 	} else {
+		// A zero must be released within 120us, or the devices see a reset. An
+		// interrupt in the low phase could stretch it past that, and the release
+		// is a read-modify-write of the port that an ISR must not interleave with.
+		// So interrupts stay off until the release, but are on for the recovery.
 		noInterrupts();
 		DIRECT_WRITE_LOW(reg, mask);
 		DIRECT_MODE_OUTPUT(reg, mask);	// drive output low
@@ -212,12 +245,21 @@ uint8_t OneWire::read_bit(void)
 	noInterrupts();
 	DIRECT_MODE_OUTPUT(reg, mask);
 	DIRECT_WRITE_LOW(reg, mask);
-	delayMicroseconds(3);
-	DIRECT_MODE_INPUT(reg, mask);	// let pin float, pull up will raise
-	delayMicroseconds(10);
-	r = DIRECT_READ(reg, mask);
-	interrupts();
-	delayMicroseconds(53);
+	if (overdrive) {
+		delayMicroseconds(1);
+		DIRECT_MODE_INPUT(reg, mask);	// let pin float, pull up will raise
+		delayMicroseconds(1);
+		r = DIRECT_READ(reg, mask);
+		interrupts();
+		delayMicroseconds(7);
+	} else {
+		delayMicroseconds(3);
+		DIRECT_MODE_INPUT(reg, mask);	// let pin float, pull up will raise
+		delayMicroseconds(10);
+		r = DIRECT_READ(reg, mask);
+		interrupts();
+		delayMicroseconds(53);
+	}
 	reg = reg; // Avoid Warning on unused variable when compiling in compatibility mode
 	return r;
 }
@@ -244,8 +286,9 @@ void OneWire::write(uint8_t v, uint8_t power /* = 0 */) {
 }
 
 void OneWire::write_bytes(const uint8_t *buf, uint16_t count, bool power /* = 0 */) {
+  // keep the line driven between the bytes and release it only once at the end
   for (uint16_t i = 0 ; i < count ; i++)
-    write(buf[i]);
+    write(buf[i], 1);
   if (!power) {
     noInterrupts();
     DIRECT_MODE_INPUT(baseReg, bitmask);
@@ -292,6 +335,35 @@ void OneWire::skip()
     write(0xCC);           // Skip ROM
 }
 
+//
+// Switch all devices on the bus to overdrive speed. Must be sent at
+// standard speed, right after a reset. A standard speed reset switches
+// the devices back.
+//
+void OneWire::overdrive_skip()
+{
+    overdrive = false;
+    write(0x3C);           // Overdrive skip ROM
+    overdrive = true;
+}
+
+//
+// Switch a single device to overdrive speed. The command byte goes out
+// at standard speed, the ROM code at overdrive speed already.
+//
+void OneWire::overdrive_select(const uint8_t rom[8])
+{
+    overdrive = false;
+    write(0x69);           // Overdrive match ROM
+    overdrive = true;
+    write_bytes(rom, 8);
+}
+
+void OneWire::set_overdrive(bool enable)
+{
+    overdrive = enable;
+}
+
 void OneWire::depower()
 {
 	noInterrupts();
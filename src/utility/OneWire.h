@@ -252,6 +252,7 @@ class OneWire
   private:
     IO_REG_TYPE bitmask;
     volatile IO_REG_TYPE *baseReg;
+    bool overdrive;
 
 #if ONEWIRE_SEARCH
     // global search state
@@ -275,6 +276,19 @@ class OneWire
     // Issue a 1-Wire rom skip command, to address all on bus.
     void skip(void);
 
+    // Issue a 1-Wire overdrive skip command, switching all devices that
+    // support it to overdrive speed. You do the (standard speed) reset first.
+    void overdrive_skip(void);
+
+    // Issue a 1-Wire overdrive match command, switching only the given
+    // device to overdrive speed. You do the (standard speed) reset first.
+    void overdrive_select(const uint8_t rom[8]);
+
+    // Select the bit timing used for all following operations. Clearing it
+    // and doing a reset() brings the devices back to standard speed.
+    void set_overdrive(bool enable);
+    bool get_overdrive(void) { return overdrive; }
+
     // Write a byte. If 'power' is one then the wire is held high at
     // the end for parasitically powered devices. You are responsible
     // for eventually depowering it by calling depower() or doing
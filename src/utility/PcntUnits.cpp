@@ -0,0 +1,43 @@
+/*
+  PcntUnits.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include "PcntUnits.h"
+
+#ifdef FIRMATA_PCNT_UNITS
+uint32_t PcntUnits::used = 0;
+bool PcntUnits::isrServiceInstalled = false;
+
+pcnt_unit_t PcntUnits::allocate()
+{
+  for (int unit = 0; unit < PCNT_UNIT_MAX; unit++) {
+    if (!(used & (1UL << unit))) {
+      used |= 1UL << unit;
+      return (pcnt_unit_t)unit;
+    }
+  }
+  return PCNT_UNIT_MAX;
+}
+
+void PcntUnits::release(pcnt_unit_t unit)
+{
+  if (unit < PCNT_UNIT_MAX) {
+    used &= ~(1UL << unit);
+  }
+}
+
+void PcntUnits::installIsrService()
+{
+  if (!isrServiceInstalled) {
+    pcnt_isr_service_install(0);
+    isrServiceInstalled = true;
+  }
+}
+#endif
@@ -0,0 +1,51 @@
+/*
+  PcntUnits.h - Firmata library
+
+  The PCNT pulse counter units of the ESP32 are shared by Frequency and EncoderFirmata,
+  each unit is handed out to one of them at a time. FIRMATA_PCNT_UNITS is the number of units
+  of the chip (8 on the ESP32, 4 on the S2 and S3), it is not defined on chips without PCNT
+  (C3, C6) and on other boards.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef PcntUnits_h
+#define PcntUnits_h
+
+#ifdef ESP32
+#if __has_include(<soc/soc_caps.h>)
+#include <soc/soc_caps.h>
+#if defined(SOC_PCNT_UNITS_PER_GROUP)
+#define FIRMATA_PCNT_UNITS SOC_PCNT_UNITS_PER_GROUP
+#elif defined(SOC_PCNT_UNIT_NUM)
+#define FIRMATA_PCNT_UNITS SOC_PCNT_UNIT_NUM // ESP-IDF before 4.4
+#endif
+#else
+#define FIRMATA_PCNT_UNITS 8 // ESP-IDF 3 only supports the ESP32
+#endif
+#endif
+
+#ifdef FIRMATA_PCNT_UNITS
+#include <driver/pcnt.h>
+
+class PcntUnits
+{
+  public:
+    // a free unit, PCNT_UNIT_MAX if all are taken
+    static pcnt_unit_t allocate();
+    static void release(pcnt_unit_t unit);
+    // the interrupt service is shared by all units, it is installed on first use
+    static void installIsrService();
+
+  private:
+    static uint32_t used; // a bit per unit
+    static bool isrServiceInstalled;
+};
+#endif
+
+#endif
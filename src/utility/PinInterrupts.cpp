@@ -0,0 +1,57 @@
+/*
+  PinInterrupts.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include "PinInterrupts.h"
+
+const void* PinInterrupts::owners[PIN_INTERRUPTS_TRACKED];
+
+void PinInterrupts::attach(int interrupt, void (*isr)(void), int mode, const void* owner)
+{
+  if (interrupt < 0) {
+    return;
+  }
+  attachInterrupt(interrupt, isr, mode);
+  if (interrupt < PIN_INTERRUPTS_TRACKED) {
+    owners[interrupt] = owner;
+  }
+}
+
+#ifdef ESP32
+void PinInterrupts::attachArg(int interrupt, void (*isr)(void*), void* arg, int mode, const void* owner)
+{
+  if (interrupt < 0) {
+    return;
+  }
+  attachInterruptArg(interrupt, isr, arg, mode);
+  if (interrupt < PIN_INTERRUPTS_TRACKED) {
+    owners[interrupt] = owner;
+  }
+}
+#endif
+
+void PinInterrupts::detach(int interrupt, const void* owner)
+{
+  if (interrupt < 0) {
+    return;
+  }
+  if (interrupt < PIN_INTERRUPTS_TRACKED) {
+    if (owners[interrupt] != owner) {
+      return;
+    }
+    owners[interrupt] = nullptr;
+  }
+  detachInterrupt(interrupt);
+}
+
+bool PinInterrupts::isOwner(int interrupt, const void* owner)
+{
+  return interrupt >= 0 && (interrupt >= PIN_INTERRUPTS_TRACKED || owners[interrupt] == owner);
+}
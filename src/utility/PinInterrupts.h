@@ -0,0 +1,45 @@
+/*
+  PinInterrupts.h - Firmata library
+
+  The external interrupts are shared by the features that watch pins (digital input changes,
+  frequency counters, encoders, sonar echoes, DHT sensors and task triggers). An interrupt has
+  one handler at a time, the feature that attached it last owns it. detach() leaves an interrupt
+  alone that another feature has taken over since, so that its handler stays in place.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef PinInterrupts_h
+#define PinInterrupts_h
+
+#include <ConfigurableFirmata.h>
+
+// the interrupt numbers that are tracked, larger ones are detached unconditionally
+#ifdef EXTERNAL_NUM_INTERRUPTS
+#define PIN_INTERRUPTS_TRACKED EXTERNAL_NUM_INTERRUPTS
+#else
+#define PIN_INTERRUPTS_TRACKED TOTAL_PINS
+#endif
+
+class PinInterrupts
+{
+  public:
+    // interrupt is the number from digitalPinToInterrupt(), owner the feature that attaches it
+    static void attach(int interrupt, void (*isr)(void), int mode, const void* owner);
+#ifdef ESP32
+    static void attachArg(int interrupt, void (*isr)(void*), void* arg, int mode, const void* owner);
+#endif
+    // detaches the interrupt, unless another owner has attached it since
+    static void detach(int interrupt, const void* owner);
+    static bool isOwner(int interrupt, const void* owner);
+
+  private:
+    static const void* owners[PIN_INTERRUPTS_TRACKED];
+};
+
+#endif
@@ -58,9 +58,13 @@ protected:
         {
           _time_connect = millis();
         }
-        else if ( _currentHostConnectionCallback )
+        else
         {
-          (*_currentHostConnectionCallback)(HOST_CONNECTION_CONNECTED);
+          configure_client( _client );
+          if ( _currentHostConnectionCallback )
+          {
+            (*_currentHostConnectionCallback)(HOST_CONNECTION_CONNECTED);
+          }
         }
       }
     }
@@ -80,6 +84,7 @@ public:
    */
   virtual inline bool maintain()
   {
+    maintain_join();
     return connect_client();
   }
 
@@ -28,35 +28,241 @@
 
 #include "WiFiStream.h"
 
+// Number of TCP clients that may be connected at the same time. All clients receive the
+// same output, commands are accepted from any of them.
+#ifndef WIFI_MAX_CLIENTS
+#define WIFI_MAX_CLIENTS 4
+#endif
+
+extern "C" {
+  // called with the slot index of a client whenever it connects or disconnects
+  typedef void (*clientConnectionCallbackFunction)(uint8_t, byte);
+}
+
 class WiFiServerStream : public WiFiStream
 {
 protected:
+  static const uint8_t START_SYSEX_BYTE = 0xF0;
+  static const uint8_t END_SYSEX_BYTE = 0xF7;
+  // message id of a client's output state while the id of a sysex message is not yet known
+  static const uint8_t TX_ID_PENDING = 0xFF;
+  // message id before the first command byte was seen
+  static const uint8_t TX_ID_NONE = 0xFE;
+
   WiFiServer _server = WiFiServer(3030);
   bool _listening = false;
 
+  WiFiClient _clients[WIFI_MAX_CLIENTS];
+  uint8_t _numClients = 0;
+  clientConnectionCallbackFunction _clientConnectionCallback = nullptr;
+
+  // Messages blocked per client, one bit per message id. The id of a sysex message is its
+  // sysex command, other messages use the upper nibble of their command byte (8-15).
+  uint8_t _blocked[WIFI_MAX_CLIENTS][16];
+  bool _filtered[WIFI_MAX_CLIENTS];
+  uint8_t _txMessage[WIFI_MAX_CLIENTS];
+
+  // Client currently read from. It is kept until its message is complete, so that the
+  // commands of two clients are never interleaved. _rxRemaining is the number of data
+  // bytes still expected, or -1 inside a sysex message.
+  uint8_t _rxClient = 0;
+  int8_t _rxRemaining = 0;
+
   /**
    * check if TCP client is connected
    * @return true if connected
    */
   virtual inline bool connect_client()
   {
-    if ( _connected )
+    if ( _connected ) return true;
+    accept_clients();
+    return _connected;
+  }
+
+  /**
+   * accept pending connections into free client slots
+   */
+  inline void accept_clients()
+  {
+    if ( !_listening ) return;
+    WiFiClient newClient;
+    while ( (newClient = _server.available()) )
     {
-      if ( _client && _client.connected() ) return true;
-      stop();
+      int slot = -1;
+      for ( int i = 0; i < WIFI_MAX_CLIENTS; i++ )
+      {
+        if ( !_clients[i] )
+        {
+          slot = i;
+          break;
+        }
+      }
+      if ( slot < 0 )
+      {
+        // all slots are in use
+        newClient.stop();
+        return;
+      }
+      _clients[slot] = newClient;
+      configure_client( _clients[slot] );
+      memset(_blocked[slot], 0, sizeof(_blocked[slot]));
+      _filtered[slot] = false;
+      _txMessage[slot] = TX_ID_NONE;
+      client_connected(slot, HOST_CONNECTION_CONNECTED);
     }
+  }
 
-    // passive TCP connect (accept)
-    WiFiClient newClient = _server.available();
-    if ( !newClient ) return false;
-    _client = newClient;
-    _connected = true;
-    if ( _currentHostConnectionCallback )
+  /**
+   * release the slots of clients that have disconnected
+   */
+  inline void prune_clients()
+  {
+    for ( int i = 0; i < WIFI_MAX_CLIENTS; i++ )
     {
-      (*_currentHostConnectionCallback)(HOST_CONNECTION_CONNECTED);
+      if ( _clients[i] && !_clients[i].connected() )
+      {
+        drop_client(i);
+      }
     }
+  }
 
-    return true;
+  inline void drop_client(uint8_t index)
+  {
+    _clients[index].stop();
+    _clients[index] = WiFiClient();
+    if ( _rxClient == index )
+    {
+      _rxRemaining = 0;
+    }
+    client_connected(index, HOST_CONNECTION_DISCONNECTED);
+  }
+
+  /**
+   * update the client count and run the callbacks. The host connection callback only
+   * reports the first client connecting and the last one leaving.
+   */
+  inline void client_connected(uint8_t index, byte state)
+  {
+    if ( state == HOST_CONNECTION_CONNECTED ) _numClients++;
+    else _numClients--;
+    _connected = _numClients > 0;
+
+    if ( _clientConnectionCallback )
+    {
+      (*_clientConnectionCallback)(index, state);
+    }
+    if ( _currentHostConnectionCallback && _numClients == (state == HOST_CONNECTION_CONNECTED ? 1 : 0) )
+    {
+      (*_currentHostConnectionCallback)(state);
+    }
+  }
+
+  /**
+   * select the client to read from
+   * @return slot index or -1 if no client has data
+   */
+  inline int rx_client()
+  {
+    if ( _rxRemaining != 0 && _clients[_rxClient] )
+    {
+      return _rxClient;
+    }
+    _rxRemaining = 0;
+    for ( int i = 1; i <= WIFI_MAX_CLIENTS; i++ )
+    {
+      uint8_t index = (_rxClient + i) % WIFI_MAX_CLIENTS;
+      if ( _clients[index] && _clients[index].available() > 0 )
+      {
+        _rxClient = index;
+        return index;
+      }
+    }
+    return -1;
+  }
+
+  /**
+   * track the message boundaries of the input
+   */
+  inline void rx_track(uint8_t b)
+  {
+    if ( b == START_SYSEX_BYTE )
+    {
+      _rxRemaining = -1;
+    }
+    else if ( b == END_SYSEX_BYTE )
+    {
+      _rxRemaining = 0;
+    }
+    else if ( b >= 0x80 )
+    {
+      uint8_t command = b < 0xF0 ? (b & 0xF0) : b;
+      // program change and channel pressure have one data byte, set pin mode and set
+      // digital pin value two, the remaining system messages none
+      if ( command == 0xC0 || command == 0xD0 ) _rxRemaining = 1;
+      else if ( command < 0xF0 || command == 0xF4 || command == 0xF5 ) _rxRemaining = 2;
+      else _rxRemaining = 0;
+    }
+    else if ( _rxRemaining > 0 )
+    {
+      _rxRemaining--;
+    }
+  }
+
+  /**
+   * apply changed socket options to all connected clients
+   */
+  virtual inline void configure_clients()
+  {
+    for ( int i = 0; i < WIFI_MAX_CLIENTS; i++ )
+    {
+      if ( _clients[i] ) configure_client( _clients[i] );
+    }
+  }
+
+  inline bool is_blocked(uint8_t index, uint8_t id)
+  {
+    return id < 128 && (_blocked[index][id >> 3] & (1 << (id & 7)));
+  }
+
+  /**
+   * write the messages of a block that are not blocked for the client
+   */
+  inline void write_filtered(uint8_t index, const uint8_t *buf, size_t size)
+  {
+    WiFiClient& client = _clients[index];
+    uint8_t id = _txMessage[index];
+    bool allowed = id != TX_ID_PENDING && !is_blocked(index, id);
+    size_t start = 0;
+    for ( size_t pos = 0; pos < size; pos++ )
+    {
+      uint8_t b = buf[pos];
+      if ( id == TX_ID_PENDING )
+      {
+        // the byte following START_SYSEX, which was held back until now
+        id = b & 0x7F;
+        allowed = !is_blocked(index, id);
+        if ( allowed ) client.write(START_SYSEX_BYTE);
+        start = pos;
+      }
+      else if ( b >= 0x80 && b != END_SYSEX_BYTE )
+      {
+        if ( allowed && pos > start ) client.write(buf + start, pos - start);
+        if ( b == START_SYSEX_BYTE )
+        {
+          id = TX_ID_PENDING;
+          allowed = false;
+          start = pos + 1;
+        }
+        else
+        {
+          id = b >> 4;
+          allowed = !is_blocked(index, id);
+          start = pos;
+        }
+      }
+    }
+    if ( allowed && size > start ) client.write(buf + start, size - start);
+    _txMessage[index] = id;
   }
 
 public:
@@ -66,14 +272,64 @@ public:
   WiFiServerStream(uint16_t server_port) : WiFiStream(server_port) {}
 
   /**
-   * maintain WiFi and TCP connection
-   * @return true if WiFi and TCP connection are established
+   * attach a callback that is run whenever a client connects or disconnects, e.g. to
+   * set up the message filter of a monitoring client
    */
-  virtual inline bool maintain()
+  inline void attachClient( clientConnectionCallbackFunction newFunction ) { _clientConnectionCallback = newFunction; }
+
+  /**
+   * @return number of connected clients
+   */
+  inline uint8_t clientCount()
+  {
+    return _numClients;
+  }
+
+  /**
+   * @return the client in a slot, e.g. to query its remote address
+   */
+  inline WiFiClient& client(uint8_t index)
+  {
+    return _clients[index];
+  }
+
+  /**
+   * block or unblock one kind of message for a client. id is the sysex command of a
+   * sysex message or the upper nibble of any other command byte, i.e. 0x0E for analog
+   * and 0x09 for digital messages.
+   */
+  inline void setClientFilter(uint8_t index, uint8_t id, bool blocked)
+  {
+    if ( index >= WIFI_MAX_CLIENTS || id >= 128 ) return;
+    if ( blocked ) _blocked[index][id >> 3] |= (1 << (id & 7));
+    else _blocked[index][id >> 3] &= ~(1 << (id & 7));
+    _filtered[index] = false;
+    for ( int i = 0; i < 16; i++ )
+    {
+      if ( _blocked[index][i] ) _filtered[index] = true;
+    }
+  }
+
+  /**
+   * let a client receive all messages again
+   */
+  inline void clearClientFilter(uint8_t index)
   {
-    if ( connect_client() ) return true;
+    if ( index >= WIFI_MAX_CLIENTS ) return;
+    memset(_blocked[index], 0, sizeof(_blocked[index]));
+    _filtered[index] = false;
+  }
 
-    stop();
+  /**
+   * maintain WiFi and TCP connections
+   * @return true if WiFi and at least one TCP connection are established
+   */
+  virtual inline bool maintain()
+  {
+    maintain_join();
+    prune_clients();
+    accept_clients();
+    if ( _connected ) return true;
 
     if ( !_listening && WiFi.status() == WL_CONNECTED )
     {
@@ -87,19 +343,82 @@ public:
   }
 
   /**
-   * stop client connection
+   * stop all client connections
    */
   virtual inline void stop()
   {
-    if ( _client)
+    for ( int i = 0; i < WIFI_MAX_CLIENTS; i++ )
     {
-      _client.stop();
-      if ( _currentHostConnectionCallback )
+      if ( _clients[i] ) drop_client(i);
+    }
+    _connected = false;
+  }
+
+/******************************************************************************
+ *             stream functions
+ ******************************************************************************/
+
+  inline int available()
+  {
+    if ( !connect_client() ) return 0;
+    int index = rx_client();
+    return index < 0 ? 0 : _clients[index].available();
+  }
+
+  inline void flush()
+  {
+    for ( int i = 0; i < WIFI_MAX_CLIENTS; i++ )
+    {
+      if ( _clients[i] ) _clients[i].flush();
+    }
+  }
+
+  inline int peek()
+  {
+    int index = rx_client();
+    return index < 0 ? -1 : _clients[index].peek();
+  }
+
+  inline int read()
+  {
+    int index = rx_client();
+    if ( index < 0 ) return -1;
+    int b = _clients[index].read();
+    if ( b >= 0 ) rx_track(b);
+    return b;
+  }
+
+  inline size_t write(uint8_t byte)
+  {
+    return write(&byte, 1);
+  }
+
+  /**
+   * send a block to all clients. Clients without a filter get the block as it is.
+   */
+  inline size_t write(const uint8_t *buf, size_t size)
+  {
+    if ( !connect_client() ) return 0;
+    for ( int i = 0; i < WIFI_MAX_CLIENTS; i++ )
+    {
+      if ( !_clients[i] ) continue;
+      if ( _filtered[i] ) write_filtered(i, buf, size);
+      else
       {
-        (*_currentHostConnectionCallback)(HOST_CONNECTION_DISCONNECTED);
+        _clients[i].write(buf, size);
+        // keep the message state current in case a filter is set later
+        for ( size_t pos = size; pos > 0; pos-- )
+        {
+          uint8_t b = buf[pos - 1];
+          if ( b >= 0x80 && b != END_SYSEX_BYTE )
+          {
+            _txMessage[i] = b == START_SYSEX_BYTE ? (pos < size ? (buf[pos] & 0x7F) : TX_ID_PENDING) : (b >> 4);
+            break;
+          }
+        }
       }
     }
-    _connected = false;
+    return size;
   }
 
 };
@@ -23,10 +23,41 @@
 
 #include <inttypes.h>
 #include <Stream.h>
+#if ESP32
+#include <Preferences.h>
+#include <lwip/sockets.h>
+#endif
 
 #define HOST_CONNECTION_DISCONNECTED 0
 #define HOST_CONNECTION_CONNECTED    1
 
+// states of a join started with beginFast()
+#define WIFI_JOIN_IDLE               0
+#define WIFI_JOIN_CACHED             1 // joining with the cached channel and BSSID
+#define WIFI_JOIN_SCAN               2 // joining after a full scan
+
+// ms to wait for a join with the cached channel and BSSID before falling back to a scan
+#ifndef WIFI_FAST_CONNECT_TIMEOUT
+#define WIFI_FAST_CONNECT_TIMEOUT    3000
+#endif
+// ESP8266: first 4 byte block of the RTC user memory used for the join cache
+#ifndef WIFI_JOIN_CACHE_RTC_BLOCK
+#define WIFI_JOIN_CACHE_RTC_BLOCK    32
+#endif
+
+/* the access point and address of the last join, kept in NVS (ESP32) or RTC memory (ESP8266) */
+struct wifi_join_cache
+{
+  uint32_t ssidHash; // 0 = invalid
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t reserved;
+};
+
 extern "C" {
   // callback function types
   typedef void (*hostConnectionCallbackFunction)(byte);
@@ -48,7 +79,20 @@ protected:
   uint8_t _key_idx;                   //WEP
   const char *_key = nullptr;         //WEP
   const char *_passphrase = nullptr;  //WPA
-  char *_ssid = nullptr;
+  const char *_ssid = nullptr;
+
+  //fast connect
+  uint8_t _joinState = WIFI_JOIN_IDLE;
+  uint32_t _joinStarted = 0;
+  bool _leaseReused = false;
+
+  //socket options, applied to every new connection (0 or -1 keeps the library default)
+  int8_t _noDelay = -1;
+  int _txSocketBufferSize = 0;
+  int _rxSocketBufferSize = 0;
+  uint16_t _keepAliveIdle = 0;        // seconds, 0 = keepalive off
+  uint16_t _keepAliveInterval = 0;    // seconds
+  uint8_t _keepAliveCount = 0;
 
   /**
    * check if TCP client is connected
@@ -56,6 +100,116 @@ protected:
    */
   virtual bool connect_client() = 0;
 
+  /**
+   * apply the socket options to a connection
+   */
+  inline void configure_client(WiFiClient& client)
+  {
+#if ESP32 || ESP8266
+    if ( _noDelay >= 0 ) client.setNoDelay( _noDelay != 0 );
+#endif
+#if ESP32
+    // WiFiClient::setSocketOption() takes 4 arguments only since core 2.0, the socket itself works with all of them
+    int fd = client.fd();
+    if ( fd < 0 ) return;
+    if ( _txSocketBufferSize > 0 ) setsockopt( fd, SOL_SOCKET, SO_SNDBUF, &_txSocketBufferSize, sizeof(int) );
+    if ( _rxSocketBufferSize > 0 ) setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &_rxSocketBufferSize, sizeof(int) );
+    if ( _keepAliveIdle > 0 )
+    {
+      int enable = 1, idle = _keepAliveIdle, interval = _keepAliveInterval, count = _keepAliveCount;
+      setsockopt( fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(int) );
+      setsockopt( fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(int) );
+      if ( interval > 0 ) setsockopt( fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(int) );
+      if ( count > 0 ) setsockopt( fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(int) );
+    }
+#elif ESP8266
+    if ( _keepAliveIdle > 0 ) client.keepAlive( _keepAliveIdle, _keepAliveInterval, _keepAliveCount );
+#endif
+  }
+
+  /**
+   * apply changed socket options to the open connections
+   */
+  virtual inline void configure_clients()
+  {
+    if ( _client ) configure_client( _client );
+  }
+
+#if ESP32 || ESP8266
+  inline uint32_t ssid_hash()
+  {
+    // FNV-1a, so that the cache of another network is not used
+    uint32_t hash = 2166136261u;
+    for ( const char *c = _ssid; *c; c++ ) hash = (hash ^ (uint8_t)*c) * 16777619u;
+    return hash == 0 ? 1 : hash;
+  }
+
+  inline bool load_join_cache(wifi_join_cache& cache)
+  {
+#if ESP32
+    Preferences prefs;
+    bool loaded = prefs.begin("firmata-wifi", true) && prefs.getBytes("join", &cache, sizeof(cache)) == sizeof(cache);
+    prefs.end();
+#else
+    bool loaded = ESP.rtcUserMemoryRead(WIFI_JOIN_CACHE_RTC_BLOCK, (uint32_t*)&cache, sizeof(cache));
+#endif
+    return loaded && cache.ssidHash == ssid_hash();
+  }
+
+  inline void save_join_cache(const wifi_join_cache& cache)
+  {
+    wifi_join_cache current;
+    if ( load_join_cache(current) && memcmp(&current, &cache, sizeof(cache)) == 0 ) return; // spare the flash
+#if ESP32
+    Preferences prefs;
+    if ( prefs.begin("firmata-wifi", false) ) prefs.putBytes("join", &cache, sizeof(cache));
+    prefs.end();
+#else
+    ESP.rtcUserMemoryWrite(WIFI_JOIN_CACHE_RTC_BLOCK, (uint32_t*)&cache, sizeof(cache));
+#endif
+  }
+
+  /**
+   * complete a join started with beginFast(). A join with the cached access point that doesn't
+   * succeed in time is retried with a scan, a successful one updates the cache.
+   */
+  inline void maintain_join()
+  {
+    if ( _joinState == WIFI_JOIN_IDLE ) return;
+    if ( WiFi.status() == WL_CONNECTED )
+    {
+      wifi_join_cache cache;
+      memset(&cache, 0, sizeof(cache));
+      cache.ssidHash = ssid_hash();
+      cache.ip = (uint32_t)WiFi.localIP();
+      cache.gateway = (uint32_t)WiFi.gatewayIP();
+      cache.subnet = (uint32_t)WiFi.subnetMask();
+      cache.dns = (uint32_t)WiFi.dnsIP();
+      memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+      cache.channel = WiFi.channel();
+      save_join_cache(cache);
+      _joinState = WIFI_JOIN_IDLE;
+      return;
+    }
+    if ( _joinState == WIFI_JOIN_CACHED && millis() - _joinStarted >= WIFI_FAST_CONNECT_TIMEOUT )
+    {
+      // the access point has moved or is gone
+      WiFi.disconnect();
+      if ( _leaseReused )
+      {
+        // back to DHCP
+        WiFi.config( IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0) );
+        _leaseReused = false;
+      }
+      WiFi.begin( _ssid, _passphrase );
+      _joinState = WIFI_JOIN_SCAN;
+      _joinStarted = millis();
+    }
+  }
+#else
+  inline void maintain_join() {}
+#endif
+
 public:
   /** constructor for TCP server */
   WiFiStream(uint16_t server_port) : _port(server_port) {}
@@ -105,6 +259,46 @@ public:
     return WiFi.localIP();
   }
 
+/******************************************************************************
+ *           socket options
+ *
+ * These take effect on open connections and on every new connection.
+ * Socket buffer sizes are only supported on the ESP32, keepalive on the
+ * ESP32 and ESP8266. Other boards ignore options they cannot set.
+ ******************************************************************************/
+
+  /**
+   * disable (true) or enable (false) the Nagle algorithm. Disabling it lowers the latency
+   * of small reports at the cost of more packets.
+   */
+  inline void setNoDelay(bool noDelay)
+  {
+    _noDelay = noDelay ? 1 : 0;
+    configure_clients();
+  }
+
+  /**
+   * set the size of the socket send and receive buffers in bytes, 0 keeps the default
+   */
+  inline void setSocketBufferSizes(int txSize, int rxSize)
+  {
+    _txSocketBufferSize = txSize;
+    _rxSocketBufferSize = rxSize;
+    configure_clients();
+  }
+
+  /**
+   * enable TCP keepalive, so that dead hosts are detected. An idle time of 0 keeps the
+   * default (off). interval and count of 0 keep the stack defaults.
+   */
+  inline void setKeepAlive(uint16_t idleSeconds, uint16_t intervalSeconds = 0, uint8_t count = 0)
+  {
+    _keepAliveIdle = idleSeconds;
+    _keepAliveInterval = intervalSeconds;
+    _keepAliveCount = count;
+    configure_clients();
+  }
+
 /******************************************************************************
  *           network functions
  ******************************************************************************/
@@ -191,6 +385,45 @@ public:
     return WiFi.status();
   }
 
+  /**
+   * initialize WiFi with WPA-PSK security without waiting for the connection. The channel and
+   * BSSID of the last join are used to skip the scan. The join completes in maintain(), so the
+   * stream attaches once it is up.
+   * With reuseLease, the address of the last join is configured statically instead of waiting
+   * for DHCP, unless config() set another one. Only use it if the network keeps the leases stable.
+   * Boards other than the ESP32 and ESP8266 do a normal begin().
+   * @return WL_CONNECTED if WiFi connection is established
+   */
+  inline int beginFast(const char *ssid, const char *passphrase, bool reuseLease = false)
+  {
+    _ssid = ssid;
+    _passphrase = passphrase;
+
+#if ESP32 || ESP8266
+    wifi_join_cache cache;
+    _leaseReused = false;
+    if ( load_join_cache(cache) )
+    {
+      if ( reuseLease && (uint32_t)_local_ip == 0 && cache.ip != 0 )
+      {
+        WiFi.config( IPAddress(cache.ip), IPAddress(cache.gateway), IPAddress(cache.subnet), IPAddress(cache.dns) );
+        _leaseReused = true;
+      }
+      WiFi.begin( ssid, passphrase, cache.channel, cache.bssid );
+      _joinState = WIFI_JOIN_CACHED;
+    }
+    else
+    {
+      WiFi.begin( ssid, passphrase );
+      _joinState = WIFI_JOIN_SCAN;
+    }
+    _joinStarted = millis();
+#else
+    WiFi.begin( ssid, passphrase );
+#endif
+    return WiFi.status();
+  }
+
 
 /******************************************************************************
  *             stream functions
@@ -221,6 +454,11 @@ public:
     return connect_client() ? _client.write( byte ) : 0;
   }
 
+  inline size_t write(const uint8_t *buf, size_t size)
+  {
+    return connect_client() ? _client.write( buf, size ) : 0;
+  }
+
 };
 
 #endif //WIFI_STREAM_H